@@ -0,0 +1,351 @@
+package core
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"math"
+	"os"
+	"regexp"
+	"strconv"
+	"strings"
+	"unsafe"
+)
+
+// Dataset files hold the vectors of a benchmark dataset as one dense matrix. The fvecs,
+// ivecs and bvecs formats of the TEXMEX corpus (SIFT, GIST) store every row as an int32
+// dimension followed by its components; NumPy .npy files store a header followed by the
+// array in row-major order. The files are memory-mapped and, where the layout allows it,
+// the rows point into the mapping, so loading a dataset allocates nothing per row.
+
+// MatrixElement lists the element types of a Matrix.
+type MatrixElement interface {
+	float32 | float64 | int32
+}
+
+// Matrix is a dense matrix whose rows all have Dim elements, held in a single array or
+// file mapping.
+type Matrix[T MatrixElement] struct {
+	Rows    int    // number of rows
+	Dim     int    // number of elements per row
+	data    []T    // row i starts at data[first+i*stride]
+	first   int    // index of the first element of row 0
+	stride  int    // distance between the starts of consecutive rows
+	mapping []byte // file mapping that data points into, if any
+}
+
+// Row returns row i, which points into the matrix.
+func (m *Matrix[T]) Row(i int) []T {
+	off := m.first + i*m.stride
+	return m.data[off : off+m.Dim : off+m.Dim]
+}
+
+// RowSlices returns every row, each pointing into the matrix.
+func (m *Matrix[T]) RowSlices() [][]T {
+	rows := make([][]T, m.Rows)
+	for i := range rows {
+		rows[i] = m.Row(i)
+	}
+	return rows
+}
+
+// Close releases the file mapping of the matrix, if any. Rows must not be used afterwards.
+func (m *Matrix[T]) Close() error {
+	err := unmapFile(m.mapping)
+	m.data, m.mapping = nil, nil
+	return err
+}
+
+// mapDataset maps the file at path copy-on-write, so that rows pointing into the mapping
+// can be modified (e.g. normalized in place) without changing the file.
+func mapDataset(path string) ([]byte, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	info, err := file.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if info.Size() > math.MaxInt {
+		return nil, fmt.Errorf("%s is too large to map", path)
+	}
+	return mapFilePrivate(file, int(info.Size()))
+}
+
+// viewAs returns the little-endian elements encoded in raw. On little-endian machines the
+// result points into raw when it is suitably aligned (aliased is then set); otherwise the
+// elements are copied.
+func viewAs[T MatrixElement](raw []byte) (data []T, aliased bool) {
+	var zero T
+	size := int(unsafe.Sizeof(zero))
+	n := len(raw) / size
+	if n == 0 {
+		return nil, false
+	}
+	if nativeLittleEndian && uintptr(unsafe.Pointer(&raw[0]))%uintptr(size) == 0 {
+		return unsafe.Slice((*T)(unsafe.Pointer(&raw[0])), n), true
+	}
+	data = make([]T, n)
+	dst := unsafe.Slice((*byte)(unsafe.Pointer(&data[0])), n*size)
+	copy(dst, raw)
+	if !nativeLittleEndian {
+		swapBytes(dst, size)
+	}
+	return data, false
+}
+
+// vecsLayout checks that data holds records of equal dimension with elemSize-byte
+// components, as in fvecs, ivecs and bvecs files, and returns their number and dimension.
+func vecsLayout(path string, data []byte, elemSize int) (rows, dim int, err error) {
+	if len(data) == 0 {
+		return 0, 0, nil
+	}
+	if len(data) < 4 {
+		return 0, 0, fmt.Errorf("%s: truncated record header", path)
+	}
+	dim = int(int32(binary.LittleEndian.Uint32(data)))
+	if dim <= 0 {
+		return 0, 0, fmt.Errorf("%s: invalid vector dimension %d", path, dim)
+	}
+	record := 4 + dim*elemSize
+	if len(data)%record != 0 {
+		return 0, 0, fmt.Errorf("%s: size %d is not a multiple of the %d-byte records of dimension %d",
+			path, len(data), record, dim)
+	}
+	rows = len(data) / record
+	for i := 1; i < rows; i++ {
+		if d := int(int32(binary.LittleEndian.Uint32(data[i*record:]))); d != dim {
+			return 0, 0, fmt.Errorf("%s: row %d has dimension %d, want %d", path, i, d, dim)
+		}
+	}
+	return rows, dim, nil
+}
+
+// openVecs opens an fvecs or ivecs file, whose rows have 4-byte components.
+func openVecs[T float32 | int32](path string) (*Matrix[T], error) {
+	data, err := mapDataset(path)
+	if err != nil {
+		return nil, err
+	}
+	rows, dim, err := vecsLayout(path, data, 4)
+	if err != nil {
+		unmapFile(data)
+		return nil, err
+	}
+	// The dimension that starts every row is skipped through the stride.
+	m := &Matrix[T]{Rows: rows, Dim: dim, first: 1, stride: dim + 1}
+	var aliased bool
+	m.data, aliased = viewAs[T](data)
+	if aliased {
+		m.mapping = data
+	} else {
+		unmapFile(data)
+	}
+	return m, nil
+}
+
+// OpenFvecs opens an fvecs file, which stores float32 vectors. On little-endian machines
+// the rows point into a mapping of the file.
+func OpenFvecs(path string) (*Matrix[float32], error) {
+	return openVecs[float32](path)
+}
+
+// OpenIvecs opens an ivecs file, which stores int32 vectors (e.g. ground-truth neighbor
+// ids). On little-endian machines the rows point into a mapping of the file.
+func OpenIvecs(path string) (*Matrix[int32], error) {
+	return openVecs[int32](path)
+}
+
+// OpenBvecs opens a bvecs file, which stores vectors of unsigned bytes. The components are
+// converted into a single float32 array.
+func OpenBvecs(path string) (*Matrix[float32], error) {
+	data, err := mapDataset(path)
+	if err != nil {
+		return nil, err
+	}
+	defer unmapFile(data)
+	rows, dim, err := vecsLayout(path, data, 1)
+	if err != nil {
+		return nil, err
+	}
+	m := &Matrix[float32]{Rows: rows, Dim: dim, data: make([]float32, rows*dim), stride: dim}
+	ParallelRange(rows, 4096, func(start, end int) {
+		for i := start; i < end; i++ {
+			src := data[i*(4+dim)+4 : (i+1)*(4+dim)]
+			dst := m.Row(i)
+			for j, b := range src {
+				dst[j] = float32(b)
+			}
+		}
+	})
+	return m, nil
+}
+
+// npyMagic starts every .npy file.
+const npyMagic = "\x93NUMPY"
+
+var (
+	npyDescr   = regexp.MustCompile(`'descr'\s*:\s*'([^']*)'`)
+	npyFortran = regexp.MustCompile(`'fortran_order'\s*:\s*(True|False)`)
+	npyShape   = regexp.MustCompile(`'shape'\s*:\s*\(([^)]*)\)`)
+)
+
+// npyDecoders decodes one little-endian element of each supported .npy type, by the
+// type code of its descriptor.
+var npyDecoders = map[string]func(b []byte) float64{
+	"f4": func(b []byte) float64 { return float64(math.Float32frombits(binary.LittleEndian.Uint32(b))) },
+	"f8": func(b []byte) float64 { return math.Float64frombits(binary.LittleEndian.Uint64(b)) },
+	"i4": func(b []byte) float64 { return float64(int32(binary.LittleEndian.Uint32(b))) },
+	"i8": func(b []byte) float64 { return float64(int64(binary.LittleEndian.Uint64(b))) },
+	"u1": func(b []byte) float64 { return float64(b[0]) },
+}
+
+// npyCode returns the .npy type code of T.
+func npyCode[T MatrixElement]() string {
+	var zero T
+	switch any(zero).(type) {
+	case float32:
+		return "f4"
+	case float64:
+		return "f8"
+	}
+	return "i4"
+}
+
+// parseNpyHeader returns the type code, the shape and the data offset of the .npy file data.
+func parseNpyHeader(data []byte) (code string, rows, dim, offset int, err error) {
+	if len(data) < 10 || string(data[:6]) != npyMagic {
+		return "", 0, 0, 0, errors.New("not a .npy file")
+	}
+	switch data[6] {
+	case 1:
+		offset = 10 + int(binary.LittleEndian.Uint16(data[8:]))
+	case 2, 3:
+		if len(data) < 12 {
+			return "", 0, 0, 0, errors.New("truncated .npy header")
+		}
+		offset = 12 + int(binary.LittleEndian.Uint32(data[8:]))
+	default:
+		return "", 0, 0, 0, fmt.Errorf("unsupported .npy format version %d", data[6])
+	}
+	if offset < 0 || offset > len(data) {
+		return "", 0, 0, 0, errors.New("truncated .npy header")
+	}
+	header := string(data[:offset])
+	descr, fortran, shape := npyDescr.FindStringSubmatch(header), npyFortran.FindStringSubmatch(header),
+		npyShape.FindStringSubmatch(header)
+	if descr == nil || fortran == nil || shape == nil {
+		return "", 0, 0, 0, errors.New("malformed .npy header")
+	}
+	if fortran[1] == "True" {
+		return "", 0, 0, 0, errors.New(".npy arrays in Fortran order are not supported")
+	}
+	code = descr[1]
+	switch {
+	case code == "|u1":
+		code = "u1"
+	case strings.HasPrefix(code, "<") || (strings.HasPrefix(code, "=") && nativeLittleEndian):
+		code = code[1:]
+	default:
+		return "", 0, 0, 0, fmt.Errorf("unsupported .npy element type %q", descr[1])
+	}
+	if npyDecoders[code] == nil {
+		return "", 0, 0, 0, fmt.Errorf("unsupported .npy element type %q", descr[1])
+	}
+	var dims []int
+	for _, f := range strings.Split(shape[1], ",") {
+		if f = strings.TrimSpace(f); f == "" {
+			continue
+		}
+		n, err := strconv.Atoi(f)
+		if err != nil || n < 0 {
+			return "", 0, 0, 0, fmt.Errorf("invalid .npy shape (%s)", shape[1])
+		}
+		dims = append(dims, n)
+	}
+	switch len(dims) {
+	case 1:
+		rows, dim = dims[0], 1
+	case 2:
+		rows, dim = dims[0], dims[1]
+	default:
+		return "", 0, 0, 0, fmt.Errorf("a .npy matrix must have one or two dimensions, not %d", len(dims))
+	}
+	return code, rows, dim, offset, nil
+}
+
+// OpenNpy opens a NumPy .npy file holding a two-dimensional array in row-major order; a
+// one-dimensional array is read as a single column. An array whose elements are of type T
+// is mapped, and on little-endian machines the rows point into the mapping. Arrays of the
+// other supported types (<f4, <f8, <i4, <i8 and |u1) are converted into a single array.
+func OpenNpy[T MatrixElement](path string) (*Matrix[T], error) {
+	data, err := mapDataset(path)
+	if err != nil {
+		return nil, err
+	}
+	code, rows, dim, offset, err := parseNpyHeader(data)
+	if err != nil {
+		unmapFile(data)
+		return nil, fmt.Errorf("%s: %w", path, err)
+	}
+	size := int(code[1] - '0')
+	n := rows * dim
+	if n > (len(data)-offset)/size {
+		unmapFile(data)
+		return nil, fmt.Errorf("%s: file is too short for a %dx%d array", path, rows, dim)
+	}
+	raw := data[offset : offset+n*size]
+	m := &Matrix[T]{Rows: rows, Dim: dim, stride: dim}
+	if code == npyCode[T]() {
+		var aliased bool
+		if m.data, aliased = viewAs[T](raw); aliased {
+			m.mapping = data
+			return m, nil
+		}
+	} else {
+		decode := npyDecoders[code]
+		m.data = make([]T, n)
+		for i := range m.data {
+			m.data[i] = T(decode(raw[i*size:]))
+		}
+	}
+	unmapFile(data)
+	return m, nil
+}
+
+// WriteNpy writes rows, which must all have the same length, as a two-dimensional .npy
+// array whose elements are of type T.
+func WriteNpy[T MatrixElement](w io.Writer, rows [][]T) error {
+	dim := 0
+	if len(rows) > 0 {
+		dim = len(rows[0])
+	}
+	header := fmt.Sprintf("{'descr': '<%s', 'fortran_order': False, 'shape': (%d, %d), }",
+		npyCode[T](), len(rows), dim)
+	// The header ends with a newline and is padded so that the data starts 64-byte aligned.
+	pad := 63 - (10+len(header))%64
+	header += strings.Repeat(" ", pad) + "\n"
+	if len(header) > math.MaxUint16 {
+		return errors.New("too many rows for a .npy header")
+	}
+	prefix := append([]byte(npyMagic), 1, 0, 0, 0)
+	binary.LittleEndian.PutUint16(prefix[8:], uint16(len(header)))
+	if _, err := w.Write(prefix); err != nil {
+		return err
+	}
+	if _, err := io.WriteString(w, header); err != nil {
+		return err
+	}
+	for i, row := range rows {
+		if len(row) != dim {
+			return fmt.Errorf("row %d has %d elements, want %d", i, len(row), dim)
+		}
+		if err := writeSlice(w, row); err != nil {
+			return err
+		}
+	}
+	return nil
+}
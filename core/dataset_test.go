@@ -0,0 +1,151 @@
+package core
+
+import (
+	"bytes"
+	"encoding/binary"
+	"math"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+// writeVecs writes rows as a vecs file whose components are encoded by put.
+func writeVecs[T any](t *testing.T, path string, rows [][]T, put func(*bytes.Buffer, T)) {
+	t.Helper()
+	var buf bytes.Buffer
+	for _, row := range rows {
+		binary.Write(&buf, binary.LittleEndian, int32(len(row)))
+		for _, x := range row {
+			put(&buf, x)
+		}
+	}
+	if err := os.WriteFile(path, buf.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+}
+
+func checkRows[T MatrixElement](t *testing.T, m *Matrix[T], want [][]T) {
+	t.Helper()
+	if m.Rows != len(want) || m.Dim != len(want[0]) {
+		t.Fatalf("matrix is %dx%d, want %dx%d", m.Rows, m.Dim, len(want), len(want[0]))
+	}
+	for i, row := range m.RowSlices() {
+		for j := range row {
+			if row[j] != want[i][j] {
+				t.Fatalf("row %d = %v, want %v", i, row, want[i])
+			}
+		}
+	}
+}
+
+func TestOpenVecs(t *testing.T) {
+	dir := t.TempDir()
+	floats := [][]float32{{1, 2, 3}, {4, 5, 6}, {-1, 0.5, 7}}
+	writeVecs(t, filepath.Join(dir, "a.fvecs"), floats, func(b *bytes.Buffer, x float32) {
+		binary.Write(b, binary.LittleEndian, x)
+	})
+	m, err := OpenFvecs(filepath.Join(dir, "a.fvecs"))
+	if err != nil {
+		t.Fatalf("OpenFvecs failed: %v", err)
+	}
+	checkRows(t, m, floats)
+	// Rows are copy-on-write views of the mapping.
+	m.Row(1)[0] = 42
+	if m.Row(1)[0] != 42 || m.Row(0)[2] != 3 || m.Row(2)[0] != -1 {
+		t.Errorf("writing a row changed its neighbors: %v", m.RowSlices())
+	}
+	if err := m.Close(); err != nil {
+		t.Errorf("Close failed: %v", err)
+	}
+	if again, err := OpenFvecs(filepath.Join(dir, "a.fvecs")); err != nil || again.Row(1)[0] != 4 {
+		t.Errorf("the file was modified through the mapping")
+	}
+
+	ints := [][]int32{{7, 8}, {9, 10}}
+	writeVecs(t, filepath.Join(dir, "a.ivecs"), ints, func(b *bytes.Buffer, x int32) {
+		binary.Write(b, binary.LittleEndian, x)
+	})
+	im, err := OpenIvecs(filepath.Join(dir, "a.ivecs"))
+	if err != nil {
+		t.Fatalf("OpenIvecs failed: %v", err)
+	}
+	checkRows(t, im, ints)
+
+	bytesRows := [][]uint8{{0, 255, 3, 4}, {5, 6, 7, 8}}
+	writeVecs(t, filepath.Join(dir, "a.bvecs"), bytesRows, func(b *bytes.Buffer, x uint8) { b.WriteByte(x) })
+	bm, err := OpenBvecs(filepath.Join(dir, "a.bvecs"))
+	if err != nil {
+		t.Fatalf("OpenBvecs failed: %v", err)
+	}
+	checkRows(t, bm, [][]float32{{0, 255, 3, 4}, {5, 6, 7, 8}})
+
+	// Rows of different dimensions are rejected.
+	writeVecs(t, filepath.Join(dir, "bad.fvecs"), [][]float32{{1, 2}, {3}, {4}, {5, 6}},
+		func(b *bytes.Buffer, x float32) { binary.Write(b, binary.LittleEndian, x) })
+	if _, err := OpenFvecs(filepath.Join(dir, "bad.fvecs")); err == nil {
+		t.Error("expected an error for rows of different dimensions")
+	}
+}
+
+func TestNpy(t *testing.T) {
+	dir := t.TempDir()
+	rows := [][]float32{{1, 2, 3}, {4, 5, 6}}
+	path := filepath.Join(dir, "a.npy")
+	var buf bytes.Buffer
+	if err := WriteNpy(&buf, rows); err != nil {
+		t.Fatalf("WriteNpy failed: %v", err)
+	}
+	if err := os.WriteFile(path, buf.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	if l := binary.LittleEndian.Uint16(buf.Bytes()[8:]); (10+int(l))%64 != 0 {
+		t.Errorf("data offset %d is not 64-byte aligned", 10+l)
+	}
+	m, err := OpenNpy[float32](path)
+	if err != nil {
+		t.Fatalf("OpenNpy failed: %v", err)
+	}
+	checkRows(t, m, rows)
+	m.Close()
+
+	// Other element types are converted.
+	wide, err := OpenNpy[float64](path)
+	if err != nil {
+		t.Fatalf("OpenNpy[float64] failed: %v", err)
+	}
+	checkRows(t, wide, [][]float64{{1, 2, 3}, {4, 5, 6}})
+
+	// A header written by NumPy, for a one-dimensional array of int64 values.
+	header := "{'descr': '<i8', 'fortran_order': False, 'shape': (3,), }"
+	header += string(bytes.Repeat([]byte{' '}, 63-(10+len(header))%64)) + "\n"
+	raw := append([]byte(npyMagic), 1, 0, byte(len(header)), 0)
+	raw = append(raw, header...)
+	for _, x := range []int64{5, -6, 7} {
+		raw = binary.LittleEndian.AppendUint64(raw, uint64(x))
+	}
+	if err := os.WriteFile(path, raw, 0o644); err != nil {
+		t.Fatal(err)
+	}
+	im, err := OpenNpy[int32](path)
+	if err != nil {
+		t.Fatalf("OpenNpy[int32] failed: %v", err)
+	}
+	checkRows(t, im, [][]int32{{5}, {-6}, {7}})
+
+	for _, bad := range []string{
+		"{'descr': '>f4', 'fortran_order': False, 'shape': (1, 1), }",
+		"{'descr': '<f4', 'fortran_order': True, 'shape': (1, 1), }",
+		"{'descr': '<c8', 'fortran_order': False, 'shape': (1, 1), }",
+		"{'descr': '<f4', 'fortran_order': False, 'shape': (1000, 1000), }",
+	} {
+		raw := append([]byte(npyMagic), 1, 0, byte(len(bad)+1), 0)
+		raw = append(append(raw, bad...), '\n')
+		raw = binary.LittleEndian.AppendUint32(raw, math.Float32bits(1))
+		if err := os.WriteFile(path, raw, 0o644); err != nil {
+			t.Fatal(err)
+		}
+		if _, err := OpenNpy[float32](path); err == nil {
+			t.Errorf("expected an error for header %s", bad)
+		}
+	}
+}
@@ -8,14 +8,153 @@ import "math"
 // Returns the computed distance as a float64.
 type DistanceFunc func(a, b []float32) float64
 
-// EuclideanDistance computes the Euclidean distance between two vectors
-// The library is rebuilt to "bring your own" distance functions, however,
-// This naive implementation of Euclidean distance is the default and is used if no distance function is provided.
-// Mainly for testing purposes.
+// Metric describes a distance known to Hann.
+// Indexes compare Kernel values internally, because the kernel is cheaper than the
+// distance itself (e.g. squared Euclidean instead of Euclidean) but ranks vectors the same way.
+// Finalize turns a kernel value into the distance reported in search results.
+type Metric struct {
+	Name      string                // name of the metric, as used in Metrics and Distances
+	Distance  DistanceFunc          // the distance reported to callers
+	Kernel    DistanceFunc          // order-preserving surrogate of Distance used for comparisons
+	Finalize  func(float64) float64 // maps a kernel value to the reported distance
+	Normalize bool                  // vectors must be L2-normalized before Kernel is applied
+}
+
+// identity returns its argument unchanged.
+func identity(x float64) float64 { return x }
+
+// Metrics holds the built-in metrics by name.
+var Metrics = map[string]Metric{
+	"euclidean": {
+		Name:     "euclidean",
+		Distance: Euclidean,
+		Kernel:   SquaredEuclidean,
+		Finalize: math.Sqrt,
+	},
+	"squared_euclidean": {
+		Name:     "squared_euclidean",
+		Distance: SquaredEuclidean,
+		Kernel:   SquaredEuclidean,
+		Finalize: identity,
+	},
+	"cosine": {
+		Name:      "cosine",
+		Distance:  Cosine,
+		Kernel:    unitCosine,
+		Finalize:  identity,
+		Normalize: true,
+	},
+	"inner_product": {
+		Name:     "inner_product",
+		Distance: InnerProduct,
+		Kernel:   InnerProduct,
+		Finalize: identity,
+	},
+	"manhattan": {
+		Name:     "manhattan",
+		Distance: Manhattan,
+		Kernel:   Manhattan,
+		Finalize: identity,
+	},
+}
+
+// Distances maps metric names to their distance functions.
+var Distances = map[string]DistanceFunc{
+	"euclidean":         Euclidean,
+	"squared_euclidean": SquaredEuclidean,
+	"cosine":            Cosine,
+	"inner_product":     InnerProduct,
+	"manhattan":         Manhattan,
+}
+
+// ResolveMetric returns the metric registered under name.
+// For unknown names, it wraps fn so that it is used both for comparisons and for results.
+func ResolveMetric(name string, fn DistanceFunc) Metric {
+	if m, ok := Metrics[name]; ok {
+		return m
+	}
+	return Metric{Name: name, Distance: fn, Kernel: fn, Finalize: identity}
+}
+
+// Euclidean computes the Euclidean distance between two vectors.
 func Euclidean(a, b []float32) float64 {
-	sum := 0.0
+	return math.Sqrt(float64(SquaredL2(a, b)))
+}
+
+// SquaredEuclidean computes the squared Euclidean distance between two vectors.
+// It ranks vectors like Euclidean but skips the square root.
+func SquaredEuclidean(a, b []float32) float64 {
+	return float64(SquaredL2(a, b))
+}
+
+// InnerProduct computes the negated inner product of two vectors, so that smaller is closer.
+func InnerProduct(a, b []float32) float64 {
+	return -float64(Dot(a, b))
+}
+
+// Cosine computes the cosine distance (1 - cosine similarity) between two vectors.
+// Zero vectors are at distance 1 from everything.
+func Cosine(a, b []float32) float64 {
+	return CosineWithNorms(a, b, Norm(a), Norm(b))
+}
+
+// CosineWithNorms computes the cosine distance between two vectors whose L2 norms are already known.
+func CosineWithNorms(a, b []float32, normA, normB float32) float64 {
+	if normA == 0 || normB == 0 {
+		return 1
+	}
+	return 1 - float64(Dot(a, b))/(float64(normA)*float64(normB))
+}
+
+// unitCosine computes the cosine distance between two L2-normalized vectors.
+func unitCosine(a, b []float32) float64 {
+	return 1 - float64(Dot(a, b))
+}
+
+// Manhattan computes the Manhattan (L1) distance between two vectors.
+func Manhattan(a, b []float32) float64 {
+	b = b[:len(a)]
+	var sum float32
 	for i := range a {
-		sum += float64(a[i]-b[i]) * float64(a[i]-b[i])
+		d := a[i] - b[i]
+		if d < 0 {
+			d = -d
+		}
+		sum += d
+	}
+	return float64(sum)
+}
+
+// Dot returns the inner product of two vectors using the fastest kernel available on this CPU.
+func Dot(a, b []float32) float32 {
+	if len(a) == 0 {
+		return 0
+	}
+	return dotImpl(a, b[:len(a)])
+}
+
+// SquaredL2 returns the squared Euclidean distance of two vectors using the fastest kernel
+// available on this CPU.
+func SquaredL2(a, b []float32) float32 {
+	if len(a) == 0 {
+		return 0
+	}
+	return squaredL2Impl(a, b[:len(a)])
+}
+
+// Norm returns the L2 norm of a vector.
+func Norm(v []float32) float32 {
+	return float32(math.Sqrt(float64(Dot(v, v))))
+}
+
+// NormalizeInPlace scales v to unit L2 norm. Zero vectors are left unchanged.
+func NormalizeInPlace(v []float32) {
+	n := Norm(v)
+	if n == 0 {
+		return
+	}
+	inv := 1 / n
+	for i := range v {
+		v[i] *= inv
 	}
-	return math.Sqrt(sum)
 }
@@ -0,0 +1,91 @@
+//go:build amd64 && !purego
+
+package core
+
+// Assembly kernels implemented in distance_amd64.s.
+// They require len(b) >= len(a) > 0.
+
+//go:noescape
+func dotAVX2(a, b []float32) float32
+
+//go:noescape
+func squaredL2AVX2(a, b []float32) float32
+
+//go:noescape
+func dotAVX512(a, b []float32) float32
+
+//go:noescape
+func squaredL2AVX512(a, b []float32) float32
+
+// Assembly kernels of the quantized dot products. They require len(c) >= len(a) > 0.
+
+//go:noescape
+func dotUint8AVX2(a []float32, c []uint8) float32
+
+//go:noescape
+func dotFloat16AVX2(a []float32, c []uint16) float32
+
+//go:noescape
+func dotUint8AVX512(a []float32, c []uint8) float32
+
+//go:noescape
+func dotFloat16AVX512(a []float32, c []uint16) float32
+
+// cpuid executes the CPUID instruction for the given leaf and sub-leaf.
+func cpuid(eaxArg, ecxArg uint32) (eax, ebx, ecx, edx uint32)
+
+// xgetbv reads the XCR0 register, which tells which register states the OS saves.
+func xgetbv() (eax, edx uint32)
+
+// cpuFeatures reports which vector extensions the CPU and the OS both support.
+// f16c, the half-precision conversions, is only reported along with avx2.
+func cpuFeatures() (avx2, avx512, f16c bool) {
+	maxLeaf, _, _, _ := cpuid(0, 0)
+	if maxLeaf < 7 {
+		return false, false, false
+	}
+	_, _, ecx1, _ := cpuid(1, 0)
+	const (
+		fmaBit     = 1 << 12
+		osxsaveBit = 1 << 27
+		avxBit     = 1 << 28
+		f16cBit    = 1 << 29
+	)
+	if ecx1&(fmaBit|osxsaveBit|avxBit) != fmaBit|osxsaveBit|avxBit {
+		return false, false, false
+	}
+	xcr0, _ := xgetbv()
+	const (
+		ymmState = 0x6  // SSE and AVX state
+		zmmState = 0xe6 // additionally opmask and upper ZMM state
+	)
+	if xcr0&ymmState != ymmState {
+		return false, false, false
+	}
+	_, ebx7, _, _ := cpuid(7, 0)
+	avx2 = ebx7&(1<<5) != 0
+	avx512 = avx2 && ebx7&(1<<16) != 0 && xcr0&zmmState == zmmState
+	f16c = avx2 && ecx1&f16cBit != 0
+	return avx2, avx512, f16c
+}
+
+// init selects the distance kernels once based on the CPU features.
+func init() {
+	avx2, avx512, f16c := cpuFeatures()
+	switch {
+	case avx512:
+		dotImpl, squaredL2Impl = dotAVX512, squaredL2AVX512
+		dotUint8Impl = dotUint8AVX512
+		KernelLevel = "avx512"
+	case avx2:
+		dotImpl, squaredL2Impl = dotAVX2, squaredL2AVX2
+		dotUint8Impl = dotUint8AVX2
+		KernelLevel = "avx2"
+	}
+	switch {
+	case avx512 && f16c:
+		dotFloat16Impl = dotFloat16AVX512
+	case f16c:
+		dotFloat16Impl = dotFloat16AVX2
+	}
+}
@@ -0,0 +1,57 @@
+package core
+
+// KernelLevel names the instruction set used by the distance kernels (e.g. "avx2", "generic").
+// It is set once at startup from the CPU features.
+var KernelLevel = "generic"
+
+// dotImpl and squaredL2Impl point to the kernels selected at startup.
+// Both receive slices of equal, non-zero length.
+var (
+	dotImpl       = dotGeneric
+	squaredL2Impl = squaredL2Generic
+)
+
+// dotGeneric is the portable inner product kernel.
+// It keeps four independent accumulators so the CPU can overlap the multiply-adds,
+// and reslices in blocks of four so the compiler can drop the bounds checks.
+func dotGeneric(a, b []float32) float32 {
+	b = b[:len(a)]
+	var s0, s1, s2, s3 float32
+	n := len(a) &^ 3
+	for i := 0; i < n; i += 4 {
+		x := a[i : i+4 : i+4]
+		y := b[i : i+4 : i+4]
+		s0 += x[0] * y[0]
+		s1 += x[1] * y[1]
+		s2 += x[2] * y[2]
+		s3 += x[3] * y[3]
+	}
+	for i := n; i < len(a); i++ {
+		s0 += a[i] * b[i]
+	}
+	return (s0 + s1) + (s2 + s3)
+}
+
+// squaredL2Generic is the portable squared Euclidean distance kernel.
+func squaredL2Generic(a, b []float32) float32 {
+	b = b[:len(a)]
+	var s0, s1, s2, s3 float32
+	n := len(a) &^ 3
+	for i := 0; i < n; i += 4 {
+		x := a[i : i+4 : i+4]
+		y := b[i : i+4 : i+4]
+		d0 := x[0] - y[0]
+		d1 := x[1] - y[1]
+		d2 := x[2] - y[2]
+		d3 := x[3] - y[3]
+		s0 += d0 * d0
+		s1 += d1 * d1
+		s2 += d2 * d2
+		s3 += d3 * d3
+	}
+	for i := n; i < len(a); i++ {
+		d := a[i] - b[i]
+		s0 += d * d
+	}
+	return (s0 + s1) + (s2 + s3)
+}
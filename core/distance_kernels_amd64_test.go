@@ -0,0 +1,22 @@
+//go:build amd64 && !purego
+
+package core
+
+// availableKernels returns the kernels that can run on this CPU.
+func availableKernels() []kernelSet {
+	sets := []kernelSet{{"generic", dotGeneric, squaredL2Generic, dotUint8Generic, dotFloat16Generic}}
+	avx2, avx512, f16c := cpuFeatures()
+	if avx2 {
+		sets = append(sets, kernelSet{"avx2", dotAVX2, squaredL2AVX2, dotUint8AVX2, dotFloat16Generic})
+		if f16c {
+			sets[len(sets)-1].dotFloat16 = dotFloat16AVX2
+		}
+	}
+	if avx512 {
+		sets = append(sets, kernelSet{"avx512", dotAVX512, squaredL2AVX512, dotUint8AVX512, dotFloat16Generic})
+		if f16c {
+			sets[len(sets)-1].dotFloat16 = dotFloat16AVX512
+		}
+	}
+	return sets
+}
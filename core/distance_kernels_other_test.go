@@ -0,0 +1,8 @@
+//go:build !amd64 || purego
+
+package core
+
+// availableKernels returns the kernels that can run on this CPU.
+func availableKernels() []kernelSet {
+	return []kernelSet{{"generic", dotGeneric, squaredL2Generic, dotUint8Generic, dotFloat16Generic}}
+}
@@ -0,0 +1,153 @@
+package core
+
+import (
+	"fmt"
+	"math"
+	"math/rand"
+	"testing"
+)
+
+// kernelSet pairs a kernel name with its implementations.
+type kernelSet struct {
+	name       string
+	dot        func(a, b []float32) float32
+	squaredL2  func(a, b []float32) float32
+	dotUint8   func(a []float32, c []uint8) float32
+	dotFloat16 func(a []float32, c []uint16) float32
+}
+
+func naiveDot(a, b []float32) float64 {
+	var s float64
+	for i := range a {
+		s += float64(a[i]) * float64(b[i])
+	}
+	return s
+}
+
+func naiveSquaredL2(a, b []float32) float64 {
+	var s float64
+	for i := range a {
+		d := float64(a[i]) - float64(b[i])
+		s += d * d
+	}
+	return s
+}
+
+func randomVector(rnd *rand.Rand, n int) []float32 {
+	v := make([]float32, n)
+	for i := range v {
+		v[i] = rnd.Float32()*2 - 1
+	}
+	return v
+}
+
+func TestDistanceKernelsMatchNaive(t *testing.T) {
+	rnd := rand.New(rand.NewSource(7))
+	for _, ks := range availableKernels() {
+		// Cover every unrolled block size and tail length.
+		for n := 1; n <= 140; n++ {
+			a := randomVector(rnd, n)
+			b := randomVector(rnd, n)
+			tol := 1e-4 * float64(n)
+			if got, want := float64(ks.dot(a, b)), naiveDot(a, b); math.Abs(got-want) > tol {
+				t.Errorf("%s dot n=%d: got %v, want %v", ks.name, n, got, want)
+			}
+			if got, want := float64(ks.squaredL2(a, b)), naiveSquaredL2(a, b); math.Abs(got-want) > tol {
+				t.Errorf("%s squaredL2 n=%d: got %v, want %v", ks.name, n, got, want)
+			}
+		}
+	}
+}
+
+func TestDistanceFunctions(t *testing.T) {
+	a := []float32{1, 2, 3, 4, 5, 6}
+	b := []float32{6, 5, 4, 3, 2, 1}
+
+	if got := SquaredEuclidean(a, b); math.Abs(got-70) > 1e-6 {
+		t.Errorf("SquaredEuclidean = %v, want 70", got)
+	}
+	if got := Euclidean(a, b); math.Abs(got-math.Sqrt(70)) > 1e-6 {
+		t.Errorf("Euclidean = %v, want %v", got, math.Sqrt(70))
+	}
+	if got := InnerProduct(a, b); math.Abs(got+56) > 1e-6 {
+		t.Errorf("InnerProduct = %v, want -56", got)
+	}
+	if got := Manhattan(a, b); math.Abs(got-18) > 1e-6 {
+		t.Errorf("Manhattan = %v, want 18", got)
+	}
+	if got, want := Cosine(a, b), 1-56.0/91.0; math.Abs(got-want) > 1e-6 {
+		t.Errorf("Cosine = %v, want %v", got, want)
+	}
+	if got := Cosine(a, a); math.Abs(got) > 1e-6 {
+		t.Errorf("Cosine of a vector with itself = %v, want 0", got)
+	}
+	if got := Euclidean(nil, nil); got != 0 {
+		t.Errorf("Euclidean of empty vectors = %v, want 0", got)
+	}
+}
+
+func TestMetricsAreConsistent(t *testing.T) {
+	rnd := rand.New(rand.NewSource(11))
+	for name, m := range Metrics {
+		if Distances[name] == nil {
+			t.Errorf("metric %q is missing from Distances", name)
+		}
+		for i := 0; i < 20; i++ {
+			a := randomVector(rnd, 33)
+			b := randomVector(rnd, 33)
+			want := m.Distance(a, b)
+			if m.Normalize {
+				NormalizeInPlace(a)
+				NormalizeInPlace(b)
+			}
+			if got := m.Finalize(m.Kernel(a, b)); math.Abs(got-want) > 1e-4 {
+				t.Errorf("%s: Finalize(Kernel) = %v, want %v", name, got, want)
+			}
+		}
+	}
+
+	custom := ResolveMetric("custom", Manhattan)
+	if custom.Finalize(3) != 3 || custom.Kernel == nil {
+		t.Errorf("ResolveMetric did not wrap an unknown distance")
+	}
+}
+
+// benchSink keeps the results of benchmarked kernels alive.
+var benchSink float32
+
+// BenchmarkKernels measures every kernel available on this CPU at the dimensions of
+// common datasets. The float32 kernels read 8 bytes per component.
+func BenchmarkKernels(b *testing.B) {
+	rnd := rand.New(rand.NewSource(1))
+	for _, n := range []int{25, 128, 784} {
+		x, y := randomVector(rnd, n), randomVector(rnd, n)
+		u8, f16 := make([]uint8, n), make([]uint16, n)
+		EncodeInt8(u8, y)
+		EncodeFloat16(f16, y)
+		for _, ks := range availableKernels() {
+			ks := ks
+			b.Run(fmt.Sprintf("%s/dot/%d", ks.name, n), func(b *testing.B) {
+				b.SetBytes(int64(8 * n))
+				for i := 0; i < b.N; i++ {
+					benchSink += ks.dot(x, y)
+				}
+			})
+			b.Run(fmt.Sprintf("%s/squaredL2/%d", ks.name, n), func(b *testing.B) {
+				b.SetBytes(int64(8 * n))
+				for i := 0; i < b.N; i++ {
+					benchSink += ks.squaredL2(x, y)
+				}
+			})
+			b.Run(fmt.Sprintf("%s/dotUint8/%d", ks.name, n), func(b *testing.B) {
+				for i := 0; i < b.N; i++ {
+					benchSink += ks.dotUint8(x, u8)
+				}
+			})
+			b.Run(fmt.Sprintf("%s/dotFloat16/%d", ks.name, n), func(b *testing.B) {
+				for i := 0; i < b.N; i++ {
+					benchSink += ks.dotFloat16(x, f16)
+				}
+			})
+		}
+	}
+}
@@ -0,0 +1,41 @@
+package core
+
+import (
+	"bufio"
+	"io"
+	"os"
+	"path/filepath"
+)
+
+// TmpSuffix is appended to the path of a file while WriteFile writes it.
+const TmpSuffix = ".tmp"
+
+// WriteFile writes a file through write to a temporary file next to path, syncs it, renames
+// it to path and syncs the directory, so that path holds either the old or the complete new
+// file after a crash. The temporary file is removed if the write fails.
+func WriteFile(path string, write func(w io.Writer) error) error {
+	tmp := path + TmpSuffix
+	file, err := os.Create(tmp)
+	if err != nil {
+		return err
+	}
+	w := bufio.NewWriterSize(file, 1<<20)
+	err = write(w)
+	if err == nil {
+		err = w.Flush()
+	}
+	if err == nil {
+		err = file.Sync()
+	}
+	if cerr := file.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(tmp, path)
+	}
+	if err != nil {
+		os.Remove(tmp)
+		return err
+	}
+	return SyncDir(filepath.Dir(path))
+}
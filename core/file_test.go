@@ -0,0 +1,40 @@
+package core
+
+import (
+	"errors"
+	"io"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+func TestWriteFile(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "index.hann")
+	write := func(data string) func(io.Writer) error {
+		return func(w io.Writer) error {
+			_, err := io.WriteString(w, data)
+			return err
+		}
+	}
+	if err := WriteFile(path, write("first")); err != nil {
+		t.Fatalf("WriteFile failed: %v", err)
+	}
+	if err := WriteFile(path, write("second")); err != nil {
+		t.Fatalf("WriteFile failed: %v", err)
+	}
+
+	// A failed write leaves the previous file and no temporary file behind.
+	failure := errors.New("write failed")
+	if err := WriteFile(path, func(w io.Writer) error {
+		write("partial")(w)
+		return failure
+	}); !errors.Is(err, failure) {
+		t.Fatalf("expected the write error, got %v", err)
+	}
+	if data, err := os.ReadFile(path); err != nil || string(data) != "second" {
+		t.Errorf("expected the second file, got %q (%v)", data, err)
+	}
+	if _, err := os.Stat(path + TmpSuffix); !os.IsNotExist(err) {
+		t.Errorf("expected the temporary file to be removed, got %v", err)
+	}
+}
@@ -0,0 +1,207 @@
+package core
+
+import (
+	"math/bits"
+	"sort"
+)
+
+// Filter is the set of ids a filtered search may return (see SearchOptions.Filter).
+// Indexes still traverse the vectors of other ids where their structure needs it, but never
+// return them. A filter must not be modified while searches use it.
+type Filter interface {
+
+	// Contains reports whether id may be returned.
+	Contains(id int) bool
+
+	// Len returns the number of ids in the filter, which indexes use to estimate its
+	// selectivity.
+	Len() int
+
+	// ForEach calls fn for every id in the filter in ascending order, until fn returns false.
+	ForEach(fn func(id int) bool)
+}
+
+// Bitset is a Filter over non-negative ids holding one bit per id up to the largest, which
+// suits dense ranges of ids. The zero value is an empty set.
+type Bitset struct {
+	words []uint64
+	count int
+}
+
+// NewBitset returns a bitset holding ids.
+func NewBitset(ids ...int) *Bitset {
+	b := new(Bitset)
+	for _, id := range ids {
+		b.Add(id)
+	}
+	return b
+}
+
+// Add adds id to the set. It panics if id is negative.
+func (b *Bitset) Add(id int) {
+	if id < 0 {
+		panic("core: negative id in Bitset")
+	}
+	w := id >> 6
+	if w >= len(b.words) {
+		b.words = append(b.words, make([]uint64, w+1-len(b.words))...)
+	}
+	if mask := uint64(1) << (id & 63); b.words[w]&mask == 0 {
+		b.words[w] |= mask
+		b.count++
+	}
+}
+
+// Remove removes id from the set.
+func (b *Bitset) Remove(id int) {
+	if !b.Contains(id) {
+		return
+	}
+	b.words[id>>6] &^= 1 << (id & 63)
+	b.count--
+}
+
+// Contains reports whether id is in the set.
+func (b *Bitset) Contains(id int) bool {
+	w := id >> 6
+	return id >= 0 && w < len(b.words) && b.words[w]&(1<<(id&63)) != 0
+}
+
+// Len returns the number of ids in the set.
+func (b *Bitset) Len() int { return b.count }
+
+// ForEach calls fn for every id in the set in ascending order, until fn returns false.
+func (b *Bitset) ForEach(fn func(id int) bool) {
+	for w, word := range b.words {
+		for word != 0 {
+			if !fn(w<<6 + bits.TrailingZeros64(word)) {
+				return
+			}
+			word &= word - 1
+		}
+	}
+}
+
+// idSetArrayMax is the number of ids above which a chunk of an IDSet switches from a
+// sorted array to a bitmap: 4096 uint16 values take as much memory as the 8 KiB bitmap.
+const idSetArrayMax = 4096
+
+// idSetChunk holds the ids of an IDSet that share their high bits, by their low 16 bits:
+// in a sorted array while there are few of them, and in a bitmap of 1024 words otherwise.
+type idSetChunk struct {
+	key    int      // id >> 16
+	array  []uint16 // sorted low bits, if bitmap is nil
+	bitmap []uint64 // low bits as a bitmap
+	count  int      // number of ids in the chunk
+}
+
+// contains reports whether the chunk holds the low bits lo.
+func (c *idSetChunk) contains(lo uint16) bool {
+	if c.bitmap != nil {
+		return c.bitmap[lo>>6]&(1<<(lo&63)) != 0
+	}
+	i := sort.Search(len(c.array), func(i int) bool { return c.array[i] >= lo })
+	return i < len(c.array) && c.array[i] == lo
+}
+
+// add adds the low bits lo to the chunk and reports whether they were missing.
+func (c *idSetChunk) add(lo uint16) bool {
+	if c.bitmap != nil {
+		mask := uint64(1) << (lo & 63)
+		if c.bitmap[lo>>6]&mask != 0 {
+			return false
+		}
+		c.bitmap[lo>>6] |= mask
+		c.count++
+		return true
+	}
+	i := sort.Search(len(c.array), func(i int) bool { return c.array[i] >= lo })
+	if i < len(c.array) && c.array[i] == lo {
+		return false
+	}
+	c.count++
+	if c.count > idSetArrayMax {
+		c.bitmap = make([]uint64, 1024)
+		for _, x := range c.array {
+			c.bitmap[x>>6] |= 1 << (x & 63)
+		}
+		c.bitmap[lo>>6] |= 1 << (lo & 63)
+		c.array = nil
+		return true
+	}
+	c.array = append(c.array, 0)
+	copy(c.array[i+1:], c.array[i:])
+	c.array[i] = lo
+	return true
+}
+
+// IDSet is a compressed Filter in the style of roaring bitmaps, e.g. for a few ids spread
+// over a large range. Ids are grouped by their high bits into chunks that hold the low 16
+// bits in a sorted array, or in a bitmap once a chunk is dense. Negative ids are supported.
+// The zero value is an empty set.
+type IDSet struct {
+	chunks []idSetChunk // sorted by key
+	count  int
+}
+
+// NewIDSet returns a set holding ids.
+func NewIDSet(ids ...int) *IDSet {
+	s := new(IDSet)
+	for _, id := range ids {
+		s.Add(id)
+	}
+	return s
+}
+
+// chunk returns the position of the chunk with the given key, or where it would be inserted.
+func (s *IDSet) chunk(key int) int {
+	return sort.Search(len(s.chunks), func(i int) bool { return s.chunks[i].key >= key })
+}
+
+// Add adds id to the set.
+func (s *IDSet) Add(id int) {
+	key := id >> 16
+	i := s.chunk(key)
+	if i == len(s.chunks) || s.chunks[i].key != key {
+		s.chunks = append(s.chunks, idSetChunk{})
+		copy(s.chunks[i+1:], s.chunks[i:])
+		s.chunks[i] = idSetChunk{key: key}
+	}
+	if s.chunks[i].add(uint16(id)) {
+		s.count++
+	}
+}
+
+// Contains reports whether id is in the set.
+func (s *IDSet) Contains(id int) bool {
+	key := id >> 16
+	i := s.chunk(key)
+	return i < len(s.chunks) && s.chunks[i].key == key && s.chunks[i].contains(uint16(id))
+}
+
+// Len returns the number of ids in the set.
+func (s *IDSet) Len() int { return s.count }
+
+// ForEach calls fn for every id in the set in ascending order, until fn returns false.
+func (s *IDSet) ForEach(fn func(id int) bool) {
+	for i := range s.chunks {
+		c := &s.chunks[i]
+		base := c.key << 16
+		if c.bitmap == nil {
+			for _, lo := range c.array {
+				if !fn(base | int(lo)) {
+					return
+				}
+			}
+			continue
+		}
+		for w, word := range c.bitmap {
+			for word != 0 {
+				if !fn(base | w<<6 | bits.TrailingZeros64(word)) {
+					return
+				}
+				word &= word - 1
+			}
+		}
+	}
+}
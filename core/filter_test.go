@@ -0,0 +1,84 @@
+package core
+
+import (
+	"math/rand"
+	"sort"
+	"testing"
+)
+
+// collect returns the ids of f in the order ForEach visits them.
+func collect(f Filter) []int {
+	var ids []int
+	f.ForEach(func(id int) bool {
+		ids = append(ids, id)
+		return true
+	})
+	return ids
+}
+
+func TestBitset(t *testing.T) {
+	b := NewBitset(3, 64, 200, 3)
+	if b.Len() != 3 {
+		t.Fatalf("expected 3 ids, got %d", b.Len())
+	}
+	for _, id := range []int{3, 64, 200} {
+		if !b.Contains(id) {
+			t.Errorf("expected %d in the set", id)
+		}
+	}
+	for _, id := range []int{-1, 0, 63, 65, 201, 1 << 20} {
+		if b.Contains(id) {
+			t.Errorf("unexpected %d in the set", id)
+		}
+	}
+	b.Remove(64)
+	b.Remove(65)
+	if got := collect(b); len(got) != 2 || got[0] != 3 || got[1] != 200 || b.Len() != 2 {
+		t.Errorf("unexpected ids %v after Remove", got)
+	}
+}
+
+func TestIDSet(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	want := map[int]bool{}
+	s := NewIDSet()
+	// Sparse ids over a large range, negative ones, and a chunk dense enough for a bitmap.
+	for i := 0; i < 2000; i++ {
+		id := rng.Intn(1<<30) - 1<<29
+		s.Add(id)
+		want[id] = true
+	}
+	for i := 0; i < 3*idSetArrayMax; i++ {
+		id := 5<<16 | rng.Intn(1<<16)
+		s.Add(id)
+		want[id] = true
+	}
+	if s.Len() != len(want) {
+		t.Fatalf("expected %d ids, got %d", len(want), s.Len())
+	}
+	var sorted []int
+	for id := range want {
+		sorted = append(sorted, id)
+	}
+	sort.Ints(sorted)
+	got := collect(s)
+	if len(got) != len(sorted) {
+		t.Fatalf("ForEach visited %d ids, want %d", len(got), len(sorted))
+	}
+	for i := range got {
+		if got[i] != sorted[i] {
+			t.Fatalf("ForEach id %d is %d, want %d", i, got[i], sorted[i])
+		}
+	}
+	for id := range want {
+		if !s.Contains(id) || s.Contains(id+1) != want[id+1] {
+			t.Fatalf("Contains is wrong around %d", id)
+		}
+	}
+	// ForEach stops when fn returns false.
+	n := 0
+	s.ForEach(func(int) bool { n++; return n < 10 })
+	if n != 10 {
+		t.Errorf("ForEach went on after fn returned false: %d calls", n)
+	}
+}
@@ -1,6 +1,13 @@
 package core
 
-import "io"
+import (
+	"errors"
+	"io"
+	"time"
+)
+
+// ErrEmptyIndex is returned by searches of an index that holds no vectors.
+var ErrEmptyIndex = errors.New("index is empty")
 
 // Index represents a generic interface for an approximate nearest neighbors search index.
 // All indexes in Hann must implement the functions defined in this interface.
@@ -14,6 +21,8 @@ type Index interface {
 
 	// BulkAdd inserts multiple vectors into the index.
 	// vectors: a map where the key is the vector id and the value is the vector.
+	// Indexes may keep the vector slices (RPT does), so they must not be modified afterwards;
+	// see AddStream for ingestion without building a map.
 	// Returns an error if the operation fails.
 	BulkAdd(vectors map[int][]float32) error
 
@@ -44,6 +53,21 @@ type Index interface {
 	// Returns a slice of Neighbor structs and an error if the operation fails.
 	Search(query []float32, k int) ([]Neighbor, error)
 
+	// SearchWithOptions is like Search, with per-query search parameters and limits, and
+	// optionally restricted to the ids of a filter (opts.Filter).
+	// query: the vector to search for.
+	// k: the number of nearest neighbors to return.
+	// opts: the search parameters; zero values keep the defaults of the index.
+	// Returns a slice of Neighbor structs and an error if the operation fails.
+	SearchWithOptions(query []float32, k int, opts SearchOptions) ([]Neighbor, error)
+
+	// SearchBatch returns the k nearest neighbors for each of several query vectors.
+	// Queries are answered concurrently on the worker pool shared by all indexes.
+	// queries: the vectors to search for.
+	// k: the number of nearest neighbors to return per query.
+	// Returns one slice of Neighbor structs per query, in query order, and an error if any query fails.
+	SearchBatch(queries [][]float32, k int) ([][]Neighbor, error)
+
 	// Stats returns metadata about the index, such as count and dimensionality.
 	// Returns an IndexStats struct containing the metadata.
 	Stats() IndexStats
@@ -67,7 +91,36 @@ type Neighbor struct {
 
 // IndexStats contains metadata about the index.
 type IndexStats struct {
-	Count     int    // total number of indexed vectors.
-	Dimension int    // dimensionality of vectors.
-	Distance  string // name of the distance function used by the index.
+	Count        int           // total number of indexed vectors.
+	Dimension    int           // dimensionality of vectors.
+	Distance     string        // name of the distance function used by the index.
+	TrainingTime time.Duration // duration of the last training run, for indexes that are trained.
+
+	// Totals over the lifetime of the index (see IndexCounters).
+	Searches             int64         // completed searches.
+	DistanceComputations int64         // distance (or ADC) evaluations of the searches.
+	NodesVisited         int64         // HNSW: graph nodes reached by the searches.
+	HeapPushes           int64         // HNSW: candidate and result heap pushes of the searches.
+	Fallbacks            int64         // restarts and widened scans of searches that found fewer than k results.
+	Reranked             int64         // candidates re-scored with exact distances.
+	Truncated            int64         // searches stopped early by their budget.
+	LockWait             time.Duration // time searches waited for the index lock.
+	Builds               int64         // bulk inserts, trainings, rebuilds and repairs.
+	BuildTime            time.Duration // time spent in those builds.
+
+	Memory MemoryStats // memory held by the index, by kind.
+}
+
+// MemoryStats breaks down the memory held by an index, in bytes. Memory-mapped data is
+// counted like heap memory; map sizes are estimates.
+type MemoryStats struct {
+	Vectors int64 // full-precision vectors.
+	Graph   int64 // neighbor lists, tree nodes and inverted list structure.
+	Codes   int64 // quantized codes, their parameters and codebooks.
+	IDs     int64 // id arrays and id maps.
+}
+
+// Total returns the sum of all kinds of memory.
+func (m MemoryStats) Total() int64 {
+	return m.Vectors + m.Graph + m.Codes + m.IDs
 }
@@ -0,0 +1,181 @@
+package core
+
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// MetricsSink receives the instrumentation of an index, e.g. to export it to Prometheus or
+// expvar. Names are prefixed with the kind of the index ("hnsw_searches"); durations are
+// in seconds. Indexes call the sink on every search, so implementations must be safe for
+// concurrent use and cheap. Without a sink, an index only keeps the totals that its Stats
+// method reports.
+type MetricsSink interface {
+
+	// Add adds delta to the counter name.
+	Add(name string, delta int64)
+
+	// Observe records value in the histogram name.
+	Observe(name string, value float64)
+}
+
+// mapEntryBytes estimates the memory of one entry of an id map, for MemoryStats.
+const mapEntryBytes = 48
+
+// MapBytes estimates the memory of a map with n int keys.
+func MapBytes(n int) int64 {
+	return int64(n) * mapEntryBytes
+}
+
+// IndexCounters accumulates the totals of IndexStats for an index and forwards every
+// recorded event to a MetricsSink. Its methods are safe for concurrent use.
+type IndexCounters struct {
+	searches             atomic.Int64
+	distanceComputations atomic.Int64
+	nodesVisited         atomic.Int64
+	heapPushes           atomic.Int64
+	fallbacks            atomic.Int64
+	reranked             atomic.Int64
+	truncated            atomic.Int64
+	lockWait             atomic.Int64 // nanoseconds
+	builds               atomic.Int64
+	buildTime            atomic.Int64 // nanoseconds
+}
+
+// RecordSearch adds a completed search with statistics s, which waited lockWait for the
+// index lock and started at start (zero if the caller did not read the clock, i.e. without
+// a sink). prefix is the kind of the index.
+func (c *IndexCounters) RecordSearch(sink MetricsSink, prefix string, s *SearchStats, lockWait time.Duration, start time.Time) {
+	fallbacks := s.Restarts + s.Fallbacks
+	c.searches.Add(1)
+	c.distanceComputations.Add(int64(s.DistanceComputations))
+	if s.NodesVisited > 0 {
+		c.nodesVisited.Add(int64(s.NodesVisited))
+		c.heapPushes.Add(int64(s.HeapPushes))
+	}
+	if fallbacks > 0 {
+		c.fallbacks.Add(int64(fallbacks))
+	}
+	if s.Reranked > 0 {
+		c.reranked.Add(int64(s.Reranked))
+	}
+	if s.Truncated {
+		c.truncated.Add(1)
+	}
+	if lockWait > 0 {
+		c.lockWait.Add(int64(lockWait))
+	}
+	if sink == nil {
+		return
+	}
+	sink.Add(prefix+"_searches", 1)
+	if !start.IsZero() {
+		sink.Observe(prefix+"_search_seconds", time.Since(start).Seconds())
+	}
+	sink.Observe(prefix+"_search_distance_computations", float64(s.DistanceComputations))
+	if s.NodesVisited > 0 {
+		sink.Observe(prefix+"_search_nodes_visited", float64(s.NodesVisited))
+		sink.Observe(prefix+"_search_heap_pushes", float64(s.HeapPushes))
+	}
+	if fallbacks > 0 {
+		sink.Add(prefix+"_search_fallbacks", int64(fallbacks))
+	}
+	if s.Reranked > 0 {
+		sink.Add(prefix+"_search_reranked", int64(s.Reranked))
+	}
+	if s.Truncated {
+		sink.Add(prefix+"_search_truncated", 1)
+	}
+	sink.Observe(prefix+"_search_lock_wait_seconds", lockWait.Seconds())
+}
+
+// RecordBuild adds a build (a bulk insert, training, rebuild or repair) named name that
+// took d, e.g. RecordBuild(sink, "rpt_rebuild", d).
+func (c *IndexCounters) RecordBuild(sink MetricsSink, name string, d time.Duration) {
+	c.builds.Add(1)
+	c.buildTime.Add(int64(d))
+	if sink != nil {
+		sink.Observe(name+"_seconds", d.Seconds())
+	}
+}
+
+// Fill copies the totals into stats.
+func (c *IndexCounters) Fill(stats *IndexStats) {
+	stats.Searches = c.searches.Load()
+	stats.DistanceComputations = c.distanceComputations.Load()
+	stats.NodesVisited = c.nodesVisited.Load()
+	stats.HeapPushes = c.heapPushes.Load()
+	stats.Fallbacks = c.fallbacks.Load()
+	stats.Reranked = c.reranked.Load()
+	stats.Truncated = c.truncated.Load()
+	stats.LockWait = time.Duration(c.lockWait.Load())
+	stats.Builds = c.builds.Load()
+	stats.BuildTime = time.Duration(c.buildTime.Load())
+}
+
+// RLockTimed read-locks mu and returns the time spent waiting for it. The clock is only
+// read when the lock is not free right away.
+func RLockTimed(mu *sync.RWMutex) time.Duration {
+	if mu.TryRLock() {
+		return 0
+	}
+	start := time.Now()
+	mu.RLock()
+	return time.Since(start)
+}
+
+// MapSink is a MetricsSink that keeps its metrics in memory, e.g. for tests or to publish
+// them with expvar. The zero value is ready to use.
+type MapSink struct {
+	mu         sync.Mutex
+	counters   map[string]int64
+	histograms map[string]Histogram
+}
+
+// Histogram summarizes the values observed by a MapSink under one name.
+type Histogram struct {
+	Count int     // number of values
+	Sum   float64 // sum of the values
+	Max   float64 // largest value
+}
+
+// Add adds delta to the counter name.
+func (m *MapSink) Add(name string, delta int64) {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if m.counters == nil {
+		m.counters = make(map[string]int64)
+	}
+	m.counters[name] += delta
+}
+
+// Observe records value in the histogram name.
+func (m *MapSink) Observe(name string, value float64) {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	if m.histograms == nil {
+		m.histograms = make(map[string]Histogram)
+	}
+	h := m.histograms[name]
+	if h.Count == 0 || value > h.Max {
+		h.Max = value
+	}
+	h.Count++
+	h.Sum += value
+	m.histograms[name] = h
+}
+
+// Counter returns the value of the counter name.
+func (m *MapSink) Counter(name string) int64 {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	return m.counters[name]
+}
+
+// Histogram returns the summary of the histogram name.
+func (m *MapSink) Histogram(name string) Histogram {
+	m.mu.Lock()
+	defer m.mu.Unlock()
+	return m.histograms[name]
+}
@@ -0,0 +1,27 @@
+//go:build !unix
+
+package core
+
+import (
+	"io"
+	"os"
+)
+
+// mapFile reads size bytes of f into memory on platforms without mmap support.
+func mapFile(f *os.File, size int) ([]byte, error) {
+	data := make([]byte, size)
+	if _, err := io.ReadFull(io.NewSectionReader(f, 0, int64(size)), data); err != nil {
+		return nil, err
+	}
+	return data, nil
+}
+
+// mapFilePrivate reads size bytes of f into a modifiable buffer on platforms without mmap support.
+func mapFilePrivate(f *os.File, size int) ([]byte, error) {
+	return mapFile(f, size)
+}
+
+// unmapFile releases a buffer created by mapFile.
+func unmapFile(data []byte) error {
+	return nil
+}
@@ -0,0 +1,125 @@
+package core
+
+import (
+	"fmt"
+	"runtime"
+	"sync"
+	"sync/atomic"
+)
+
+// workerPool is a fixed set of goroutines shared by all indexes in the process.
+// Parallel loops hand work to idle workers instead of starting goroutines of their own,
+// so concurrent searches never run more than runtime.NumCPU() extra goroutines in total.
+type workerPool struct {
+	once  sync.Once
+	size  int
+	tasks chan func()
+}
+
+// sharedPool is the worker pool behind ParallelFor and ParallelRange.
+var sharedPool workerPool
+
+// start launches the pool goroutines.
+func (p *workerPool) start() {
+	p.size = runtime.NumCPU()
+	p.tasks = make(chan func())
+	for i := 0; i < p.size; i++ {
+		go func() {
+			for task := range p.tasks {
+				task()
+			}
+		}()
+	}
+}
+
+// Workers returns the number of goroutines in the shared worker pool.
+func Workers() int {
+	sharedPool.once.Do(sharedPool.start)
+	return sharedPool.size
+}
+
+// ParallelFor calls fn(i) for every i in [0, n) using the shared worker pool.
+// The calling goroutine takes part in the loop, and helpers are only handed to workers
+// that are idle at the time of the call. ParallelFor may therefore be nested (e.g. a
+// batch of searches that each compute distances in parallel) without deadlocking.
+func ParallelFor(n int, fn func(i int)) {
+	if n <= 0 {
+		return
+	}
+	if n == 1 {
+		fn(0)
+		return
+	}
+	helpers := Workers() - 1
+	if helpers > n-1 {
+		helpers = n - 1
+	}
+
+	var next atomic.Int64
+	run := func() {
+		for {
+			i := int(next.Add(1) - 1)
+			if i >= n {
+				return
+			}
+			fn(i)
+		}
+	}
+	var wg sync.WaitGroup
+	helper := func() {
+		defer wg.Done()
+		run()
+	}
+	for h := 0; h < helpers; h++ {
+		wg.Add(1)
+		select {
+		case sharedPool.tasks <- helper:
+		default:
+			// No idle worker: the remaining iterations run on the goroutines already engaged.
+			wg.Done()
+			h = helpers
+		}
+	}
+	run()
+	wg.Wait()
+}
+
+// ParallelRange splits [0, n) into contiguous chunks of at least minChunk elements and
+// calls fn(start, end) for each chunk using the shared worker pool.
+func ParallelRange(n, minChunk int, fn func(start, end int)) {
+	if n <= 0 {
+		return
+	}
+	workers := Workers()
+	chunk := (n + workers - 1) / workers
+	if chunk < minChunk {
+		chunk = minChunk
+	}
+	chunks := (n + chunk - 1) / chunk
+	ParallelFor(chunks, func(c int) {
+		start := c * chunk
+		end := start + chunk
+		if end > n {
+			end = n
+		}
+		fn(start, end)
+	})
+}
+
+// SearchBatch answers several queries with search, spreading them over the shared worker pool.
+// The results are returned in the order of the queries. If any query fails, the error of the
+// first failing query is returned.
+func SearchBatch(queries [][]float32, k int,
+	search func(query []float32, k int) ([]Neighbor, error)) ([][]Neighbor, error) {
+	results := make([][]Neighbor, len(queries))
+	errs := make([]error, len(queries))
+	ParallelFor(len(queries), func(i int) {
+		results[i], errs[i] = search(queries[i], k)
+	})
+	for i, err := range errs {
+		if err != nil {
+			return nil, fmt.Errorf("query %d: %w", i, err)
+		}
+	}
+	return results, nil
+}
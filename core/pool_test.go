@@ -0,0 +1,57 @@
+package core
+
+import (
+	"errors"
+	"sync/atomic"
+	"testing"
+)
+
+func TestParallelForVisitsEveryIndexOnce(t *testing.T) {
+	for _, n := range []int{0, 1, 2, 7, 1000} {
+		counts := make([]int32, n)
+		ParallelFor(n, func(i int) {
+			atomic.AddInt32(&counts[i], 1)
+		})
+		for i, c := range counts {
+			if c != 1 {
+				t.Fatalf("n=%d: index %d visited %d times", n, i, c)
+			}
+		}
+	}
+}
+
+func TestParallelForNested(t *testing.T) {
+	var total atomic.Int64
+	ParallelFor(16, func(int) {
+		ParallelRange(1000, 10, func(start, end int) {
+			total.Add(int64(end - start))
+		})
+	})
+	if got := total.Load(); got != 16*1000 {
+		t.Errorf("expected 16000 iterations from nested loops, got %d", got)
+	}
+}
+
+func TestSearchBatch(t *testing.T) {
+	search := func(query []float32, k int) ([]Neighbor, error) {
+		if len(query) == 0 {
+			return nil, errors.New("empty query")
+		}
+		return []Neighbor{{ID: int(query[0]), Distance: float64(k)}}, nil
+	}
+
+	queries := [][]float32{{3}, {1}, {2}}
+	results, err := SearchBatch(queries, 5, search)
+	if err != nil {
+		t.Fatalf("SearchBatch failed: %v", err)
+	}
+	for i, res := range results {
+		if len(res) != 1 || res[0].ID != int(queries[i][0]) {
+			t.Errorf("query %d: expected id %d, got %v", i, int(queries[i][0]), res)
+		}
+	}
+
+	if _, err := SearchBatch([][]float32{{1}, {}}, 5, search); err == nil {
+		t.Error("expected error from a failing query, got none")
+	}
+}
@@ -0,0 +1,204 @@
+package core
+
+import (
+	"math"
+	"sync"
+)
+
+// Scalar quantization stores every component of a vector in fewer bits: as an 8-bit code
+// on a per-vector affine grid, or as an IEEE 754 half-precision float. Indexes compare
+// float32 queries with the codes directly through the kernels below, so the codes are
+// never expanded back into float32 vectors on the hot path.
+
+// dotUint8Impl and dotFloat16Impl point to the kernels selected at startup.
+// Both receive slices of equal, non-zero length.
+var (
+	dotUint8Impl   = dotUint8Generic
+	dotFloat16Impl = dotFloat16Generic
+)
+
+// DotUint8 returns the inner product of a float32 vector with a vector of 8-bit codes,
+// each code taken as its unsigned integer value.
+func DotUint8(a []float32, c []uint8) float32 {
+	if len(a) == 0 {
+		return 0
+	}
+	return dotUint8Impl(a, c[:len(a)])
+}
+
+// DotFloat16 returns the inner product of a float32 vector with a vector of half-precision
+// floats (see Float16).
+func DotFloat16(a []float32, c []uint16) float32 {
+	if len(a) == 0 {
+		return 0
+	}
+	return dotFloat16Impl(a, c[:len(a)])
+}
+
+// EncodeInt8 quantizes v into 8-bit codes on a grid spanning the range of its components:
+// v[i] is approximated by offset + scale*dst[i]. It returns the offset and the scale, which
+// is zero for a constant vector. dst must be as long as v.
+func EncodeInt8(dst []uint8, v []float32) (offset, scale float32) {
+	if len(v) == 0 {
+		return 0, 0
+	}
+	lo, hi := v[0], v[0]
+	for _, x := range v[1:] {
+		lo = min(lo, x)
+		hi = max(hi, x)
+	}
+	scale = (hi - lo) / 255
+	if scale == 0 {
+		for i := range v {
+			dst[i] = 0
+		}
+		return lo, 0
+	}
+	inv := 1 / scale
+	for i, x := range v {
+		q := math.Round(float64((x - lo) * inv))
+		dst[i] = uint8(max(0, min(255, q)))
+	}
+	return lo, scale
+}
+
+// DecodeInt8 writes the vector approximated by codes made with EncodeInt8 into dst.
+func DecodeInt8(dst []float32, codes []uint8, offset, scale float32) {
+	for i, c := range codes {
+		dst[i] = offset + scale*float32(c)
+	}
+}
+
+// EncodeFloat16 converts v into half-precision floats in dst, which must be as long as v.
+func EncodeFloat16(dst []uint16, v []float32) {
+	for i, x := range v {
+		dst[i] = Float16(x)
+	}
+}
+
+// DecodeFloat16 converts half-precision floats back into float32 values in dst.
+func DecodeFloat16(dst []float32, codes []uint16) {
+	for i, c := range codes {
+		dst[i] = Float32FromFloat16(c)
+	}
+}
+
+// Float16 returns the IEEE 754 half-precision value nearest to f, rounding ties to even.
+// Values beyond the half-precision range become infinities, and NaNs stay NaNs.
+func Float16(f float32) uint16 {
+	b := math.Float32bits(f)
+	sign := uint16(b>>16) & 0x8000
+	exp := int(b >> 23 & 0xff)
+	mant := b & 0x7fffff
+	if exp == 0xff {
+		if mant != 0 {
+			return sign | 0x7e00
+		}
+		return sign | 0x7c00
+	}
+	e := exp - 127 + 15
+	switch {
+	case e >= 0x1f:
+		return sign | 0x7c00
+	case e <= 0:
+		// The value is a subnormal half (or rounds to zero): its mantissa, with the implicit
+		// bit, is shifted down to units of 2^-24.
+		if e < -10 {
+			return sign
+		}
+		mant |= 0x800000
+		shift := uint(14 - e)
+		half := mant >> shift
+		rem, mid := mant&(1<<shift-1), uint32(1)<<(shift-1)
+		if rem > mid || (rem == mid && half&1 == 1) {
+			half++
+		}
+		return sign | uint16(half)
+	}
+	// A carry out of the mantissa correctly moves on to the next exponent (or infinity).
+	half := uint32(e)<<10 | mant>>13
+	if rem := mant & 0x1fff; rem > 0x1000 || (rem == 0x1000 && half&1 == 1) {
+		half++
+	}
+	return sign | uint16(half)
+}
+
+// Float32FromFloat16 returns the float32 value of a half-precision float.
+func Float32FromFloat16(h uint16) float32 {
+	sign := uint32(h&0x8000) << 16
+	exp := uint32(h>>10) & 0x1f
+	mant := uint32(h & 0x3ff)
+	switch {
+	case exp == 0x1f:
+		return math.Float32frombits(sign | 0x7f800000 | mant<<13)
+	case exp == 0:
+		if mant == 0 {
+			return math.Float32frombits(sign)
+		}
+		// Subnormal: shift the mantissa up until its leading bit becomes the implicit one.
+		e := uint32(127 - 15 + 1)
+		for mant&0x400 == 0 {
+			mant <<= 1
+			e--
+		}
+		return math.Float32frombits(sign | e<<23 | (mant&0x3ff)<<13)
+	}
+	return math.Float32frombits(sign | (exp+127-15)<<23 | mant<<13)
+}
+
+// float16Table maps every half-precision value to its float32 value for the portable kernel.
+var (
+	float16Table     []float32
+	float16TableOnce sync.Once
+)
+
+// float16Values returns float16Table, building it on first use.
+func float16Values() []float32 {
+	float16TableOnce.Do(func() {
+		float16Table = make([]float32, 1<<16)
+		for i := range float16Table {
+			float16Table[i] = Float32FromFloat16(uint16(i))
+		}
+	})
+	return float16Table
+}
+
+// dotUint8Generic is the portable kernel of DotUint8.
+func dotUint8Generic(a []float32, c []uint8) float32 {
+	c = c[:len(a)]
+	var s0, s1, s2, s3 float32
+	n := len(a) &^ 3
+	for i := 0; i < n; i += 4 {
+		x := a[i : i+4 : i+4]
+		y := c[i : i+4 : i+4]
+		s0 += x[0] * float32(y[0])
+		s1 += x[1] * float32(y[1])
+		s2 += x[2] * float32(y[2])
+		s3 += x[3] * float32(y[3])
+	}
+	for i := n; i < len(a); i++ {
+		s0 += a[i] * float32(c[i])
+	}
+	return (s0 + s1) + (s2 + s3)
+}
+
+// dotFloat16Generic is the portable kernel of DotFloat16. It converts the halves through
+// a lookup table.
+func dotFloat16Generic(a []float32, c []uint16) float32 {
+	c = c[:len(a)]
+	table := float16Values()
+	var s0, s1, s2, s3 float32
+	n := len(a) &^ 3
+	for i := 0; i < n; i += 4 {
+		x := a[i : i+4 : i+4]
+		y := c[i : i+4 : i+4]
+		s0 += x[0] * table[y[0]]
+		s1 += x[1] * table[y[1]]
+		s2 += x[2] * table[y[2]]
+		s3 += x[3] * table[y[3]]
+	}
+	for i := n; i < len(a); i++ {
+		s0 += a[i] * table[c[i]]
+	}
+	return (s0 + s1) + (s2 + s3)
+}
@@ -0,0 +1,89 @@
+package core
+
+import (
+	"math"
+	"math/rand"
+	"testing"
+)
+
+func TestQuantizedKernelsMatchNaive(t *testing.T) {
+	rnd := rand.New(rand.NewSource(7))
+	for _, ks := range availableKernels() {
+		// Cover every unrolled block size and tail length.
+		for n := 1; n <= 140; n++ {
+			a := randomVector(rnd, n)
+			u8 := make([]uint8, n)
+			f16 := make([]uint16, n)
+			var want8, want16 float64
+			for i := range a {
+				u8[i] = uint8(rnd.Intn(256))
+				f16[i] = Float16(rnd.Float32()*8 - 4)
+				want8 += float64(a[i]) * float64(u8[i])
+				want16 += float64(a[i]) * float64(Float32FromFloat16(f16[i]))
+			}
+			if got := float64(ks.dotUint8(a, u8)); math.Abs(got-want8) > 1e-2*float64(n) {
+				t.Errorf("%s dotUint8 n=%d: got %v, want %v", ks.name, n, got, want8)
+			}
+			if got := float64(ks.dotFloat16(a, f16)); math.Abs(got-want16) > 1e-4*float64(n) {
+				t.Errorf("%s dotFloat16 n=%d: got %v, want %v", ks.name, n, got, want16)
+			}
+		}
+	}
+}
+
+func TestFloat16Conversion(t *testing.T) {
+	cases := []struct {
+		f    float32
+		bits uint16
+	}{
+		{0, 0x0000},
+		{float32(math.Copysign(0, -1)), 0x8000},
+		{1, 0x3c00},
+		{-2, 0xc000},
+		{0.5, 0x3800},
+		{65504, 0x7bff},           // largest finite half
+		{65520, 0x7c00},           // rounds up to infinity
+		{6.103515625e-05, 0x0400}, // smallest normal half
+		{5.960464477539063e-08, 0x0001},
+		{2.9802322387695312e-08, 0x0000}, // half of the smallest subnormal rounds to even
+		{1 + 1.0/2048, 0x3c00},           // tie rounds to even
+		{1 + 3.0/2048, 0x3c02},
+		{float32(math.Inf(1)), 0x7c00},
+	}
+	for _, c := range cases {
+		if got := Float16(c.f); got != c.bits {
+			t.Errorf("Float16(%v) = %#04x, want %#04x", c.f, got, c.bits)
+		}
+	}
+	if got := Float16(float32(math.NaN())); got&0x7c00 != 0x7c00 || got&0x3ff == 0 {
+		t.Errorf("Float16(NaN) = %#04x, want a NaN", got)
+	}
+	// Every finite half converts to float32 and back unchanged.
+	for h := 0; h < 1<<16; h++ {
+		if h&0x7c00 == 0x7c00 {
+			continue
+		}
+		if got := Float16(Float32FromFloat16(uint16(h))); got != uint16(h) {
+			t.Fatalf("round trip of %#04x gives %#04x", h, got)
+		}
+	}
+}
+
+func TestEncodeInt8(t *testing.T) {
+	rnd := rand.New(rand.NewSource(3))
+	v := randomVector(rnd, 100)
+	codes := make([]uint8, len(v))
+	offset, scale := EncodeInt8(codes, v)
+	decoded := make([]float32, len(v))
+	DecodeInt8(decoded, codes, offset, scale)
+	for i := range v {
+		if d := math.Abs(float64(decoded[i] - v[i])); d > float64(scale)/2+1e-6 {
+			t.Fatalf("component %d: decoded %v from %v, error above half a step (%v)", i, decoded[i], v[i], scale)
+		}
+	}
+	// A constant vector is encoded exactly.
+	offset, scale = EncodeInt8(codes[:3], []float32{2, 2, 2})
+	if offset != 2 || scale != 0 {
+		t.Errorf("constant vector: offset %v, scale %v; want 2 and 0", offset, scale)
+	}
+}
@@ -0,0 +1,97 @@
+package core
+
+import "time"
+
+// SearchOptions tunes a single search. Zero values keep the defaults of the index, so
+// the latency/recall trade-off can be chosen per query without changing or locking the index.
+type SearchOptions struct {
+	Ef                      int           // HNSW: size of the dynamic candidate list on the base layer; DiskANN: size of the beam search list
+	NProbe                  int           // PQIVF: number of coarse clusters scanned
+	ProbeMargin             float64       // RPT: distance to a split within which both sides are probed (negative disables)
+	RerankFactor            int           // re-rank the best k*RerankFactor approximate candidates with exact distances
+	MaxDistanceComputations int           // stop exploring after this many distance computations (0 is unlimited)
+	Timeout                 time.Duration // stop exploring once the search has run this long (0 is unlimited)
+	Filter                  Filter        // if not nil, only ids in the filter are returned (see Filter)
+	Stats                   *SearchStats  // if not nil, receives statistics about the search
+}
+
+// SearchStats reports the work done by a single search.
+type SearchStats struct {
+	Candidates           int  // candidates scored by the first (approximate or exact) stage
+	Reranked             int  // candidates re-scored with exact distances
+	DistanceComputations int  // distance (or ADC) evaluations, including those spent on navigation
+	Truncated            bool // the search stopped early because its budget ran out
+	Restarts             int  // HNSW: times the graph search was resumed from further entry points to find k results
+	Fallbacks            int  // PQIVF, RPT: times the scan was widened (more clusters, a larger margin, all points) to find k results
+	NodesVisited         int  // HNSW: graph nodes reached by the search; DiskANN: nodes expanded
+	BlocksRead           int  // DiskANN: node blocks read from disk (cached nodes are not counted)
+	HeapPushes           int  // HNSW: pushes onto the candidate and result heaps
+	BruteForce           bool // HNSW: the filter was selective enough to score its ids directly instead of searching the graph; RPT: the tree was still being built, so all points were scanned
+}
+
+// budgetClockInterval is the number of distance computations between two reads of the clock.
+const budgetClockInterval = 64
+
+// SearchBudget counts the distance computations of one search and enforces the
+// MaxDistanceComputations and Timeout limits of its options.
+// Indexes call Spend as they explore and stop once it returns false; the best results
+// found until then are returned.
+type SearchBudget struct {
+	max       int       // maximum number of computations (0 is unlimited)
+	deadline  time.Time // time after which the search stops (zero is unlimited)
+	used      int       // computations so far
+	nextCheck int       // value of used at which the clock is read next
+	exhausted bool      // a limit was reached
+}
+
+// NewSearchBudget starts the budget of a search with the given options.
+func NewSearchBudget(opts SearchOptions) SearchBudget {
+	b := SearchBudget{max: opts.MaxDistanceComputations}
+	if opts.Timeout > 0 {
+		b.deadline = time.Now().Add(opts.Timeout)
+		b.nextCheck = budgetClockInterval
+	}
+	return b
+}
+
+// Spend records n distance computations and reports whether the search may continue.
+func (b *SearchBudget) Spend(n int) bool {
+	b.used += n
+	if b.exhausted {
+		return false
+	}
+	if b.max > 0 && b.used >= b.max {
+		b.exhausted = true
+	} else if !b.deadline.IsZero() && b.used >= b.nextCheck {
+		b.nextCheck = b.used + budgetClockInterval
+		b.exhausted = time.Now().After(b.deadline)
+	}
+	return !b.exhausted
+}
+
+// Remaining returns the number of computations left before the computation limit is
+// reached, or -1 if the number is unlimited.
+func (b *SearchBudget) Remaining() int {
+	if b.exhausted {
+		return 0
+	}
+	if b.max <= 0 {
+		return -1
+	}
+	return b.max - b.used
+}
+
+// Used returns the number of computations recorded so far.
+func (b *SearchBudget) Used() int { return b.used }
+
+// Exhausted reports whether a limit was reached.
+func (b *SearchBudget) Exhausted() bool { return b.exhausted }
+
+// Report writes the budget's counters into stats, if stats is not nil.
+func (b *SearchBudget) Report(stats *SearchStats) {
+	if stats == nil {
+		return
+	}
+	stats.DistanceComputations = b.used
+	stats.Truncated = b.exhausted
+}
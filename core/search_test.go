@@ -0,0 +1,104 @@
+package core
+
+import (
+	"sync"
+	"testing"
+	"time"
+)
+
+func TestSearchBudgetComputations(t *testing.T) {
+	b := NewSearchBudget(SearchOptions{MaxDistanceComputations: 10})
+	if got := b.Remaining(); got != 10 {
+		t.Fatalf("expected 10 remaining, got %d", got)
+	}
+	if !b.Spend(9) {
+		t.Fatal("budget exhausted after 9 of 10 computations")
+	}
+	if b.Spend(1) {
+		t.Fatal("budget not exhausted after 10 of 10 computations")
+	}
+	b.Spend(5)
+	var stats SearchStats
+	b.Report(&stats)
+	if stats.DistanceComputations != 15 || !stats.Truncated {
+		t.Errorf("unexpected stats %+v", stats)
+	}
+}
+
+func TestSearchBudgetUnlimited(t *testing.T) {
+	b := NewSearchBudget(SearchOptions{})
+	for i := 0; i < 1000; i++ {
+		if !b.Spend(100) {
+			t.Fatal("unlimited budget ran out")
+		}
+	}
+	if b.Remaining() != -1 || b.Used() != 100000 {
+		t.Errorf("unexpected budget state: remaining %d, used %d", b.Remaining(), b.Used())
+	}
+}
+
+func TestSearchBudgetTimeout(t *testing.T) {
+	b := NewSearchBudget(SearchOptions{Timeout: time.Nanosecond})
+	time.Sleep(time.Millisecond)
+	// The clock is only read every budgetClockInterval computations.
+	if !b.Spend(1) {
+		t.Fatal("clock read before the check interval")
+	}
+	if b.Spend(budgetClockInterval) {
+		t.Fatal("budget not exhausted after its timeout")
+	}
+}
+
+func TestIndexCounters(t *testing.T) {
+	var c IndexCounters
+	var sink MapSink
+	stats := SearchStats{DistanceComputations: 40, NodesVisited: 12, HeapPushes: 30, Restarts: 1, Truncated: true}
+	c.RecordSearch(&sink, "test", &stats, time.Millisecond, time.Now())
+	c.RecordSearch(nil, "test", &SearchStats{DistanceComputations: 10, Fallbacks: 2}, 0, time.Time{})
+	c.RecordBuild(&sink, "test_build", time.Second)
+
+	var got IndexStats
+	c.Fill(&got)
+	if got.Searches != 2 || got.DistanceComputations != 50 || got.NodesVisited != 12 || got.HeapPushes != 30 ||
+		got.Fallbacks != 3 || got.Truncated != 1 || got.LockWait != time.Millisecond ||
+		got.Builds != 1 || got.BuildTime != time.Second {
+		t.Errorf("unexpected totals %+v", got)
+	}
+	// Only the search that had a sink reached it.
+	if n := sink.Counter("test_searches"); n != 1 {
+		t.Errorf("expected 1 search in the sink, got %d", n)
+	}
+	if n := sink.Counter("test_search_fallbacks"); n != 1 {
+		t.Errorf("expected 1 fallback in the sink, got %d", n)
+	}
+	if h := sink.Histogram("test_search_distance_computations"); h.Count != 1 || h.Sum != 40 {
+		t.Errorf("unexpected distance histogram %+v", h)
+	}
+	if h := sink.Histogram("test_search_seconds"); h.Count != 1 {
+		t.Errorf("expected a search latency, got %+v", h)
+	}
+	if h := sink.Histogram("test_build_seconds"); h.Count != 1 || h.Sum != 1 {
+		t.Errorf("unexpected build histogram %+v", h)
+	}
+}
+
+func TestRLockTimed(t *testing.T) {
+	var mu sync.RWMutex
+	if wait := RLockTimed(&mu); wait != 0 {
+		t.Errorf("a free lock waited %v", wait)
+	}
+	mu.RUnlock()
+
+	mu.Lock()
+	done := make(chan time.Duration)
+	go func() {
+		wait := RLockTimed(&mu)
+		mu.RUnlock()
+		done <- wait
+	}()
+	time.Sleep(10 * time.Millisecond)
+	mu.Unlock()
+	if wait := <-done; wait <= 0 {
+		t.Errorf("a held lock reported a wait of %v", wait)
+	}
+}
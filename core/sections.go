@@ -0,0 +1,560 @@
+package core
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"math"
+	"os"
+	"slices"
+	"unsafe"
+)
+
+// Binary index files consist of a fixed header, a section table and the sections.
+// All values are little-endian. The header holds the magic bytes, the format version,
+// the number of sections and the kind of index (e.g. "hnsw"). Each table entry holds
+// the name, offset and length of a section. Sections start at multiples of
+// SectionAlignment, so a file mapped into memory can be viewed as typed slices in place.
+const (
+	FormatVersion    = 1  // version written by WriteSections
+	SectionAlignment = 64 // alignment of section offsets in bytes
+
+	headerSize     = 32      // magic, version, section count, kind
+	tableEntrySize = 32      // name, offset, length
+	maxNameLen     = 16      // maximum length of kind and section names
+	maxSections    = 1 << 16 // upper bound on the section count, to reject corrupt tables
+)
+
+// ErrNotSectionFile is returned when a file does not start with the magic bytes of a binary index file.
+var ErrNotSectionFile = errors.New("not a binary index file")
+
+// sectionMagic identifies binary index files.
+var sectionMagic = [8]byte{'H', 'A', 'N', 'N', 'I', 'D', 'X', 0}
+
+// IsSectionFile reports whether prefix starts with the magic bytes of a binary index file.
+// Indexes use it to tell binary files from the gob files written by earlier versions.
+func IsSectionFile(prefix []byte) bool {
+	return len(prefix) >= len(sectionMagic) && string(prefix[:len(sectionMagic)]) == string(sectionMagic[:])
+}
+
+// SectionMagicLen is the number of bytes IsSectionFile needs to look at.
+const SectionMagicLen = len(sectionMagic)
+
+// Section describes one section of a binary index file.
+type Section struct {
+	Name  string                  // name of the section, at most 16 bytes
+	Size  int64                   // length of the section in bytes
+	Write func(w io.Writer) error // writes exactly Size bytes
+	Align int64                   // alignment of the section offset, a multiple of SectionAlignment (0 uses SectionAlignment)
+}
+
+// fixed lists the element types sections can hold.
+type fixed interface {
+	~int8 | ~uint8 | ~uint16 | ~int32 | ~uint32 | ~int64 | ~uint64 | ~float32 | ~float64
+}
+
+// chunkSize is the size of the buffer used to encode sections on big-endian machines.
+const chunkSize = 64 << 10
+
+// SliceSection returns a section holding the concatenation of chunks.
+// On little-endian machines the slices are written as they are, without copying.
+func SliceSection[T fixed](name string, chunks ...[]T) Section {
+	var zero T
+	size := int64(unsafe.Sizeof(zero))
+	var n int64
+	for _, c := range chunks {
+		n += int64(len(c))
+	}
+	return Section{
+		Name: name,
+		Size: n * size,
+		Write: func(w io.Writer) error {
+			for _, c := range chunks {
+				if err := writeSlice(w, c); err != nil {
+					return err
+				}
+			}
+			return nil
+		},
+	}
+}
+
+// IntsSection returns a section holding ints as int64 values.
+func IntsSection(name string, chunks ...[]int) Section {
+	var n int64
+	for _, c := range chunks {
+		n += int64(len(c))
+	}
+	return Section{
+		Name: name,
+		Size: n * 8,
+		Write: func(w io.Writer) error {
+			for _, c := range chunks {
+				if unsafe.Sizeof(int(0)) == 8 {
+					if err := writeSlice(w, unsafe.Slice((*int64)(unsafe.Pointer(unsafe.SliceData(c))), len(c))); err != nil {
+						return err
+					}
+					continue
+				}
+				buf := make([]int64, 0, chunkSize/8)
+				for len(c) > 0 {
+					buf = buf[:0]
+					for len(c) > 0 && len(buf) < cap(buf) {
+						buf = append(buf, int64(c[0]))
+						c = c[1:]
+					}
+					if err := writeSlice(w, buf); err != nil {
+						return err
+					}
+				}
+			}
+			return nil
+		},
+	}
+}
+
+// BytesSection returns a section holding raw bytes.
+func BytesSection(name string, data []byte) Section {
+	return SliceSection(name, data)
+}
+
+// writeSlice writes the little-endian encoding of data.
+func writeSlice[T fixed](w io.Writer, data []T) error {
+	if len(data) == 0 {
+		return nil
+	}
+	var zero T
+	size := int(unsafe.Sizeof(zero))
+	raw := unsafe.Slice((*byte)(unsafe.Pointer(unsafe.SliceData(data))), len(data)*size)
+	if nativeLittleEndian || size == 1 {
+		_, err := w.Write(raw)
+		return err
+	}
+	buf := make([]byte, chunkSize)
+	for len(raw) > 0 {
+		n := copy(buf, raw)
+		swapBytes(buf[:n], size)
+		if _, err := w.Write(buf[:n]); err != nil {
+			return err
+		}
+		raw = raw[n:]
+	}
+	return nil
+}
+
+// swapBytes reverses the byte order of every size-byte element of b.
+func swapBytes(b []byte, size int) {
+	for i := 0; i+size <= len(b); i += size {
+		for l, r := i, i+size-1; l < r; l, r = l+1, r-1 {
+			b[l], b[r] = b[r], b[l]
+		}
+	}
+}
+
+// alignUp rounds n up to a multiple of SectionAlignment.
+func alignUp(n int64) int64 {
+	return alignTo(n, SectionAlignment)
+}
+
+// alignTo rounds n up to a multiple of align.
+func alignTo(n, align int64) int64 {
+	return (n + align - 1) / align * align
+}
+
+// offsetAlignment returns the alignment of the offset of s.
+func (s Section) offsetAlignment() (int64, error) {
+	if s.Align == 0 {
+		return SectionAlignment, nil
+	}
+	if s.Align < 0 || s.Align%SectionAlignment != 0 {
+		return 0, fmt.Errorf("section %q: alignment %d is not a multiple of %d", s.Name, s.Align, SectionAlignment)
+	}
+	return s.Align, nil
+}
+
+// WriteSections writes a binary index file of the given kind to w.
+// Section offsets are computed from the section sizes up front, so the sections are
+// streamed to w one after another without buffering the file.
+func WriteSections(w io.Writer, kind string, sections []Section) error {
+	if len(kind) > maxNameLen {
+		return fmt.Errorf("index kind %q is longer than %d bytes", kind, maxNameLen)
+	}
+	header := make([]byte, headerSize+tableEntrySize*len(sections))
+	copy(header, sectionMagic[:])
+	binary.LittleEndian.PutUint32(header[8:], FormatVersion)
+	binary.LittleEndian.PutUint32(header[12:], uint32(len(sections)))
+	copy(header[16:32], kind)
+	offsets := make([]int64, len(sections))
+	end := int64(len(header))
+	for i, s := range sections {
+		if len(s.Name) > maxNameLen {
+			return fmt.Errorf("section name %q is longer than %d bytes", s.Name, maxNameLen)
+		}
+		align, err := s.offsetAlignment()
+		if err != nil {
+			return err
+		}
+		offsets[i] = alignTo(end, align)
+		entry := header[headerSize+i*tableEntrySize:]
+		copy(entry[:maxNameLen], s.Name)
+		binary.LittleEndian.PutUint64(entry[16:], uint64(offsets[i]))
+		binary.LittleEndian.PutUint64(entry[24:], uint64(s.Size))
+		end = offsets[i] + s.Size
+	}
+	cw := &countingWriter{w: w}
+	if _, err := cw.Write(header); err != nil {
+		return err
+	}
+	var pad [SectionAlignment]byte
+	for i, s := range sections {
+		for cw.n < offsets[i] {
+			if _, err := cw.Write(pad[:min(offsets[i]-cw.n, SectionAlignment)]); err != nil {
+				return err
+			}
+		}
+		start := cw.n
+		if err := s.Write(cw); err != nil {
+			return err
+		}
+		if cw.n-start != s.Size {
+			return fmt.Errorf("section %q: wrote %d bytes, expected %d", s.Name, cw.n-start, s.Size)
+		}
+	}
+	return nil
+}
+
+// countingWriter counts the bytes written through it.
+type countingWriter struct {
+	w io.Writer
+	n int64
+}
+
+func (c *countingWriter) Write(p []byte) (int, error) {
+	n, err := c.w.Write(p)
+	c.n += int64(n)
+	return n, err
+}
+
+// SectionFile is a binary index file opened for reading.
+// Typed views of its sections alias the file contents whenever the machine's byte order
+// allows it, so loading an index does not copy its arrays.
+type SectionFile struct {
+	Kind     string              // kind of index stored in the file
+	Version  uint32              // format version of the file
+	sections map[string][]byte   // section name to contents
+	mapping  []byte              // memory mapping, if the file was mapped
+	extents  map[string][2]int64 // offset and length of the sections left on disk (see OpenSections)
+}
+
+// ReadSections reads a binary index file from r into a single buffer.
+func ReadSections(r io.Reader) (*SectionFile, error) {
+	head := make([]byte, headerSize)
+	if _, err := io.ReadFull(r, head); err != nil {
+		return nil, err
+	}
+	if !IsSectionFile(head) {
+		return nil, ErrNotSectionFile
+	}
+	count := int(binary.LittleEndian.Uint32(head[12:]))
+	if count > maxSections {
+		return nil, fmt.Errorf("corrupt binary index file: %d sections", count)
+	}
+	table := make([]byte, count*tableEntrySize)
+	if _, err := io.ReadFull(r, table); err != nil {
+		return nil, err
+	}
+	size := int64(len(head) + len(table))
+	for i := 0; i < count; i++ {
+		entry := table[i*tableEntrySize:]
+		end := int64(binary.LittleEndian.Uint64(entry[16:]) + binary.LittleEndian.Uint64(entry[24:]))
+		if end > size {
+			size = end
+		}
+	}
+	if size < 0 || size > math.MaxInt {
+		return nil, errors.New("corrupt binary index file: invalid section table")
+	}
+	// Back the file with 8-byte words, so that typed views of sections are aligned.
+	words := make([]uint64, (size+7)/8)
+	data := unsafe.Slice((*byte)(unsafe.Pointer(unsafe.SliceData(words))), len(words)*8)[:size]
+	n := copy(data, head)
+	n += copy(data[n:], table)
+	if int64(n) < size {
+		if _, err := io.ReadFull(r, data[n:]); err != nil {
+			return nil, err
+		}
+	}
+	return parseSections(data, nil)
+}
+
+// MapSections maps the binary index file at path into memory.
+// Pages are read only when they are first touched, so an index loaded from the mapping
+// is usable almost immediately. The mapping is private: modifying the loaded index
+// copies the touched pages and never writes to the file. The mapping stays valid until
+// Close is called.
+func MapSections(path string) (*SectionFile, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	info, err := file.Stat()
+	if err != nil {
+		return nil, err
+	}
+	data, err := mapFilePrivate(file, int(info.Size()))
+	if err != nil {
+		return nil, err
+	}
+	f, err := parseSections(data, data)
+	if err != nil {
+		unmapFile(data)
+		return nil, err
+	}
+	return f, nil
+}
+
+// LoadIndexFile implements the LoadFile methods of the indexes. A binary index file at
+// path is mapped with MapSections and handed to mapped, which takes ownership of the
+// mapping if it succeeds. Any other file (e.g. a gob file written by an earlier version)
+// is streamed to load instead.
+func LoadIndexFile(path string, mapped func(*SectionFile) error, load func(io.Reader) error) error {
+	f, err := MapSections(path)
+	if errors.Is(err, ErrNotSectionFile) {
+		file, err := os.Open(path)
+		if err != nil {
+			return err
+		}
+		defer file.Close()
+		return load(file)
+	}
+	if err != nil {
+		return err
+	}
+	if err := mapped(f); err != nil {
+		f.Close()
+		return err
+	}
+	return nil
+}
+
+// OpenSections reads the binary index file at path like ReadSections, except for the
+// sections named in onDisk, whose contents are not read: Extent returns where they are in
+// the file, which is returned open so that they can be read on demand (e.g. with ReadAt).
+// The caller closes the file.
+func OpenSections(path string, onDisk ...string) (*SectionFile, *os.File, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, nil, err
+	}
+	f, err := readSectionsAt(file, onDisk)
+	if err != nil {
+		file.Close()
+		return nil, nil, err
+	}
+	return f, file, nil
+}
+
+// readSectionsAt reads the sections of file other than those in onDisk, each into its own
+// buffer of 8-byte words, so that typed views of them are aligned.
+func readSectionsAt(file *os.File, onDisk []string) (*SectionFile, error) {
+	info, err := file.Stat()
+	if err != nil {
+		return nil, err
+	}
+	size := info.Size()
+	head := make([]byte, headerSize)
+	if _, err := file.ReadAt(head, 0); err != nil {
+		if errors.Is(err, io.EOF) {
+			return nil, ErrNotSectionFile
+		}
+		return nil, err
+	}
+	if !IsSectionFile(head) {
+		return nil, ErrNotSectionFile
+	}
+	f := &SectionFile{
+		Kind:     trimName(head[16:32]),
+		Version:  binary.LittleEndian.Uint32(head[8:]),
+		sections: make(map[string][]byte),
+		extents:  make(map[string][2]int64),
+	}
+	if f.Version == 0 || f.Version > FormatVersion {
+		return nil, fmt.Errorf("unsupported binary index format version %d", f.Version)
+	}
+	count := int(binary.LittleEndian.Uint32(head[12:]))
+	if count > maxSections || int64(headerSize+count*tableEntrySize) > size {
+		return nil, errors.New("corrupt binary index file: truncated section table")
+	}
+	table := make([]byte, count*tableEntrySize)
+	if _, err := file.ReadAt(table, headerSize); err != nil {
+		return nil, err
+	}
+	for i := 0; i < count; i++ {
+		entry := table[i*tableEntrySize:]
+		name := trimName(entry[:maxNameLen])
+		off := binary.LittleEndian.Uint64(entry[16:])
+		length := binary.LittleEndian.Uint64(entry[24:])
+		if off%SectionAlignment != 0 || off > uint64(size) || length > uint64(size)-off {
+			return nil, fmt.Errorf("corrupt binary index file: section %q is out of bounds", name)
+		}
+		if slices.Contains(onDisk, name) {
+			f.extents[name] = [2]int64{int64(off), int64(length)}
+			continue
+		}
+		words := make([]uint64, (length+7)/8)
+		data := unsafe.Slice((*byte)(unsafe.Pointer(unsafe.SliceData(words))), len(words)*8)[:length:length]
+		if _, err := file.ReadAt(data, int64(off)); err != nil {
+			return nil, err
+		}
+		f.sections[name] = data
+	}
+	return f, nil
+}
+
+// Extent returns the offset and the length in the file of a section left on disk by
+// OpenSections.
+func (f *SectionFile) Extent(name string) (offset, length int64, err error) {
+	e, ok := f.extents[name]
+	if !ok {
+		return 0, 0, fmt.Errorf("binary index file has no section %q on disk", name)
+	}
+	return e[0], e[1], nil
+}
+
+// parseSections validates the header and section table of data.
+func parseSections(data, mapping []byte) (*SectionFile, error) {
+	if len(data) < headerSize || !IsSectionFile(data) {
+		return nil, ErrNotSectionFile
+	}
+	f := &SectionFile{
+		Version:  binary.LittleEndian.Uint32(data[8:]),
+		sections: make(map[string][]byte),
+		mapping:  mapping,
+	}
+	if f.Version == 0 || f.Version > FormatVersion {
+		return nil, fmt.Errorf("unsupported binary index format version %d", f.Version)
+	}
+	f.Kind = trimName(data[16:32])
+	count := int(binary.LittleEndian.Uint32(data[12:]))
+	if count > maxSections || headerSize+count*tableEntrySize > len(data) {
+		return nil, errors.New("corrupt binary index file: truncated section table")
+	}
+	for i := 0; i < count; i++ {
+		entry := data[headerSize+i*tableEntrySize:]
+		name := trimName(entry[:maxNameLen])
+		off := binary.LittleEndian.Uint64(entry[16:])
+		length := binary.LittleEndian.Uint64(entry[24:])
+		if off%SectionAlignment != 0 || off > uint64(len(data)) || length > uint64(len(data))-off {
+			return nil, fmt.Errorf("corrupt binary index file: section %q is out of bounds", name)
+		}
+		f.sections[name] = data[off : off+length : off+length]
+	}
+	return f, nil
+}
+
+// trimName strips the zero padding of a name field.
+func trimName(b []byte) string {
+	for i, c := range b {
+		if c == 0 {
+			return string(b[:i])
+		}
+	}
+	return string(b)
+}
+
+// Close releases the memory mapping of the file, if any.
+// Indexes loaded from a mapped file must not be used afterwards.
+func (f *SectionFile) Close() error {
+	mapping := f.mapping
+	f.mapping = nil
+	f.sections = nil
+	return unmapFile(mapping)
+}
+
+// Has reports whether the file contains a section with the given name, so that readers
+// can accept files written before the section was introduced.
+func (f *SectionFile) Has(name string) bool {
+	_, ok := f.sections[name]
+	if !ok {
+		_, ok = f.extents[name]
+	}
+	return ok
+}
+
+// Bytes returns the contents of a section.
+func (f *SectionFile) Bytes(name string) ([]byte, error) {
+	b, ok := f.sections[name]
+	if !ok {
+		return nil, fmt.Errorf("binary index file has no section %q", name)
+	}
+	return b, nil
+}
+
+// sectionView returns the contents of a section as a slice of T. The slice aliases the
+// file when the machine is little-endian; its capacity equals its length, so appending
+// to it copies instead of writing past the section.
+func sectionView[T fixed](f *SectionFile, name string) ([]T, error) {
+	b, err := f.Bytes(name)
+	if err != nil {
+		return nil, err
+	}
+	var zero T
+	size := int(unsafe.Sizeof(zero))
+	if len(b)%size != 0 {
+		return nil, fmt.Errorf("binary index file: section %q has size %d, not a multiple of %d", name, len(b), size)
+	}
+	if len(b) == 0 {
+		return nil, nil
+	}
+	if nativeLittleEndian || size == 1 {
+		return unsafe.Slice((*T)(unsafe.Pointer(&b[0])), len(b)/size), nil
+	}
+	out := make([]T, len(b)/size)
+	raw := unsafe.Slice((*byte)(unsafe.Pointer(&out[0])), len(b))
+	copy(raw, b)
+	swapBytes(raw, size)
+	return out, nil
+}
+
+// Float32s returns a section as float32 values.
+func (f *SectionFile) Float32s(name string) ([]float32, error) { return sectionView[float32](f, name) }
+
+// Float64s returns a section as float64 values.
+func (f *SectionFile) Float64s(name string) ([]float64, error) { return sectionView[float64](f, name) }
+
+// Uint32s returns a section as uint32 values.
+func (f *SectionFile) Uint32s(name string) ([]uint32, error) { return sectionView[uint32](f, name) }
+
+// Uint16s returns a section as uint16 values.
+func (f *SectionFile) Uint16s(name string) ([]uint16, error) { return sectionView[uint16](f, name) }
+
+// Uint8s returns a section as uint8 values.
+func (f *SectionFile) Uint8s(name string) ([]uint8, error) { return sectionView[uint8](f, name) }
+
+// Int8s returns a section as int8 values.
+func (f *SectionFile) Int8s(name string) ([]int8, error) { return sectionView[int8](f, name) }
+
+// Int64s returns a section as int64 values.
+func (f *SectionFile) Int64s(name string) ([]int64, error) { return sectionView[int64](f, name) }
+
+// Ints returns a section written by IntsSection. On 64-bit little-endian machines the
+// returned slice aliases the file.
+func (f *SectionFile) Ints(name string) ([]int, error) {
+	v, err := f.Int64s(name)
+	if err != nil {
+		return nil, err
+	}
+	if unsafe.Sizeof(int(0)) == 8 {
+		return unsafe.Slice((*int)(unsafe.Pointer(unsafe.SliceData(v))), len(v)), nil
+	}
+	out := make([]int, len(v))
+	for i, x := range v {
+		if x < math.MinInt || x > math.MaxInt {
+			return nil, fmt.Errorf("binary index file: value %d of section %q overflows int", x, name)
+		}
+		out[i] = int(x)
+	}
+	return out, nil
+}
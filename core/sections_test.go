@@ -0,0 +1,152 @@
+package core
+
+import (
+	"bytes"
+	"errors"
+	"io"
+	"os"
+	"path/filepath"
+	"testing"
+)
+
+func testSections() []Section {
+	return []Section{
+		SliceSection("floats", []float32{1, 2}, []float32{3}),
+		IntsSection("ints", []int{-1, 1 << 30}),
+		BytesSection("name", []byte("abc")),
+		SliceSection("empty", []uint32(nil)),
+		SliceSection("small", []int8{-3, 4}),
+	}
+}
+
+func checkSections(t *testing.T, f *SectionFile) {
+	t.Helper()
+	if f.Kind != "test" || f.Version != FormatVersion {
+		t.Fatalf("unexpected kind %q or version %d", f.Kind, f.Version)
+	}
+	floats, err := f.Float32s("floats")
+	if err != nil || len(floats) != 3 || floats[2] != 3 || cap(floats) != 3 {
+		t.Errorf("floats: %v, %v", floats, err)
+	}
+	ints, err := f.Ints("ints")
+	if err != nil || len(ints) != 2 || ints[0] != -1 || ints[1] != 1<<30 {
+		t.Errorf("ints: %v, %v", ints, err)
+	}
+	name, err := f.Bytes("name")
+	if err != nil || string(name) != "abc" {
+		t.Errorf("name: %q, %v", name, err)
+	}
+	if empty, err := f.Uint32s("empty"); err != nil || len(empty) != 0 {
+		t.Errorf("empty: %v, %v", empty, err)
+	}
+	if small, err := f.Int8s("small"); err != nil || len(small) != 2 || small[0] != -3 {
+		t.Errorf("small: %v, %v", small, err)
+	}
+	if _, err := f.Float32s("missing"); err == nil {
+		t.Error("expected an error for a missing section")
+	}
+	if _, err := f.Float32s("name"); err == nil {
+		t.Error("expected an error for a section of the wrong size")
+	}
+}
+
+func TestSectionsRoundTrip(t *testing.T) {
+	var buf bytes.Buffer
+	if err := WriteSections(&buf, "test", testSections()); err != nil {
+		t.Fatalf("WriteSections failed: %v", err)
+	}
+	f, err := ReadSections(bytes.NewReader(buf.Bytes()))
+	if err != nil {
+		t.Fatalf("ReadSections failed: %v", err)
+	}
+	checkSections(t, f)
+
+	path := filepath.Join(t.TempDir(), "index.bin")
+	if err := os.WriteFile(path, buf.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	mapped, err := MapSections(path)
+	if err != nil {
+		t.Fatalf("MapSections failed: %v", err)
+	}
+	checkSections(t, mapped)
+	// The mapping is private, so writes through a view do not reach the file.
+	floats, _ := mapped.Float32s("floats")
+	floats[0] = 42
+	if err := mapped.Close(); err != nil {
+		t.Fatalf("Close failed: %v", err)
+	}
+	data, err := os.ReadFile(path)
+	if err != nil || !bytes.Equal(data, buf.Bytes()) {
+		t.Error("modifying a mapped section changed the file")
+	}
+}
+
+func TestOpenSections(t *testing.T) {
+	blocks := make([]byte, 5000)
+	blocks[4999] = 7
+	sections := append(testSections(), Section{Name: "blocks", Size: int64(len(blocks)), Align: 4096,
+		Write: func(w io.Writer) error {
+			_, err := w.Write(blocks)
+			return err
+		}})
+	var buf bytes.Buffer
+	if err := WriteSections(&buf, "test", sections); err != nil {
+		t.Fatalf("WriteSections failed: %v", err)
+	}
+	path := filepath.Join(t.TempDir(), "index.bin")
+	if err := os.WriteFile(path, buf.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	f, file, err := OpenSections(path, "blocks")
+	if err != nil {
+		t.Fatalf("OpenSections failed: %v", err)
+	}
+	defer file.Close()
+	checkSections(t, f)
+	off, length, err := f.Extent("blocks")
+	if err != nil || off%4096 != 0 || length != 5000 || !f.Has("blocks") {
+		t.Fatalf("unexpected extent %d+%d (%v)", off, length, err)
+	}
+	if _, err := f.Bytes("blocks"); err == nil {
+		t.Error("expected a section left on disk not to be read")
+	}
+	last := make([]byte, 1)
+	if _, err := file.ReadAt(last, off+length-1); err != nil || last[0] != 7 {
+		t.Errorf("read %v (%v) at the end of the section", last, err)
+	}
+	if _, _, err := f.Extent("floats"); err == nil {
+		t.Error("expected no extent for a section read into memory")
+	}
+	if err := WriteSections(io.Discard, "test", []Section{{Name: "odd", Align: 100, Write: sections[0].Write}}); err == nil {
+		t.Error("expected an error for an alignment that is not a multiple of SectionAlignment")
+	}
+}
+
+func TestSectionsRejectInvalidFiles(t *testing.T) {
+	if _, err := ReadSections(bytes.NewReader([]byte("not an index file at all, just text"))); !errors.Is(err, ErrNotSectionFile) {
+		t.Errorf("expected ErrNotSectionFile, got %v", err)
+	}
+	var buf bytes.Buffer
+	if err := WriteSections(&buf, "test", testSections()); err != nil {
+		t.Fatalf("WriteSections failed: %v", err)
+	}
+	future := bytes.Clone(buf.Bytes())
+	future[8] = FormatVersion + 1
+	if _, err := ReadSections(bytes.NewReader(future)); err == nil {
+		t.Error("expected an error for an unsupported version")
+	}
+	if _, err := ReadSections(bytes.NewReader(buf.Bytes()[:buf.Len()-1])); err == nil {
+		t.Error("expected an error for a truncated file")
+	}
+}
+
+func TestWriteSectionsChecksSizes(t *testing.T) {
+	short := Section{Name: "short", Size: 8, Write: func(w io.Writer) error {
+		_, err := w.Write([]byte{1, 2, 3})
+		return err
+	}}
+	if err := WriteSections(io.Discard, "test", []Section{short}); err == nil {
+		t.Error("expected an error for a section shorter than its size")
+	}
+}
@@ -0,0 +1,134 @@
+package core
+
+import "fmt"
+
+// Batch is a batch of vectors for streaming ingestion (see AddStream). Row i of Vectors, a
+// row-major matrix of len(IDs)*dimension values, is the vector of IDs[i].
+type Batch struct {
+	IDs     []int     // ids of the rows
+	Vectors []float32 // row-major matrix of the vectors
+	Release func()    // called, if not nil, once the index no longer reads the matrix (see StreamOptions)
+}
+
+// Validate checks that the matrix of the batch holds dimension values per id and that no id
+// occurs twice.
+func (b Batch) Validate(dimension int) error {
+	if len(b.Vectors) != len(b.IDs)*dimension {
+		return fmt.Errorf("batch of %d ids holds %d values, want %d per vector",
+			len(b.IDs), len(b.Vectors), dimension)
+	}
+	seen := make(map[int]struct{}, len(b.IDs))
+	for _, id := range b.IDs {
+		if _, dup := seen[id]; dup {
+			return fmt.Errorf("id %d occurs twice in the batch", id)
+		}
+		seen[id] = struct{}{}
+	}
+	return nil
+}
+
+// Row returns the vector of row i, aliasing the matrix.
+func (b Batch) Row(i, dimension int) []float32 {
+	return b.Vectors[i*dimension : (i+1)*dimension : (i+1)*dimension]
+}
+
+// StreamOptions controls streaming ingestion (see AddStream).
+type StreamOptions struct {
+	// Copy makes the index copy the vectors into memory it owns, so that the matrix of every
+	// batch can be reused once its Release is called. Without it, indexes that keep the
+	// vectors by reference (RPT) alias the matrices, which must then stay unchanged, and
+	// never release them; indexes that copy vectors anyway (HNSW, PQIVF) always release.
+	Copy bool
+}
+
+// StreamAdder is implemented by indexes that ingest batches natively (see AddStream).
+type StreamAdder interface {
+	AddStream(batches <-chan Batch, opts StreamOptions) error
+}
+
+// AddStream inserts the batches received from batches into idx until the channel is
+// closed. A batch is inserted while the producer prepares the next ones, so reading and
+// building overlap; a producer that fills the channel blocks until the index catches up,
+// which bounds the memory held by pending batches by the capacity of the channel.
+// Indexes that implement StreamAdder ingest the batches natively; others receive every
+// batch as a BulkAdd. After an error, the remaining batches are received and released
+// without being added, so that the producer does not block; the batches inserted before
+// it stay in the index, and the first error is returned.
+func AddStream(idx Index, batches <-chan Batch, opts StreamOptions) error {
+	if s, ok := idx.(StreamAdder); ok {
+		return s.AddStream(batches, opts)
+	}
+	dimension := idx.Stats().Dimension
+	vectors := make(map[int][]float32)
+	return ConsumeBatches(batches, opts.Copy, func(b Batch) error {
+		if err := b.Validate(dimension); err != nil {
+			return err
+		}
+		m := b.Vectors
+		if opts.Copy {
+			m = append([]float32(nil), m...)
+		}
+		clear(vectors)
+		for i, id := range b.IDs {
+			vectors[id] = m[i*dimension : (i+1)*dimension : (i+1)*dimension]
+		}
+		return idx.BulkAdd(vectors)
+	})
+}
+
+// ConsumeBatches calls add for every batch received from batches until the channel is
+// closed, and then releases the batch if release is set. Once add has failed, the remaining
+// batches are only received and released, and the first error is returned.
+func ConsumeBatches(batches <-chan Batch, release bool, add func(Batch) error) error {
+	var err error
+	for b := range batches {
+		skipped := err != nil
+		if !skipped {
+			err = add(b)
+		}
+		if (release || skipped) && b.Release != nil {
+			b.Release()
+		}
+	}
+	return err
+}
+
+// StreamMatrix sends the rows of m, with ids counting up from firstID, to the returned
+// channel in batches of batchSize rows, which a goroutine copies out of the matrix while
+// the index inserts the previous batches; for a mapped dataset file, this is also where its
+// pages are read. With buffers > 0 the batches reuse that many matrices, each once its
+// batch is released, so the stream holds at most buffers batches; with buffers == 0 every
+// batch gets a new matrix, which indexes that alias the vectors (RPT without
+// StreamOptions.Copy) need, as they never release them.
+func StreamMatrix(m *Matrix[float32], firstID, batchSize, buffers int) <-chan Batch {
+	batchSize = max(batchSize, 1)
+	batches := make(chan Batch)
+	var free chan []float32
+	if buffers > 0 {
+		free = make(chan []float32, buffers)
+		for i := 0; i < buffers; i++ {
+			free <- make([]float32, batchSize*m.Dim)
+		}
+	}
+	go func() {
+		defer close(batches)
+		for start := 0; start < m.Rows; start += batchSize {
+			n := min(batchSize, m.Rows-start)
+			var b Batch
+			if free != nil {
+				buf := <-free
+				b.Vectors = buf[:n*m.Dim]
+				b.Release = func() { free <- buf }
+			} else {
+				b.Vectors = make([]float32, n*m.Dim)
+			}
+			b.IDs = make([]int, n)
+			for i := range b.IDs {
+				b.IDs[i] = firstID + start + i
+				copy(b.Vectors[i*m.Dim:], m.Row(start+i))
+			}
+			batches <- b
+		}
+	}()
+	return batches
+}
@@ -0,0 +1,90 @@
+package core
+
+import (
+	"errors"
+	"testing"
+)
+
+// bulkIndex records the vectors of its BulkAdd calls; its other methods are not used.
+type bulkIndex struct {
+	Index
+	vectors map[int][]float32
+}
+
+func (b *bulkIndex) Stats() IndexStats { return IndexStats{Dimension: 2} }
+
+func (b *bulkIndex) BulkAdd(vectors map[int][]float32) error {
+	for id, v := range vectors {
+		if _, ok := b.vectors[id]; ok {
+			return errors.New("duplicate")
+		}
+		b.vectors[id] = v
+	}
+	return nil
+}
+
+func TestBatchValidate(t *testing.T) {
+	b := Batch{IDs: []int{1, 2}, Vectors: []float32{1, 2, 3, 4}}
+	if err := b.Validate(2); err != nil {
+		t.Errorf("unexpected error: %v", err)
+	}
+	if got := b.Row(1, 2); len(got) != 2 || cap(got) != 2 || got[0] != 3 {
+		t.Errorf("unexpected row %v", got)
+	}
+	if err := b.Validate(3); err == nil {
+		t.Error("expected an error for a matrix of the wrong size")
+	}
+	if err := (Batch{IDs: []int{1, 1}, Vectors: make([]float32, 4)}).Validate(2); err == nil {
+		t.Error("expected an error for a duplicate id")
+	}
+}
+
+func TestAddStream(t *testing.T) {
+	for _, copyVectors := range []bool{false, true} {
+		idx := &bulkIndex{vectors: make(map[int][]float32)}
+		batches := make(chan Batch)
+		released := 0
+		go func() {
+			defer close(batches)
+			for start := 0; start < 10; start += 3 {
+				var b Batch
+				for id := start; id < min(start+3, 10); id++ {
+					b.IDs = append(b.IDs, id)
+					b.Vectors = append(b.Vectors, float32(id), float32(-id))
+				}
+				b.Release = func() { released++ }
+				batches <- b
+			}
+			// A duplicate fails the stream; the batches after it are drained.
+			batches <- Batch{IDs: []int{4}, Vectors: []float32{0, 0}, Release: func() { released++ }}
+			batches <- Batch{IDs: []int{20}, Vectors: []float32{0, 0}, Release: func() { released++ }}
+		}()
+		if err := AddStream(idx, batches, StreamOptions{Copy: copyVectors}); err == nil {
+			t.Fatal("expected an error for a duplicate id")
+		}
+		if len(idx.vectors) != 10 || idx.vectors[7][1] != -7 {
+			t.Fatalf("unexpected vectors %v", idx.vectors)
+		}
+		// Without Copy only the skipped batch is released, as the index may alias the others.
+		want := 1
+		if copyVectors {
+			want = 6
+		}
+		if released != want {
+			t.Errorf("Copy %v: %d batches released, want %d", copyVectors, released, want)
+		}
+	}
+}
+
+func TestStreamMatrix(t *testing.T) {
+	m := &Matrix[float32]{Rows: 5, Dim: 2, data: []float32{0, 1, 2, 3, 4, 5, 6, 7, 8, 9}, stride: 2}
+	for _, buffers := range []int{0, 1} {
+		idx := &bulkIndex{vectors: make(map[int][]float32)}
+		if err := AddStream(idx, StreamMatrix(m, 100, 2, buffers), StreamOptions{Copy: true}); err != nil {
+			t.Fatalf("AddStream failed: %v", err)
+		}
+		if len(idx.vectors) != 5 || idx.vectors[100][1] != 1 || idx.vectors[104][0] != 8 {
+			t.Errorf("buffers %d: unexpected vectors %v", buffers, idx.vectors)
+		}
+	}
+}
@@ -0,0 +1,9 @@
+//go:build !unix
+
+package core
+
+// SyncDir does nothing on platforms whose directories cannot be synced; renames are
+// persisted by the file system.
+func SyncDir(dir string) error {
+	return nil
+}
@@ -0,0 +1,18 @@
+//go:build unix
+
+package core
+
+import "os"
+
+// SyncDir syncs dir, so that the files created and renamed in it persist.
+func SyncDir(dir string) error {
+	d, err := os.Open(dir)
+	if err != nil {
+		return err
+	}
+	err = d.Sync()
+	if cerr := d.Close(); err == nil {
+		err = cerr
+	}
+	return err
+}
@@ -0,0 +1,305 @@
+package core
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"math"
+	"os"
+	"sync"
+	"unsafe"
+)
+
+// VectorStore holds full-precision vectors outside an index.
+// Compressed indexes use it to keep raw vectors off the heap (e.g. on disk) and to read
+// them back only for the few candidates that are re-ranked. Searches read a store
+// concurrently with each other and with writes of the index.
+type VectorStore interface {
+
+	// Put stores a vector under id, replacing any vector previously stored under it.
+	Put(id int, vector []float32) error
+
+	// Get returns the vector stored under id.
+	// dst: an optional buffer the vector is written into when it is large enough.
+	// The returned slice may alias memory owned by the store and must not be modified.
+	// Returns an error if no vector is stored under id.
+	Get(id int, dst []float32) ([]float32, error)
+
+	// Delete removes the vector stored under id. Deleting an unknown id is not an error.
+	Delete(id int) error
+}
+
+// freeRecord marks unused records in a FileVectorStore.
+const freeRecord = -1
+
+// FileVectorStore is a VectorStore that keeps vectors in fixed-size records of a file.
+// Each record holds an int64 id (or -1 for a free record) followed by the vector as
+// little-endian float32 values. Only the id-to-record table is kept in memory.
+type FileVectorStore struct {
+	mu        sync.RWMutex
+	file      *os.File
+	dimension int
+	offsets   map[int]int64 // id to record offset
+	free      []int64       // offsets of free records available for reuse
+	end       int64         // offset after the last record
+	bufs      sync.Pool     // record-sized byte buffers
+}
+
+// OpenFileVectorStore opens the vector store at path, creating the file if it does not exist.
+// Existing records are scanned to rebuild the id table.
+func OpenFileVectorStore(path string, dimension int) (*FileVectorStore, error) {
+	if dimension <= 0 {
+		return nil, fmt.Errorf("invalid vector dimension %d", dimension)
+	}
+	file, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE, 0o644)
+	if err != nil {
+		return nil, err
+	}
+	s := &FileVectorStore{
+		file:      file,
+		dimension: dimension,
+		offsets:   make(map[int]int64),
+	}
+	recordSize := s.recordSize()
+	s.bufs.New = func() interface{} {
+		buf := make([]byte, recordSize)
+		return &buf
+	}
+	info, err := file.Stat()
+	if err != nil {
+		file.Close()
+		return nil, err
+	}
+	if info.Size()%int64(recordSize) != 0 {
+		file.Close()
+		return nil, fmt.Errorf("vector store %s has size %d, which is not a multiple of the record size %d",
+			path, info.Size(), recordSize)
+	}
+	var header [8]byte
+	for off := int64(0); off < info.Size(); off += int64(recordSize) {
+		if _, err := file.ReadAt(header[:], off); err != nil {
+			file.Close()
+			return nil, err
+		}
+		id := int(int64(binary.LittleEndian.Uint64(header[:])))
+		if id == freeRecord {
+			s.free = append(s.free, off)
+		} else {
+			s.offsets[id] = off
+		}
+	}
+	s.end = info.Size()
+	return s, nil
+}
+
+// recordSize returns the size in bytes of one record.
+func (s *FileVectorStore) recordSize() int {
+	return 8 + 4*s.dimension
+}
+
+// putRecordID writes the id of a record header.
+func putRecordID(buf []byte, id int) {
+	v := int64(id)
+	binary.LittleEndian.PutUint64(buf, uint64(v))
+}
+
+// Put stores a vector under id, replacing any vector previously stored under it.
+func (s *FileVectorStore) Put(id int, vector []float32) error {
+	if len(vector) != s.dimension {
+		return fmt.Errorf("vector dimension %d does not match store dimension %d", len(vector), s.dimension)
+	}
+	if id == freeRecord {
+		return fmt.Errorf("id %d is reserved", id)
+	}
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	off, exists := s.offsets[id]
+	if !exists {
+		if n := len(s.free); n > 0 {
+			off = s.free[n-1]
+			s.free = s.free[:n-1]
+		} else {
+			off = s.end
+			s.end += int64(s.recordSize())
+		}
+	}
+	bufp := s.bufs.Get().(*[]byte)
+	defer s.bufs.Put(bufp)
+	buf := *bufp
+	putRecordID(buf, id)
+	for i, v := range vector {
+		binary.LittleEndian.PutUint32(buf[8+4*i:], math.Float32bits(v))
+	}
+	if _, err := s.file.WriteAt(buf, off); err != nil {
+		if !exists {
+			s.free = append(s.free, off)
+		}
+		return err
+	}
+	s.offsets[id] = off
+	return nil
+}
+
+// Get returns the vector stored under id.
+func (s *FileVectorStore) Get(id int, dst []float32) ([]float32, error) {
+	// Hold the read lock while reading, so the record cannot be freed and reused meanwhile.
+	s.mu.RLock()
+	defer s.mu.RUnlock()
+	off, exists := s.offsets[id]
+	if !exists {
+		return nil, fmt.Errorf("id %d not found in vector store", id)
+	}
+	bufp := s.bufs.Get().(*[]byte)
+	defer s.bufs.Put(bufp)
+	buf := (*bufp)[8:]
+	if _, err := s.file.ReadAt(buf, off+8); err != nil && err != io.EOF {
+		return nil, err
+	}
+	if cap(dst) < s.dimension {
+		dst = make([]float32, s.dimension)
+	}
+	dst = dst[:s.dimension]
+	for i := range dst {
+		dst[i] = math.Float32frombits(binary.LittleEndian.Uint32(buf[4*i:]))
+	}
+	return dst, nil
+}
+
+// Delete removes the vector stored under id and marks its record as free.
+func (s *FileVectorStore) Delete(id int) error {
+	s.mu.Lock()
+	defer s.mu.Unlock()
+	off, exists := s.offsets[id]
+	if !exists {
+		return nil
+	}
+	var header [8]byte
+	putRecordID(header[:], freeRecord)
+	if _, err := s.file.WriteAt(header[:], off); err != nil {
+		return err
+	}
+	delete(s.offsets, id)
+	s.free = append(s.free, off)
+	return nil
+}
+
+// Len returns the number of stored vectors.
+func (s *FileVectorStore) Len() int {
+	s.mu.RLock()
+	defer s.mu.RUnlock()
+	return len(s.offsets)
+}
+
+// Sync commits the stored vectors to stable storage.
+func (s *FileVectorStore) Sync() error {
+	return s.file.Sync()
+}
+
+// Close closes the underlying file.
+func (s *FileVectorStore) Close() error {
+	return s.file.Close()
+}
+
+// nativeLittleEndian reports whether float32 values can be read from records in place.
+var nativeLittleEndian = binary.NativeEndian.Uint16([]byte{1, 0}) == 1
+
+// MappedVectorStore is a read-only VectorStore over a file written by FileVectorStore.
+// The file is memory-mapped, so vectors are paged in only when a search touches them, and
+// Get returns slices that point directly into the mapping instead of copying.
+type MappedVectorStore struct {
+	file      *os.File
+	data      []byte        // mapped file contents
+	dimension int           // dimension of the vectors
+	offsets   map[int]int64 // id to record offset
+}
+
+// OpenMappedVectorStore maps the vector store file at path read-only.
+func OpenMappedVectorStore(path string, dimension int) (*MappedVectorStore, error) {
+	if dimension <= 0 {
+		return nil, fmt.Errorf("invalid vector dimension %d", dimension)
+	}
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	info, err := file.Stat()
+	if err != nil {
+		file.Close()
+		return nil, err
+	}
+	recordSize := int64(8 + 4*dimension)
+	if info.Size()%recordSize != 0 {
+		file.Close()
+		return nil, fmt.Errorf("vector store %s has size %d, which is not a multiple of the record size %d",
+			path, info.Size(), recordSize)
+	}
+	data, err := mapFile(file, int(info.Size()))
+	if err != nil {
+		file.Close()
+		return nil, err
+	}
+	s := &MappedVectorStore{
+		file:      file,
+		data:      data,
+		dimension: dimension,
+		offsets:   make(map[int]int64),
+	}
+	for off := int64(0); off < info.Size(); off += recordSize {
+		id := int(int64(binary.LittleEndian.Uint64(data[off:])))
+		if id != freeRecord {
+			s.offsets[id] = off
+		}
+	}
+	return s, nil
+}
+
+// Put is not supported by a mapped store.
+func (s *MappedVectorStore) Put(id int, vector []float32) error {
+	return errors.New("mapped vector store is read-only")
+}
+
+// Get returns the vector stored under id. On little-endian machines the returned
+// slice points into the mapping.
+func (s *MappedVectorStore) Get(id int, dst []float32) ([]float32, error) {
+	off, exists := s.offsets[id]
+	if !exists {
+		return nil, fmt.Errorf("id %d not found in vector store", id)
+	}
+	raw := s.data[off+8 : off+8+int64(4*s.dimension)]
+	if nativeLittleEndian {
+		return unsafe.Slice((*float32)(unsafe.Pointer(&raw[0])), s.dimension), nil
+	}
+	if cap(dst) < s.dimension {
+		dst = make([]float32, s.dimension)
+	}
+	dst = dst[:s.dimension]
+	for i := range dst {
+		dst[i] = math.Float32frombits(binary.LittleEndian.Uint32(raw[4*i:]))
+	}
+	return dst, nil
+}
+
+// Delete is not supported by a mapped store.
+func (s *MappedVectorStore) Delete(id int) error {
+	return errors.New("mapped vector store is read-only")
+}
+
+// Len returns the number of stored vectors.
+func (s *MappedVectorStore) Len() int {
+	return len(s.offsets)
+}
+
+// Close unmaps and closes the file. Slices returned by Get must not be used afterwards.
+func (s *MappedVectorStore) Close() error {
+	err := unmapFile(s.data)
+	s.data = nil
+	if cerr := s.file.Close(); err == nil {
+		err = cerr
+	}
+	return err
+}
+
+// Check interface compliance at compile time.
+var _ VectorStore = (*FileVectorStore)(nil)
+var _ VectorStore = (*MappedVectorStore)(nil)
@@ -0,0 +1,103 @@
+package core
+
+import (
+	"path/filepath"
+	"testing"
+)
+
+func TestFileVectorStore(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "vectors.bin")
+	store, err := OpenFileVectorStore(path, 3)
+	if err != nil {
+		t.Fatalf("OpenFileVectorStore failed: %v", err)
+	}
+
+	if err := store.Put(1, []float32{1, 2, 3}); err != nil {
+		t.Fatalf("Put failed: %v", err)
+	}
+	if err := store.Put(2, []float32{4, 5, 6}); err != nil {
+		t.Fatalf("Put failed: %v", err)
+	}
+	if err := store.Put(3, []float32{1, 2}); err == nil {
+		t.Error("expected error due to dimension mismatch, got none")
+	}
+	// Replace a vector and free a record that a later Put reuses.
+	if err := store.Put(1, []float32{7, 8, 9}); err != nil {
+		t.Fatalf("Put failed: %v", err)
+	}
+	if err := store.Delete(2); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	if err := store.Put(4, []float32{-1, 0, 1}); err != nil {
+		t.Fatalf("Put failed: %v", err)
+	}
+	if _, err := store.Get(2, nil); err == nil {
+		t.Error("expected error when getting a deleted id, got none")
+	}
+	if err := store.Close(); err != nil {
+		t.Fatalf("Close failed: %v", err)
+	}
+
+	// Reopening the file rebuilds the id table from the records.
+	store, err = OpenFileVectorStore(path, 3)
+	if err != nil {
+		t.Fatalf("OpenFileVectorStore failed on reopen: %v", err)
+	}
+	defer store.Close()
+	if store.Len() != 2 {
+		t.Errorf("expected 2 vectors after reopen, got %d", store.Len())
+	}
+	want := map[int][]float32{1: {7, 8, 9}, 4: {-1, 0, 1}}
+	buf := make([]float32, 3)
+	for id, vec := range want {
+		got, err := store.Get(id, buf)
+		if err != nil {
+			t.Fatalf("Get(%d) failed: %v", id, err)
+		}
+		for i := range vec {
+			if got[i] != vec[i] {
+				t.Errorf("Get(%d) = %v; want %v", id, got, vec)
+				break
+			}
+		}
+	}
+}
+
+func TestMappedVectorStore(t *testing.T) {
+	path := filepath.Join(t.TempDir(), "vectors.bin")
+	store, err := OpenFileVectorStore(path, 2)
+	if err != nil {
+		t.Fatalf("OpenFileVectorStore failed: %v", err)
+	}
+	for id := 0; id < 10; id++ {
+		if err := store.Put(id, []float32{float32(id), float32(-id)}); err != nil {
+			t.Fatalf("Put failed: %v", err)
+		}
+	}
+	if err := store.Delete(3); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	store.Close()
+
+	mapped, err := OpenMappedVectorStore(path, 2)
+	if err != nil {
+		t.Fatalf("OpenMappedVectorStore failed: %v", err)
+	}
+	defer mapped.Close()
+	if mapped.Len() != 9 {
+		t.Errorf("expected 9 vectors, got %d", mapped.Len())
+	}
+	got, err := mapped.Get(7, nil)
+	if err != nil {
+		t.Fatalf("Get failed: %v", err)
+	}
+	if len(got) != 2 || got[0] != 7 || got[1] != -7 {
+		t.Errorf("Get(7) = %v; want [7 -7]", got)
+	}
+	if _, err := mapped.Get(3, nil); err == nil {
+		t.Error("expected error when getting a deleted id, got none")
+	}
+	if err := mapped.Put(11, []float32{1, 1}); err == nil {
+		t.Error("expected error when writing to a mapped store, got none")
+	}
+}
@@ -0,0 +1,226 @@
+package diskann
+
+import (
+	"math"
+	"sync"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/schollz/progressbar/v3"
+)
+
+// linkStripes is the number of locks guarding the neighbor lists of a graph being built.
+// Node s is guarded by stripe s%linkStripes.
+const linkStripes = 1024
+
+// slackNumerator/slackDenominator is the factor by which neighbor lists may outgrow the
+// degree while the graph is built, so that back links prune a list only every few inserts;
+// lists are pruned to the degree at the end of the build.
+const (
+	slackNumerator   = 13
+	slackDenominator = 10
+)
+
+// builder builds a Vamana graph over vectors held in memory. Nodes are inserted
+// concurrently: each finds its candidates with a greedy search of the graph built so far,
+// keeps a pruned subset of them as its neighbors and links them back to it.
+type builder struct {
+	data   []float32             // row-major vectors
+	dim    int                   // dimension of the vectors
+	degree int                   // maximum number of neighbors per node
+	size   int                   // candidate list size of the greedy searches
+	kernel core.DistanceFunc     // distance compared by the searches
+	finish func(float64) float64 // maps kernel values to distances, which pruning compares
+	slack  int                   // length up to which neighbor lists grow before they are pruned
+	links  [][]uint32            // neighbor lists by node
+	medoid uint32                // entry point of the greedy searches
+	locks  [linkStripes]sync.Mutex
+}
+
+// newBuilder prepares the build of a graph over the n = len(data)/dim vectors of data.
+func newBuilder(data []float32, dim, degree, size int, metric core.Metric) *builder {
+	b := &builder{
+		data:   data,
+		dim:    dim,
+		degree: degree,
+		size:   max(size, degree),
+		slack:  max(degree*slackNumerator/slackDenominator, degree+1),
+		kernel: metric.Kernel,
+		finish: metric.Finalize,
+		links:  make([][]uint32, len(data)/dim),
+	}
+	b.medoid = b.findMedoid()
+	return b
+}
+
+// vector returns the vector of node s.
+func (b *builder) vector(s uint32) []float32 {
+	return b.data[int(s)*b.dim : (int(s)+1)*b.dim : (int(s)+1)*b.dim]
+}
+
+// findMedoid returns the node closest to the mean of the vectors, which every search
+// enters the graph from.
+func (b *builder) findMedoid() uint32 {
+	n := len(b.links)
+	mean := make([]float32, b.dim)
+	for s := 0; s < n; s++ {
+		for j, v := range b.vector(uint32(s)) {
+			mean[j] += v / float32(n)
+		}
+	}
+	var mu sync.Mutex
+	best, bestDist := uint32(0), math.Inf(1)
+	core.ParallelRange(n, 1024, func(start, end int) {
+		local, localDist := uint32(0), math.Inf(1)
+		for s := start; s < end; s++ {
+			if d := b.kernel(mean, b.vector(uint32(s))); d < localDist {
+				local, localDist = uint32(s), d
+			}
+		}
+		mu.Lock()
+		if localDist < bestDist || (localDist == bestDist && local < best) {
+			best, bestDist = local, localDist
+		}
+		mu.Unlock()
+	})
+	return best
+}
+
+// build runs the two passes of Vamana over the nodes in the given order: the first prunes
+// with alpha 1, which yields a sparse graph quickly; the second with alpha, which keeps some
+// longer links and makes the graph navigable in few hops.
+func (b *builder) build(order []uint32, alpha float64, bar *progressbar.ProgressBar) {
+	for _, a := range []float64{1, alpha} {
+		workers := min(core.Workers(), len(order))
+		core.ParallelFor(workers, func(w int) {
+			bctx := &buildContext{}
+			for i := w; i < len(order); i += workers {
+				b.insert(bctx, order[i], a)
+				bar.Add(1)
+			}
+		})
+	}
+	core.ParallelRange(len(b.links), 256, func(start, end int) {
+		for s := start; s < end; s++ {
+			if len(b.links[s]) > b.degree {
+				b.links[s] = b.prune(uint32(s), b.linkCandidates(uint32(s), b.links[s]), alpha)
+			}
+		}
+	})
+}
+
+// buildContext holds the scratch state of one building goroutine.
+type buildContext struct {
+	visited visitSet
+	beam    beam
+	cands   []candidate
+	nbrs    []uint32
+}
+
+// neighbors copies the neighbor list of s into dst under its stripe lock.
+func (b *builder) neighbors(s uint32, dst []uint32) []uint32 {
+	mu := &b.locks[s%linkStripes]
+	mu.Lock()
+	dst = append(dst[:0], b.links[s]...)
+	mu.Unlock()
+	return dst
+}
+
+// insert links node s into the graph.
+func (b *builder) insert(bctx *buildContext, s uint32, alpha float64) {
+	q := b.vector(s)
+	cands := b.greedySearch(bctx, q)
+	// The current neighbors of s stay candidates, so the second pass only refines them.
+	for _, nb := range b.neighbors(s, bctx.nbrs) {
+		if bctx.visited.visit(nb) {
+			cands = append(cands, candidate{node: nb, dist: b.kernel(q, b.vector(nb))})
+		}
+	}
+	nbrs := b.prune(s, cands, alpha)
+	mu := &b.locks[s%linkStripes]
+	mu.Lock()
+	b.links[s] = nbrs
+	mu.Unlock()
+
+	// Link the new neighbors back to s, pruning their lists once they reach the slack.
+	for _, nb := range nbrs {
+		mu := &b.locks[nb%linkStripes]
+		mu.Lock()
+		if !containsNode(b.links[nb], s) {
+			b.links[nb] = append(b.links[nb], s)
+			if len(b.links[nb]) >= b.slack {
+				b.links[nb] = b.prune(nb, b.linkCandidates(nb, b.links[nb]), alpha)
+			}
+		}
+		mu.Unlock()
+	}
+}
+
+// linkCandidates returns the nodes of list with their distances to s.
+func (b *builder) linkCandidates(s uint32, list []uint32) []candidate {
+	v := b.vector(s)
+	cands := make([]candidate, len(list))
+	for i, o := range list {
+		cands[i] = candidate{node: o, dist: b.kernel(v, b.vector(o))}
+	}
+	return cands
+}
+
+// greedySearch searches the graph built so far for q from the medoid and returns all
+// nodes it expanded, with their distances, as the candidate neighbors of q.
+func (b *builder) greedySearch(bctx *buildContext, q []float32) []candidate {
+	bctx.visited.reset(len(b.links))
+	bctx.beam = bctx.beam[:0]
+	bctx.cands = bctx.cands[:0]
+	bctx.visited.visit(b.medoid)
+	bctx.beam.push(candidate{node: b.medoid, dist: b.kernel(q, b.vector(b.medoid))}, b.size)
+	var front [1]candidate
+	for {
+		next := bctx.beam.next(front[:0], 1)
+		if len(next) == 0 {
+			break
+		}
+		bctx.cands = append(bctx.cands, next[0])
+		bctx.nbrs = b.neighbors(next[0].node, bctx.nbrs)
+		for _, nb := range bctx.nbrs {
+			if bctx.visited.visit(nb) {
+				bctx.beam.push(candidate{node: nb, dist: b.kernel(q, b.vector(nb))}, b.size)
+			}
+		}
+	}
+	return bctx.cands
+}
+
+// prune selects up to degree neighbors of s from cands with the robust pruning of Vamana:
+// candidates are taken in order of distance, and each one drops the remaining candidates
+// that are more than alpha times closer to it than to s, as they are reached through it.
+func (b *builder) prune(s uint32, cands []candidate, alpha float64) []uint32 {
+	sortCandidates(cands)
+	pruned := make([]bool, len(cands))
+	out := make([]uint32, 0, b.degree)
+	for i, c := range cands {
+		if len(out) == b.degree {
+			break
+		}
+		if pruned[i] || c.node == s {
+			continue
+		}
+		out = append(out, c.node)
+		v := b.vector(c.node)
+		for j := i + 1; j < len(cands); j++ {
+			if !pruned[j] && alpha*b.finish(b.kernel(v, b.vector(cands[j].node))) <= b.finish(cands[j].dist) {
+				pruned[j] = true
+			}
+		}
+	}
+	return out
+}
+
+// containsNode reports whether list holds s.
+func containsNode(list []uint32, s uint32) bool {
+	for _, o := range list {
+		if o == s {
+			return true
+		}
+	}
+	return false
+}
@@ -0,0 +1,334 @@
+package diskann
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"math"
+	"os"
+	"sync"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/pqivf"
+)
+
+// formatKind identifies DiskANN indexes in binary index files.
+const formatKind = "diskann"
+
+// sectorSize is the unit of disk reads. Node blocks start at multiples of it and span whole
+// sectors, so loading a node is one aligned read of one sector (or of a few, for nodes
+// larger than a sector).
+const sectorSize = 4096
+
+// Positions of the parameters in the "meta" section.
+const (
+	metaDimension = iota
+	metaDegree
+	metaNodes
+	metaMedoid
+	metaSubquantizers
+	metaCodewords
+	metaLen
+)
+
+// layout places the nodes of a graph in sector-aligned blocks. A node is its vector
+// (float32 values), its number of neighbors and degree neighbor slots (uint32 values), all
+// little-endian. Nodes never straddle blocks: nodes that fit a sector are packed perBlock to
+// a one-sector block, larger ones get a block of whole sectors each.
+type layout struct {
+	dimension int // dimension of the vectors
+	degree    int // neighbor slots per node
+	nodeSize  int // bytes per node
+	perBlock  int // nodes per block
+	blockSize int // bytes per block, a multiple of sectorSize
+}
+
+// newLayout returns the layout of nodes with the given dimension and degree.
+func newLayout(dimension, degree int) layout {
+	l := layout{dimension: dimension, degree: degree, nodeSize: 4*dimension + 4 + 4*degree}
+	if l.nodeSize <= sectorSize {
+		l.perBlock = sectorSize / l.nodeSize
+		l.blockSize = sectorSize
+	} else {
+		l.perBlock = 1
+		l.blockSize = (l.nodeSize + sectorSize - 1) / sectorSize * sectorSize
+	}
+	return l
+}
+
+// blocks returns the number of blocks holding n nodes.
+func (l layout) blocks(n int) int {
+	return (n + l.perBlock - 1) / l.perBlock
+}
+
+// locate returns the block holding a node and the offset of the node in the block.
+func (l layout) locate(node uint32) (int, int) {
+	return int(node) / l.perBlock, int(node) % l.perBlock * l.nodeSize
+}
+
+// encode writes a node into dst, which holds nodeSize bytes.
+func (l layout) encode(dst []byte, vector []float32, neighbors []uint32) {
+	for i, v := range vector {
+		binary.LittleEndian.PutUint32(dst[4*i:], math.Float32bits(v))
+	}
+	off := 4 * l.dimension
+	binary.LittleEndian.PutUint32(dst[off:], uint32(len(neighbors)))
+	for i, nb := range neighbors {
+		binary.LittleEndian.PutUint32(dst[off+4+4*i:], nb)
+	}
+}
+
+// decode reads the node at src into vector and appends its neighbors to nbrs[:0].
+func (l layout) decode(src []byte, vector []float32, nbrs []uint32) []uint32 {
+	for i := range vector {
+		vector[i] = math.Float32frombits(binary.LittleEndian.Uint32(src[4*i:]))
+	}
+	off := 4 * l.dimension
+	count := min(int(binary.LittleEndian.Uint32(src[off:])), l.degree)
+	nbrs = nbrs[:0]
+	for i := 0; i < count; i++ {
+		nbrs = append(nbrs, binary.LittleEndian.Uint32(src[off+4+4*i:]))
+	}
+	return nbrs
+}
+
+// node is a node loaded from its block.
+type node struct {
+	vector    []float32
+	neighbors []uint32
+}
+
+// diskGraph is a built graph. Its node blocks stay in the file and are read by searches;
+// only the PQ codes of the nodes, their ids and the cached nodes are held in memory.
+type diskGraph struct {
+	path     string           // path of the file
+	file     *os.File         // file holding the node blocks
+	base     int64            // offset of the first block in the file
+	layout   layout           // placement of the nodes in the blocks
+	medoid   uint32           // entry point of searches
+	ids      []int            // ids by node
+	codes    []uint8          // PQ codes, subquantizers bytes per node
+	pq       *pqivf.Quantizer // codebooks of the codes (nil for an empty graph)
+	cache    map[uint32]node  // nodes near the medoid, kept in memory
+	contexts sync.Pool        // pooled *searchContext values
+}
+
+// size returns the number of nodes of the graph.
+func (g *diskGraph) size() int {
+	return len(g.ids)
+}
+
+// graphSections returns the sections of a graph file. The PQ sections are read into memory
+// when the file is opened; the node blocks, sector-aligned, are written block by block
+// by writeNodes and stay on disk.
+func graphSections(distance string, l layout, medoid uint32, ids []int, pq *pqivf.Quantizer, codes []uint8,
+	writeNodes func(w io.Writer) error) []core.Section {
+	meta := make([]int64, metaLen)
+	meta[metaDimension] = int64(l.dimension)
+	meta[metaDegree] = int64(l.degree)
+	meta[metaNodes] = int64(len(ids))
+	meta[metaMedoid] = int64(medoid)
+	var codebooks [][]float32
+	if pq != nil {
+		meta[metaSubquantizers] = int64(len(pq.Codebooks))
+		meta[metaCodewords] = int64(len(pq.Codebooks[0]))
+		for _, cb := range pq.Codebooks {
+			codebooks = append(codebooks, cb...)
+		}
+	}
+	return []core.Section{
+		core.SliceSection("meta", meta),
+		core.BytesSection("distance", []byte(distance)),
+		core.IntsSection("ids", ids),
+		core.SliceSection("codebooks", codebooks...),
+		core.SliceSection("codes", codes),
+		{
+			Name:  "nodes",
+			Size:  int64(l.blocks(len(ids)) * l.blockSize),
+			Write: writeNodes,
+			Align: sectorSize,
+		},
+	}
+}
+
+// writeGraphFile writes the sections of a graph to a new file at path and syncs it.
+func writeGraphFile(path string, sections []core.Section) error {
+	file, err := os.Create(path)
+	if err != nil {
+		return err
+	}
+	w := bufio.NewWriterSize(file, 1<<20)
+	err = core.WriteSections(w, formatKind, sections)
+	if err == nil {
+		err = w.Flush()
+	}
+	if err == nil {
+		err = file.Sync()
+	}
+	if cerr := file.Close(); err == nil {
+		err = cerr
+	}
+	if err != nil {
+		os.Remove(path)
+	}
+	return err
+}
+
+// openGraph opens the graph file at path, reading everything but the node blocks, and
+// loads up to cacheNodes nodes around the medoid into memory. dimension and distance must
+// match the file.
+func openGraph(path string, dimension int, distance string, cacheNodes int) (*diskGraph, error) {
+	f, file, err := core.OpenSections(path, "nodes")
+	if err != nil {
+		return nil, err
+	}
+	g, err := loadGraph(f, file, dimension, distance)
+	if err == nil {
+		err = g.loadCache(cacheNodes)
+	}
+	if err != nil {
+		file.Close()
+		return nil, err
+	}
+	return g, nil
+}
+
+// loadGraph validates the sections of a graph file and builds its in-memory part.
+func loadGraph(f *core.SectionFile, file *os.File, dimension int, distance string) (*diskGraph, error) {
+	if f.Kind != formatKind {
+		return nil, fmt.Errorf("binary index file holds a %q index, not %q", f.Kind, formatKind)
+	}
+	meta, err := f.Int64s("meta")
+	if err != nil {
+		return nil, err
+	}
+	if len(meta) < metaLen {
+		return nil, fmt.Errorf("corrupt index file: meta section has %d values", len(meta))
+	}
+	if int(meta[metaDimension]) != dimension {
+		return nil, fmt.Errorf("index file dimension %d does not match index dimension %d", meta[metaDimension], dimension)
+	}
+	name, err := f.Bytes("distance")
+	if err != nil {
+		return nil, err
+	}
+	if string(name) != distance {
+		return nil, fmt.Errorf("index file uses distance %q, index uses %q", name, distance)
+	}
+	n, degree, m, codewords := int(meta[metaNodes]), int(meta[metaDegree]), int(meta[metaSubquantizers]), int(meta[metaCodewords])
+	if meta[metaNodes] < 0 || meta[metaNodes] > math.MaxUint32 || degree <= 0 || (n > 0 && (m <= 0 || dimension%m != 0 || codewords <= 0 || codewords > 256)) {
+		return nil, fmt.Errorf("corrupt index file: invalid parameters %v", meta)
+	}
+	g := &diskGraph{file: file, layout: newLayout(dimension, degree), medoid: uint32(meta[metaMedoid])}
+	var length int64
+	if g.base, length, err = f.Extent("nodes"); err != nil {
+		return nil, err
+	}
+	if g.ids, err = f.Ints("ids"); err != nil {
+		return nil, err
+	}
+	if g.codes, err = f.Uint8s("codes"); err != nil {
+		return nil, err
+	}
+	flat, err := f.Float32s("codebooks")
+	if err != nil {
+		return nil, err
+	}
+	if len(g.ids) != n || len(g.codes) != n*m || len(flat) != m*codewords*(dimension/max(m, 1)) ||
+		length < int64(g.layout.blocks(n)*g.layout.blockSize) || (n > 0 && int(g.medoid) >= n) {
+		return nil, fmt.Errorf("corrupt index file: sections do not match %d nodes", n)
+	}
+	if n > 0 {
+		subDim := dimension / m
+		g.pq = &pqivf.Quantizer{Dimension: dimension, Codebooks: make([][][]float32, m)}
+		for i := range g.pq.Codebooks {
+			cb := make([][]float32, codewords)
+			for j := range cb {
+				off := (i*codewords + j) * subDim
+				cb[j] = flat[off : off+subDim : off+subDim]
+			}
+			g.pq.Codebooks[i] = cb
+		}
+	}
+	return g, nil
+}
+
+// readBlock reads block b into dst, which holds blockSize bytes.
+func (g *diskGraph) readBlock(b int, dst []byte) error {
+	_, err := g.file.ReadAt(dst, g.base+int64(b)*int64(g.layout.blockSize))
+	return err
+}
+
+// loadCache reads up to limit nodes into the cache in breadth-first order from the medoid,
+// the nodes every search passes first.
+func (g *diskGraph) loadCache(limit int) error {
+	g.cache = make(map[uint32]node)
+	limit = min(limit, g.size())
+	if limit <= 0 {
+		return nil
+	}
+	vectors := make([]float32, limit*g.layout.dimension)
+	block := make([]byte, g.layout.blockSize)
+	queue := []uint32{g.medoid}
+	queued := map[uint32]bool{g.medoid: true}
+	for len(queue) > 0 && len(g.cache) < limit {
+		s := queue[0]
+		queue = queue[1:]
+		b, off := g.layout.locate(s)
+		if err := g.readBlock(b, block); err != nil {
+			return err
+		}
+		i := len(g.cache)
+		vec := vectors[i*g.layout.dimension : (i+1)*g.layout.dimension : (i+1)*g.layout.dimension]
+		nbrs := g.layout.decode(block[off:], vec, nil)
+		g.cache[s] = node{vector: vec, neighbors: nbrs}
+		for _, nb := range nbrs {
+			if int(nb) < g.size() && !queued[nb] {
+				queued[nb] = true
+				queue = append(queue, nb)
+			}
+		}
+	}
+	return nil
+}
+
+// forEachNode reads the blocks of the graph in order and calls fn for every node, whose
+// vector is only valid during the call.
+func (g *diskGraph) forEachNode(fn func(s uint32, vector []float32) error) error {
+	l := g.layout
+	r := bufio.NewReaderSize(io.NewSectionReader(g.file, g.base, int64(l.blocks(g.size())*l.blockSize)), 1<<20)
+	block := make([]byte, l.blockSize)
+	vec := make([]float32, l.dimension)
+	var nbrs []uint32
+	for s := 0; s < g.size(); s++ {
+		b, off := l.locate(uint32(s))
+		if off == 0 {
+			if _, err := io.ReadFull(r, block); err != nil {
+				return fmt.Errorf("reading block %d: %w", b, err)
+			}
+		}
+		nbrs = l.decode(block[off:], vec, nbrs)
+		if err := fn(uint32(s), vec); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// memory returns the memory held by the graph: its codes, ids and cached nodes.
+func (g *diskGraph) memory() core.MemoryStats {
+	m := core.MemoryStats{
+		Codes: int64(len(g.codes)),
+		IDs:   int64(len(g.ids)) * 8,
+		Graph: core.MapBytes(len(g.cache)),
+	}
+	if g.pq != nil {
+		m.Codes += int64(len(g.pq.Codebooks)*len(g.pq.Codebooks[0])) * int64(g.layout.dimension/len(g.pq.Codebooks)) * 4
+	}
+	for _, nd := range g.cache {
+		m.Vectors += int64(len(nd.vector)) * 4
+		m.Graph += int64(len(nd.neighbors)) * 4
+	}
+	return m
+}
@@ -0,0 +1,666 @@
+package diskann
+
+import (
+	"fmt"
+	"io"
+	"math/rand"
+	"os"
+	"sort"
+	"sync"
+	"time"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/pqivf"
+	"github.com/rs/zerolog/log"
+	"github.com/schollz/progressbar/v3"
+)
+
+// Defaults of the parameters of a DiskIndex.
+const (
+	defaultAlpha        = 1.2
+	defaultBeamWidth    = 4
+	defaultCacheNodes   = 1024
+	defaultCodewords    = 256
+	defaultKMeansIters  = 10
+	defaultTrainingSize = 100000
+	defaultMergeMin     = 1024
+)
+
+// DiskIndex is a graph index in the style of DiskANN that keeps its vectors and its graph
+// on disk. The nodes of a Vamana graph, each holding its full vector and its neighbor list,
+// are stored in sector-aligned blocks of the index file at the path of the index; memory
+// holds only the PQ codes of the nodes (see pqivf.Quantizer), their ids and a cache of the
+// nodes nearest the entry point. A search is a beam search: each step reads the blocks of
+// the BeamWidth closest candidates concurrently, ranks their neighbors by PQ distance and
+// scores the loaded vectors exactly, so the results are re-ranked without further reads.
+//
+// The graph file is never modified. Vectors added since the last build are kept in memory
+// and scanned exactly by searches, and deleted nodes are skipped; Build merges both into a
+// new graph, which happens automatically once MergeThreshold of them accumulate and at the
+// end of a bulk insert into an index without a graph. A build holds all vectors in memory
+// and blocks searches until the new graph is in place.
+type DiskIndex struct {
+	mu                 sync.RWMutex      // mutex for concurrent access
+	Dimension          int               // dimension of the vectors
+	R                  int               // maximum number of neighbors per node
+	L                  int               // candidate list size of the graph build
+	Alpha              float64           // pruning factor of the second build pass (0 uses 1.2)
+	Ef                 int               // default candidate list size of searches (0 uses L)
+	BeamWidth          int               // nodes a search loads per step, reading their blocks in parallel (0 uses 4)
+	CacheNodes         int               // nodes near the entry point kept in memory (0 uses 1024, negative disables)
+	Subquantizers      int               // PQ subquantizers (0 uses the largest divisor of Dimension up to Dimension/4)
+	Codewords          int               // codewords per subquantizer, at most 256 (0 uses 256)
+	KMeansIters        int               // k-means iterations of the codebook training (0 uses 10)
+	TrainingSampleSize int               // maximum number of vectors the codebooks are trained on (0 uses 100000, negative uses all)
+	MergeThreshold     int               // pending inserts and deletes that start a build (0 uses max(1024, nodes/8), negative disables)
+	Distance           core.DistanceFunc // reported distance between vectors
+	DistanceName       string            // name of the distance metric
+	Sink               core.MetricsSink  // receives the instrumentation of the index, if not nil (set before use)
+
+	path     string             // file the builds write the graph to
+	metric   core.Metric        // metric whose kernel is compared internally
+	graph    *diskGraph         // graph of the last build, nil before the first
+	idToNode map[int]uint32     // graph nodes of the live ids
+	deleted  core.Bitset        // graph nodes deleted since the last build
+	pending  map[int][]float32  // vectors added since the last build
+	rng      *rand.Rand         // draws the training sample and the insertion order
+	counters core.IndexCounters // totals of the searches and builds, reported by Stats
+}
+
+// NewDiskIndex creates an empty index whose graph file is written to path. R is the
+// maximum number of neighbors per node and L the candidate list size of the build, which
+// is also the default list size of searches. If distanceName names a metric in
+// core.Metrics, its cheaper kernel is compared internally; vectors are ranked by PQ codes
+// of their Euclidean geometry while searching, so the metric should agree with it
+// (euclidean, squared_euclidean or cosine).
+func NewDiskIndex(path string, dimension, R, L int, distance core.DistanceFunc, distanceName string) *DiskIndex {
+	log.Info().Msgf("Creating new DiskANN index at %s with dimension=%d, R=%d, L=%d, distance=%s",
+		path, dimension, R, L, distanceName)
+	return &DiskIndex{
+		Dimension:    dimension,
+		R:            R,
+		L:            L,
+		Distance:     distance,
+		DistanceName: distanceName,
+		path:         path,
+		metric:       core.ResolveMetric(distanceName, distance),
+		idToNode:     make(map[int]uint32),
+		pending:      make(map[int][]float32),
+		rng:          rand.New(rand.NewSource(core.GetSeed())),
+	}
+}
+
+// count returns the number of live vectors.
+func (d *DiskIndex) count() int {
+	return len(d.idToNode) + len(d.pending)
+}
+
+// has reports whether id is in the index.
+func (d *DiskIndex) has(id int) bool {
+	if _, ok := d.idToNode[id]; ok {
+		return true
+	}
+	_, ok := d.pending[id]
+	return ok
+}
+
+// add keeps a copy of vector for the next build, normalized if the metric needs it.
+func (d *DiskIndex) add(id int, vector []float32) {
+	v := append([]float32(nil), vector...)
+	if d.metric.Normalize {
+		core.NormalizeInPlace(v)
+	}
+	d.pending[id] = v
+}
+
+// remove deletes id from the pending vectors or marks its graph node deleted, and
+// reports whether the id was found.
+func (d *DiskIndex) remove(id int) bool {
+	if _, ok := d.pending[id]; ok {
+		delete(d.pending, id)
+		return true
+	}
+	s, ok := d.idToNode[id]
+	if ok {
+		d.deleted.Add(int(s))
+		delete(d.idToNode, id)
+	}
+	return ok
+}
+
+// checkDimension returns an error if vector does not have the dimension of the index.
+func (d *DiskIndex) checkDimension(id int, vector []float32) error {
+	if len(vector) != d.Dimension {
+		return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
+			len(vector), d.Dimension, id)
+	}
+	return nil
+}
+
+// maybeMerge builds a new graph once enough changes are pending, or, after a bulk insert,
+// if the index has no graph yet.
+func (d *DiskIndex) maybeMerge(bulk bool) error {
+	changes := len(d.pending) + d.deleted.Len()
+	if d.MergeThreshold < 0 || changes == 0 {
+		return nil
+	}
+	threshold := d.MergeThreshold
+	if threshold == 0 {
+		threshold = max(defaultMergeMin, len(d.idToNode)/8)
+	}
+	if changes >= threshold || (bulk && d.graph == nil) {
+		return d.build()
+	}
+	return nil
+}
+
+// Add inserts a vector with the given id. It is searched exactly until the next build.
+func (d *DiskIndex) Add(id int, vector []float32) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	if err := d.checkDimension(id, vector); err != nil {
+		return err
+	}
+	if d.has(id) {
+		return fmt.Errorf("id %d already exists", id)
+	}
+	d.add(id, vector)
+	return d.maybeMerge(false)
+}
+
+// BulkAdd inserts multiple vectors. The vectors are copied.
+func (d *DiskIndex) BulkAdd(vectors map[int][]float32) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	for id, vector := range vectors {
+		if err := d.checkDimension(id, vector); err != nil {
+			return err
+		}
+		if d.has(id) {
+			return fmt.Errorf("id %d already exists", id)
+		}
+	}
+	for id, vector := range vectors {
+		d.add(id, vector)
+	}
+	return d.maybeMerge(true)
+}
+
+// AddStream inserts the batches received from batches (see core.AddStream). The vectors
+// are copied, so every batch is released once it has been added; the graph is built when
+// the stream ends, as after a BulkAdd.
+func (d *DiskIndex) AddStream(batches <-chan core.Batch, _ core.StreamOptions) error {
+	err := core.ConsumeBatches(batches, true, d.addBatch)
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	if merr := d.maybeMerge(true); err == nil {
+		err = merr
+	}
+	return err
+}
+
+// addBatch inserts the vectors of one batch of a stream.
+func (d *DiskIndex) addBatch(b core.Batch) error {
+	if err := b.Validate(d.Dimension); err != nil {
+		return err
+	}
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	for _, id := range b.IDs {
+		if d.has(id) {
+			return fmt.Errorf("id %d already exists", id)
+		}
+	}
+	for i, id := range b.IDs {
+		d.add(id, b.Row(i, d.Dimension))
+	}
+	return nil
+}
+
+// Delete removes the vector with the given id.
+func (d *DiskIndex) Delete(id int) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	if !d.remove(id) {
+		return fmt.Errorf("id %d not found", id)
+	}
+	return d.maybeMerge(false)
+}
+
+// BulkDelete removes multiple vectors. Ids that are not in the index are skipped.
+func (d *DiskIndex) BulkDelete(ids []int) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	for _, id := range ids {
+		d.remove(id)
+	}
+	return d.maybeMerge(false)
+}
+
+// Update replaces the vector of the given id.
+func (d *DiskIndex) Update(id int, vector []float32) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	if err := d.checkDimension(id, vector); err != nil {
+		return err
+	}
+	if !d.remove(id) {
+		return fmt.Errorf("id %d not found", id)
+	}
+	d.add(id, vector)
+	return d.maybeMerge(false)
+}
+
+// BulkUpdate replaces the vectors of multiple ids. Ids that are not in the index are
+// skipped.
+func (d *DiskIndex) BulkUpdate(updates map[int][]float32) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	for id, vector := range updates {
+		if err := d.checkDimension(id, vector); err != nil {
+			return err
+		}
+	}
+	for id, vector := range updates {
+		if d.remove(id) {
+			d.add(id, vector)
+		}
+	}
+	return d.maybeMerge(false)
+}
+
+// Build merges the pending inserts and deletes into a new graph: it trains the codebooks
+// on the live vectors, builds a Vamana graph over them and writes it to the path of the
+// index, replacing the previous graph file.
+func (d *DiskIndex) Build() error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	return d.build()
+}
+
+// build implements Build. The caller holds mu exclusively.
+func (d *DiskIndex) build() error {
+	start := time.Now()
+	ids, data, err := d.collect()
+	if err != nil {
+		return err
+	}
+	n := len(ids)
+	var pq *pqivf.Quantizer
+	var codes []uint8
+	var links [][]uint32
+	var medoid uint32
+	if n > 0 {
+		if pq, err = d.trainQuantizer(data); err != nil {
+			return err
+		}
+		m := len(pq.Codebooks)
+		codes = make([]uint8, n*m)
+		core.ParallelRange(n, 256, func(start, end int) {
+			for i := start; i < end; i++ {
+				pq.Encode(data[i*d.Dimension:(i+1)*d.Dimension], codes[i*m:(i+1)*m])
+			}
+		})
+		alpha := d.Alpha
+		if alpha == 0 {
+			alpha = defaultAlpha
+		}
+		b := newBuilder(data, d.Dimension, d.R, d.L, d.metric)
+		order := make([]uint32, n)
+		for i, p := range d.rng.Perm(n) {
+			order[i] = uint32(p)
+		}
+		// Initialize progress bar with newline on completion.
+		bar := progressbar.NewOptions(2*n,
+			progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
+		)
+		b.build(order, alpha, bar)
+		links, medoid = b.links, b.medoid
+	}
+
+	l := newLayout(d.Dimension, d.R)
+	writeNodes := func(w io.Writer) error {
+		block := make([]byte, l.blockSize)
+		for first := 0; first < n; first += l.perBlock {
+			clear(block)
+			for s := first; s < min(first+l.perBlock, n); s++ {
+				l.encode(block[(s-first)*l.nodeSize:], data[s*d.Dimension:(s+1)*d.Dimension], links[s])
+			}
+			if _, err := w.Write(block); err != nil {
+				return err
+			}
+		}
+		return nil
+	}
+	tmp := d.path + ".tmp"
+	if err := writeGraphFile(tmp, graphSections(d.DistanceName, l, medoid, ids, pq, codes, writeNodes)); err != nil {
+		return err
+	}
+	if err := d.install(tmp); err != nil {
+		return err
+	}
+	d.counters.RecordBuild(d.Sink, "diskann_build", time.Since(start))
+	log.Info().Msgf("Built DiskANN graph of %d nodes in %v", n, time.Since(start))
+	return nil
+}
+
+// collect returns the ids and the row-major vectors of all live vectors: those of the
+// graph in node order, followed by the pending ones in id order.
+func (d *DiskIndex) collect() ([]int, []float32, error) {
+	ids := make([]int, 0, d.count())
+	data := make([]float32, 0, d.count()*d.Dimension)
+	if g := d.graph; g != nil {
+		err := g.forEachNode(func(s uint32, vector []float32) error {
+			if !d.deleted.Contains(int(s)) {
+				ids = append(ids, g.ids[s])
+				data = append(data, vector...)
+			}
+			return nil
+		})
+		if err != nil {
+			return nil, nil, err
+		}
+	}
+	added := make([]int, 0, len(d.pending))
+	for id := range d.pending {
+		added = append(added, id)
+	}
+	sort.Ints(added)
+	for _, id := range added {
+		ids = append(ids, id)
+		data = append(data, d.pending[id]...)
+	}
+	return ids, data, nil
+}
+
+// trainQuantizer trains the codebooks on a sample of the row-major vectors of data.
+func (d *DiskIndex) trainQuantizer(data []float32) (*pqivf.Quantizer, error) {
+	dim := d.Dimension
+	n := len(data) / dim
+	sample := d.TrainingSampleSize
+	if sample == 0 {
+		sample = defaultTrainingSize
+	}
+	train := data
+	if sample > 0 && n > sample {
+		train = make([]float32, 0, sample*dim)
+		for _, row := range d.rng.Perm(n)[:sample] {
+			train = append(train, data[row*dim:(row+1)*dim]...)
+		}
+	}
+	m := d.Subquantizers
+	if m == 0 {
+		m = max(dim/4, 1)
+		for dim%m != 0 {
+			m--
+		}
+	}
+	k := d.Codewords
+	if k == 0 {
+		k = defaultCodewords
+	}
+	iters := d.KMeansIters
+	if iters == 0 {
+		iters = defaultKMeansIters
+	}
+	return pqivf.TrainQuantizer(train, dim, m, k, iters, 0, d.rng)
+}
+
+// cacheNodes returns the number of nodes to cache.
+func (d *DiskIndex) cacheNodes() int {
+	if d.CacheNodes == 0 {
+		return defaultCacheNodes
+	}
+	return d.CacheNodes
+}
+
+// install moves the graph file written to tmp to the path of the index and serves the
+// graph from it, discarding the pending changes it includes. The file of the previous
+// graph is closed first, so that it can be replaced on every platform.
+func (d *DiskIndex) install(tmp string) error {
+	g, err := openGraph(tmp, d.Dimension, d.DistanceName, d.cacheNodes())
+	if err != nil {
+		os.Remove(tmp)
+		return err
+	}
+	g.file.Close()
+	old := d.graph
+	if old != nil {
+		old.file.Close()
+	}
+	if err := os.Rename(tmp, d.path); err != nil {
+		os.Remove(tmp)
+		if old != nil {
+			// Keep serving the previous graph, whose file is still in place.
+			if file, oerr := os.Open(old.path); oerr == nil {
+				old.file = file
+			}
+		}
+		return err
+	}
+	if g.file, err = os.Open(d.path); err != nil {
+		return err
+	}
+	g.path = d.path
+	d.setGraph(g)
+	return nil
+}
+
+// setGraph makes g the graph of the index, without pending changes.
+func (d *DiskIndex) setGraph(g *diskGraph) {
+	d.graph = g
+	d.idToNode = make(map[int]uint32, g.size())
+	for s, id := range g.ids {
+		d.idToNode[id] = uint32(s)
+	}
+	d.deleted = core.Bitset{}
+	d.pending = make(map[int][]float32)
+}
+
+// Search returns the k nearest neighbors of query.
+func (d *DiskIndex) Search(query []float32, k int) ([]core.Neighbor, error) {
+	return d.SearchWithOptions(query, k, core.SearchOptions{})
+}
+
+// SearchWithOptions is like Search with per-query parameters; opts.Ef sets the candidate
+// list size of the beam search. Deleted nodes and nodes outside opts.Filter are still
+// traversed, but not returned; if they leave fewer than k results, the search is repeated
+// with a list twice as long. Pending vectors are scored exactly.
+func (d *DiskIndex) SearchWithOptions(query []float32, k int, opts core.SearchOptions) ([]core.Neighbor, error) {
+	var start time.Time
+	if d.Sink != nil {
+		start = time.Now()
+	}
+	wait := core.RLockTimed(&d.mu)
+	defer d.mu.RUnlock()
+
+	if len(query) != d.Dimension {
+		return nil, fmt.Errorf("query dimension %d does not match index dimension %d", len(query), d.Dimension)
+	}
+	if d.count() == 0 {
+		return nil, core.ErrEmptyIndex
+	}
+	q := query
+	if d.metric.Normalize {
+		q = append([]float32(nil), query...)
+		core.NormalizeInPlace(q)
+	}
+	budget := core.NewSearchBudget(opts)
+	var stats core.SearchStats
+	filter := opts.Filter
+	var scored []core.Neighbor
+
+	if g := d.graph; g != nil && len(d.idToNode) > 0 {
+		size := opts.Ef
+		if size <= 0 {
+			size = d.Ef
+		}
+		if size <= 0 {
+			size = d.L
+		}
+		size = min(max(size, k), g.size())
+		width := d.BeamWidth
+		if width <= 0 {
+			width = defaultBeamWidth
+		}
+		allowed := func(s uint32) bool {
+			return !d.deleted.Contains(int(s)) && (filter == nil || filter.Contains(g.ids[s]))
+		}
+		ctx := g.getContext(width)
+		for {
+			found, err := g.search(ctx, q, size, width, d.metric.Kernel, allowed, &budget, &stats)
+			if err != nil {
+				g.contexts.Put(ctx)
+				return nil, err
+			}
+			if len(found) >= k || size == g.size() || budget.Exhausted() {
+				for _, c := range found {
+					scored = append(scored, core.Neighbor{ID: g.ids[c.node], Distance: c.dist})
+				}
+				break
+			}
+			stats.Fallbacks++
+			size = min(2*size, g.size())
+			ctx.reset(g.size())
+		}
+		g.contexts.Put(ctx)
+	}
+	for id, v := range d.pending {
+		if filter == nil || filter.Contains(id) {
+			scored = append(scored, core.Neighbor{ID: id, Distance: d.metric.Kernel(q, v)})
+		}
+	}
+	budget.Spend(len(d.pending))
+	sort.Slice(scored, func(i, j int) bool {
+		if scored[i].Distance == scored[j].Distance {
+			return scored[i].ID < scored[j].ID
+		}
+		return scored[i].Distance < scored[j].Distance
+	})
+	stats.Candidates = len(scored)
+	budget.Report(&stats)
+	if opts.Stats != nil {
+		*opts.Stats = stats
+	}
+	d.counters.RecordSearch(d.Sink, "diskann", &stats, wait, start)
+
+	results := scored[:min(k, len(scored))]
+	for i := range results {
+		results[i].Distance = d.metric.Finalize(results[i].Distance)
+	}
+	return results, nil
+}
+
+// SearchBatch finds the k nearest neighbors for each query vector using the shared worker pool.
+func (d *DiskIndex) SearchBatch(queries [][]float32, k int) ([][]core.Neighbor, error) {
+	return core.SearchBatch(queries, k, d.Search)
+}
+
+// Stats returns metadata about the index. Memory counts what the index holds in memory;
+// the node blocks on disk are not included.
+func (d *DiskIndex) Stats() core.IndexStats {
+	d.mu.RLock()
+	defer d.mu.RUnlock()
+	var mem core.MemoryStats
+	if d.graph != nil {
+		mem = d.graph.memory()
+	}
+	mem.IDs += core.MapBytes(len(d.idToNode)) + core.MapBytes(len(d.pending))
+	mem.Vectors += int64(len(d.pending)*d.Dimension) * 4
+	stats := core.IndexStats{
+		Count:     d.count(),
+		Dimension: d.Dimension,
+		Distance:  d.DistanceName,
+		Memory:    mem,
+	}
+	d.counters.Fill(&stats)
+	return stats
+}
+
+// Save writes the index file to w, building the graph first if changes are pending. The
+// written file can be loaded with Load or, after writing it to a file, with LoadFile.
+func (d *DiskIndex) Save(w io.Writer) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	if d.graph == nil || len(d.pending) > 0 || d.deleted.Len() > 0 {
+		if err := d.build(); err != nil {
+			return err
+		}
+	}
+	info, err := d.graph.file.Stat()
+	if err != nil {
+		return err
+	}
+	if _, err := io.Copy(w, io.NewSectionReader(d.graph.file, 0, info.Size())); err != nil {
+		return err
+	}
+	log.Info().Msg("Index saved")
+	return nil
+}
+
+// Load reads an index written by Save, copying it to the path of the index, and serves
+// the graph from there. Pending changes are discarded.
+func (d *DiskIndex) Load(r io.Reader) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	tmp := d.path + ".tmp"
+	file, err := os.Create(tmp)
+	if err != nil {
+		return err
+	}
+	_, err = io.Copy(file, r)
+	if err == nil {
+		err = file.Sync()
+	}
+	if cerr := file.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = d.install(tmp)
+	}
+	if err != nil {
+		os.Remove(tmp)
+		return err
+	}
+	log.Info().Msg("Index loaded")
+	return nil
+}
+
+// LoadFile serves the graph of the index file at path, written by Save or by a build, in
+// place: the node blocks are read from that file, which the index never modifies. The
+// next build writes the path of the index. Pending changes are discarded.
+func (d *DiskIndex) LoadFile(path string) error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	g, err := openGraph(path, d.Dimension, d.DistanceName, d.cacheNodes())
+	if err != nil {
+		return err
+	}
+	g.path = path
+	if d.graph != nil {
+		d.graph.file.Close()
+	}
+	d.setGraph(g)
+	return nil
+}
+
+// Close closes the graph file. The index is empty afterwards.
+func (d *DiskIndex) Close() error {
+	d.mu.Lock()
+	defer d.mu.Unlock()
+	var err error
+	if d.graph != nil {
+		err = d.graph.file.Close()
+		d.graph = nil
+	}
+	d.idToNode = make(map[int]uint32)
+	d.deleted = core.Bitset{}
+	d.pending = make(map[int][]float32)
+	return err
+}
+
+// Check interface compliance at compile time.
+var (
+	_ core.Index       = (*DiskIndex)(nil)
+	_ core.StreamAdder = (*DiskIndex)(nil)
+)
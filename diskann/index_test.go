@@ -0,0 +1,272 @@
+package diskann_test
+
+import (
+	"bytes"
+	"errors"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"sort"
+	"testing"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/diskann"
+)
+
+func randomVectors(n, dim int, seed int64) map[int][]float32 {
+	rng := rand.New(rand.NewSource(seed))
+	vectors := make(map[int][]float32, n)
+	for id := 0; id < n; id++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = rng.Float32()
+		}
+		vectors[id] = vec
+	}
+	return vectors
+}
+
+// exactNeighbors returns the ids of the k vectors closest to query in Euclidean distance.
+func exactNeighbors(vectors map[int][]float32, query []float32, k int) []int {
+	ids := make([]int, 0, len(vectors))
+	for id := range vectors {
+		ids = append(ids, id)
+	}
+	sort.Slice(ids, func(i, j int) bool {
+		di, dj := core.SquaredL2(query, vectors[ids[i]]), core.SquaredL2(query, vectors[ids[j]])
+		if di == dj {
+			return ids[i] < ids[j]
+		}
+		return di < dj
+	})
+	return ids[:k]
+}
+
+func newIndex(t *testing.T, dim int) *diskann.DiskIndex {
+	t.Helper()
+	idx := diskann.NewDiskIndex(filepath.Join(t.TempDir(), "index.diskann"), dim, 16, 64,
+		core.Distances["euclidean"], "euclidean")
+	t.Cleanup(func() { idx.Close() })
+	return idx
+}
+
+func TestDiskIndex_Search(t *testing.T) {
+	dim := 16
+	vectors := randomVectors(2000, dim, 1)
+	idx := newIndex(t, dim)
+	idx.CacheNodes = -1
+	if _, err := idx.Search(vectors[0], 5); !errors.Is(err, core.ErrEmptyIndex) {
+		t.Fatalf("expected ErrEmptyIndex from an empty index, got %v", err)
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	stats := idx.Stats()
+	if stats.Count != 2000 || stats.Builds != 1 {
+		t.Fatalf("expected 2000 vectors in one build, got %+v", stats)
+	}
+	// Memory holds the codes and ids, not the vectors.
+	if stats.Memory.Vectors != 0 || stats.Memory.Codes == 0 {
+		t.Errorf("unexpected memory stats %+v", stats.Memory)
+	}
+
+	hits := 0
+	for q := 0; q < 20; q++ {
+		query := vectors[q*97]
+		var s core.SearchStats
+		neighbors, err := idx.SearchWithOptions(query, 10, core.SearchOptions{Stats: &s})
+		if err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+		if len(neighbors) != 10 || neighbors[0].ID != q*97 || neighbors[0].Distance != 0 {
+			t.Fatalf("query %d: expected the query vector first, got %v", q, neighbors)
+		}
+		want := make(map[int]bool)
+		for _, id := range exactNeighbors(vectors, query, 10) {
+			want[id] = true
+		}
+		for _, n := range neighbors {
+			if want[n.ID] {
+				hits++
+			}
+		}
+		if s.BlocksRead == 0 || s.NodesVisited < 10 {
+			t.Errorf("query %d: expected the search to read node blocks, got %+v", q, s)
+		}
+	}
+	if recall := float64(hits) / 200; recall < 0.9 {
+		t.Errorf("recall@10 is %.2f", recall)
+	}
+}
+
+func TestDiskIndex_Cache(t *testing.T) {
+	dim := 8
+	vectors := randomVectors(500, dim, 2)
+	idx := newIndex(t, dim)
+	idx.CacheNodes = 500
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	path := filepath.Join(t.TempDir(), "copy.diskann")
+	file, err := os.Create(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := idx.Save(file); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	file.Close()
+	uncached := diskann.NewDiskIndex(filepath.Join(t.TempDir(), "other"), dim, 16, 64,
+		core.Distances["euclidean"], "euclidean")
+	defer uncached.Close()
+	uncached.CacheNodes = -1
+	if err := uncached.LoadFile(path); err != nil {
+		t.Fatalf("LoadFile failed: %v", err)
+	}
+	for q := 0; q < 10; q++ {
+		var cs, us core.SearchStats
+		cached, err := idx.SearchWithOptions(vectors[q*7], 5, core.SearchOptions{Stats: &cs})
+		if err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+		got, err := uncached.SearchWithOptions(vectors[q*7], 5, core.SearchOptions{Stats: &us})
+		if err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+		for i := range cached {
+			if got[i] != cached[i] {
+				t.Fatalf("query %d: got %v, want %v", q, got, cached)
+			}
+		}
+		if cs.BlocksRead != 0 || us.BlocksRead == 0 {
+			t.Errorf("query %d: %d blocks read with all nodes cached, %d without", q, cs.BlocksRead, us.BlocksRead)
+		}
+	}
+	if a, b := idx.Stats().Memory.Vectors, uncached.Stats().Memory.Vectors; a != 500*int64(dim)*4 || b != 0 {
+		t.Errorf("expected the cached vectors in the memory stats, got %d and %d", a, b)
+	}
+}
+
+func TestDiskIndex_Mutations(t *testing.T) {
+	dim := 8
+	vectors := randomVectors(600, dim, 3)
+	idx := newIndex(t, dim)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.Add(5, vectors[5]); err == nil {
+		t.Error("expected an error for an existing id")
+	}
+
+	// Pending inserts are scored exactly, deleted nodes are skipped.
+	added := []float32{0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5}
+	if err := idx.Add(1000, added); err != nil {
+		t.Fatalf("Add failed: %v", err)
+	}
+	if err := idx.Delete(10); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	if err := idx.Update(20, added); err != nil {
+		t.Fatalf("Update failed: %v", err)
+	}
+	if err := idx.Delete(10); err == nil {
+		t.Error("expected an error deleting a missing id")
+	}
+	check := func(name string) {
+		t.Helper()
+		if n := idx.Stats().Count; n != 600 {
+			t.Fatalf("%s: expected 600 vectors, got %d", name, n)
+		}
+		neighbors, err := idx.Search(added, 2)
+		if err != nil {
+			t.Fatalf("%s: Search failed: %v", name, err)
+		}
+		if len(neighbors) != 2 || neighbors[0].ID != 20 || neighbors[1].ID != 1000 || neighbors[1].Distance != 0 {
+			t.Errorf("%s: expected ids 20 and 1000 at distance 0, got %v", name, neighbors)
+		}
+		neighbors, err = idx.Search(vectors[10], 600)
+		if err != nil {
+			t.Fatalf("%s: Search failed: %v", name, err)
+		}
+		for _, n := range neighbors {
+			if n.ID == 10 {
+				t.Fatalf("%s: deleted id 10 was returned", name)
+			}
+		}
+	}
+	check("pending")
+	if err := idx.Build(); err != nil {
+		t.Fatalf("Build failed: %v", err)
+	}
+	check("built")
+
+	// A filter is applied to graph nodes and pending vectors alike.
+	if err := idx.Add(2000, added); err != nil {
+		t.Fatalf("Add failed: %v", err)
+	}
+	filter := core.NewBitset(3, 300, 2000)
+	neighbors, err := idx.SearchWithOptions(vectors[3], 5, core.SearchOptions{Filter: filter})
+	if err != nil || len(neighbors) != 3 || neighbors[0].ID != 3 {
+		t.Errorf("expected the 3 filtered ids, got %v (%v)", neighbors, err)
+	}
+
+	// Streamed batches are copied and released, and the stream ends with a build.
+	batches := make(chan core.Batch, 2)
+	released := 0
+	batches <- core.Batch{IDs: []int{3000, 3001}, Vectors: append(append([]float32(nil), added...), vectors[1]...),
+		Release: func() { released++ }}
+	close(batches)
+	idx.MergeThreshold = 1
+	if err := core.AddStream(idx, batches, core.StreamOptions{}); err != nil {
+		t.Fatalf("AddStream failed: %v", err)
+	}
+	if s := idx.Stats(); released != 1 || s.Count != 603 || s.Builds != 3 {
+		t.Errorf("expected the stream to be merged into the graph, got %d released and %+v", released, s)
+	}
+}
+
+func TestDiskIndex_SaveLoad(t *testing.T) {
+	dim := 12
+	vectors := randomVectors(800, dim, 4)
+	idx := newIndex(t, dim)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	queries := [][]float32{vectors[1], vectors[400], vectors[799]}
+	want, err := idx.SearchBatch(queries, 5)
+	if err != nil {
+		t.Fatalf("SearchBatch failed: %v", err)
+	}
+	var buf bytes.Buffer
+	if err := idx.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	loaded := newIndex(t, dim)
+	if err := loaded.Load(bytes.NewReader(buf.Bytes())); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	got, err := loaded.SearchBatch(queries, 5)
+	if err != nil {
+		t.Fatalf("SearchBatch failed: %v", err)
+	}
+	for q := range want {
+		for i := range want[q] {
+			if got[q][i] != want[q][i] {
+				t.Fatalf("query %d: got %v, want %v", q, got[q], want[q])
+			}
+		}
+	}
+	if n := loaded.Stats().Count; n != 800 {
+		t.Errorf("expected 800 vectors, got %d", n)
+	}
+	if err := newIndex(t, dim+1).Load(bytes.NewReader(buf.Bytes())); err == nil {
+		t.Error("expected an error loading into an index of another dimension")
+	}
+	if err := loaded.Load(bytes.NewReader([]byte("not an index"))); err == nil {
+		t.Error("expected an error loading an invalid file")
+	}
+	// A failed load leaves the index as it was.
+	if got, err := loaded.Search(vectors[1], 1); err != nil || got[0].ID != 1 {
+		t.Errorf("expected the loaded index to still serve searches, got %v (%v)", got, err)
+	}
+}
@@ -0,0 +1,246 @@
+package diskann
+
+import (
+	"sort"
+	"sync"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/pqivf"
+)
+
+// candidate is a node with its distance to a query.
+type candidate struct {
+	node     uint32
+	dist     float64
+	expanded bool // the neighbors of the node have been pushed (beam entries only)
+}
+
+// less orders candidates by distance, breaking ties by node.
+func (c candidate) less(o candidate) bool {
+	if c.dist != o.dist {
+		return c.dist < o.dist
+	}
+	return c.node < o.node
+}
+
+// sortCandidates sorts candidates by ascending distance.
+func sortCandidates(c []candidate) {
+	sort.Slice(c, func(i, j int) bool { return c[i].less(c[j]) })
+}
+
+// beam is the candidate list of a greedy search: the closest candidates found so far, in
+// ascending order, of which the search expands the closest it has not expanded yet.
+type beam []candidate
+
+// push inserts c unless the beam already holds size closer candidates, and drops the
+// candidates beyond size.
+func (b *beam) push(c candidate, size int) {
+	list := *b
+	if len(list) >= size && !c.less(list[len(list)-1]) {
+		return
+	}
+	i := sort.Search(len(list), func(i int) bool { return c.less(list[i]) })
+	if len(list) < size {
+		list = append(list, candidate{})
+	}
+	copy(list[i+1:], list[i:])
+	list[i] = c
+	*b = list
+}
+
+// next marks up to width of the closest unexpanded candidates as expanded and appends them
+// to dst.
+func (b beam) next(dst []candidate, width int) []candidate {
+	for i := range b {
+		if len(dst) == width {
+			break
+		}
+		if !b[i].expanded {
+			b[i].expanded = true
+			dst = append(dst, b[i])
+		}
+	}
+	return dst
+}
+
+// visitSet tracks the nodes a search has reached, cleared in constant time by advancing
+// an epoch.
+type visitSet struct {
+	marks []uint32
+	epoch uint32
+}
+
+// reset clears the set for a graph of n nodes.
+func (v *visitSet) reset(n int) {
+	if len(v.marks) != n {
+		v.marks = make([]uint32, n)
+		v.epoch = 0
+	}
+	v.epoch++
+	if v.epoch == 0 {
+		clear(v.marks)
+		v.epoch = 1
+	}
+}
+
+// visit marks s and reports whether it was not marked yet.
+func (v *visitSet) visit(s uint32) bool {
+	if v.marks[s] == v.epoch {
+		return false
+	}
+	v.marks[s] = v.epoch
+	return true
+}
+
+// searchContext holds the scratch state of one search of a diskGraph.
+type searchContext struct {
+	visited visitSet
+	beam    beam
+	exact   []candidate  // expanded nodes with their exact distances
+	table   *pqivf.Table // ADC table of the query
+	front   []candidate  // nodes expanded in the current step
+	loaded  []node       // the nodes of front, loaded
+	blocks  []int        // distinct blocks of the uncached nodes of front
+	buf     []byte       // one buffer of blockSize bytes per block read in a step
+	vectors []float32    // decoded vectors of the nodes read in a step
+	nbrs    [][]uint32   // decoded neighbor lists of the nodes read in a step
+	errs    []error      // errors of the block reads of a step
+}
+
+// getContext returns a search context for g sized for beams of the given width.
+func (g *diskGraph) getContext(width int) *searchContext {
+	ctx, _ := g.contexts.Get().(*searchContext)
+	if ctx == nil {
+		ctx = &searchContext{table: g.pq.NewTable()}
+	}
+	if len(ctx.nbrs) < width {
+		ctx.buf = make([]byte, width*g.layout.blockSize)
+		ctx.vectors = make([]float32, width*g.layout.dimension)
+		ctx.nbrs = make([][]uint32, width)
+		ctx.loaded = make([]node, width)
+		ctx.errs = make([]error, width)
+	}
+	ctx.reset(g.size())
+	return ctx
+}
+
+// reset clears the state of the previous search for a graph of n nodes.
+func (ctx *searchContext) reset(n int) {
+	ctx.visited.reset(n)
+	ctx.beam = ctx.beam[:0]
+	ctx.exact = ctx.exact[:0]
+}
+
+// pqDistance returns the approximate distance of node s to the query of the table.
+func (g *diskGraph) pqDistance(ctx *searchContext, s uint32) float64 {
+	m := len(g.pq.Codebooks)
+	return ctx.table.Distance(g.codes[int(s)*m : (int(s)+1)*m])
+}
+
+// load loads the nodes of ctx.front into ctx.loaded: cached nodes from memory, the others
+// from their blocks, which are read concurrently. It returns the number of blocks read.
+func (g *diskGraph) load(ctx *searchContext) (int, error) {
+	ctx.blocks = ctx.blocks[:0]
+	for _, c := range ctx.front {
+		if _, ok := g.cache[c.node]; ok {
+			continue
+		}
+		b, _ := g.layout.locate(c.node)
+		found := false
+		for _, have := range ctx.blocks {
+			found = found || have == b
+		}
+		if !found {
+			ctx.blocks = append(ctx.blocks, b)
+		}
+	}
+	if err := g.readBlocks(ctx); err != nil {
+		return len(ctx.blocks), err
+	}
+	dim := g.layout.dimension
+	for i, c := range ctx.front {
+		if nd, ok := g.cache[c.node]; ok {
+			ctx.loaded[i] = nd
+			continue
+		}
+		b, off := g.layout.locate(c.node)
+		j := 0
+		for ctx.blocks[j] != b {
+			j++
+		}
+		vec := ctx.vectors[i*dim : (i+1)*dim : (i+1)*dim]
+		ctx.nbrs[i] = g.layout.decode(ctx.buf[j*g.layout.blockSize+off:], vec, ctx.nbrs[i])
+		ctx.loaded[i] = node{vector: vec, neighbors: ctx.nbrs[i]}
+	}
+	return len(ctx.blocks), nil
+}
+
+// readBlocks reads ctx.blocks into consecutive buffers of ctx.buf. The reads of a step are
+// independent, so all but the first are issued from their own goroutines and wait for the
+// disk in parallel; the first is read by the search itself.
+func (g *diskGraph) readBlocks(ctx *searchContext) error {
+	size := g.layout.blockSize
+	if len(ctx.blocks) <= 1 {
+		if len(ctx.blocks) == 0 {
+			return nil
+		}
+		return g.readBlock(ctx.blocks[0], ctx.buf[:size])
+	}
+	var wg sync.WaitGroup
+	for i := 1; i < len(ctx.blocks); i++ {
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			ctx.errs[i] = g.readBlock(ctx.blocks[i], ctx.buf[i*size:(i+1)*size])
+		}(i)
+	}
+	ctx.errs[0] = g.readBlock(ctx.blocks[0], ctx.buf[:size])
+	wg.Wait()
+	for _, err := range ctx.errs[:len(ctx.blocks)] {
+		if err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// search runs a beam search for q with a candidate list of size nodes: each step loads the
+// width closest unexpanded candidates, scores the loaded vectors exactly with kernel and
+// pushes their neighbors, ranked by their PQ codes. The expanded nodes for which allowed
+// returns true are returned sorted by exact distance. The search stops early once the
+// budget runs out.
+func (g *diskGraph) search(ctx *searchContext, q []float32, size, width int, kernel core.DistanceFunc,
+	allowed func(s uint32) bool, budget *core.SearchBudget, stats *core.SearchStats) ([]candidate, error) {
+	g.pq.Fill(ctx.table, q)
+	ctx.visited.visit(g.medoid)
+	ctx.beam.push(candidate{node: g.medoid, dist: g.pqDistance(ctx, g.medoid)}, size)
+	for !budget.Exhausted() {
+		ctx.front = ctx.beam.next(ctx.front[:0], width)
+		if len(ctx.front) == 0 {
+			break
+		}
+		reads, err := g.load(ctx)
+		stats.BlocksRead += reads
+		if err != nil {
+			return nil, err
+		}
+		computed := 0
+		for i, c := range ctx.front {
+			nd := ctx.loaded[i]
+			stats.NodesVisited++
+			computed++
+			if allowed(c.node) {
+				ctx.exact = append(ctx.exact, candidate{node: c.node, dist: kernel(q, nd.vector)})
+			}
+			for _, nb := range nd.neighbors {
+				if int(nb) < g.size() && ctx.visited.visit(nb) {
+					ctx.beam.push(candidate{node: nb, dist: g.pqDistance(ctx, nb)}, size)
+					computed++
+				}
+			}
+		}
+		budget.Spend(computed)
+	}
+	sortCandidates(ctx.exact)
+	return ctx.exact, nil
+}
@@ -0,0 +1,338 @@
+package example
+
+import (
+	"encoding/json"
+	"fmt"
+	"math"
+	"os"
+	"path/filepath"
+	"runtime"
+	"runtime/metrics"
+	"sort"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"time"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/rs/zerolog/log"
+)
+
+// defaultWarmup is the number of queries run before timing when BenchmarkConfig.Warmup is zero.
+const defaultWarmup = 100
+
+// BenchmarkConfig configures RunBenchmark.
+type BenchmarkConfig struct {
+	Algorithm string                 // name of the index in the results, e.g. "hnsw(M=16)"
+	Dataset   string                 // name of the dataset directory under Root
+	Root      string                 // directory holding the datasets
+	K         int                    // number of neighbors per query
+	Queries   int                    // number of test queries that are timed (all if zero or negative)
+	Warmup    int                    // untimed queries run before each measurement (negative disables)
+	Threads   []int                  // thread counts the queries run with (HANN_BENCH_NTRD if empty)
+	Sweep     []SweepPoint           // search settings to measure (the index defaults if empty)
+	Prepare   func(core.Index) error // timed with the build after BulkAdd, e.g. to train the index
+	Output    string                 // file the results are written to as JSON, if not empty
+}
+
+// SweepPoint is one search setting measured by a benchmark.
+type SweepPoint struct {
+	Parameters string             // description of the setting in the results, e.g. "ef=100"
+	Options    core.SearchOptions // options the queries are run with
+}
+
+// EfSweep returns the settings of a sweep over the HNSW search parameter ef.
+func EfSweep(values ...int) []SweepPoint {
+	points := make([]SweepPoint, len(values))
+	for i, v := range values {
+		points[i] = SweepPoint{fmt.Sprintf("ef=%d", v), core.SearchOptions{Ef: v}}
+	}
+	return points
+}
+
+// NProbeSweep returns the settings of a sweep over the PQIVF search parameter nprobe.
+func NProbeSweep(values ...int) []SweepPoint {
+	points := make([]SweepPoint, len(values))
+	for i, v := range values {
+		points[i] = SweepPoint{fmt.Sprintf("nprobe=%d", v), core.SearchOptions{NProbe: v}}
+	}
+	return points
+}
+
+// ProbeMarginSweep returns the settings of a sweep over the RPT search parameter ProbeMargin.
+func ProbeMarginSweep(values ...float64) []SweepPoint {
+	points := make([]SweepPoint, len(values))
+	for i, v := range values {
+		points[i] = SweepPoint{fmt.Sprintf("probe_margin=%g", v), core.SearchOptions{ProbeMargin: v}}
+	}
+	return points
+}
+
+// BenchmarkResult is the measurement of one search setting at one thread count. The JSON
+// names of the fields follow the metrics of ann-benchmarks, so recall–QPS curves can be
+// plotted with its tools; latencies are in milliseconds and sizes in kB.
+type BenchmarkResult struct {
+	Algorithm       string  `json:"algorithm"`
+	Parameters      string  `json:"parameters"`
+	Dataset         string  `json:"dataset"`
+	Count           int     `json:"count"`            // number of neighbors per query (k)
+	Threads         int     `json:"threads"`          // number of threads running queries
+	Queries         int     `json:"queries"`          // number of timed queries
+	Recall          float64 `json:"k-nn"`             // mean Recall@k
+	QPS             float64 `json:"qps"`              // queries per second over the timed run
+	P50             float64 `json:"p50"`              // median latency
+	P95             float64 `json:"p95"`              // 95th percentile of the latencies
+	P99             float64 `json:"p99"`              // 99th percentile of the latencies
+	P999            float64 `json:"p999"`             // 99.9th percentile of the latencies
+	DistComps       float64 `json:"distcomps"`        // mean distance computations per query
+	Build           float64 `json:"build"`            // time to build the index, in seconds
+	BuildThroughput float64 `json:"build_throughput"` // vectors indexed per second
+	IndexSize       float64 `json:"indexsize"`        // growth of the live heap during the build
+	PeakHeap        float64 `json:"peak_heap"`        // peak heap of the process
+	PeakRSS         float64 `json:"peak_rss"`         // peak resident set size of the process
+}
+
+// RunBenchmark builds an index with factory on a dataset and measures its searches with
+// every setting of cfg.Sweep at every thread count of cfg.Threads.
+// The build is timed from BulkAdd through cfg.Prepare and the build of indexes that
+// build lazily (see finishBuild) to the end of a first search. Loading the dataset is not timed.
+// Every measurement starts with cfg.Warmup untimed queries; the timed queries are then
+// spread over the threads, and their latencies give the percentiles while the wall time
+// of the whole run gives the QPS.
+func RunBenchmark(factory IndexFactory, cfg BenchmarkConfig) ([]BenchmarkResult, error) {
+	if cfg.K <= 0 {
+		return nil, fmt.Errorf("invalid number of neighbors %d", cfg.K)
+	}
+	dir := filepath.Join(cfg.Root, cfg.Dataset)
+	train, err := LoadTrainingVectors(dir)
+	if err != nil {
+		return nil, err
+	}
+	queries, truth, _, err := LoadTestDataset(dir)
+	if err != nil {
+		return nil, err
+	}
+	if len(queries) == 0 {
+		return nil, fmt.Errorf("dataset %s has no test vectors", cfg.Dataset)
+	}
+	if cfg.Queries <= 0 || cfg.Queries > len(queries) {
+		cfg.Queries = len(queries)
+	}
+	if cfg.Warmup == 0 {
+		cfg.Warmup = defaultWarmup
+	}
+	if len(cfg.Threads) == 0 {
+		cfg.Threads = []int{benchThreads()}
+	}
+	if len(cfg.Sweep) == 0 {
+		cfg.Sweep = []SweepPoint{{Parameters: "default"}}
+	}
+
+	sampler := startHeapSampler()
+	defer sampler.stop()
+	heapBefore := liveHeap()
+	index := factory()
+	start := time.Now()
+	if err := index.BulkAdd(train); err != nil {
+		return nil, fmt.Errorf("BulkAdd failed: %w", err)
+	}
+	if cfg.Prepare != nil {
+		if err := cfg.Prepare(index); err != nil {
+			return nil, err
+		}
+	}
+	finishBuild(index)
+	if _, err := index.Search(queries[0], cfg.K); err != nil {
+		return nil, fmt.Errorf("search failed: %w", err)
+	}
+	build := time.Since(start)
+	indexSize := math.Max(0, float64(liveHeap())-float64(heapBefore)) / 1024
+	fmt.Printf("Built %s on %s: %d vectors in %.2fs (%.0f vectors/s), index heap %.0f kB\n",
+		cfg.Algorithm, cfg.Dataset, len(train), build.Seconds(),
+		float64(len(train))/build.Seconds(), indexSize)
+
+	var results []BenchmarkResult
+	for _, point := range cfg.Sweep {
+		for _, threads := range cfg.Threads {
+			res, err := measureQueries(index, queries[:cfg.Queries], truth, cfg, point, threads)
+			if err != nil {
+				return nil, err
+			}
+			res.Algorithm, res.Dataset = cfg.Algorithm, cfg.Dataset
+			res.Build = build.Seconds()
+			res.BuildThroughput = float64(len(train)) / build.Seconds()
+			res.IndexSize = indexSize
+			res.PeakHeap = float64(sampler.peak()) / 1024
+			res.PeakRSS = float64(peakRSS()) / 1024
+			fmt.Printf("%-24s threads=%-3d recall=%.4f qps=%-9.1f p50=%.3fms p95=%.3fms p99=%.3fms p999=%.3fms\n",
+				res.Parameters, threads, res.Recall, res.QPS, res.P50, res.P95, res.P99, res.P999)
+			results = append(results, res)
+		}
+	}
+
+	if cfg.Output != "" {
+		if err := writeBenchmarkResults(cfg.Output, results); err != nil {
+			return nil, err
+		}
+		log.Info().Msgf("Wrote benchmark results to %s", cfg.Output)
+	}
+	return results, nil
+}
+
+// finishBuild builds the tree of indexes that would otherwise build it in the background
+// on their first search (RPT), so that searches are measured on the finished index.
+func finishBuild(index core.Index) {
+	if r, ok := index.(interface{ Rebuild() }); ok {
+		r.Rebuild()
+	}
+}
+
+// measureQueries runs the warm-up and then the timed queries of one measurement.
+func measureQueries(index core.Index, queries [][]float32, truth [][]int, cfg BenchmarkConfig,
+	point SweepPoint, threads int) (BenchmarkResult, error) {
+	threads = max(1, threads)
+	for i := 0; i < cfg.Warmup; i++ {
+		if _, err := index.SearchWithOptions(queries[i%len(queries)], cfg.K, point.Options); err != nil {
+			return BenchmarkResult{}, fmt.Errorf("search failed: %w", err)
+		}
+	}
+
+	latencies := make([]time.Duration, len(queries))
+	recalls := make([]float64, len(queries))
+	comps := make([]int, len(queries))
+	var next atomic.Int64
+	var firstErr error
+	var errOnce sync.Once
+	var wg sync.WaitGroup
+	start := time.Now()
+	for t := 0; t < threads; t++ {
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			for {
+				i := int(next.Add(1) - 1)
+				if i >= len(queries) {
+					return
+				}
+				opts := point.Options
+				var stats core.SearchStats
+				opts.Stats = &stats
+				begin := time.Now()
+				res, err := index.SearchWithOptions(queries[i], cfg.K, opts)
+				latencies[i] = time.Since(begin)
+				if err != nil {
+					errOnce.Do(func() { firstErr = fmt.Errorf("search failed on query %d: %w", i, err) })
+					return
+				}
+				gt := truth[i]
+				recalls[i] = RecallAtK(res, gt[:min(cfg.K, len(gt))], cfg.K)
+				comps[i] = stats.DistanceComputations
+			}
+		}()
+	}
+	wg.Wait()
+	wall := time.Since(start)
+	if firstErr != nil {
+		return BenchmarkResult{}, firstErr
+	}
+
+	res := BenchmarkResult{
+		Parameters: point.Parameters,
+		Count:      cfg.K,
+		Threads:    threads,
+		Queries:    len(queries),
+		QPS:        float64(len(queries)) / wall.Seconds(),
+	}
+	for i := range queries {
+		res.Recall += recalls[i]
+		res.DistComps += float64(comps[i])
+	}
+	res.Recall /= float64(len(queries))
+	res.DistComps /= float64(len(queries))
+	sort.Slice(latencies, func(a, b int) bool { return latencies[a] < latencies[b] })
+	res.P50 = percentileMs(latencies, 0.5)
+	res.P95 = percentileMs(latencies, 0.95)
+	res.P99 = percentileMs(latencies, 0.99)
+	res.P999 = percentileMs(latencies, 0.999)
+	return res, nil
+}
+
+// percentileMs returns the p-quantile of sorted latencies, by the nearest-rank method,
+// in milliseconds.
+func percentileMs(sorted []time.Duration, p float64) float64 {
+	i := int(math.Ceil(p*float64(len(sorted)))) - 1
+	i = max(0, min(len(sorted)-1, i))
+	return float64(sorted[i]) / float64(time.Millisecond)
+}
+
+// writeBenchmarkResults writes results to path as a JSON array.
+func writeBenchmarkResults(path string, results []BenchmarkResult) error {
+	if err := os.MkdirAll(filepath.Dir(path), 0o755); err != nil {
+		return err
+	}
+	data, err := json.MarshalIndent(results, "", "  ")
+	if err != nil {
+		return err
+	}
+	return os.WriteFile(path, append(data, '\n'), 0o644)
+}
+
+// benchThreads returns the number of query threads set by the HANN_BENCH_NTRD
+// environment variable, or 1.
+func benchThreads() int {
+	if env := os.Getenv("HANN_BENCH_NTRD"); env != "" {
+		if t, err := strconv.Atoi(env); err == nil && t > 0 {
+			return t
+		}
+	}
+	return 1
+}
+
+// heapMetric is the runtime metric of the memory held by live and not yet swept heap objects.
+const heapMetric = "/memory/classes/heap/objects:bytes"
+
+// liveHeap returns the size of the live heap after a garbage collection.
+func liveHeap() uint64 {
+	runtime.GC()
+	var m runtime.MemStats
+	runtime.ReadMemStats(&m)
+	return m.HeapAlloc
+}
+
+// heapSampler records the peak heap size of the process by sampling it periodically.
+type heapSampler struct {
+	max  atomic.Uint64
+	done chan struct{}
+}
+
+// startHeapSampler starts sampling the heap size every 10ms.
+func startHeapSampler() *heapSampler {
+	s := &heapSampler{done: make(chan struct{})}
+	go func() {
+		sample := []metrics.Sample{{Name: heapMetric}}
+		ticker := time.NewTicker(10 * time.Millisecond)
+		defer ticker.Stop()
+		for {
+			metrics.Read(sample)
+			if v := sample[0].Value.Uint64(); v > s.max.Load() {
+				s.max.Store(v)
+			}
+			select {
+			case <-ticker.C:
+			case <-s.done:
+				return
+			}
+		}
+	}()
+	return s
+}
+
+// peak returns the largest heap size sampled so far, in bytes.
+func (s *heapSampler) peak() uint64 {
+	return s.max.Load()
+}
+
+// stop ends the sampling.
+func (s *heapSampler) stop() {
+	close(s.done)
+}
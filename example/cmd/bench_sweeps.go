@@ -0,0 +1,94 @@
+//go:build ignore
+// +build ignore
+
+package main
+
+import (
+	"os"
+	"runtime"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/example"
+	"github.com/patrikhermansson/hann/hnsw"
+	"github.com/patrikhermansson/hann/pqivf"
+	"github.com/patrikhermansson/hann/rpt"
+	"github.com/rs/zerolog"
+	"github.com/rs/zerolog/log"
+)
+
+// Recall–QPS sweeps of the three indexes on FashionMNIST. The results are written in the
+// JSON format of ann-benchmarks to example/data/results.
+func main() {
+	// Set the logger to output to the console.
+	log.Logger = log.Output(zerolog.ConsoleWriter{Out: os.Stderr})
+
+	SweepHNSWFashionMNIST()
+	SweepPQIVFFashionMNIST()
+	SweepRPTFashionMNIST()
+}
+
+// config returns the benchmark settings shared by the sweeps, which measure every setting
+// on one thread and on every CPU.
+func config(algorithm string, sweep []example.SweepPoint) example.BenchmarkConfig {
+	dataset := "fashion-mnist-784-euclidean"
+	return example.BenchmarkConfig{
+		Algorithm: algorithm,
+		Dataset:   dataset,
+		Root:      "example/data/nearest-neighbors-datasets",
+		K:         10,
+		Threads:   []int{1, runtime.NumCPU()},
+		Sweep:     sweep,
+		Output:    "example/data/results/" + algorithm + "-" + dataset + ".json",
+	}
+}
+
+func SweepHNSWFashionMNIST() {
+	factory := func() core.Index {
+		dimension := 784
+		M := 16
+		ef := 100
+		distanceName := "euclidean"
+		return hnsw.NewHNSW(dimension, M, ef, core.Distances[distanceName], distanceName)
+	}
+
+	cfg := config("hnsw", example.EfSweep(10, 20, 40, 80, 160, 320))
+	if _, err := example.RunBenchmark(factory, cfg); err != nil {
+		log.Fatal().Err(err).Msg("HNSW sweep failed")
+	}
+}
+
+func SweepPQIVFFashionMNIST() {
+	factory := func() core.Index {
+		dimension := 784
+		coarseK := 64
+		numSubquantizers := 8
+		pqK := 256
+		kMeansIters := 10
+		return pqivf.NewPQIVFIndex(dimension, coarseK, numSubquantizers, pqK, kMeansIters)
+	}
+
+	cfg := config("pqivf", example.NProbeSweep(1, 2, 4, 8, 16, 32))
+	cfg.Prepare = func(index core.Index) error {
+		return index.(*pqivf.PQIVFIndex).Train()
+	}
+	if _, err := example.RunBenchmark(factory, cfg); err != nil {
+		log.Fatal().Err(err).Msg("PQIVF sweep failed")
+	}
+}
+
+func SweepRPTFashionMNIST() {
+	factory := func() core.Index {
+		dimension := 784
+		leafCapacity := 10
+		candidateProjections := 3
+		parallelThreshold := 100
+		probeMargin := 0.15
+		return rpt.NewRPTIndex(dimension, leafCapacity, candidateProjections, parallelThreshold,
+			probeMargin)
+	}
+
+	cfg := config("rpt", example.ProbeMarginSweep(-1, 0.05, 0.15, 0.3, 0.6))
+	if _, err := example.RunBenchmark(factory, cfg); err != nil {
+		log.Fatal().Err(err).Msg("RPT sweep failed")
+	}
+}
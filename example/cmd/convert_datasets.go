@@ -0,0 +1,34 @@
+//go:build ignore
+// +build ignore
+
+package main
+
+import (
+	"os"
+
+	"github.com/patrikhermansson/hann/example"
+	"github.com/rs/zerolog"
+	"github.com/rs/zerolog/log"
+)
+
+// Converts the CSV files of the downloaded datasets to .npy files, which the example
+// loaders map into memory instead of parsing. The arguments are the directories that
+// hold the datasets; those that do not exist are skipped.
+func main() {
+	// Set the logger to output to the console.
+	log.Logger = log.Output(zerolog.ConsoleWriter{Out: os.Stderr})
+
+	roots := os.Args[1:]
+	if len(roots) == 0 {
+		roots = []string{"example/data/nearest-neighbors-datasets"}
+	}
+	for _, root := range roots {
+		if _, err := os.Stat(root); err != nil {
+			log.Warn().Msgf("Skipping %s: %v", root, err)
+			continue
+		}
+		if err := example.ConvertDatasets(root); err != nil {
+			log.Fatal().Err(err).Msgf("Failed to convert the datasets in %s", root)
+		}
+	}
+}
@@ -0,0 +1,77 @@
+package example
+
+import (
+	"bufio"
+	"fmt"
+	"os"
+	"path/filepath"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/rs/zerolog/log"
+)
+
+// ConvertDataset writes the CSV files of the dataset in dir (see LoadDataset) as .npy
+// files next to them, which the loaders then map instead of parsing the CSV files.
+// Missing CSV files are skipped.
+func ConvertDataset(dir string) error {
+	if err := convertCSV[float32](dir, "train"); err != nil {
+		return err
+	}
+	if err := convertCSV[float32](dir, "test"); err != nil {
+		return err
+	}
+	if err := convertCSV[int32](dir, "neighbors"); err != nil {
+		return err
+	}
+	return convertCSV[float64](dir, "distances")
+}
+
+// ConvertDatasets converts every dataset in the subdirectories of root with ConvertDataset.
+func ConvertDatasets(root string) error {
+	entries, err := os.ReadDir(root)
+	if err != nil {
+		return err
+	}
+	for _, entry := range entries {
+		if !entry.IsDir() {
+			continue
+		}
+		if err := ConvertDataset(filepath.Join(root, entry.Name())); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// convertCSV writes name.csv in dir as name.npy.
+func convertCSV[T core.MatrixElement](dir, name string) error {
+	src := filepath.Join(dir, name+".csv")
+	if _, err := os.Stat(src); err != nil {
+		return nil
+	}
+	rows, err := readCSV[T](src, false)
+	if err != nil {
+		return err
+	}
+	dst := filepath.Join(dir, name+".npy")
+	log.Info().Msgf("Converting %s to %s", src, dst)
+	// The file is written under a temporary name, so that a partial file is never loaded.
+	tmp := dst + ".tmp"
+	file, err := os.Create(tmp)
+	if err != nil {
+		return err
+	}
+	w := bufio.NewWriterSize(file, 1<<20)
+	err = core.WriteNpy(w, rows)
+	if err == nil {
+		err = w.Flush()
+	}
+	if cerr := file.Close(); err == nil {
+		err = cerr
+	}
+	if err != nil {
+		os.Remove(tmp)
+		return fmt.Errorf("failed to write %s: %w", dst, err)
+	}
+	return os.Rename(tmp, dst)
+}
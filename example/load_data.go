@@ -1,9 +1,7 @@
 package example
 
 import (
-	"encoding/csv"
 	"fmt"
-	"io"
 	"os"
 	"path/filepath"
 	"strconv"
@@ -19,6 +17,10 @@ import (
 //   - test.csv        (query vectors, not added to the index)
 //   - neighbors.csv   (expected neighbor IDs per query)
 //   - distances.csv   (expected distances per query)
+//
+// Each file can be replaced by a binary one, which loads much faster (see loadMatrix):
+// train.npy, train.fvecs or train.bvecs; test.npy, test.fvecs or test.bvecs;
+// neighbors.npy or neighbors.ivecs; and distances.npy.
 func LoadDataset(index core.Index, dir string) (
 	testVectors [][]float32,
 	trueNeighbors [][]int,
@@ -27,40 +29,23 @@ func LoadDataset(index core.Index, dir string) (
 ) {
 	log.Info().Msgf("Loading dataset from directory: %s", dir)
 
-	trainPath := filepath.Join(dir, "train.csv")
-	testPath := filepath.Join(dir, "test.csv")
-	neighborsPath := filepath.Join(dir, "neighbors.csv")
-	distancesPath := filepath.Join(dir, "distances.csv")
-
 	// Load training vectors into the index.
-	log.Info().Msgf("Loading training data from: %s", trainPath)
-	if err := LoadCSV(index, trainPath, false); err != nil {
-		return nil, nil, nil,
-			fmt.Errorf("failed to load train.csv: %w", err)
-	}
-
-	// Load test vectors (not added to the index).
-	log.Info().Msgf("Loading test data from: %s", testPath)
-	testVectors, err = readCSV[float32](testPath, false)
+	trainVectors, err := loadMatrix(dir, "train", vectorFormats)
 	if err != nil {
-		return nil, nil, nil,
-			fmt.Errorf("failed to load test.csv: %w", err)
+		return nil, nil, nil, err
 	}
-
-	// Load ground-truth neighbors.
-	log.Info().Msgf("Loading ground-truth neighbors from: %s", neighborsPath)
-	trueNeighbors, err = readCSV[int](neighborsPath, false)
-	if err != nil {
-		return nil, nil, nil,
-			fmt.Errorf("failed to load neighbors.csv: %w", err)
+	// Do not adjust IDs. Use 0-indexing to match ground-truth.
+	for id, vec := range trainVectors {
+		if err := index.Add(id, vec); err != nil {
+			return nil, nil, nil,
+				fmt.Errorf("failed to add vector %d: %w", id, err)
+		}
 	}
 
-	// Load ground-truth distances.
-	log.Info().Msgf("Loading ground-truth distances from: %s", distancesPath)
-	trueDistances, err = readCSV[float64](distancesPath, false)
+	// Load test vectors (not added to the index) and the ground truth.
+	testVectors, trueNeighbors, trueDistances, err = LoadTestDataset(dir)
 	if err != nil {
-		return nil, nil, nil,
-			fmt.Errorf("failed to load distances.csv: %w", err)
+		return nil, nil, nil, err
 	}
 
 	log.Info().Msg("Dataset loaded successfully")
@@ -84,53 +69,106 @@ func LoadCSV(index core.Index, path string, skipHeader bool) error {
 	return nil
 }
 
-// readCSV is a generic CSV reader for types: int, float32, and float64.
-func readCSV[T int | float32 | float64](path string, skipHeader bool) ([][]T, error) {
+// csvValue lists the types of the values that readCSV parses.
+type csvValue interface {
+	int | int32 | float32 | float64
+}
+
+// csvChunkSize is the approximate amount of text that one task of readCSV parses.
+const csvChunkSize = 1 << 20
+
+// readCSV is a generic CSV reader for types: int, int32, float32, and float64.
+// The file is split at line boundaries into chunks, which are parsed in parallel on the
+// shared worker pool. The fields must be unquoted numbers, and empty lines are skipped.
+func readCSV[T csvValue](path string, skipHeader bool) ([][]T, error) {
 	log.Debug().Msgf("Opening CSV file: %s", path)
-	file, err := os.Open(path)
+	data, err := os.ReadFile(path)
 	if err != nil {
 		return nil, fmt.Errorf("open %s: %w", path, err)
 	}
-	defer file.Close()
-
-	reader := csv.NewReader(file)
-	var result [][]T
+	text := string(data)
+	if skipHeader {
+		_, text, _ = strings.Cut(text, "\n")
+	}
 
-	for {
-		record, err := reader.Read()
-		if err == io.EOF {
-			break
+	var chunks []string
+	for len(text) > 0 {
+		end := len(text)
+		if end > csvChunkSize {
+			end = csvChunkSize
+			if nl := strings.IndexByte(text[end:], '\n'); nl >= 0 {
+				end += nl + 1
+			} else {
+				end = len(text)
+			}
 		}
-		if err != nil {
-			return nil, fmt.Errorf("read error in %s: %w", path, err)
+		chunks = append(chunks, text[:end])
+		text = text[end:]
+	}
+	parts := make([][][]T, len(chunks))
+	errs := make([]error, len(chunks))
+	core.ParallelFor(len(chunks), func(i int) {
+		parts[i], errs[i] = parseCSVChunk[T](chunks[i])
+	})
+
+	var result [][]T
+	for i, part := range parts {
+		if errs[i] != nil {
+			return nil, fmt.Errorf("parse error in %s: %w", path, errs[i])
 		}
-		if skipHeader {
-			skipHeader = false
+		result = append(result, part...)
+	}
+
+	log.Debug().Msgf("Parsed %d rows from %s", len(result), path)
+	return result, nil
+}
+
+// parseCSVChunk parses the lines of a chunk of CSV text. The values of all rows are stored
+// in one array, which the rows point into.
+func parseCSVChunk[T csvValue](text string) ([][]T, error) {
+	var values []T
+	var ends []int
+	for len(text) > 0 {
+		line, rest, _ := strings.Cut(text, "\n")
+		text = rest
+		line = strings.TrimSuffix(line, "\r")
+		if strings.TrimSpace(line) == "" {
 			continue
 		}
-		row := make([]T, len(record))
-		for i, val := range record {
-			parsed, err := parseValue[T](val)
+		for col := 0; ; col++ {
+			field, rest, more := strings.Cut(line, ",")
+			parsed, err := parseValue[T](field)
 			if err != nil {
-				return nil, fmt.Errorf("parse error at col %d in %s: %w", i, path, err)
+				return nil, fmt.Errorf("col %d: %w", col, err)
+			}
+			values = append(values, parsed)
+			if !more {
+				break
 			}
-			row[i] = parsed
+			line = rest
 		}
-		result = append(result, row)
+		ends = append(ends, len(values))
 	}
-
-	log.Debug().Msgf("Parsed %d rows from %s", len(result), path)
-	return result, nil
+	rows := make([][]T, len(ends))
+	start := 0
+	for i, end := range ends {
+		rows[i] = values[start:end:end]
+		start = end
+	}
+	return rows, nil
 }
 
-// parseValue converts a string to T (int, float32, or float64).
-func parseValue[T int | float32 | float64](s string) (T, error) {
+// parseValue converts a string to T (int, int32, float32, or float64).
+func parseValue[T csvValue](s string) (T, error) {
 	s = strings.TrimSpace(s)
 	var zero T
 	switch any(zero).(type) {
 	case int:
 		v, err := strconv.Atoi(s)
 		return any(v).(T), err
+	case int32:
+		v, err := strconv.ParseInt(s, 10, 32)
+		return any(int32(v)).(T), err
 	case float32:
 		v, err := strconv.ParseFloat(s, 32)
 		return any(float32(v)).(T), err
@@ -142,47 +180,104 @@ func parseValue[T int | float32 | float64](s string) (T, error) {
 	}
 }
 
-// LoadTrainingVectors loads training vectors from "train.csv" in the specified directory.
+// matrixFormat is a binary file format that a dataset matrix can be stored in.
+type matrixFormat[T core.MatrixElement] struct {
+	ext  string                                // file name extension
+	open func(string) (*core.Matrix[T], error) // opens a file of the format
+}
+
+// vectorFormats lists the binary formats of vector files, in order of preference.
+var vectorFormats = []matrixFormat[float32]{
+	{".npy", core.OpenNpy[float32]},
+	{".fvecs", core.OpenFvecs},
+	{".bvecs", core.OpenBvecs},
+}
+
+// neighborFormats lists the binary formats of ground-truth neighbor files.
+var neighborFormats = []matrixFormat[int32]{
+	{".npy", core.OpenNpy[int32]},
+	{".ivecs", core.OpenIvecs},
+}
+
+// distanceFormats lists the binary formats of ground-truth distance files.
+var distanceFormats = []matrixFormat[float64]{
+	{".npy", core.OpenNpy[float64]},
+}
+
+// loadMatrix reads the matrix stored under name in dir from the first file of one of the
+// binary formats that exists, or from name.csv if there is none. Binary files are
+// memory-mapped: their rows point into the mapping, which is never released, instead of
+// being allocated one by one.
+func loadMatrix[T core.MatrixElement](dir, name string, formats []matrixFormat[T]) ([][]T, error) {
+	for _, format := range formats {
+		path := filepath.Join(dir, name+format.ext)
+		if _, err := os.Stat(path); err != nil {
+			continue
+		}
+		log.Info().Msgf("Loading %s", path)
+		m, err := format.open(path)
+		if err != nil {
+			return nil, fmt.Errorf("failed to load %s%s: %w", name, format.ext, err)
+		}
+		return m.RowSlices(), nil
+	}
+	path := filepath.Join(dir, name+".csv")
+	log.Info().Msgf("Loading %s", path)
+	// No header in these CSV files.
+	rows, err := readCSV[T](path, false)
+	if err != nil {
+		return nil, fmt.Errorf("failed to load %s.csv: %w", name, err)
+	}
+	return rows, nil
+}
+
+// LoadTrainingVectors loads the training vectors in the specified directory, from
+// "train.csv" or one of its binary replacements (see LoadDataset).
 // It returns a map from id (row number, 0-indexed) to the vector.
 func LoadTrainingVectors(dir string) (map[int][]float32, error) {
-	trainPath := filepath.Join(dir, "train.csv")
-	log.Info().Msgf("Loading training vectors from: %s", trainPath)
-	// reuse generic CSV reader (no header in these CSV files)
-	vectors, err := readCSV[float32](trainPath, false)
+	vectors, err := loadMatrix(dir, "train", vectorFormats)
 	if err != nil {
-		return nil, fmt.Errorf("failed to load train.csv: %w", err)
+		return nil, err
 	}
 	m := make(map[int][]float32, len(vectors))
 	for id, vec := range vectors {
 		m[id] = vec
 	}
-	log.Info().Msgf("Loaded %d training vectors from %s", len(m), trainPath)
+	log.Info().Msgf("Loaded %d training vectors from %s", len(m), dir)
 	return m, nil
 }
 
 // LoadTestDataset loads the test vectors and ground-truth data from the specified directory.
 // It returns the test vectors, true neighbor IDs, and true distances (ground-truth).
 func LoadTestDataset(dir string) ([][]float32, [][]int, [][]float64, error) {
-	testPath := filepath.Join(dir, "test.csv")
-	neighborsPath := filepath.Join(dir, "neighbors.csv")
-	distancesPath := filepath.Join(dir, "distances.csv")
-
-	log.Info().Msgf("Loading test vectors from: %s", testPath)
-	testVectors, err := readCSV[float32](testPath, false)
+	testVectors, err := loadMatrix(dir, "test", vectorFormats)
 	if err != nil {
-		return nil, nil, nil, fmt.Errorf("failed to load test.csv: %w", err)
+		return nil, nil, nil, err
 	}
 
-	log.Info().Msgf("Loading ground-truth neighbors from: %s", neighborsPath)
-	trueNeighbors, err := readCSV[int](neighborsPath, false)
+	neighbors, err := loadMatrix(dir, "neighbors", neighborFormats)
 	if err != nil {
-		return nil, nil, nil, fmt.Errorf("failed to load neighbors.csv: %w", err)
+		return nil, nil, nil, err
+	}
+	// The neighbor IDs of all queries are widened into one array.
+	trueNeighbors := make([][]int, len(neighbors))
+	total := 0
+	for _, row := range neighbors {
+		total += len(row)
+	}
+	ids := make([]int, total)
+	for i, row := range neighbors {
+		dst := ids[:len(row):len(row)]
+		ids = ids[len(row):]
+		for j, id := range row {
+			dst[j] = int(id)
+		}
+		trueNeighbors[i] = dst
 	}
 
-	log.Info().Msgf("Loading ground-truth distances from: %s", distancesPath)
-	trueDistances, err := readCSV[float64](distancesPath, false)
+	trueDistances, err := loadMatrix(dir, "distances", distanceFormats)
 	if err != nil {
-		return nil, nil, nil, fmt.Errorf("failed to load distances.csv: %w", err)
+		return nil, nil, nil, err
 	}
 
 	return testVectors, trueNeighbors, trueDistances, nil
@@ -0,0 +1,8 @@
+//go:build !(linux || darwin || freebsd || netbsd || openbsd || dragonfly)
+
+package example
+
+// peakRSS returns 0 on platforms where the peak resident set size is not available.
+func peakRSS() int64 {
+	return 0
+}
@@ -2,9 +2,7 @@ package example
 
 import (
 	"fmt"
-	"os"
 	"path/filepath"
-	"strconv"
 	"sync"
 	"time"
 
@@ -50,6 +48,7 @@ func RunDataset(factory IndexFactory, dataset, root string, k, numQueries, maxRe
 	if err := index.BulkAdd(trainingVectors); err != nil {
 		log.Fatal().Err(err).Msg("BulkAdd failed")
 	}
+	finishBuild(index)
 
 	// Load test dataset.
 	testVectors, gtNeighbors, gtDistances, err := LoadTestDataset(datasetPath)
@@ -70,13 +69,8 @@ func RunDataset(factory IndexFactory, dataset, root string, k, numQueries, maxRe
 	}
 
 	// Get the number of threads from HANN_BENCH_NTRD.
-	threads := 1
-	if env := os.Getenv("HANN_BENCH_NTRD"); env != "" {
-		if t, err := strconv.Atoi(env); err == nil && t > 0 {
-			threads = t
-			log.Info().Msgf("Using %d threads used for benchmarking", threads)
-		}
-	}
+	threads := benchThreads()
+	log.Info().Msgf("Using %d threads for benchmarking", threads)
 
 	fmt.Printf("Running kNN queries (k=%d) on %d test vectors using %d threads\n", k, numQueries, threads)
 
@@ -0,0 +1,269 @@
+package hnsw
+
+import (
+	"errors"
+	"fmt"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// formatKind identifies HNSW indexes in binary index files.
+const formatKind = "hnsw"
+
+// Positions of the parameters in the "meta" section.
+const (
+	metaDimension = iota
+	metaM
+	metaEf
+	metaEfConstruction
+	metaEntryPoint
+	metaMaxLevel
+	metaQuantization  // absent in files written before quantization
+	metaRetainVectors // 1 if the float32 vectors are kept under quantization
+	metaRerankFactor
+	metaLen
+)
+
+// sections returns the binary file sections of the index. The flat graph arrays are
+// written as they are; the upper-level blocks of all nodes above level 0 are concatenated
+// in slot order, so their offsets follow from the levels.
+func (h *HNSWIndex) sections() []core.Section {
+	meta := make([]int64, metaLen)
+	meta[metaDimension] = int64(h.Dimension)
+	meta[metaM] = int64(h.M)
+	meta[metaEf] = int64(h.Ef)
+	meta[metaEfConstruction] = int64(h.EfConstruction)
+	meta[metaEntryPoint] = -1
+	if h.entryPoint != noSlot {
+		meta[metaEntryPoint] = int64(h.entryPoint)
+	}
+	meta[metaMaxLevel] = int64(h.MaxLevel)
+	meta[metaQuantization] = int64(h.g.quant)
+	if h.RetainVectors {
+		meta[metaRetainVectors] = 1
+	}
+	meta[metaRerankFactor] = int64(h.RerankFactor)
+	var upper [][]uint32
+	var dists [][]float32
+	deleted := make([]uint8, h.g.numSlots())
+	for s, lvl := range h.g.levels {
+		if lvl > 0 {
+			upper = append(upper, h.g.upper[s])
+			dists = append(dists, h.g.dists[s])
+		}
+		if h.g.isDeleted(uint32(s)) {
+			deleted[s] = 1
+		}
+	}
+	return []core.Section{
+		core.SliceSection("meta", meta),
+		core.BytesSection("distance", []byte(h.DistanceName)),
+		core.IntsSection("ids", h.g.ids),
+		core.SliceSection("levels", h.g.levels),
+		core.SliceSection("vectors", h.g.vectors),
+		core.SliceSection("links0", h.g.links0),
+		core.SliceSection("upper", upper...),
+		core.SliceSection("deleted", deleted),
+		core.SliceSection("dists0", h.g.dists0),
+		core.SliceSection("dists", dists...),
+		core.SliceSection("codes8", h.g.codes8),
+		core.SliceSection("codes16", h.g.codes16),
+		core.SliceSection("code_params", h.g.params),
+	}
+}
+
+// loadSections replaces the index with the contents of a binary index file.
+// The graph arrays alias the file, so only the id table and the upper-level block
+// headers are built; vectors and adjacency lists are not touched until searches need them.
+// The caller holds Mu exclusively.
+func (h *HNSWIndex) loadSections(f *core.SectionFile) error {
+	if f.Kind != formatKind {
+		return fmt.Errorf("binary index file holds a %q index, not an HNSW index", f.Kind)
+	}
+	meta, err := f.Int64s("meta")
+	if err != nil {
+		return err
+	}
+	if len(meta) < metaQuantization {
+		return errors.New("corrupt HNSW index file: short meta section")
+	}
+	quant, retain, rerankFactor := QuantizeNone, false, 0
+	if len(meta) >= metaLen {
+		quant = Quantization(meta[metaQuantization])
+		retain = meta[metaRetainVectors] != 0
+		rerankFactor = int(meta[metaRerankFactor])
+	}
+	name, err := f.Bytes("distance")
+	if err != nil {
+		return err
+	}
+	ids, err := f.Ints("ids")
+	if err != nil {
+		return err
+	}
+	levels, err := f.Int8s("levels")
+	if err != nil {
+		return err
+	}
+	vectors, err := f.Float32s("vectors")
+	if err != nil {
+		return err
+	}
+	links0, err := f.Uint32s("links0")
+	if err != nil {
+		return err
+	}
+	upper, err := f.Uint32s("upper")
+	if err != nil {
+		return err
+	}
+	// Files written before tombstones existed have no "deleted" section.
+	var deleted []uint8
+	if f.Has("deleted") {
+		if deleted, err = f.Uint8s("deleted"); err != nil {
+			return err
+		}
+	}
+	// Files written before link distances were cached have no "dists0" and "dists" sections;
+	// the distances are computed after loading.
+	var dists0, dists []float32
+	if f.Has("dists0") {
+		if dists0, err = f.Float32s("dists0"); err != nil {
+			return err
+		}
+		if dists, err = f.Float32s("dists"); err != nil {
+			return err
+		}
+	}
+	// Files written before quantization have no code sections.
+	var codes8 []uint8
+	var codes16 []uint16
+	var params []float32
+	if f.Has("code_params") {
+		if codes8, err = f.Uint8s("codes8"); err != nil {
+			return err
+		}
+		if codes16, err = f.Uint16s("codes16"); err != nil {
+			return err
+		}
+		if params, err = f.Float32s("code_params"); err != nil {
+			return err
+		}
+	}
+	dim, m := int(meta[metaDimension]), int(meta[metaM])
+	n := len(ids)
+	if deleted == nil {
+		deleted = make([]uint8, n)
+	}
+	floats := quant == QuantizeNone || len(vectors) > 0 || (n == 0 && retain)
+	if dim <= 0 || m <= 0 || len(levels) != n || (floats && len(vectors) != n*dim) || len(links0) != n*(2*m+1) ||
+		len(deleted) != n || (dists0 != nil && (len(dists0) != n*2*m || len(dists)*(m+1) != len(upper)*m)) ||
+		!validCodes(quant, n*dim, codes8, codes16, n*codeParams, params) {
+		return errors.New("corrupt HNSW index file: inconsistent section sizes")
+	}
+
+	g := newGraph(dim, m, 2*m)
+	g.ids = ids
+	g.levels = levels
+	g.floats = floats
+	if floats {
+		g.vectors = vectors
+	}
+	g.quant = quant
+	g.codes8, g.codes16, g.params = codes8, codes16, params
+	g.links0 = links0
+	g.upper = make([][]uint32, n)
+	if dists0 != nil {
+		g.dists0 = dists0
+		g.dists = make([][]float32, n)
+	}
+	g.deleted = make([]uint64, deletedWords(n))
+	for s, d := range deleted {
+		if d != 0 {
+			g.setDeleted(uint32(s), true)
+		}
+	}
+	stride := m + 1
+	off := 0
+	for s, lvl := range levels {
+		if lvl == freeLevel {
+			continue
+		}
+		if lvl < 0 || lvl > maxLevelCap {
+			return fmt.Errorf("corrupt HNSW index file: slot %d has level %d", s, lvl)
+		}
+		if lvl > 0 {
+			size := int(lvl) * stride
+			if off+size > len(upper) {
+				return errors.New("corrupt HNSW index file: truncated upper levels")
+			}
+			g.upper[s] = upper[off : off+size : off+size]
+			if dists0 != nil {
+				doff, dsize := off/stride*m, int(lvl)*m
+				g.dists[s] = dists[doff : doff+dsize : doff+dsize]
+			}
+			off += size
+		}
+	}
+	if off != len(upper) {
+		return errors.New("corrupt HNSW index file: inconsistent upper levels")
+	}
+	entryPoint := noSlot
+	if ep := meta[metaEntryPoint]; ep >= 0 {
+		if ep >= int64(n) || levels[ep] == freeLevel {
+			return errors.New("corrupt HNSW index file: invalid entry point")
+		}
+		entryPoint = uint32(ep)
+	}
+
+	h.Dimension = dim
+	h.M = m
+	h.setSearchDefaults(int(meta[metaEf]), rerankFactor)
+	h.EfConstruction = int(meta[metaEfConstruction])
+	h.MaxLevel = int(meta[metaMaxLevel])
+	h.DistanceName = string(name)
+	h.RetainVectors = retain
+	g.metric = core.ResolveMetric(h.DistanceName, h.Distance)
+	g.scoring = codeScorings[g.metric.Name]
+	h.store = nil
+	h.g = g
+	if dists0 == nil {
+		h.cacheDistances()
+	}
+	h.indexSlots()
+	h.entryPoint = entryPoint
+	h.collectTopSlots()
+	h.version++
+	h.retiring = nil
+	h.publish()
+	return nil
+}
+
+// setMapping makes f the memory mapping backing the index and releases the previous one
+// once no search reads a view that aliases it. The caller holds Mu exclusively and has
+// already replaced and published every array that aliased it.
+func (h *HNSWIndex) setMapping(f *core.SectionFile) {
+	if h.mapping != nil && h.mapping != f {
+		h.drainViews()
+		h.mapping.Close()
+	}
+	h.mapping = f
+}
+
+// LoadFile loads an index saved with Save from the file at path.
+// The file is memory-mapped instead of read, so the index can serve searches almost
+// immediately and pages are read from disk as searches touch them. The mapping is
+// copy-on-write: the index can still be modified, and the file is never changed.
+// It is released when another index is loaded into h. Files in the older gob format
+// are read as with Load.
+func (h *HNSWIndex) LoadFile(path string) error {
+	return core.LoadIndexFile(path, func(f *core.SectionFile) error {
+		h.Mu.Lock()
+		defer h.Mu.Unlock()
+		if err := h.loadSections(f); err != nil {
+			return err
+		}
+		h.setMapping(f)
+		return nil
+	}, h.Load)
+}
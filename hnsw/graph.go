@@ -0,0 +1,383 @@
+package hnsw
+
+import (
+	"math/bits"
+	"sync"
+	"sync/atomic"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// noSlot marks the absence of a node (e.g. an empty index has no entry point).
+const noSlot = ^uint32(0)
+
+// freeLevel is stored in graph.levels for slots that are not currently in use.
+const freeLevel = -1
+
+// graph is the flat storage behind an HNSWIndex.
+// Every node occupies a dense uint32 slot. Vectors live in one contiguous arena
+// (slot*dim), level-0 adjacency lists sit in one fixed-stride block per slot, and
+// the upper levels of a node share a single block sized by maxM. Each adjacency
+// list is stored as a count followed by up to maxM (or maxM0) neighbor slots. The
+// distance of every link is cached in blocks of the same layout (without the count),
+// so pruning a full list does not recompute the distances to its neighbors.
+// Under quantization the vectors are also encoded into a code arena (slot*dim) with a few
+// parameters per slot, and the float32 arena is only kept when floats is set.
+//
+// Searches read a copy of the graph header published in a view (see view.go) while a
+// writer changes the graph: the data of a slot is only written before the slot becomes
+// reachable, or after every search that could reach it has finished, and the neighbor
+// lists, which are rewritten in place, are accessed under their stripe locks. The
+// tombstone flags are read and written atomically.
+type graph struct {
+	dim        int            // dimension of the stored vectors
+	maxM       int            // capacity of an upper-level neighbor list
+	maxM0      int            // capacity of a level-0 neighbor list
+	metric     core.Metric    // resolved metric; its kernel is compared during searches
+	scoring    codeScoring    // form of the metric kernel on quantized vectors
+	vectors    []float32      // vector arena, slot*dim (nil unless floats is set)
+	floats     bool           // the float32 vector arena is kept (always without quantization)
+	quant      Quantization   // encoding of the code arena
+	codes8     []uint8        // int8 code arena, slot*dim
+	codes16    []uint16       // float16 code arena, slot*dim
+	params     []float32      // code parameters, slot*codeParams
+	scratch    []float32      // normalized copy of a vector being encoded, when floats is not set
+	ids        []int          // slot to external id
+	levels     []int8         // slot to node level (freeLevel for unused slots)
+	links0     []uint32       // level-0 lists, slot*(maxM0+1)
+	upper      [][]uint32     // slot to the block holding levels 1..level, (level-1)*(maxM+1)
+	dists0     []float32      // level-0 link distances, slot*maxM0
+	dists      [][]float32    // slot to the upper-level link distances, (level-1)*maxM
+	deleted    []uint64       // bit per slot: a tombstone, still linked for navigation but never returned, or a free slot
+	tombstones int            // number of deleted nodes still linked into the graph
+	idToSlot   map[int]uint32 // external id to slot, for live nodes that are not tombstones
+	idMu       *sync.RWMutex  // guards idToSlot against the lookups of searches; writers only lock it to modify the map
+	free       []uint32       // released slots available for reuse
+}
+
+// newGraph creates empty flat storage for vectors of the given dimension.
+func newGraph(dim, maxM, maxM0 int) graph {
+	return graph{
+		dim:      dim,
+		maxM:     maxM,
+		maxM0:    maxM0,
+		floats:   true,
+		idToSlot: make(map[int]uint32),
+		idMu:     new(sync.RWMutex),
+	}
+}
+
+// isDeleted reports whether slot s holds a tombstone or is free.
+func (g *graph) isDeleted(s uint32) bool {
+	return atomic.LoadUint64(&g.deleted[s>>6])&(1<<(s&63)) != 0
+}
+
+// setDeleted sets or clears the tombstone flag of slot s. Only a writer calls it, so the word
+// can be updated with a plain store that searches read atomically.
+func (g *graph) setDeleted(s uint32, on bool) {
+	w := &g.deleted[s>>6]
+	if on {
+		atomic.StoreUint64(w, *w|1<<(s&63))
+	} else {
+		atomic.StoreUint64(w, *w&^(1<<(s&63)))
+	}
+}
+
+// deletedWords returns the number of words of a tombstone bitset for n slots.
+func deletedWords(n int) int {
+	return (n + 63) / 64
+}
+
+// setID maps id to slot s, or removes id from the map if s is noSlot.
+func (g *graph) setID(id int, s uint32) {
+	g.idMu.Lock()
+	if s == noSlot {
+		delete(g.idToSlot, id)
+	} else {
+		g.idToSlot[id] = s
+	}
+	g.idMu.Unlock()
+}
+
+// lookup returns the slot of id for a search, which must not read idToSlot unlocked.
+func (g *graph) lookup(id int) (uint32, bool) {
+	g.idMu.RLock()
+	s, ok := g.idToSlot[id]
+	g.idMu.RUnlock()
+	return s, ok
+}
+
+// size returns the number of live nodes, not counting tombstones.
+func (g *graph) size() int {
+	return len(g.idToSlot)
+}
+
+// memory returns the memory held by the arenas of g.
+func (g *graph) memory() core.MemoryStats {
+	m := core.MemoryStats{
+		Vectors: int64(len(g.vectors)) * 4,
+		Graph:   int64(len(g.levels)+len(g.deleted)*8) + int64(len(g.links0)+len(g.dists0))*4,
+		Codes:   int64(len(g.codes8)) + int64(len(g.codes16))*2 + int64(len(g.params))*4,
+		IDs:     int64(len(g.ids))*bits.UintSize/8 + int64(len(g.free))*4 + core.MapBytes(len(g.idToSlot)),
+	}
+	for s := range g.upper {
+		m.Graph += int64(len(g.upper[s])+len(g.dists[s])) * 4
+	}
+	return m
+}
+
+// numSlots returns the number of allocated slots, including free ones.
+func (g *graph) numSlots() int {
+	return len(g.ids)
+}
+
+// live reports whether the slot currently holds a node.
+func (g *graph) live(s uint32) bool {
+	return g.levels[s] != freeLevel
+}
+
+// level returns the level of the node stored in slot s.
+func (g *graph) level(s uint32) int {
+	return int(g.levels[s])
+}
+
+// vector returns the arena view of the vector stored in slot s.
+func (g *graph) vector(s uint32) []float32 {
+	off := int(s) * g.dim
+	return g.vectors[off : off+g.dim : off+g.dim]
+}
+
+// list returns the raw block (count followed by capacity entries) of slot s at a level.
+func (g *graph) list(s uint32, level int) []uint32 {
+	if level == 0 {
+		stride := g.maxM0 + 1
+		off := int(s) * stride
+		return g.links0[off : off+stride : off+stride]
+	}
+	stride := g.maxM + 1
+	off := (level - 1) * stride
+	return g.upper[s][off : off+stride : off+stride]
+}
+
+// linkDists returns the raw distance block of slot s at a level, one entry per list position.
+func (g *graph) linkDists(s uint32, level int) []float32 {
+	if level == 0 {
+		off := int(s) * g.maxM0
+		return g.dists0[off : off+g.maxM0 : off+g.maxM0]
+	}
+	off := (level - 1) * g.maxM
+	return g.dists[s][off : off+g.maxM : off+g.maxM]
+}
+
+// neighborDists returns the cached distances of s to its neighbors at a level, in list order.
+func (g *graph) neighborDists(s uint32, level int) []float32 {
+	return g.linkDists(s, level)[:g.list(s, level)[0]]
+}
+
+// neighbors returns the neighbor slots of s at a level. The slice aliases graph storage.
+func (g *graph) neighbors(s uint32, level int) []uint32 {
+	l := g.list(s, level)
+	return l[1 : 1+l[0]]
+}
+
+// capacity returns the maximum number of neighbors a list can hold at a level.
+func (g *graph) capacity(level int) int {
+	if level == 0 {
+		return g.maxM0
+	}
+	return g.maxM
+}
+
+// setNeighbors overwrites the neighbor list of s at a level with the candidates in nbrs,
+// whose distances are cached with the links. nbrs must fit the list capacity.
+func (g *graph) setNeighbors(s uint32, level int, nbrs []candidate) {
+	l, d := g.list(s, level), g.linkDists(s, level)
+	for i, c := range nbrs {
+		l[i+1], d[i] = c.slot, float32(c.dist)
+	}
+	l[0] = uint32(len(nbrs))
+}
+
+// appendNeighbor adds a link to c to the list of s at a level, which must not be full.
+func (g *graph) appendNeighbor(s uint32, level int, c candidate) {
+	l := g.list(s, level)
+	g.linkDists(s, level)[l[0]] = float32(c.dist)
+	l[l[0]+1] = c.slot
+	l[0]++
+}
+
+// clearLinks empties every neighbor list of slot s.
+func (g *graph) clearLinks(s uint32) {
+	for L := g.level(s); L >= 0; L-- {
+		g.list(s, L)[0] = 0
+	}
+}
+
+// alloc stores a vector under an external id at the given level and returns its slot.
+// The vector is copied into the arenas (see store), so the caller keeps ownership of its slice.
+// A reused slot keeps its tombstone flag until its data is written, so that searches, which
+// skip free slots, never read it half-written.
+func (g *graph) alloc(id int, vector []float32, level int, normalize bool) uint32 {
+	var s uint32
+	reused := len(g.free) > 0
+	if n := len(g.free); n > 0 {
+		s = g.free[n-1]
+		g.free = g.free[:n-1]
+		g.ids[s] = id
+		g.list(s, 0)[0] = 0
+	} else {
+		s = uint32(len(g.ids))
+		g.ids = append(g.ids, id)
+		g.levels = append(g.levels, 0)
+		if int(s>>6) == len(g.deleted) {
+			g.deleted = append(g.deleted, 0)
+		}
+		if g.floats {
+			g.vectors = append(g.vectors, make([]float32, g.dim)...)
+		}
+		switch g.quant {
+		case QuantizeInt8:
+			g.codes8 = append(g.codes8, make([]uint8, g.dim)...)
+		case QuantizeFloat16:
+			g.codes16 = append(g.codes16, make([]uint16, g.dim)...)
+		}
+		if g.quant != QuantizeNone {
+			g.params = append(g.params, make([]float32, codeParams)...)
+		}
+		g.links0 = append(g.links0, make([]uint32, g.maxM0+1)...)
+		g.dists0 = append(g.dists0, make([]float32, g.maxM0)...)
+		g.upper = append(g.upper, nil)
+		g.dists = append(g.dists, nil)
+	}
+	g.levels[s] = int8(level)
+	if level > 0 {
+		g.upper[s] = make([]uint32, level*(g.maxM+1))
+		g.dists[s] = make([]float32, level*g.maxM)
+	} else {
+		g.upper[s] = nil
+		g.dists[s] = nil
+	}
+	g.setID(id, s)
+	g.store(s, vector, normalize)
+	if reused {
+		g.setDeleted(s, false)
+	}
+	return s
+}
+
+// store writes a vector into slot s, scaled to unit length first if normalize is set: into
+// the float32 arena if it is kept, and encoded into the code arena under quantization.
+func (g *graph) store(s uint32, vector []float32, normalize bool) {
+	if g.floats {
+		dst := g.vector(s)
+		copy(dst, vector)
+		vector = dst
+		if normalize {
+			core.NormalizeInPlace(dst)
+		}
+	} else if normalize {
+		g.scratch = append(g.scratch[:0], vector...)
+		core.NormalizeInPlace(g.scratch)
+		vector = g.scratch
+	}
+	if g.quant != QuantizeNone {
+		g.encode(s, vector)
+	}
+}
+
+// tombstone marks the node in slot s as deleted. Its id is released at once, but the node
+// stays linked, so searches still pass through it, until it is reclaimed with release.
+func (g *graph) tombstone(s uint32) {
+	if t, ok := g.idToSlot[g.ids[s]]; ok && t == s {
+		g.setID(g.ids[s], noSlot)
+	}
+	g.setDeleted(s, true)
+}
+
+// release returns slot s to the free list; it stays flagged as deleted until it is reused.
+// Inbound links must already be removed, and no search may still reach the slot.
+func (g *graph) release(s uint32) {
+	if t, ok := g.idToSlot[g.ids[s]]; ok && t == s {
+		g.setID(g.ids[s], noSlot)
+	}
+	g.setDeleted(s, true)
+	g.levels[s] = freeLevel
+	g.upper[s] = nil
+	g.dists[s] = nil
+	g.list(s, 0)[0] = 0
+	g.free = append(g.free, s)
+}
+
+// grow reserves room for n additional slots so that appends do not reallocate.
+func (g *graph) grow(n int) {
+	n -= len(g.free)
+	if n <= 0 {
+		return
+	}
+	if need := len(g.ids) + n; need > cap(g.ids) {
+		g.ids = append(make([]int, 0, need), g.ids...)
+		g.levels = append(make([]int8, 0, need), g.levels...)
+		g.deleted = append(make([]uint64, 0, deletedWords(need)), g.deleted...)
+		g.upper = append(make([][]uint32, 0, need), g.upper...)
+		g.dists = append(make([][]float32, 0, need), g.dists...)
+		if g.floats {
+			g.vectors = append(make([]float32, 0, need*g.dim), g.vectors...)
+		}
+		switch g.quant {
+		case QuantizeInt8:
+			g.codes8 = append(make([]uint8, 0, need*g.dim), g.codes8...)
+		case QuantizeFloat16:
+			g.codes16 = append(make([]uint16, 0, need*g.dim), g.codes16...)
+		}
+		if g.quant != QuantizeNone {
+			g.params = append(make([]float32, 0, need*codeParams), g.params...)
+		}
+		g.links0 = append(make([]uint32, 0, need*(g.maxM0+1)), g.links0...)
+		g.dists0 = append(make([]float32, 0, need*g.maxM0), g.dists0...)
+	}
+}
+
+// highestSlot returns the live slot with the highest level, or noSlot if the graph is empty.
+// Tombstones and slots in skip are ignored.
+func (g *graph) highestSlot(skip []bool) uint32 {
+	best := noSlot
+	bestLevel := freeLevel
+	for s, lvl := range g.levels {
+		if int(lvl) > bestLevel && !g.isDeleted(uint32(s)) && (skip == nil || !skip[s]) {
+			best = uint32(s)
+			bestLevel = int(lvl)
+		}
+	}
+	return best
+}
+
+// cacheDistances allocates the link distance blocks of a graph whose adjacency lists were
+// loaded (or whose vectors were re-encoded) without them and fills them in. Slots are
+// processed in chunks on the shared worker pool.
+func (h *HNSWIndex) cacheDistances() {
+	g := &h.g
+	g.dists0 = make([]float32, len(g.levels)*g.maxM0)
+	g.dists = make([][]float32, len(g.levels))
+	for s, lvl := range g.levels {
+		if lvl > 0 {
+			g.dists[s] = make([]float32, int(lvl)*g.maxM)
+		}
+	}
+	core.ParallelRange(len(g.levels), 1024, func(start, end int) {
+		ctx := getSearchContext(g)
+		defer putSearchContext(ctx)
+		for s := start; s < end; s++ {
+			slot := uint32(s)
+			if !g.live(slot) {
+				continue
+			}
+			g.nodeProbe(&ctx.node, slot)
+			for L := g.level(slot); L >= 0; L-- {
+				d := g.linkDists(slot, L)
+				for i, nb := range g.neighbors(slot, L) {
+					d[i] = float32(g.distance(&ctx.node, nb))
+				}
+			}
+		}
+	})
+}
@@ -0,0 +1,130 @@
+package hnsw
+
+import (
+	"bytes"
+	"os"
+	"path/filepath"
+	"testing"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// checkDistances fails the test if a cached link distance of h differs from the kernel.
+func checkDistances(t *testing.T, stage string, h *HNSWIndex) {
+	t.Helper()
+	var p probe
+	for s := range h.g.levels {
+		slot := uint32(s)
+		if !h.g.live(slot) {
+			continue
+		}
+		h.g.nodeProbe(&p, slot)
+		for L := h.g.level(slot); L >= 0; L-- {
+			dists := h.g.neighborDists(slot, L)
+			for i, nb := range h.g.neighbors(slot, L) {
+				want := float32(h.g.distance(&p, nb))
+				if dists[i] != want {
+					t.Fatalf("%s: slot %d level %d: cached distance %v to %d, want %v", stage, s, L, dists[i], nb, want)
+				}
+			}
+		}
+	}
+}
+
+func TestGraph_CachedDistances(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	dim := 4
+	vectors := make(map[int][]float32)
+	for i := 0; i < 600; i++ {
+		vectors[i] = []float32{float32(i % 7), float32(i % 11), float32(i % 13), float32(i)}
+	}
+	h := NewHNSW(dim, 4, 16, core.Distances["euclidean"], "euclidean")
+	h.RepairThreshold = -1
+	if err := h.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	checkDistances(t, "built", h)
+
+	updates := make(map[int][]float32)
+	for i := 0; i < 600; i += 5 {
+		updates[i] = []float32{float32(i % 3), float32(i % 5), 0, float32(i)}
+	}
+	if err := h.BulkUpdate(updates); err != nil {
+		t.Fatalf("BulkUpdate failed: %v", err)
+	}
+	if err := h.BulkDelete([]int{1, 2, 3, 50, 51, 52}); err != nil {
+		t.Fatalf("BulkDelete failed: %v", err)
+	}
+	h.Repair()
+	checkDistances(t, "repaired", h)
+
+	// Both formats keep the cache, and the binary one is also kept when it is mapped.
+	var buf bytes.Buffer
+	if err := h.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	path := filepath.Join(t.TempDir(), "index.hann")
+	if err := os.WriteFile(path, buf.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	loaded := NewHNSW(dim, 4, 16, core.Distances["euclidean"], "euclidean")
+	if err := loaded.Load(&buf); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	checkDistances(t, "loaded", loaded)
+	mapped := NewHNSW(dim, 4, 16, core.Distances["euclidean"], "euclidean")
+	if err := mapped.LoadFile(path); err != nil {
+		t.Fatalf("LoadFile failed: %v", err)
+	}
+	checkDistances(t, "mapped", mapped)
+	data, err := h.GobEncode()
+	if err != nil {
+		t.Fatalf("GobEncode failed: %v", err)
+	}
+	decoded := NewHNSW(dim, 4, 16, core.Distances["euclidean"], "euclidean")
+	if err := decoded.GobDecode(data); err != nil {
+		t.Fatalf("GobDecode failed: %v", err)
+	}
+	checkDistances(t, "decoded", decoded)
+
+	// Files written before the cache existed get it computed on load.
+	decoded.cacheDistances()
+	checkDistances(t, "recomputed", decoded)
+}
+
+func TestGraph_QuantizedArenas(t *testing.T) {
+	dim := 16
+	h := NewHNSW(dim, 4, 16, core.Distances["euclidean"], "euclidean")
+	for i := 0; i < 200; i++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = float32((i*7+j*3)%17) - 8
+		}
+		if err := h.Add(i, vec); err != nil {
+			t.Fatalf("Add failed: %v", err)
+		}
+	}
+	if err := h.SetQuantization(QuantizeInt8); err != nil {
+		t.Fatalf("SetQuantization failed: %v", err)
+	}
+	// Re-encoding recomputes the cached distances on the codes.
+	checkDistances(t, "quantized", h)
+	for i := 200; i < 300; i++ {
+		if err := h.Add(i, make([]float32, dim)); err != nil {
+			t.Fatalf("Add failed: %v", err)
+		}
+	}
+	n := h.g.numSlots()
+	if h.g.vectors != nil || len(h.g.codes8) != n*dim || len(h.g.params) != n*codeParams || h.g.codes16 != nil {
+		t.Fatalf("unexpected arenas for %d slots: %d floats, %d int8 codes, %d float16 codes, %d params",
+			n, len(h.g.vectors), len(h.g.codes8), len(h.g.codes16), len(h.g.params))
+	}
+	// Decoded codes stay within half a grid step of the vectors.
+	buf := make([]float32, dim)
+	h.g.decode(h.g.idToSlot[5], buf)
+	for j, x := range buf {
+		if want := float32((5*7+j*3)%17) - 8; x < want-0.04 || x > want+0.04 {
+			t.Fatalf("component %d of node 5 decodes to %v, want %v", j, x, want)
+		}
+	}
+}
@@ -1,8 +1,8 @@
 package hnsw
 
 import (
+	"bufio"
 	"bytes"
-	"container/heap"
 	"encoding/gob"
 	"errors"
 	"fmt"
@@ -12,111 +12,162 @@ import (
 	"runtime"
 	"sort"
 	"sync"
+	"sync/atomic"
+	"time"
 
 	"github.com/patrikhermansson/hann/core"
 	"github.com/rs/zerolog/log"
 	"github.com/schollz/progressbar/v3"
 )
 
-// seededRand is a global random number generator used for level generation.
-var seededRand = rand.New(rand.NewSource(core.GetSeed()))
-var seededRandMu sync.Mutex
-
 // maxLevelCap is the upper bound for a node's level.
 const maxLevelCap = 32
 
+// linkStripes is the number of locks guarding neighbor lists against concurrent searches
+// and the inserts of a parallel build. Slot s is guarded by stripe s%linkStripes; it must
+// be a power of two.
+const linkStripes = 1024
+
+// maxSearchRestarts bounds how often a search that found fewer than k nodes is resumed
+// from further entry points, and restartProbes is the number of slots each restart probes.
+const (
+	maxSearchRestarts = 4
+	restartProbes     = 16
+)
+
+// defaultBruteForceRatio is the share of the nodes up to which a filtered search scores
+// the ids of its filter directly when BruteForceRatio is zero. Below it, the graph search
+// would traverse many disallowed nodes for every allowed one it finds.
+const defaultBruteForceRatio = 0.05
+
+// updateBatchSize is the number of nodes BulkUpdate re-links per hold of the write lock.
+const updateBatchSize = 1024
+
 // candidate represents a potential neighbor with its distance.
 type candidate struct {
-	node *Node   // reference to the candidate node
+	slot uint32  // slot of the candidate node
 	dist float64 // distance to the query vector
 }
 
-// candidateMinHeap implements a min-heap for candidates based on their distance.
-type candidateMinHeap []candidate
-
-func (h candidateMinHeap) Len() int { return len(h) }
-func (h candidateMinHeap) Less(i, j int) bool {
-	if h[i].dist == h[j].dist {
-		return h[i].node.ID < h[j].node.ID
+// less orders candidates by distance, breaking ties by slot.
+func (c candidate) less(o candidate) bool {
+	if c.dist == o.dist {
+		return c.slot < o.slot
 	}
-	return h[i].dist < h[j].dist
-}
-func (h candidateMinHeap) Swap(i, j int)       { h[i], h[j] = h[j], h[i] }
-func (h *candidateMinHeap) Push(x interface{}) { *h = append(*h, x.(candidate)) }
-func (h *candidateMinHeap) Pop() interface{} {
-	old := *h
-	n := len(old)
-	x := old[n-1]
-	*h = old[:n-1]
-	return x
+	return c.dist < o.dist
 }
 
-// candidateMaxHeap implements a max-heap for candidates based on their distance.
-type candidateMaxHeap []candidate
-
-func (h candidateMaxHeap) Len() int { return len(h) }
-func (h candidateMaxHeap) Less(i, j int) bool {
-	if h[i].dist == h[j].dist {
-		return h[i].node.ID < h[j].node.ID
+// sortCandidates sorts candidates by ascending distance.
+// Short lists, such as neighbor lists being pruned, use an allocation-free insertion sort.
+func sortCandidates(c []candidate) {
+	if len(c) > 64 {
+		sort.Slice(c, func(i, j int) bool { return c[i].less(c[j]) })
+		return
+	}
+	for i := 1; i < len(c); i++ {
+		for j := i; j > 0 && c[j].less(c[j-1]); j-- {
+			c[j], c[j-1] = c[j-1], c[j]
+		}
 	}
-	return h[i].dist > h[j].dist
-}
-func (h candidateMaxHeap) Swap(i, j int)       { h[i], h[j] = h[j], h[i] }
-func (h *candidateMaxHeap) Push(x interface{}) { *h = append(*h, x.(candidate)) }
-func (h *candidateMaxHeap) Pop() interface{} {
-	old := *h
-	n := len(old)
-	x := old[n-1]
-	*h = old[:n-1]
-	return x
-}
-
-// Node represents a vector in the HNSW graph along with its links.
-type Node struct {
-	ID           int             // unique identifier of the node
-	Vector       []float32       // vector data
-	Level        int             // node level in the hierarchy
-	Links        map[int][]*Node // links to neighbors at each level
-	ReverseLinks map[int][]*Node // reverse links from neighbors
 }
 
 // HNSWIndex is the main structure for the HNSW graph index.
+// Nodes are kept in flat, slot-indexed storage (see graph) instead of per-node heap objects.
+// Writers are serialized by Mu, while searches read a published view of the index (see
+// view) without taking it, so they are never blocked by writers, nor writers by them.
 type HNSWIndex struct {
-	Mu               sync.RWMutex      `gob:"-"` // mutex to control concurrent access
+	Mu               sync.RWMutex      `gob:"-"` // serializes writers; searches do not take it
 	Dimension        int               // dimension of the vectors
-	EntryPoint       *Node             // starting point for searches
 	MaxLevel         int               // current maximum level in the graph
-	Nodes            map[int]*Node     // map of node id to Node pointer
-	M                int               // maximum number of neighbors per node
-	Ef               int               // search parameter controlling search depth
+	M                int               // maximum number of neighbors per node (2*M on level 0)
+	Ef               int               // default size of the candidate list of searches
+	EfConstruction   int               // size of the candidate list used while inserting nodes
 	Distance         core.DistanceFunc // function to calculate distance between vectors
 	DistanceName     string            // name of the distance metric
 	ExhaustiveSearch bool              // flag for performing exhaustive search during searchLayer
+	BuildWorkers     int               // goroutines inserting nodes in bulk operations (0 uses runtime.NumCPU())
+	RepairThreshold  float64           // share of tombstones among the nodes that starts a background repair (0 uses 0.1, negative disables)
+	BruteForceRatio  float64           // share of the nodes up to which a filtered search scores the filter's ids directly (0 uses 0.05, negative disables)
+
+	NeighborSelection NeighborSelection // strategy picking the links of a node (SelectHeuristic by default)
+	KeepPruned        bool              // fill lists the heuristic leaves short with the closest pruned candidates
+	ExtendCandidates  bool              // let the heuristic also consider the neighbors of a new node's candidates
+	RetainVectors     bool              // keep the float32 vectors in memory under quantization (read by SetQuantization)
+	RerankFactor      int               // default re-ranking factor of searches on quantized vectors (0 disables)
+	Sink              core.MetricsSink  // receives the instrumentation of the index, if not nil (set before use)
+
+	entryPoint uint32             // slot of the starting point for searches
+	topSlots   []uint32           // live nodes on the top level; a deleted entry point is replaced by one of them
+	version    uint64             // incremented whenever the graph is rebuilt or replaced as a whole
+	repairing  bool               // a background repair has been started
+	repairMu   sync.Mutex         // serializes repairs
+	g          graph              // flat node storage
+	store      core.VectorStore   // optional external store receiving the float32 vectors
+	rng        *rand.Rand         // level generator, seeded from HANN_SEED
+	mapping    *core.SectionFile  // memory-mapped file the graph arrays alias (see LoadFile)
+	counters   core.IndexCounters // totals of the searches and builds, reported by Stats
+
+	// Published state read by searches (see view.go).
+	current  atomic.Pointer[view] // most recent view
+	seq      uint64               // publication number of the current view
+	retired  []*view              // superseded views that searches may still read
+	retiring []retiredSlot        // reclaimed tombstones waiting for the searches that may reach them
+
+	// State of a parallel build. building is only toggled while Mu is held exclusively.
+	building bool                    // inserts access neighbor lists under their stripe lock
+	topMu    sync.Mutex              // guards entryPoint and MaxLevel while building
+	linkMu   [linkStripes]sync.Mutex // stripe locks for neighbor lists
 }
 
 // NewHNSW creates a new HNSW index given the dimension, M, ef, and distance function.
+// ef is used both as the default search ef and as EfConstruction; set the fields
+// directly (or pass SearchOptions.Ef per query) to tune them separately.
+// If distanceName names a metric in core.Metrics, the index compares the metric's cheaper
+// kernel internally (e.g. squared Euclidean) and only converts the final results;
+// otherwise the given distance function is used as is.
 func NewHNSW(dimension int, M int, ef int, distance core.DistanceFunc, distanceName string) *HNSWIndex {
 	log.Info().Msgf("Creating new HNSW index with dimension=%d, M=%d, ef=%d, distance=%s",
 		dimension, M, ef, distanceName)
-	return &HNSWIndex{
-		Dimension:    dimension,
-		Nodes:        make(map[int]*Node),
-		MaxLevel:     -1,
-		M:            M,
-		Ef:           ef,
-		Distance:     distance,
-		DistanceName: distanceName,
+	h := &HNSWIndex{
+		Dimension:      dimension,
+		MaxLevel:       -1,
+		M:              M,
+		Ef:             ef,
+		EfConstruction: ef,
+		Distance:       distance,
+		DistanceName:   distanceName,
+		entryPoint:     noSlot,
+		g:              newGraph(dimension, M, 2*M),
+		rng:            rand.New(rand.NewSource(core.GetSeed())),
 	}
+	h.g.metric = core.ResolveMetric(distanceName, distance)
+	h.publish()
+	return h
+}
+
+// prepareQuery loads the query into the probe of ctx in the form the metric kernel expects.
+// The caller's slice is never modified; normalized queries are copied into ctx.
+func prepareQuery(ctx *searchContext, query []float32) *probe {
+	q := &ctx.query
+	if ctx.g.metric.Normalize {
+		q.buf = append(q.buf[:0], query...)
+		core.NormalizeInPlace(q.buf)
+		query = q.buf
+	}
+	ctx.g.setProbe(q, query)
+	return q
 }
 
 // randomLevel computes a random level for a new node based on an exponential distribution.
+// The caller must hold Mu exclusively.
 func (h *HNSWIndex) randomLevel() int {
 	if h.M <= 1 {
 		return 0
 	}
-	seededRandMu.Lock()
-	r := seededRand.Float64()
-	seededRandMu.Unlock()
+	if h.rng == nil {
+		h.rng = rand.New(rand.NewSource(core.GetSeed()))
+	}
+	r := h.rng.Float64()
 	level := int(-math.Log(r) / math.Log(float64(h.M)))
 	if level > maxLevelCap {
 		level = maxLevelCap
@@ -125,55 +176,76 @@ func (h *HNSWIndex) randomLevel() int {
 	return level
 }
 
-// serializedNode is used to store a Node during gob encoding/decoding.
-type serializedNode struct {
+// serializedIndex is the serializable version of the HNSWIndex.
+// It mirrors the flat graph storage, so encoding and decoding copy whole arrays
+// instead of rebuilding per-node structures.
+type serializedIndex struct {
+	Dimension      int          // dimension of the index
+	M              int          // maximum neighbors per node
+	Ef             int          // search parameter
+	EfConstruction int          // construction parameter (0 in files written before it existed)
+	EntryPoint     int          // slot of the entry point node (-1 if empty)
+	MaxLevel       int          // maximum level in the graph
+	DistanceName   string       // name of the distance metric
+	IDs            []int        // slot to external id
+	Levels         []int8       // slot to level (-1 for free slots)
+	Vectors        []float32    // vector arena
+	Links0         []uint32     // level-0 adjacency blocks
+	Upper          [][]uint32   // upper-level adjacency blocks
+	Dists0         []float32    // level-0 link distances (nil in files written before they were cached)
+	Dists          [][]float32  // upper-level link distances
+	Deleted        []bool       // slot to tombstone flag (nil in files written before tombstones existed)
+	Quantization   Quantization // encoding of the code arena (QuantizeNone in files written before quantization)
+	Codes8         []uint8      // int8 code arena
+	Codes16        []uint16     // float16 code arena
+	CodeParams     []float32    // code parameters per slot
+	RetainVectors  bool         // the float32 vectors are kept under quantization
+	RerankFactor   int          // default re-ranking factor
+
+	Nodes map[int]legacyNode // nodes of files written before the flat storage (see decodeLegacy)
+}
+
+// legacyNode is a node of the gob files written before the flat storage, which held
+// every node with its vector and the ids of its neighbors at each level.
+type legacyNode struct {
 	ID     int           // node id
 	Vector []float32     // vector data
 	Level  int           // node level
 	Links  map[int][]int // neighbor ids at each level
 }
 
-// serializedIndex is the serializable version of the HNSWIndex.
-type serializedIndex struct {
-	Dimension    int                    // dimension of the index
-	M            int                    // maximum neighbors per node
-	Ef           int                    // search parameter
-	Nodes        map[int]serializedNode // serialized nodes
-	EntryPoint   int                    // id of the entry point node
-	MaxLevel     int                    // maximum level in the graph
-	DistanceName string                 // name of the distance metric
-}
-
 // GobEncode serializes the HNSWIndex using the gob encoder.
 func (h *HNSWIndex) GobEncode() ([]byte, error) {
 	h.Mu.RLock()
 	defer h.Mu.RUnlock()
 	si := serializedIndex{
-		Dimension:    h.Dimension,
-		M:            h.M,
-		Ef:           h.Ef,
-		Nodes:        make(map[int]serializedNode),
-		EntryPoint:   0,
-		MaxLevel:     h.MaxLevel,
-		DistanceName: h.DistanceName,
-	}
-	for id, node := range h.Nodes {
-		sn := serializedNode{
-			ID:     node.ID,
-			Vector: node.Vector,
-			Level:  node.Level,
-			Links:  make(map[int][]int),
-		}
-		// Store neighbor ids for each level.
-		for level, neighbors := range node.Links {
-			for _, nb := range neighbors {
-				sn.Links[level] = append(sn.Links[level], nb.ID)
-			}
-		}
-		si.Nodes[id] = sn
+		Dimension:      h.Dimension,
+		M:              h.M,
+		Ef:             h.Ef,
+		EfConstruction: h.EfConstruction,
+		EntryPoint:     -1,
+		MaxLevel:       h.MaxLevel,
+		DistanceName:   h.DistanceName,
+		IDs:            h.g.ids,
+		Levels:         h.g.levels,
+		Vectors:        h.g.vectors,
+		Links0:         h.g.links0,
+		Upper:          h.g.upper,
+		Dists0:         h.g.dists0,
+		Dists:          h.g.dists,
+		Deleted:        make([]bool, h.g.numSlots()),
+		Quantization:   h.g.quant,
+		Codes8:         h.g.codes8,
+		Codes16:        h.g.codes16,
+		CodeParams:     h.g.params,
+		RetainVectors:  h.RetainVectors,
+		RerankFactor:   h.RerankFactor,
 	}
-	if h.EntryPoint != nil {
-		si.EntryPoint = h.EntryPoint.ID
+	for s := range si.Deleted {
+		si.Deleted[s] = h.g.isDeleted(uint32(s))
+	}
+	if h.entryPoint != noSlot {
+		si.EntryPoint = int(h.entryPoint)
 	}
 	var buf bytes.Buffer
 	enc := gob.NewEncoder(&buf)
@@ -184,6 +256,17 @@ func (h *HNSWIndex) GobEncode() ([]byte, error) {
 	return buf.Bytes(), nil
 }
 
+// setSearchDefaults restores the default search parameters of a loaded index. Searches
+// read them without a lock, so they are only written if they change.
+func (h *HNSWIndex) setSearchDefaults(ef, rerankFactor int) {
+	if h.Ef != ef {
+		h.Ef = ef
+	}
+	if h.RerankFactor != rerankFactor {
+		h.RerankFactor = rerankFactor
+	}
+}
+
 // GobDecode deserializes data into the HNSWIndex using the gob decoder.
 func (h *HNSWIndex) GobDecode(data []byte) error {
 	var si serializedIndex
@@ -193,297 +276,525 @@ func (h *HNSWIndex) GobDecode(data []byte) error {
 		log.Error().Err(err).Msg("Failed to decode HNSWIndex")
 		return err
 	}
+	if len(si.Nodes) > 0 {
+		return h.decodeLegacy(&si)
+	}
+	n := len(si.IDs)
+	if si.Deleted == nil {
+		si.Deleted = make([]bool, n)
+	}
+	floats := si.Quantization == QuantizeNone || len(si.Vectors) > 0 || (n == 0 && si.RetainVectors)
+	if len(si.Levels) != n || len(si.Upper) != n || (floats && len(si.Vectors) != n*si.Dimension) ||
+		len(si.Links0) != n*(2*si.M+1) || len(si.Deleted) != n ||
+		(si.Dists0 != nil && (len(si.Dists0) != n*2*si.M || len(si.Dists) != n)) ||
+		!validCodes(si.Quantization, n*si.Dimension, si.Codes8, si.Codes16, n*codeParams, si.CodeParams) {
+		return errors.New("corrupt HNSW index data: inconsistent section sizes")
+	}
 	h.Dimension = si.Dimension
 	h.M = si.M
-	h.Ef = si.Ef
+	h.setSearchDefaults(si.Ef, si.RerankFactor)
+	h.EfConstruction = si.EfConstruction
 	h.MaxLevel = si.MaxLevel
 	h.DistanceName = si.DistanceName
-	h.Nodes = make(map[int]*Node)
-	// Recreate nodes from the serialized data.
-	for id, sn := range si.Nodes {
-		h.Nodes[id] = &Node{
-			ID:           sn.ID,
-			Vector:       sn.Vector,
-			Level:        sn.Level,
-			Links:        make(map[int][]*Node),
-			ReverseLinks: make(map[int][]*Node),
+	h.RetainVectors = si.RetainVectors
+	h.store = nil
+	h.g = newGraph(si.Dimension, si.M, 2*si.M)
+	h.g.metric = core.ResolveMetric(si.DistanceName, h.Distance)
+	h.g.scoring = codeScorings[h.g.metric.Name]
+	h.g.ids = si.IDs
+	h.g.levels = si.Levels
+	h.g.vectors = si.Vectors
+	h.g.floats = floats
+	h.g.quant = si.Quantization
+	h.g.codes8, h.g.codes16, h.g.params = si.Codes8, si.Codes16, si.CodeParams
+	h.g.links0 = si.Links0
+	h.g.upper = si.Upper
+	h.g.deleted = make([]uint64, deletedWords(n))
+	for s, d := range si.Deleted {
+		if d {
+			h.g.setDeleted(uint32(s), true)
 		}
 	}
-	// Restore neighbor pointers.
+	if si.Dists0 == nil {
+		h.cacheDistances()
+	} else {
+		h.g.dists0, h.g.dists = si.Dists0, si.Dists
+	}
+	h.indexSlots()
+	h.entryPoint = noSlot
+	if si.EntryPoint >= 0 && si.EntryPoint < n {
+		h.entryPoint = uint32(si.EntryPoint)
+	}
+	h.collectTopSlots()
+	h.version++
+	h.retiring = nil
+	h.publish()
+	return nil
+}
+
+// decodeLegacy restores an index from a gob file written before the flat storage: the
+// nodes are stored in slots in id order and linked to the neighbors they had at each
+// level, and the entry point is the saved one if it is still on the top level.
+func (h *HNSWIndex) decodeLegacy(si *serializedIndex) error {
+	ids := make([]int, 0, len(si.Nodes))
 	for id, sn := range si.Nodes {
-		node := h.Nodes[id]
-		for level, nbIDs := range sn.Links {
+		if len(sn.Vector) != si.Dimension || sn.Level < 0 || sn.Level > maxLevelCap {
+			return fmt.Errorf("corrupt HNSW index data: node %d has a vector of dimension %d at level %d",
+				id, len(sn.Vector), sn.Level)
+		}
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	h.Dimension = si.Dimension
+	h.M = si.M
+	h.setSearchDefaults(si.Ef, 0)
+	h.EfConstruction = 0
+	h.DistanceName = si.DistanceName
+	h.RetainVectors = false
+	h.store = nil
+	h.g = newGraph(si.Dimension, si.M, 2*si.M)
+	h.g.metric = core.ResolveMetric(si.DistanceName, h.Distance)
+	h.g.scoring = codeScorings[h.g.metric.Name]
+	for _, id := range ids {
+		h.g.alloc(id, si.Nodes[id].Vector, si.Nodes[id].Level, h.g.metric.Normalize)
+	}
+	// The earlier graph kept at most M neighbors per level, which fits every list; links to
+	// missing nodes or above the level of a neighbor are dropped.
+	for s, id := range ids {
+		slot := uint32(s)
+		for L, nbIDs := range si.Nodes[id].Links {
+			if L < 0 || L > h.g.level(slot) {
+				continue
+			}
+			l := h.g.list(slot, L)
 			for _, nbID := range nbIDs {
-				if nb, exists := h.Nodes[nbID]; exists {
-					node.Links[level] = append(node.Links[level], nb)
+				nb, ok := h.g.idToSlot[nbID]
+				if !ok || nb == slot || h.g.level(nb) < L || int(l[0]) == h.g.capacity(L) {
+					continue
 				}
+				l[l[0]+1] = nb
+				l[0]++
 			}
 		}
 	}
-	// Rebuild reverse links.
-	for _, node := range h.Nodes {
-		for level, neighbors := range node.Links {
-			for _, nb := range neighbors {
-				nb.ReverseLinks[level] = append(nb.ReverseLinks[level], node)
-			}
+	h.cacheDistances()
+	h.entryPoint = h.g.highestSlot(nil)
+	h.MaxLevel = -1
+	if h.entryPoint != noSlot {
+		if s, ok := h.g.idToSlot[si.EntryPoint]; ok && h.g.level(s) == h.g.level(h.entryPoint) {
+			h.entryPoint = s
 		}
+		h.MaxLevel = h.g.level(h.entryPoint)
 	}
-	if si.EntryPoint != 0 {
-		h.EntryPoint = h.Nodes[si.EntryPoint]
-	} else {
-		h.EntryPoint = nil
-	}
+	h.collectTopSlots()
+	h.version++
+	h.retiring = nil
+	h.publish()
 	return nil
 }
 
-// selectM chooses the top M candidates based on distance.
-func selectM(candidates []candidate, M int) []candidate {
-	sort.Slice(candidates, func(i, j int) bool {
-		if candidates[i].dist == candidates[j].dist {
-			return candidates[i].node.ID < candidates[j].node.ID
-		}
-		return candidates[i].dist < candidates[j].dist
-	})
-	if len(candidates) > M {
-		return candidates[:M]
+// minInt returns the smaller of two integers.
+func minInt(a, b int) int {
+	if a < b {
+		return a
 	}
-	return candidates
+	return b
 }
 
-// selectNodes selects up to M nodes from a list based on their distance to vec.
-func selectNodes(nodes []*Node, vec []float32, M int, distance func([]float32, []float32) float64) []*Node {
-	// Create a temporary array with nodes and their distances.
-	type nodeWithDist struct {
-		node *Node
-		dist float64
-	}
-	arr := make([]nodeWithDist, len(nodes))
-	for i, n := range nodes {
-		arr[i] = nodeWithDist{n, distance(vec, n.Vector)}
+// addLink adds a link to target, whose dist is its distance to s, to the neighbor list of
+// s at a level. A full list is pruned back to its capacity with the neighbor selection of
+// the index; the distances to the current neighbors come from the cache.
+func (h *HNSWIndex) addLink(ctx *searchContext, s uint32, target candidate, level int) {
+	mu := h.stripe(s)
+	mu.Lock()
+	defer mu.Unlock()
+	l := h.g.list(s, level)
+	n := int(l[0])
+	if n < h.g.capacity(level) {
+		h.g.appendNeighbor(s, level, target)
+		return
 	}
-	sort.Slice(arr, func(i, j int) bool {
-		if arr[i].dist == arr[j].dist {
-			return arr[i].node.ID < arr[j].node.ID
+	// A full list gives up a link to a deleted node before any link to a live one.
+	dists := h.g.neighborDists(s, level)
+	for i := 1; i <= n; i++ {
+		if h.g.isDeleted(l[i]) {
+			l[i], dists[i-1] = target.slot, float32(target.dist)
+			return
 		}
-		return arr[i].dist < arr[j].dist
-	})
-	selected := make([]*Node, minInt(len(arr), M))
-	for i := range selected {
-		selected[i] = arr[i].node
 	}
-	return selected
+	cands := ctx.scratch[:0]
+	for i, nb := range l[1 : n+1] {
+		cands = append(cands, candidate{nb, float64(dists[i])})
+	}
+	cands = append(cands, candidate{target.slot, float64(float32(target.dist))})
+	ctx.scratch = cands
+	ctx.kept = h.selectNeighbors(ctx, cands, n, ctx.kept[:0])
+	h.g.setNeighbors(s, level, ctx.kept)
 }
 
-// removeFromSlice removes a target node from a slice of nodes.
-func removeFromSlice(slice []*Node, target *Node) []*Node {
-	newSlice := slice[:0]
-	for _, n := range slice {
-		if n != target {
-			newSlice = append(newSlice, n)
-		}
-	}
-	return newSlice
+// stripe returns the lock guarding the neighbor lists of slot s. Writers hold it to rewrite
+// a list; searches, and the inserts of a parallel build, hold it to read one.
+func (h *HNSWIndex) stripe(s uint32) *sync.Mutex {
+	return &h.linkMu[s&(linkStripes-1)]
 }
 
-// difference returns nodes in a that are not in b.
-func difference(a, b []*Node) []*Node {
-	set := make(map[int]bool)
-	for _, n := range b {
-		set[n.ID] = true
+// setNeighbors overwrites the neighbor list of s at a level under its stripe lock.
+func (h *HNSWIndex) setNeighbors(s uint32, level int, nbrs []candidate) {
+	mu := h.stripe(s)
+	mu.Lock()
+	h.g.setNeighbors(s, level, nbrs)
+	mu.Unlock()
+}
+
+// clearLinks empties every neighbor list of slot s under its stripe lock.
+func (h *HNSWIndex) clearLinks(s uint32) {
+	mu := h.stripe(s)
+	mu.Lock()
+	h.g.clearLinks(s)
+	mu.Unlock()
+}
+
+// neighborsOf returns the neighbor slots of s at a level.
+// For a search, or during a parallel build, the list is copied into ctx under its stripe
+// lock, because writers may rewrite it; a search also drops the links to slots that were
+// allocated after its view was published. Otherwise the graph storage is returned directly.
+func (h *HNSWIndex) neighborsOf(ctx *searchContext, s uint32, level int) []uint32 {
+	if !ctx.shared && !h.building {
+		return ctx.g.neighbors(s, level)
 	}
-	var diff []*Node
-	for _, n := range a {
-		if !set[n.ID] {
-			diff = append(diff, n)
+	mu := h.stripe(s)
+	mu.Lock()
+	ctx.nbrs = append(ctx.nbrs[:0], ctx.g.neighbors(s, level)...)
+	mu.Unlock()
+	if ctx.shared {
+		n, kept := uint32(ctx.g.numSlots()), ctx.nbrs[:0]
+		for _, nb := range ctx.nbrs {
+			if nb < n {
+				kept = append(kept, nb)
+			}
 		}
+		ctx.nbrs = kept
 	}
-	return diff
+	return ctx.nbrs
 }
 
-// trimNeighborLinks reduces a node's neighbors at a level to the best M based on distance.
-func trimNeighborLinks(n *Node, level, M int, distance func([]float32, []float32) float64) {
-	original := n.Links[level]
-	trimmed := selectNodes(original, n.Vector, M, distance)
-	removed := difference(original, trimmed)
-	for _, r := range removed {
-		r.ReverseLinks[level] = removeFromSlice(r.ReverseLinks[level], n)
+// efConstruction returns the candidate list size used while inserting nodes.
+func (h *HNSWIndex) efConstruction() int {
+	if h.EfConstruction > 0 {
+		return h.EfConstruction
 	}
-	n.Links[level] = trimmed
+	return h.Ef
 }
 
-// removeNodeLinks removes all links of a node from the graph.
-func (h *HNSWIndex) removeNodeLinks(n *Node) {
-	for level, neighbors := range n.ReverseLinks {
-		for _, neighbor := range neighbors {
-			neighbor.Links[level] = removeFromSlice(neighbor.Links[level], n)
+// greedyClosest walks a single level greedily towards the query and returns the closest slot found.
+func (h *HNSWIndex) greedyClosest(ctx *searchContext, q *probe, cur uint32, level int) uint32 {
+	curDist := ctx.g.distance(q, cur)
+	for changed := true; changed; {
+		changed = false
+		nbrs := h.neighborsOf(ctx, cur, level)
+		if !ctx.budget.Spend(len(nbrs)) {
+			break
 		}
-		n.ReverseLinks[level] = nil
-	}
-	for level, neighbors := range n.Links {
-		for _, neighbor := range neighbors {
-			neighbor.ReverseLinks[level] = removeFromSlice(neighbor.ReverseLinks[level], n)
+		for _, nb := range nbrs {
+			if d := ctx.g.distance(q, nb); d < curDist {
+				cur, curDist = nb, d
+				changed = true
+			}
 		}
-		n.Links[level] = nil
 	}
+	return cur
 }
 
-// minInt returns the smaller of two integers.
-func minInt(a, b int) int {
-	if a < b {
-		return a
+// insertNode links the node in slot s into the HNSW graph.
+func (h *HNSWIndex) insertNode(ctx *searchContext, s uint32, searchEf int) {
+	level := h.g.level(s)
+	if h.building {
+		// As in hnswlib, inserts that may raise the top level are serialized;
+		// all other inserts only need a snapshot of the entry point.
+		h.topMu.Lock()
+		if level <= h.MaxLevel {
+			entryPoint, maxLevel := h.entryPoint, h.MaxLevel
+			if level == maxLevel {
+				h.topSlots = append(h.topSlots, s)
+			}
+			h.topMu.Unlock()
+			h.linkNode(ctx, s, entryPoint, maxLevel, searchEf)
+			return
+		}
+		defer h.topMu.Unlock()
 	}
-	return b
-}
-
-// insertNode adds a node into the HNSW graph, updating links as needed.
-func (h *HNSWIndex) insertNode(n *Node, searchEf int) {
 	// If index is empty, set this node as entry point.
-	if h.EntryPoint == nil {
-		h.EntryPoint = n
-		h.MaxLevel = n.Level
+	if h.entryPoint == noSlot {
+		h.entryPoint = s
+		h.MaxLevel = level
+		h.topSlots = append(h.topSlots[:0], s)
 		return
 	}
-	// Update entry point if the new node has a higher level.
-	if n.Level > h.MaxLevel {
-		h.EntryPoint = n
-		h.MaxLevel = n.Level
+	h.linkNode(ctx, s, h.entryPoint, h.MaxLevel, searchEf)
+	// Promote the node to entry point once it is linked, if it reaches a new top level
+	// (or replaces a deleted entry point on the top level).
+	switch {
+	case level > h.MaxLevel:
+		h.entryPoint = s
+		h.MaxLevel = level
+		h.topSlots = append(h.topSlots[:0], s)
+	case level == h.MaxLevel:
+		h.topSlots = append(h.topSlots, s)
+		if h.g.isDeleted(h.entryPoint) {
+			h.entryPoint = s
+		}
 	}
-	current := h.EntryPoint
+}
+
+// linkNode connects slot s to its neighbors, descending from entryPoint at maxLevel.
+func (h *HNSWIndex) linkNode(ctx *searchContext, s, entryPoint uint32, maxLevel, searchEf int) {
+	level := h.g.level(s)
+	q := &ctx.node
+	h.g.nodeProbe(q, s)
+	current := entryPoint
 	// Navigate the graph from the top level down to the node's level.
-	for L := h.MaxLevel; L > n.Level; L-- {
-		changed := true
-		for changed {
-			changed = false
-			for _, neighbor := range current.Links[L] {
-				if h.Distance(n.Vector, neighbor.Vector) < h.Distance(n.Vector, current.Vector) {
-					current = neighbor
-					changed = true
-				}
-			}
-		}
+	for L := maxLevel; L > level; L-- {
+		current = h.greedyClosest(ctx, q, current, L)
 	}
 	// For each level where the new node will be inserted.
-	for L := minInt(n.Level, h.MaxLevel); L >= 0; L-- {
-		candList := h.searchLayer(n.Vector, current, L, searchEf, h.Distance)
-		selectedCands := selectM(candList, h.M)
-		selectedNodes := make([]*Node, len(selectedCands))
-		for i, cand := range selectedCands {
-			selectedNodes[i] = cand.node
-		}
-		n.Links[L] = selectedNodes
-		// Update neighbor links to include the new node.
-		for _, neighbor := range selectedNodes {
-			neighbor.Links[L] = append(neighbor.Links[L], n)
-			neighbor.ReverseLinks[L] = append(neighbor.ReverseLinks[L], n)
-			if len(neighbor.Links[L]) > h.M {
-				trimNeighborLinks(neighbor, L, h.M, h.Distance)
+	for L := minInt(level, maxLevel); L >= 0; L-- {
+		candList := h.searchLayer(ctx, q, current, L, searchEf)
+		// Move the current pointer for the next level before candList is reused.
+		if len(candList) > 0 {
+			current = candList[0].slot
+		}
+		pool := ctx.pool[:0]
+		for _, cand := range candList {
+			if cand.slot != s {
+				pool = append(pool, cand)
 			}
 		}
-		// Move the current pointer for the next level.
-		if len(candList) > 0 {
-			current = candList[0].node
+		if h.ExtendCandidates && h.NeighborSelection == SelectHeuristic {
+			ctx.begin(h.g.numSlots())
+			pool = h.extendCandidates(ctx, q, s, pool, L)
 		}
+		ctx.pool = pool
+		// New nodes take M links on every level; level-0 lists grow up to M0 = 2*M as
+		// later nodes link back.
+		selected := h.selectNeighbors(ctx, pool, h.M, ctx.selected[:0])
+		h.setNeighbors(s, L, selected)
+		// Update neighbor links to include the new node.
+		for _, nb := range selected {
+			h.addLink(ctx, nb.slot, candidate{s, nb.dist}, L)
+		}
+		ctx.selected = selected
 	}
 }
 
 // searchLayer performs a search in the graph at a given level.
-func (h *HNSWIndex) searchLayer(query []float32, entrypoint *Node, level int, ef int, distance func([]float32, []float32) float64) []candidate {
-	visited := map[int]bool{entrypoint.ID: true}
-	d0 := distance(query, entrypoint.Vector)
-	candQueue := candidateMinHeap{{entrypoint, d0}}
-	heap.Init(&candQueue)
-	resultQueue := candidateMaxHeap{{entrypoint, d0}}
-	heap.Init(&resultQueue)
+// The returned candidates are sorted by distance and alias ctx, so they are only
+// valid until the next search that uses the same context. The exploration stops as soon
+// as the budget of ctx runs out, and the best candidates found so far are returned.
+// Tombstones, and nodes outside the filter of ctx, are explored like any other node but
+// never returned; while the graph holds any, the search goes on until it has found ef
+// returnable candidates.
+func (h *HNSWIndex) searchLayer(ctx *searchContext, q *probe, entrypoint uint32, level int, ef int) []candidate {
+	ctx.begin(ctx.g.numSlots())
+	h.enterLayer(ctx, q, entrypoint)
+	return h.exploreLayer(ctx, q, level, ef)
+}
+
+// enterLayer adds slot s as a starting point of the search in ctx, unless it was visited.
+func (h *HNSWIndex) enterLayer(ctx *searchContext, q *probe, s uint32) {
+	if !ctx.visit(s) {
+		return
+	}
+	c := candidate{s, ctx.g.distance(q, s)}
+	ctx.cands.Push(c)
+	if returnable(ctx, s) {
+		ctx.results.Push(c)
+	}
+}
+
+// returnable reports whether the node in slot s may be among the results of the search in
+// ctx: it is not a tombstone, and its id is in the filter of the search, if there is one.
+func returnable(ctx *searchContext, s uint32) bool {
+	return !ctx.g.isDeleted(s) && (ctx.filter == nil || ctx.filter.Contains(ctx.g.ids[s]))
+}
+
+// exploreLayer runs the search of searchLayer from the starting points queued in ctx.
+func (h *HNSWIndex) exploreLayer(ctx *searchContext, q *probe, level int, ef int) []candidate {
 	// Explore candidates while there are promising ones.
-	for candQueue.Len() > 0 {
-		current := candQueue[0]
-		worstResult := resultQueue[0]
-		if current.dist > worstResult.dist && !h.ExhaustiveSearch {
+explore:
+	for ctx.cands.Len() > 0 {
+		current := ctx.cands.Top()
+		if !h.ExhaustiveSearch && ctx.results.Len() > 0 && current.dist > ctx.results.Top().dist &&
+			(ctx.g.tombstones == 0 && ctx.filter == nil || ctx.results.Len() >= ef) {
 			break
 		}
-		heap.Pop(&candQueue)
-		for _, neighbor := range current.node.Links[level] {
-			if visited[neighbor.ID] {
+		ctx.cands.Pop()
+		for _, neighbor := range h.neighborsOf(ctx, current.slot, level) {
+			if !ctx.visit(neighbor) {
 				continue
 			}
-			visited[neighbor.ID] = true
-			d := distance(query, neighbor.Vector)
-			if resultQueue.Len() < ef || d < resultQueue[0].dist {
+			if !ctx.budget.Spend(1) {
+				break explore
+			}
+			d := ctx.g.distance(q, neighbor)
+			if ctx.results.Len() < ef || d < ctx.results.Top().dist {
 				newCand := candidate{neighbor, d}
-				heap.Push(&candQueue, newCand)
-				heap.Push(&resultQueue, newCand)
-				if resultQueue.Len() > ef {
-					heap.Pop(&resultQueue)
+				ctx.cands.Push(newCand)
+				if !returnable(ctx, neighbor) {
+					continue
+				}
+				ctx.results.Push(newCand)
+				if ctx.results.Len() > ef {
+					ctx.results.Pop()
 				}
 			}
 		}
 	}
-	// Collect and sort results.
-	results := make([]candidate, resultQueue.Len())
-	for i := range results {
-		results[i] = heap.Pop(&resultQueue).(candidate)
+	return ctx.drainResults()
+}
+
+// bruteForce reports whether a search restricted to filter, of an index of size nodes,
+// should score the ids of the filter directly rather than search the graph (see
+// BruteForceRatio).
+func (h *HNSWIndex) bruteForce(filter core.Filter, size int) bool {
+	ratio := h.BruteForceRatio
+	if ratio == 0 {
+		ratio = defaultBruteForceRatio
 	}
-	sort.Slice(results, func(i, j int) bool {
-		if results[i].dist == results[j].dist {
-			return results[i].node.ID < results[j].node.ID
+	return float64(filter.Len()) <= ratio*float64(size)
+}
+
+// scanFilter scores the nodes of the ids in the filter of ctx directly and returns the best
+// ef of them, sorted by distance, like searchLayer. The scan stops when the budget of ctx
+// runs out. Ids are looked up in the id table of the index, so slots that are not live in
+// the searched view are skipped.
+func scanFilter(ctx *searchContext, q *probe, ef int) []candidate {
+	ctx.results.Reset()
+	n := uint32(ctx.g.numSlots())
+	ctx.filter.ForEach(func(id int) bool {
+		s, ok := ctx.g.lookup(id)
+		if !ok || s >= n || ctx.g.isDeleted(s) {
+			return true
 		}
-		return results[i].dist < results[j].dist
+		if !ctx.budget.Spend(1) {
+			return false
+		}
+		d := ctx.g.distance(q, s)
+		if ctx.results.Len() < ef || d < ctx.results.Top().dist {
+			ctx.results.Push(candidate{s, d})
+			if ctx.results.Len() > ef {
+				ctx.results.Pop()
+			}
+		}
+		return true
 	})
-	return results
+	return ctx.drainResults()
+}
+
+// resetEntryPoint picks the highest-level live node not marked in skip as the entry point.
+func (h *HNSWIndex) resetEntryPoint(skip []bool) {
+	h.entryPoint = h.g.highestSlot(skip)
+	h.MaxLevel = -1
+	if h.entryPoint != noSlot {
+		h.MaxLevel = h.g.level(h.entryPoint)
+	}
+	h.collectTopSlots()
+}
+
+// collectTopSlots rebuilds topSlots from the live nodes on the top level.
+func (h *HNSWIndex) collectTopSlots() {
+	h.topSlots = h.topSlots[:0]
+	if h.MaxLevel < 0 {
+		return
+	}
+	for s, lvl := range h.g.levels {
+		if int(lvl) == h.MaxLevel && !h.g.isDeleted(uint32(s)) {
+			h.topSlots = append(h.topSlots, uint32(s))
+		}
+	}
+}
+
+// dropTopSlot removes slot s from topSlots, if it is there.
+func (h *HNSWIndex) dropTopSlot(s uint32) {
+	for i, t := range h.topSlots {
+		if t == s {
+			last := len(h.topSlots) - 1
+			h.topSlots[i] = h.topSlots[last]
+			h.topSlots = h.topSlots[:last]
+			return
+		}
+	}
+}
+
+// remove deletes the node in slot s by turning it into a tombstone, in constant time.
+// The node keeps its links until a repair reclaims it, so the graph stays connected. A
+// deleted entry point is replaced by another node of the top level; if there is none,
+// searches keep entering the graph through the tombstone until the repair.
+func (h *HNSWIndex) remove(s uint32) {
+	h.g.tombstone(s)
+	h.g.tombstones++
+	if h.g.level(s) == h.MaxLevel {
+		h.dropTopSlot(s)
+	}
+	if h.entryPoint == s && len(h.topSlots) > 0 {
+		h.entryPoint = h.topSlots[0]
+	}
 }
 
 // Add inserts a new vector into the index with a unique id.
 func (h *HNSWIndex) Add(id int, vector []float32) error {
 	h.Mu.Lock()
 	defer h.Mu.Unlock()
+	defer h.publish()
 	if len(vector) != h.Dimension {
 		return fmt.Errorf("vector dimension %d does not match index dimension %d",
 			len(vector), h.Dimension)
 	}
 
-	if _, exists := h.Nodes[id]; exists {
+	if _, exists := h.g.idToSlot[id]; exists {
 		return fmt.Errorf("id %d already exists", id)
 	}
-	level := h.randomLevel()
-	newNode := &Node{
-		ID:           id,
-		Vector:       vector,
-		Level:        level,
-		Links:        make(map[int][]*Node),
-		ReverseLinks: make(map[int][]*Node),
+	if h.store != nil {
+		if err := h.store.Put(id, vector); err != nil {
+			return err
+		}
 	}
-	h.Nodes[id] = newNode
-	h.insertNode(newNode, h.Ef)
+	s := h.g.alloc(id, vector, h.randomLevel(), h.g.metric.Normalize)
+	ctx := getSearchContext(&h.g)
+	h.insertNode(ctx, s, h.efConstruction())
+	putSearchContext(ctx)
 	return nil
 }
 
 // Delete removes a vector from the index by its id.
+// The node becomes a tombstone that searches skip; its slot is reclaimed by Repair, which
+// runs in the background once RepairThreshold is crossed.
 func (h *HNSWIndex) Delete(id int) error {
 	h.Mu.Lock()
 	defer h.Mu.Unlock()
-	node, exists := h.Nodes[id]
+	defer h.publish()
+	s, exists := h.g.idToSlot[id]
 	if !exists {
 		return fmt.Errorf("id %d not found", id)
 	}
-	h.removeNodeLinks(node)
-	delete(h.Nodes, id)
-	// Update the entry point if necessary.
-	if h.EntryPoint != nil && h.EntryPoint.ID == id {
-		h.EntryPoint = nil
-		for _, n := range h.Nodes {
-			if h.EntryPoint == nil || n.Level > h.EntryPoint.Level {
-				h.EntryPoint = n
-			}
+	if h.store != nil {
+		if err := h.store.Delete(id); err != nil {
+			return err
 		}
 	}
+	h.remove(s)
+	h.maybeRepair()
 	return nil
 }
 
-// Update changes the vector for an existing node and re-inserts it in the graph.
+// Update changes the vector for an existing node and re-inserts it in the graph. As in
+// BulkUpdate, the node moves to a new slot, and its old slot becomes a tombstone whose
+// former neighbors are repaired locally: a vector is never overwritten while searches may
+// read it.
 func (h *HNSWIndex) Update(id int, vector []float32) error {
 	h.Mu.Lock()
 	defer h.Mu.Unlock()
-	node, exists := h.Nodes[id]
+	defer h.publish()
+	s, exists := h.g.idToSlot[id]
 	if !exists {
 		return fmt.Errorf("id %d not found", id)
 	}
@@ -492,62 +803,189 @@ func (h *HNSWIndex) Update(id int, vector []float32) error {
 			len(vector), h.Dimension)
 	}
 
-	h.removeNodeLinks(node)
-	node.Vector = vector
-	node.Links = make(map[int][]*Node)
-	node.ReverseLinks = make(map[int][]*Node)
-	h.insertNode(node, h.Ef)
+	if h.store != nil {
+		if err := h.store.Put(id, vector); err != nil {
+			return err
+		}
+	}
+	h.remove(s)
+	ns := h.g.alloc(id, vector, h.g.level(s), h.g.metric.Normalize)
+	ctx := getSearchContext(&h.g)
+	h.insertNode(ctx, ns, h.efConstruction())
+	putSearchContext(ctx)
+	h.repairNeighbors([]uint32{s})
+	h.maybeRepair()
 	return nil
 }
 
-// BulkAdd inserts multiple vectors into the index at once.
+// BulkAdd inserts multiple vectors into the index at once. Searches see the new nodes as
+// they are linked: the progress is published every publishInterval nodes. The vectors are
+// copied into the arena, so the caller keeps ownership of the slices.
 func (h *HNSWIndex) BulkAdd(vectors map[int][]float32) error {
+	h.Mu.Lock()
+	defer h.Mu.Unlock()
+	defer h.publish()
+	start := time.Now()
 
-	nodesSlice := make([]*Node, 0, len(vectors))
 	for id, vector := range vectors {
 		if len(vector) != h.Dimension {
 			return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
 				len(vector), h.Dimension, id)
 		}
-		if _, exists := h.Nodes[id]; exists {
+		if _, exists := h.g.idToSlot[id]; exists {
 			return fmt.Errorf("id %d already exists", id)
 		}
-		level := h.randomLevel()
-		newNode := &Node{
-			ID:           id,
-			Vector:       vector,
-			Level:        level,
-			Links:        make(map[int][]*Node),
-			ReverseLinks: make(map[int][]*Node),
-		}
-		nodesSlice = append(nodesSlice, newNode)
 	}
-	// Sort nodes by level descending.
-	sort.Slice(nodesSlice, func(i, j int) bool {
-		return nodesSlice[i].Level > nodesSlice[j].Level
+	// Assign slots and levels in id order, so that a build is reproducible under HANN_SEED.
+	ids := make([]int, 0, len(vectors))
+	for id := range vectors {
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	// Initialize progress bar with a newline after finish.
+	bar := progressbar.NewOptions(len(ids),
+		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
+	)
+	// Reserve the arena up front so that allocating slots does not reallocate it repeatedly.
+	if err := h.addNodes(ids, func(i int) []float32 { return vectors[ids[i]] }, len(ids), bar); err != nil {
+		return err
+	}
+	h.counters.RecordBuild(h.Sink, "hnsw_bulk_add", time.Since(start))
+	return nil
+}
+
+// AddStream inserts the batches received from batches until the channel is closed (see
+// core.AddStream). Every batch is inserted like a BulkAdd, in the order of its rows, under
+// a write lock that is released between batches, and searches see it as it is linked.
+// The vectors are copied into the arena, so every batch is released once it is inserted.
+func (h *HNSWIndex) AddStream(batches <-chan core.Batch, opts core.StreamOptions) error {
+	bar := progressbar.NewOptions(-1,
+		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
+	)
+	err := core.ConsumeBatches(batches, true, func(b core.Batch) error {
+		return h.addBatch(b, bar)
 	})
-	bulkEf := h.Ef
+	if ferr := bar.Finish(); err == nil {
+		err = ferr
+	}
+	return err
+}
+
+// addBatch inserts the vectors of one batch of a stream.
+func (h *HNSWIndex) addBatch(b core.Batch, bar *progressbar.ProgressBar) error {
 	h.Mu.Lock()
 	defer h.Mu.Unlock()
+	defer h.publish()
+	start := time.Now()
+	if err := b.Validate(h.Dimension); err != nil {
+		return err
+	}
+	for _, id := range b.IDs {
+		if _, exists := h.g.idToSlot[id]; exists {
+			return fmt.Errorf("id %d already exists", id)
+		}
+	}
+	// The arena grows by at least a quarter, so that a long stream of small batches copies
+	// it a logarithmic number of times.
+	reserve := max(len(b.IDs), len(h.g.ids)/4)
+	dim := h.Dimension
+	if err := h.addNodes(b.IDs, func(i int) []float32 { return b.Row(i, dim) }, reserve, bar); err != nil {
+		return err
+	}
+	h.counters.RecordBuild(h.Sink, "hnsw_add_stream", time.Since(start))
+	return nil
+}
 
-	// Initialize progress bar with a newline after finish.
-	bar := progressbar.NewOptions(len(nodesSlice),
-		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
-	)
+// addNodes allocates a slot for every id, with the vector that vector returns for its
+// position, and links the new nodes. The arena is first grown to hold reserve more nodes.
+// The caller holds Mu exclusively and has checked the vectors and ids.
+func (h *HNSWIndex) addNodes(ids []int, vector func(i int) []float32, reserve int,
+	bar *progressbar.ProgressBar) error {
+	h.g.grow(reserve)
+	slots := make([]uint32, 0, len(ids))
+	for i, id := range ids {
+		v := vector(i)
+		if h.store != nil {
+			if err := h.store.Put(id, v); err != nil {
+				return err
+			}
+		}
+		s := h.g.alloc(id, v, h.randomLevel(), h.g.metric.Normalize)
+		slots = append(slots, s)
+	}
+	h.publish()
+	// Sort nodes by level descending.
+	sort.SliceStable(slots, func(i, j int) bool {
+		return h.g.level(slots[i]) > h.g.level(slots[j])
+	})
+	return h.insertAll(slots, bar, true)
+}
+
+// buildWorkers returns the number of goroutines used to insert n nodes.
+func (h *HNSWIndex) buildWorkers(n int) int {
+	workers := h.BuildWorkers
+	if workers <= 0 {
+		workers = runtime.NumCPU()
+	}
+	if workers > n {
+		workers = n
+	}
+	return workers
+}
 
-	for _, newNode := range nodesSlice {
-		h.Nodes[newNode.ID] = newNode
-		if h.EntryPoint == nil {
-			h.EntryPoint = newNode
-			h.MaxLevel = newNode.Level
-		} else {
-			if newNode.Level > h.MaxLevel {
-				h.EntryPoint = newNode
-				h.MaxLevel = newNode.Level
+// insertAll inserts the nodes in slots, in order, using up to BuildWorkers goroutines.
+// With a single worker the insertion order, and therefore the graph, is deterministic.
+// With progress set, the state is published every publishInterval inserted nodes.
+// The caller must hold Mu exclusively and the slots must already be allocated.
+func (h *HNSWIndex) insertAll(slots []uint32, bar *progressbar.ProgressBar, progress bool) error {
+	workers := h.buildWorkers(len(slots))
+	if workers <= 1 {
+		ctx := getSearchContext(&h.g)
+		defer putSearchContext(ctx)
+		for i, s := range slots {
+			h.insertNode(ctx, s, h.efConstruction())
+			if progress && (i+1)%publishInterval == 0 {
+				h.publish()
+			}
+			err := bar.Add(1)
+			if err != nil {
+				return err
 			}
-			h.insertNode(newNode, bulkEf)
 		}
-		err := bar.Add(1)
+		return nil
+	}
+
+	// Workers claim the next slot in order, so high-level nodes are still inserted first.
+	h.building = true
+	defer func() { h.building = false }()
+	var next atomic.Int64
+	errs := make([]error, workers)
+	var wg sync.WaitGroup
+	for w := 0; w < workers; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			ctx := getSearchContext(&h.g)
+			defer putSearchContext(ctx)
+			for {
+				i := int(next.Add(1) - 1)
+				if i >= len(slots) {
+					return
+				}
+				h.insertNode(ctx, slots[i], h.efConstruction())
+				if progress && (i+1)%publishInterval == 0 {
+					h.topMu.Lock()
+					h.publish()
+					h.topMu.Unlock()
+				}
+				if err := bar.Add(1); err != nil && errs[w] == nil {
+					errs[w] = err
+				}
+			}
+		}(w)
+	}
+	wg.Wait()
+	for _, err := range errs {
 		if err != nil {
 			return err
 		}
@@ -555,288 +993,325 @@ func (h *HNSWIndex) BulkAdd(vectors map[int][]float32) error {
 	return nil
 }
 
-// BulkDelete removes multiple nodes from the index.
+// BulkDelete removes multiple nodes from the index, turning them into tombstones as Delete does.
 func (h *HNSWIndex) BulkDelete(ids []int) error {
 	h.Mu.Lock()
 	defer h.Mu.Unlock()
+	defer h.publish()
 
 	// Initialize progress bar with newline on completion.
 	bar := progressbar.NewOptions(len(ids),
 		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
 	)
 	for _, id := range ids {
-		node, exists := h.Nodes[id]
-		if !exists {
-			err := bar.Add(1)
-			if err != nil {
-				return err
+		if s, exists := h.g.idToSlot[id]; exists {
+			if h.store != nil {
+				if err := h.store.Delete(id); err != nil {
+					return err
+				}
 			}
-			continue
+			h.remove(s)
 		}
-		h.removeNodeLinks(node)
-		delete(h.Nodes, id)
 		err := bar.Add(1)
 		if err != nil {
 			return err
 		}
 	}
+	h.maybeRepair()
+	return nil
+}
 
-	// Clean up links in remaining nodes.
-	for _, n := range h.Nodes {
-		for L, neighbors := range n.Links {
-			newNeighbors := make([]*Node, 0, len(neighbors))
-			for _, neighbor := range neighbors {
-				if _, exists := h.Nodes[neighbor.ID]; exists {
-					newNeighbors = append(newNeighbors, neighbor)
-				}
-			}
-			n.Links[L] = newNeighbors
+// BulkUpdate updates multiple nodes with new vectors. Ids that are not in the index are
+// skipped. Only the updated nodes are re-linked: each one is moved to a new slot and
+// inserted like a new node (in parallel, as in BulkAdd), and its old slot becomes a
+// tombstone whose former neighbors are repaired locally. The updates are applied in
+// batches of updateBatchSize, and the write lock is released between batches, so
+// searches and other mutations are not blocked for the whole operation.
+func (h *HNSWIndex) BulkUpdate(updates map[int][]float32) error {
+	h.Mu.RLock()
+	dimension := h.Dimension
+	h.Mu.RUnlock()
+	for id, vector := range updates {
+		if len(vector) != dimension {
+			return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
+				len(vector), dimension, id)
 		}
 	}
-	// Update the entry point.
-	h.EntryPoint = nil
-	for _, n := range h.Nodes {
-		if h.EntryPoint == nil || n.Level > h.EntryPoint.Level {
-			h.EntryPoint = n
+	// Apply the updates in id order, so that an update is reproducible under HANN_SEED.
+	ids := make([]int, 0, len(updates))
+	for id := range updates {
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+
+	// Progress bar for processing updates with newline on finish.
+	bar := progressbar.NewOptions(len(ids),
+		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
+	)
+	for start := 0; start < len(ids); start += updateBatchSize {
+		batch := ids[start:minInt(start+updateBatchSize, len(ids))]
+		if err := h.updateBatch(batch, updates, bar); err != nil {
+			return err
 		}
 	}
 	return nil
 }
 
-// BulkUpdate updates multiple nodes with new vectors.
-func (h *HNSWIndex) BulkUpdate(updates map[int][]float32) error {
-
+// updateBatch re-links the nodes of ids with their vectors from updates under the write lock.
+// Searches see the new slots once the batch is published at its end; until then, the ids
+// of the batch are missing from their results.
+func (h *HNSWIndex) updateBatch(ids []int, updates map[int][]float32, bar *progressbar.ProgressBar) error {
 	h.Mu.Lock()
 	defer h.Mu.Unlock()
+	defer h.publish()
 
-	// Progress bar for processing updates with newline on finish.
-	bar := progressbar.NewOptions(len(updates),
-		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
-	)
-	for id, vector := range updates {
-		node, exists := h.Nodes[id]
+	// Retire all old slots first, so that no new link points to an outdated vector. A new
+	// slot keeps the level of the node it replaces.
+	old := make([]uint32, 0, len(ids))
+	slots := make([]uint32, 0, len(ids))
+	h.g.grow(len(ids))
+	for _, id := range ids {
+		s, exists := h.g.idToSlot[id]
 		if !exists {
-			err := bar.Add(1)
-			if err != nil {
+			continue // deleted since the update started
+		}
+		h.remove(s)
+		old = append(old, s)
+	}
+	if err := bar.Add(len(ids) - len(old)); err != nil {
+		return err
+	}
+	for _, s := range old {
+		id := h.g.ids[s]
+		if h.store != nil {
+			if err := h.store.Put(id, updates[id]); err != nil {
 				return err
 			}
-			continue
 		}
-		if len(vector) != h.Dimension {
-			return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
-				len(vector), h.Dimension, id)
-		}
-		h.removeNodeLinks(node)
-		node.Vector = vector
-		node.Links = make(map[int][]*Node)
-		node.ReverseLinks = make(map[int][]*Node)
-		err := bar.Add(1)
-		if err != nil {
-			return err
-		}
-	}
-
-	// Reinsert all nodes to rebuild links.
-	allNodes := make([]*Node, 0, len(h.Nodes))
-	for _, node := range h.Nodes {
-		allNodes = append(allNodes, node)
+		ns := h.g.alloc(id, updates[id], h.g.level(s), h.g.metric.Normalize)
+		slots = append(slots, ns)
 	}
-	sort.Slice(allNodes, func(i, j int) bool {
-		return allNodes[i].Level > allNodes[j].Level
+	sort.SliceStable(slots, func(i, j int) bool {
+		return h.g.level(slots[i]) > h.g.level(slots[j])
 	})
-	h.EntryPoint = nil
-	h.MaxLevel = -1
-
-	// Progress bar for reinsertion with newline on finish.
-	bar = progressbar.NewOptions(len(allNodes),
-		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
-	)
-	for _, node := range allNodes {
-		if h.EntryPoint == nil || node.Level > h.MaxLevel {
-			h.EntryPoint = node
-			h.MaxLevel = node.Level
-		}
-		h.insertNode(node, h.Ef)
-		err := bar.Add(1)
-		if err != nil {
-			return err
-		}
+	if err := h.insertAll(slots, bar, false); err != nil {
+		return err
+	}
+	// Parallel inserts on the top level do not take over a deleted entry point.
+	if h.entryPoint != noSlot && h.g.isDeleted(h.entryPoint) && len(h.topSlots) > 0 {
+		h.entryPoint = h.topSlots[0]
 	}
+	h.repairNeighbors(old)
+	h.maybeRepair()
 	return nil
 }
 
 // Search finds the k-nearest neighbors of a given query vector.
 func (h *HNSWIndex) Search(query []float32, k int) ([]core.Neighbor, error) {
-	h.Mu.RLock()
-	defer h.Mu.RUnlock()
-	if len(query) != h.Dimension {
+	return h.SearchWithOptions(query, k, core.SearchOptions{})
+}
+
+// SearchWithOptions finds the k-nearest neighbors of a given query vector.
+// opts.Ef overrides the index's Ef for this query; the base layer is always searched with
+// at least k candidates. If the graph search still finds fewer than k nodes (because the
+// part of the graph it reached is too small), it is resumed from further entry points with
+// a doubled ef, at most maxSearchRestarts times; opts.Stats reports the restarts. When the
+// distance-computation or time budget of opts runs out, the best candidates found so far
+// are returned. On quantized vectors, a positive RerankFactor (from opts, or the index
+// default) re-scores the best k*RerankFactor candidates (at most the ef found) against their
+// float32 vectors, taken from memory (RetainVectors) or from the attached vector store, and
+// returns exact distances. With opts.Filter, the graph search traverses nodes outside the
+// filter without returning them; filters that allow at most BruteForceRatio of the nodes
+// are served by scoring their ids directly instead.
+// The search reads the view most recently published by the writers and does not take Mu,
+// so it never waits for a write, however long; it sees the nodes of a running BulkAdd as
+// they are linked.
+func (h *HNSWIndex) SearchWithOptions(query []float32, k int, opts core.SearchOptions) ([]core.Neighbor, error) {
+	var start time.Time
+	if h.Sink != nil {
+		start = time.Now()
+	}
+	v := h.acquire()
+	if v == nil {
+		return nil, core.ErrEmptyIndex
+	}
+	defer v.readers.Add(-1)
+	if len(query) != v.dimension {
 		return nil, fmt.Errorf("query dimension %d does not match index dimension %d",
-			len(query), h.Dimension)
-	}
-	if h.EntryPoint == nil {
-		return nil, errors.New("index is empty")
-	}
-
-	// Greedy search down from the top layer.
-	current := h.EntryPoint
-	for L := h.MaxLevel; L > 0; L-- {
-		changed := true
-		for changed {
-			changed = false
-			for _, neighbor := range current.Links[L] {
-				if h.Distance(query, neighbor.Vector) < h.Distance(query, current.Vector) {
-					current = neighbor
-					changed = true
-				}
-			}
-		}
+			len(query), v.dimension)
+	}
+	if v.size == 0 || v.entryPoint == noSlot {
+		return nil, core.ErrEmptyIndex
+	}
+	ef := h.Ef
+	if opts.Ef > 0 {
+		ef = opts.Ef
+	}
+	rerankFactor := opts.RerankFactor
+	if rerankFactor == 0 {
+		rerankFactor = h.RerankFactor
+	}
+	rerank := v.g.quant != QuantizeNone && rerankFactor > 0
+	if rerank && !v.g.floats && v.store == nil {
+		return nil, errors.New("re-ranking needs the float32 vectors; set RetainVectors or attach a vector store")
 	}
-	// Search in the base layer (level 0) for candidates.
-	candidates := h.searchLayer(query, current, 0, h.Ef, h.Distance)
-	if len(candidates) < k {
-		// Use fallback to gather more candidates if needed.
-
-		// Log that fallback is triggered.
-		log.Warn().Msgf("Fallback search triggered: insufficient candidates from"+
-			" searchLayer; only %d found", len(candidates))
-
-		candidateIDs := make(map[int]bool)
-		for _, c := range candidates {
-			candidateIDs[c.node.ID] = true
-		}
 
-		fallbackSize := k - len(candidates)
-		var keys []int
-		for id := range h.Nodes {
-			keys = append(keys, id)
-		}
-		sort.Ints(keys)
-		nodesSlice := make([]*Node, 0, len(h.Nodes))
-		for _, id := range keys {
-			node := h.Nodes[id]
-			if candidateIDs[node.ID] {
-				continue
-			}
-			nodesSlice = append(nodesSlice, node)
+	ctx := getSearchContext(&v.g)
+	defer putSearchContext(ctx)
+	ctx.shared = true
+	ctx.budget = core.NewSearchBudget(opts)
+	ctx.filter = opts.Filter
+	q := prepareQuery(ctx, query)
+	ef = max(ef, k)
+	var stats core.SearchStats
+	var candidates []candidate
+	if ctx.filter != nil && h.BruteForceRatio >= 0 && h.bruteForce(ctx.filter, v.size) {
+		candidates = scanFilter(ctx, q, ef)
+		stats.BruteForce = true
+	} else {
+		// Greedy search down from the top layer.
+		current := v.entryPoint
+		for L := v.maxLevel; L > 0; L-- {
+			current = h.greedyClosest(ctx, q, current, L)
 		}
-
-		numWorkers := runtime.NumCPU()
-		if numWorkers > len(nodesSlice) {
-			numWorkers = len(nodesSlice)
+		// Search in the base layer (level 0) for candidates.
+		candidates = h.searchLayer(ctx, q, current, 0, ef)
+		want := min(k, v.size)
+		if ctx.filter != nil {
+			want = min(want, ctx.filter.Len())
 		}
-		chunkSize := (len(nodesSlice) + numWorkers - 1) / numWorkers
-		resultsCh := make(chan candidateMaxHeap, numWorkers)
-		var wg sync.WaitGroup
-
-		// Run parallel fallback search.
-		for i := 0; i < numWorkers; i++ {
-			start := i * chunkSize
-			end := start + chunkSize
-			if end > len(nodesSlice) {
-				end = len(nodesSlice)
-			}
-			wg.Add(1)
-			go func(nodesChunk []*Node) {
-				defer wg.Done()
-				localHeap := candidateMaxHeap{}
-				heap.Init(&localHeap)
-				for _, node := range nodesChunk {
-					d := h.Distance(query, node.Vector)
-					cand := candidate{node, d}
-					if localHeap.Len() < fallbackSize {
-						heap.Push(&localHeap, cand)
-					} else if localHeap.Len() > 0 && d < localHeap[0].dist {
-						heap.Pop(&localHeap)
-						heap.Push(&localHeap, cand)
-					}
-				}
-				resultsCh <- localHeap
-			}(nodesSlice[start:end])
-		}
-		wg.Wait()
-		close(resultsCh)
-
-		finalHeap := candidateMaxHeap{}
-		heap.Init(&finalHeap)
-		// Merge results from all workers.
-		for partialHeap := range resultsCh {
-			for partialHeap.Len() > 0 {
-				cand := heap.Pop(&partialHeap).(candidate)
-				if finalHeap.Len() < fallbackSize {
-					heap.Push(&finalHeap, cand)
-				} else if finalHeap.Len() > 0 && cand.dist < finalHeap[0].dist {
-					heap.Pop(&finalHeap)
-					heap.Push(&finalHeap, cand)
-				}
+		for ; len(candidates) < want && stats.Restarts < maxSearchRestarts && !ctx.budget.Exhausted(); stats.Restarts++ {
+			// Every returnable node visited so far is among the candidates, as fewer than ef
+			// were found, so the search resumes with its visited set and candidates unchanged.
+			for _, c := range candidates {
+				ctx.results.Push(c)
 			}
+			h.enterRestart(ctx, q, v.topSlots, stats.Restarts)
+			ef *= 2
+			candidates = h.exploreLayer(ctx, q, 0, ef)
 		}
-		fallbackCandidates := make([]candidate, finalHeap.Len())
-		for i := range fallbackCandidates {
-			fallbackCandidates[i] = heap.Pop(&finalHeap).(candidate)
+	}
+	stats.Candidates = len(candidates)
+	if rerank {
+		// Second stage: exact distances for the best candidates found on the codes.
+		candidates = candidates[:min(k*rerankFactor, len(candidates))]
+		if err := rerankCandidates(ctx, v.store, q.vec, candidates); err != nil {
+			return nil, err
 		}
-		candidates = append(candidates, fallbackCandidates...)
-		sort.Slice(candidates, func(i, j int) bool {
-			if candidates[i].dist == candidates[j].dist {
-				return candidates[i].node.ID < candidates[j].node.ID
-			}
-			return candidates[i].dist < candidates[j].dist
-		})
+		ctx.budget.Spend(len(candidates))
+		stats.Reranked = len(candidates)
+	}
+	ctx.budget.Report(&stats)
+	stats.NodesVisited = ctx.visits
+	stats.HeapPushes = ctx.cands.pushes + ctx.results.pushes
+	if opts.Stats != nil {
+		*opts.Stats = stats
 	}
+	h.counters.RecordSearch(h.Sink, "hnsw", &stats, 0, start)
 	if k > len(candidates) {
 		k = len(candidates)
 	}
 	results := make([]core.Neighbor, k)
 	for i := 0; i < k; i++ {
-		results[i] = core.Neighbor{ID: candidates[i].node.ID, Distance: candidates[i].dist}
+		results[i] = core.Neighbor{
+			ID:       v.g.ids[candidates[i].slot],
+			Distance: v.g.metric.Finalize(candidates[i].dist),
+		}
 	}
 	return results, nil
 }
 
-// Stats returns simple statistics about the index.
+// SearchBatch finds the k-nearest neighbors of several query vectors using the shared worker pool.
+func (h *HNSWIndex) SearchBatch(queries [][]float32, k int) ([][]core.Neighbor, error) {
+	return core.SearchBatch(queries, k, h.Search)
+}
+
+// enterRestart adds the starting points of restart number n of a base-layer search to
+// ctx: the nodes of topSlots (the top level) that the search has not visited yet, and
+// unvisited nodes found by probing restartProbes slots spread over the graph. The probes of
+// each restart start at another offset, so repeated restarts reach further parts of a
+// disconnected graph while the cost of a restart stays bounded.
+func (h *HNSWIndex) enterRestart(ctx *searchContext, q *probe, topSlots []uint32, n int) {
+	for _, s := range topSlots {
+		h.enterLayer(ctx, q, s)
+	}
+	slots := ctx.g.numSlots()
+	stride := max(slots/restartProbes, 1)
+	offset := (n*stride/maxSearchRestarts + n) % slots
+	for i := 0; i < restartProbes; i++ {
+		s := uint32((offset + i*stride) % slots)
+		// Free slots are flagged as deleted, so the level of a slot that a writer may be
+		// reusing is never read.
+		if !ctx.g.isDeleted(s) && ctx.g.live(s) {
+			h.enterLayer(ctx, q, s)
+		}
+	}
+}
+
+// Stats returns statistics about the index: its size, the totals of its searches and
+// builds, and its memory by kind.
 func (h *HNSWIndex) Stats() core.IndexStats {
 	h.Mu.RLock()
 	defer h.Mu.RUnlock()
-	count := len(h.Nodes)
+	count := h.g.size()
 	stats := core.IndexStats{
 		Count:     count,
 		Dimension: h.Dimension,
 		Distance:  h.DistanceName,
+		Memory:    h.g.memory(),
 	}
+	h.counters.Fill(&stats)
 	return stats
 }
 
-// Save writes the index to the given writer using gob encoding.
+// Save writes the index to the given writer in the sectioned binary format (see core.WriteSections).
+// The graph arrays are streamed to w without an intermediate buffer.
 func (h *HNSWIndex) Save(w io.Writer) error {
 	h.Mu.RLock()
 	defer h.Mu.RUnlock()
-	enc := gob.NewEncoder(w)
-	if err := enc.Encode(h); err != nil {
+	if err := core.WriteSections(w, formatKind, h.sections()); err != nil {
 		return err
 	}
 	log.Info().Msg("Index saved")
 	return nil
 }
 
-// Load reads the index from the given reader using gob decoding.
+// Load reads an index written by Save from the given reader.
+// Gob files are still accepted: those of the flat layout and those of the first version,
+// whose nodes are stored in slots and linked again (see decodeLegacy). An attached vector
+// store is not part of the saved state and has to be set again.
 func (h *HNSWIndex) Load(r io.Reader) error {
 	h.Mu.Lock()
 	defer h.Mu.Unlock()
-	dec := gob.NewDecoder(r)
-	if err := dec.Decode(h); err != nil {
-		return err
+	br := bufio.NewReader(r)
+	if prefix, _ := br.Peek(core.SectionMagicLen); !core.IsSectionFile(prefix) {
+		dec := gob.NewDecoder(br)
+		if err := dec.Decode(h); err != nil {
+			return err
+		}
+	} else {
+		f, err := core.ReadSections(br)
+		if err != nil {
+			return err
+		}
+		if err := h.loadSections(f); err != nil {
+			return err
+		}
 	}
+	h.setMapping(nil)
 	log.Info().Msg("Index loaded")
 	return nil
 }
 
 // Check interface compliance at compile time.
-var _ core.Index = (*HNSWIndex)(nil)
+var (
+	_ core.Index       = (*HNSWIndex)(nil)
+	_ core.StreamAdder = (*HNSWIndex)(nil)
+)
 
 // init registers types for gob encoding.
 func init() {
 	gob.Register(serializedIndex{})
-	gob.Register(serializedNode{})
 	gob.Register(&HNSWIndex{})
-	gob.Register(&Node{})
-	log.Debug().Msg("Registered HNSWIndex and Node types for Gob encoding")
+	log.Debug().Msg("Registered HNSWIndex type for Gob encoding")
 }
@@ -1,9 +1,16 @@
 package hnsw_test
 
 import (
+	"bytes"
+	"encoding/gob"
+	"math"
 	"os"
+	"path/filepath"
+	"sort"
 	"sync"
+	"sync/atomic"
 	"testing"
+	"time"
 
 	"github.com/patrikhermansson/hann/core"
 	"github.com/patrikhermansson/hann/hnsw"
@@ -205,6 +212,69 @@ func TestHNSWIndex_BulkUpdate(t *testing.T) {
 	}
 }
 
+func TestHNSWIndex_BulkUpdateRelinksUpdatedNodes(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	dim, n := 8, 3000
+	vectors := uniformVectors(n, dim)
+	idx := hnsw.NewHNSW(dim, 8, 32, core.Distances["euclidean"], "euclidean")
+	idx.RepairThreshold = -1 // keep the tombstones of the old vectors
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	// Move more than one batch of nodes to the positions of other vectors, shifted out of the cube.
+	moved := uniformVectors(n, dim)
+	updates := make(map[int][]float32)
+	for id := 0; id < n; id += 2 {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = moved[n-1-id][j] + 2
+		}
+		updates[id] = vec
+	}
+
+	done := make(chan struct{})
+	go func() {
+		defer close(done)
+		for i := 0; i < 200; i++ {
+			if _, err := idx.Search(vectors[i], 5); err != nil {
+				t.Errorf("Search during BulkUpdate failed: %v", err)
+				return
+			}
+		}
+	}()
+	if err := idx.BulkUpdate(updates); err != nil {
+		t.Fatalf("BulkUpdate failed: %v", err)
+	}
+	<-done
+	if count := idx.Stats().Count; count != n {
+		t.Fatalf("expected count %d after BulkUpdate, got %d", n, count)
+	}
+
+	found := 0
+	for id := 0; id < n; id++ {
+		query := vectors[id]
+		if vec, ok := updates[id]; ok {
+			query = vec
+		}
+		res, err := idx.Search(query, 1)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		if res[0].ID == id {
+			found++
+		}
+		// The old vector of an updated node is never returned.
+		if _, ok := updates[id]; ok {
+			if res, _ := idx.Search(vectors[id], 1); res[0].ID == id && res[0].Distance == 0 {
+				t.Fatalf("old vector of updated id %d was returned", id)
+			}
+		}
+	}
+	if found < n*95/100 {
+		t.Errorf("only %d of %d nodes found themselves after BulkUpdate", found, n)
+	}
+}
+
 func TestHNSWIndex_SaveLoad(t *testing.T) {
 	dim := 6
 	index := hnsw.NewHNSW(dim, 5, 10, core.Euclidean, "euclidean")
@@ -249,6 +319,20 @@ func TestHNSWIndex_SaveLoad(t *testing.T) {
 	if stats.Count != len(vectors) {
 		t.Errorf("expected count %d after Load, got %d", len(vectors), stats.Count)
 	}
+
+	// Assert: the loaded graph answers queries like the original one.
+	query := []float32{6, 5, 4, 3, 2, 1}
+	want, err := index.Search(query, 2)
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	got, err := newIndex.Search(query, 2)
+	if err != nil {
+		t.Fatalf("Search on loaded index failed: %v", err)
+	}
+	if len(got) != len(want) || got[0].ID != want[0].ID || got[0].ID != 2 {
+		t.Errorf("expected %v from loaded index, got %v", want, got)
+	}
 }
 
 func TestHNSWIndex_ConcurrentBulkOperations(t *testing.T) {
@@ -317,3 +401,1031 @@ func TestHNSWIndex_ConcurrentBulkOperations(t *testing.T) {
 			stats.Count)
 	}
 }
+
+func TestHNSWIndex_SearchAllocations(t *testing.T) {
+	if raceEnabled {
+		t.Skip("sync.Pool drops items under the race detector")
+	}
+	dim := 6
+	index := hnsw.NewHNSW(dim, 5, 20, core.Euclidean, "euclidean")
+	for i := 0; i < 500; i++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = float32((i*(j+3))%97) / 7
+		}
+		if err := index.Add(i, vec); err != nil {
+			t.Fatalf("Add failed: %v", err)
+		}
+	}
+
+	query := []float32{1, 2, 3, 4, 5, 6}
+	if _, err := index.Search(query, 5); err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	// Only the returned neighbor slice should be allocated once the search context is pooled.
+	allocs := testing.AllocsPerRun(100, func() {
+		if _, err := index.Search(query, 5); err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+	})
+	if allocs > 1 {
+		t.Errorf("expected at most 1 allocation per Search, got %.1f", allocs)
+	}
+}
+
+// clusteredVectors returns n deterministic pseudo-random vectors of the given dimension.
+func clusteredVectors(n, dim int) map[int][]float32 {
+	vectors := make(map[int][]float32, n)
+	state := uint32(1)
+	for i := 0; i < n; i++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			state = state*1664525 + 1013904223
+			vec[j] = float32(i%10) + float32(state>>8)/float32(1<<24)
+		}
+		vectors[i] = vec
+	}
+	return vectors
+}
+
+// uniformVectors returns n deterministic vectors spread uniformly over the unit cube.
+func uniformVectors(n, dim int) map[int][]float32 {
+	vectors := make(map[int][]float32, n)
+	state := uint32(7)
+	for i := 0; i < n; i++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			state = state*1664525 + 1013904223
+			vec[j] = float32(state>>8) / float32(1<<24)
+		}
+		vectors[i] = vec
+	}
+	return vectors
+}
+
+func TestHNSWIndex_BulkAddDeterministicWithOneWorker(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	vectors := clusteredVectors(300, 8)
+
+	build := func() []byte {
+		index := hnsw.NewHNSW(8, 5, 20, core.Euclidean, "euclidean")
+		index.BuildWorkers = 1
+		if err := index.BulkAdd(vectors); err != nil {
+			t.Fatalf("BulkAdd failed: %v", err)
+		}
+		var buf bytes.Buffer
+		if err := index.Save(&buf); err != nil {
+			t.Fatalf("Save failed: %v", err)
+		}
+		return buf.Bytes()
+	}
+
+	if !bytes.Equal(build(), build()) {
+		t.Error("expected identical graphs from two single-worker builds with the same seed")
+	}
+}
+
+func TestHNSWIndex_ParallelBulkAdd(t *testing.T) {
+	dim, n, k := 8, 2000, 10
+	vectors := clusteredVectors(n, dim)
+	index := hnsw.NewHNSW(dim, 8, 64, core.Euclidean, "euclidean")
+	index.BuildWorkers = 4
+	if err := index.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if stats := index.Stats(); stats.Count != n {
+		t.Fatalf("expected count %d after BulkAdd, got %d", n, stats.Count)
+	}
+
+	// Compare against exact neighbors to check that concurrent inserts kept the graph navigable.
+	hits := 0
+	for q := 0; q < 50; q++ {
+		query := vectors[q*37]
+		exact := make([]core.Neighbor, 0, n)
+		for id, vec := range vectors {
+			exact = append(exact, core.Neighbor{ID: id, Distance: core.Euclidean(query, vec)})
+		}
+		sort.Slice(exact, func(i, j int) bool { return exact[i].Distance < exact[j].Distance })
+		want := make(map[int]bool, k)
+		for _, nb := range exact[:k] {
+			want[nb.ID] = true
+		}
+		got, err := index.Search(query, k)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		for _, nb := range got {
+			if want[nb.ID] {
+				hits++
+			}
+		}
+	}
+	if recall := float64(hits) / float64(50*k); recall < 0.9 {
+		t.Errorf("expected recall@%d of at least 0.9 after a parallel build, got %.3f", k, recall)
+	}
+}
+
+func TestHNSWIndex_AddStream(t *testing.T) {
+	dim, n, size := 8, 2000, 128
+	vectors := clusteredVectors(n, dim)
+	index := hnsw.NewHNSW(dim, 8, 64, core.Euclidean, "euclidean")
+
+	// The producer fills two reusable buffers, so it never holds more than two batches and
+	// waits until the index releases one.
+	free := make(chan []float32, 2)
+	for i := 0; i < cap(free); i++ {
+		free <- make([]float32, size*dim)
+	}
+	batches := make(chan core.Batch)
+	go func() {
+		defer close(batches)
+		for start := 0; start < n; start += size {
+			buf := <-free
+			b := core.Batch{Release: func() { free <- buf }}
+			for id := start; id < min(start+size, n); id++ {
+				b.IDs = append(b.IDs, id)
+				copy(buf[len(b.Vectors):], vectors[id])
+				b.Vectors = buf[:len(b.Vectors)+dim]
+			}
+			batches <- b
+		}
+	}()
+	if err := core.AddStream(index, batches, core.StreamOptions{}); err != nil {
+		t.Fatalf("AddStream failed: %v", err)
+	}
+	if stats := index.Stats(); stats.Count != n {
+		t.Fatalf("expected count %d after AddStream, got %d", n, stats.Count)
+	}
+	if len(free) != cap(free) {
+		t.Errorf("expected every buffer to be released, %d of %d are", len(free), cap(free))
+	}
+	queries := make([][]float32, 0, 50)
+	for q := 0; q < 50; q++ {
+		queries = append(queries, vectors[q*37])
+	}
+	if recall := recallAt10(t, index, vectors, queries, core.SearchOptions{}); recall < 0.9 {
+		t.Errorf("expected recall@10 of at least 0.9 after streaming, got %.3f", recall)
+	}
+
+	// A batch with an existing id fails as a whole.
+	batches = make(chan core.Batch, 1)
+	batches <- core.Batch{IDs: []int{n, 5}, Vectors: make([]float32, 2*dim)}
+	close(batches)
+	if err := index.AddStream(batches, core.StreamOptions{}); err == nil {
+		t.Error("expected an error for an existing id")
+	}
+	if stats := index.Stats(); stats.Count != n {
+		t.Errorf("expected the failed batch to leave %d vectors, got %d", n, stats.Count)
+	}
+}
+
+func TestHNSWIndex_NeighborSelection(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	dim := 8
+	vectors := clusteredVectors(1000, dim)
+	selfRecall := func(configure func(*hnsw.HNSWIndex)) int {
+		idx := hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean")
+		idx.BuildWorkers = 1
+		configure(idx)
+		if err := idx.BulkAdd(vectors); err != nil {
+			t.Fatalf("BulkAdd failed: %v", err)
+		}
+		found := 0
+		for id, vec := range vectors {
+			res, err := idx.Search(vec, 1)
+			if err != nil {
+				t.Fatalf("Search failed: %v", err)
+			}
+			if res[0].ID == id {
+				found++
+			}
+		}
+		return found
+	}
+	// The closest candidates of a node in a dense cluster all lie in that cluster, so the
+	// simple selection leaves the clusters poorly connected; the heuristic keeps links
+	// between them.
+	simple := selfRecall(func(idx *hnsw.HNSWIndex) { idx.NeighborSelection = hnsw.SelectSimple })
+	heuristic := selfRecall(func(idx *hnsw.HNSWIndex) {})
+	if heuristic < simple || heuristic < len(vectors)*99/100 {
+		t.Errorf("heuristic selection found %d of %d nodes, simple selection %d", heuristic, len(vectors), simple)
+	}
+	extended := selfRecall(func(idx *hnsw.HNSWIndex) {
+		idx.KeepPruned = true
+		idx.ExtendCandidates = true
+	})
+	if extended < len(vectors)*99/100 {
+		t.Errorf("heuristic selection with keepPruned and extendCandidates found %d of %d nodes", extended, len(vectors))
+	}
+}
+
+func TestHNSWIndex_SearchBatch(t *testing.T) {
+	idx := hnsw.NewHNSW(6, 5, 10, core.Euclidean, "euclidean")
+
+	vectors := map[int][]float32{
+		1: {1, 2, 3, 4, 5, 6},
+		2: {6, 5, 4, 3, 2, 1},
+		3: {1, 1, 1, 1, 1, 1},
+		4: {2, 2, 2, 2, 2, 2},
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	// Each query is an indexed vector, so it should come back as its own nearest neighbor.
+	ids := []int{1, 2, 3, 4, 2, 1}
+	queries := make([][]float32, len(ids))
+	for i, id := range ids {
+		queries[i] = vectors[id]
+	}
+	results, err := idx.SearchBatch(queries, 1)
+	if err != nil {
+		t.Fatalf("SearchBatch failed: %v", err)
+	}
+	if len(results) != len(queries) {
+		t.Fatalf("expected %d result lists, got %d", len(queries), len(results))
+	}
+	for i, res := range results {
+		if len(res) != 1 || res[0].ID != ids[i] {
+			t.Errorf("query %d: expected neighbor id %d, got %v", i, ids[i], res)
+		}
+	}
+
+	// A query with the wrong dimension fails the whole batch.
+	if _, err := idx.SearchBatch([][]float32{{1, 2, 3}}, 1); err == nil {
+		t.Error("expected error for query dimension mismatch, got none")
+	}
+}
+
+func TestHNSWIndex_SearchWithOptions(t *testing.T) {
+	dim := 8
+	vectors := clusteredVectors(2000, dim)
+	idx := hnsw.NewHNSW(dim, 8, 16, core.Distances["euclidean"], "euclidean")
+	idx.EfConstruction = 100
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	query := vectors[17]
+
+	// A larger per-query ef explores more of the graph than the index default.
+	var narrow, wide core.SearchStats
+	if _, err := idx.SearchWithOptions(query, 10, core.SearchOptions{Stats: &narrow}); err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	neighbors, err := idx.SearchWithOptions(query, 10, core.SearchOptions{Ef: 200, Stats: &wide})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if len(neighbors) != 10 || neighbors[0].ID != 17 {
+		t.Fatalf("expected 10 neighbors starting with the query, got %v", neighbors)
+	}
+	if wide.Candidates != 200 || wide.DistanceComputations <= narrow.DistanceComputations {
+		t.Errorf("ef=200 did not widen the search: default %+v, wide %+v", narrow, wide)
+	}
+
+	// A small budget truncates the search but still returns the best candidates found.
+	var stats core.SearchStats
+	neighbors, err = idx.SearchWithOptions(query, 10, core.SearchOptions{
+		Ef:                      200,
+		MaxDistanceComputations: 50,
+		Stats:                   &stats,
+	})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if !stats.Truncated || stats.DistanceComputations > 50+2*8 {
+		t.Errorf("expected a truncated search of about 50 computations, got %+v", stats)
+	}
+	if len(neighbors) == 0 {
+		t.Error("truncated search returned no neighbors")
+	}
+}
+
+func TestHNSWIndex_Instrumentation(t *testing.T) {
+	dim := 8
+	vectors := clusteredVectors(1000, dim)
+	idx := hnsw.NewHNSW(dim, 8, 16, core.Distances["euclidean"], "euclidean")
+	var sink core.MapSink
+	idx.Sink = &sink
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	var last core.SearchStats
+	for i := 0; i < 10; i++ {
+		if _, err := idx.SearchWithOptions(vectors[i], 10, core.SearchOptions{Stats: &last}); err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+	}
+	if last.NodesVisited == 0 || last.HeapPushes == 0 {
+		t.Errorf("expected visited nodes and heap pushes, got %+v", last)
+	}
+
+	stats := idx.Stats()
+	if stats.Searches != 10 || stats.DistanceComputations < 10*int64(last.Candidates) || stats.Builds != 1 {
+		t.Errorf("unexpected totals %+v", stats)
+	}
+	if stats.Memory.Vectors != int64(1000*dim*4) || stats.Memory.Graph == 0 || stats.Memory.IDs == 0 {
+		t.Errorf("unexpected memory %+v", stats.Memory)
+	}
+	if n := sink.Counter("hnsw_searches"); n != 10 {
+		t.Errorf("expected 10 searches in the sink, got %d", n)
+	}
+	if h := sink.Histogram("hnsw_search_nodes_visited"); h.Count != 10 || h.Sum != float64(stats.NodesVisited) {
+		t.Errorf("node histogram %+v does not match the total %d", h, stats.NodesVisited)
+	}
+	if h := sink.Histogram("hnsw_bulk_add_seconds"); h.Count != 1 {
+		t.Errorf("expected one bulk add in the sink, got %+v", h)
+	}
+}
+
+// filteredNeighbors returns the ids of the k vectors in filter closest to query.
+func filteredNeighbors(vectors map[int][]float32, query []float32, k int, filter core.Filter) []int {
+	var ids []int
+	filter.ForEach(func(id int) bool {
+		if _, ok := vectors[id]; ok {
+			ids = append(ids, id)
+		}
+		return true
+	})
+	sort.Slice(ids, func(i, j int) bool {
+		return core.SquaredL2(query, vectors[ids[i]]) < core.SquaredL2(query, vectors[ids[j]])
+	})
+	return ids[:min(k, len(ids))]
+}
+
+func TestHNSWIndex_FilteredSearch(t *testing.T) {
+	dim := 8
+	vectors := clusteredVectors(2000, dim)
+	idx := hnsw.NewHNSW(dim, 8, 50, core.Distances["euclidean"], "euclidean")
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	third := core.NewBitset()
+	for id := 0; id < 2000; id += 3 {
+		third.Add(id)
+	}
+	few := core.NewIDSet(5, 77, 300, 301, 999, 1500, 1998, 4000)
+
+	for _, tc := range []struct {
+		name       string
+		filter     core.Filter
+		ratio      float64
+		bruteForce bool
+	}{
+		{"graph", third, 0, false},
+		{"brute force", few, 0, true},
+		{"graph with a selective filter", few, -1, false},
+	} {
+		idx.BruteForceRatio = tc.ratio
+		found, total := 0, 0
+		for q := 0; q < 20; q++ {
+			query := vectors[q*97]
+			var stats core.SearchStats
+			neighbors, err := idx.SearchWithOptions(query, 5, core.SearchOptions{Filter: tc.filter, Stats: &stats})
+			if err != nil {
+				t.Fatalf("%s: SearchWithOptions failed: %v", tc.name, err)
+			}
+			if stats.BruteForce != tc.bruteForce {
+				t.Errorf("%s: expected BruteForce=%v, got %+v", tc.name, tc.bruteForce, stats)
+			}
+			want := filteredNeighbors(vectors, query, 5, tc.filter)
+			if len(neighbors) != len(want) {
+				t.Fatalf("%s: expected %d neighbors, got %v", tc.name, len(want), neighbors)
+			}
+			exact := map[int]bool{}
+			for _, id := range want {
+				exact[id] = true
+			}
+			for _, n := range neighbors {
+				if !tc.filter.Contains(n.ID) {
+					t.Fatalf("%s: neighbor %d is not in the filter", tc.name, n.ID)
+				}
+				if exact[n.ID] {
+					found++
+				}
+			}
+			total += len(want)
+		}
+		if recall := float64(found) / float64(total); recall < 0.9 || tc.bruteForce && recall != 1 {
+			t.Errorf("%s: recall %.2f is too low", tc.name, recall)
+		}
+	}
+}
+
+func TestHNSWIndex_LoadFile(t *testing.T) {
+	dim := 8
+	vectors := clusteredVectors(500, dim)
+	index := hnsw.NewHNSW(dim, 8, 32, core.Distances["euclidean"], "euclidean")
+	if err := index.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	var saved bytes.Buffer
+	if err := index.Save(&saved); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	path := filepath.Join(t.TempDir(), "index.hann")
+	if err := os.WriteFile(path, saved.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+
+	loaded := hnsw.NewHNSW(dim, 8, 32, core.Distances["euclidean"], "euclidean")
+	if err := loaded.LoadFile(path); err != nil {
+		t.Fatalf("LoadFile failed: %v", err)
+	}
+	for _, id := range []int{0, 17, 499} {
+		want, err := index.Search(vectors[id], 5)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		got, err := loaded.Search(vectors[id], 5)
+		if err != nil {
+			t.Fatalf("Search on mapped index failed: %v", err)
+		}
+		for i := range want {
+			if got[i] != want[i] {
+				t.Fatalf("query %d: expected %v from mapped index, got %v", id, want, got)
+			}
+		}
+	}
+
+	// The mapped index can still be modified, without touching the file.
+	if err := loaded.Add(1000, vectors[3]); err != nil {
+		t.Fatalf("Add failed: %v", err)
+	}
+	if err := loaded.Delete(17); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	if count := loaded.Stats().Count; count != 500 {
+		t.Errorf("expected 500 vectors after Add and Delete, got %d", count)
+	}
+	data, err := os.ReadFile(path)
+	if err != nil || !bytes.Equal(data, saved.Bytes()) {
+		t.Error("modifying the mapped index changed its file")
+	}
+
+	// Indexes saved in the earlier gob format still load.
+	var legacy bytes.Buffer
+	if err := gob.NewEncoder(&legacy).Encode(index); err != nil {
+		t.Fatalf("gob encoding failed: %v", err)
+	}
+	fromGob := hnsw.NewHNSW(dim, 8, 32, core.Distances["euclidean"], "euclidean")
+	if err := fromGob.Load(&legacy); err != nil {
+		t.Fatalf("Load of gob data failed: %v", err)
+	}
+	if count := fromGob.Stats().Count; count != 500 {
+		t.Errorf("expected 500 vectors from gob data, got %d", count)
+	}
+}
+
+// baselineNode and baselineIndex mirror the gob encoding of the first HNSW version, which
+// stored every node with the ids of its neighbors.
+type baselineNode struct {
+	ID     int
+	Vector []float32
+	Level  int
+	Links  map[int][]int
+}
+
+type baselineIndex struct {
+	Dimension    int
+	M            int
+	Ef           int
+	Nodes        map[int]baselineNode
+	EntryPoint   int
+	MaxLevel     int
+	DistanceName string
+}
+
+// baselineFile is the index as the first version saved it: a gob-encoded index whose
+// GobEncode encodes a baselineIndex.
+type baselineFile struct{ index baselineIndex }
+
+func (b baselineFile) GobEncode() ([]byte, error) {
+	var buf bytes.Buffer
+	err := gob.NewEncoder(&buf).Encode(b.index)
+	return buf.Bytes(), err
+}
+
+func TestHNSWIndex_LoadBaselineGob(t *testing.T) {
+	dim, m := 8, 6
+	vectors := uniformVectors(300, dim)
+	ids := make([]int, 0, len(vectors))
+	for id := range vectors {
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	nearest := func(id int, among []int, k int) []int {
+		others := make([]int, 0, len(among))
+		for _, o := range among {
+			if o != id {
+				others = append(others, o)
+			}
+		}
+		sort.Slice(others, func(i, j int) bool {
+			return core.SquaredL2(vectors[id], vectors[others[i]]) < core.SquaredL2(vectors[id], vectors[others[j]])
+		})
+		return others[:min(k, len(others))]
+	}
+	// Every tenth node is also on level 1, and the last one is the entry point.
+	var upper []int
+	for _, id := range ids {
+		if id%10 == 9 {
+			upper = append(upper, id)
+		}
+	}
+	legacy := baselineIndex{Dimension: dim, M: m, Ef: 50, Nodes: make(map[int]baselineNode),
+		EntryPoint: 299, MaxLevel: 1, DistanceName: "euclidean"}
+	for _, id := range ids {
+		node := baselineNode{ID: id, Vector: vectors[id], Links: map[int][]int{0: nearest(id, ids, m)}}
+		if id%10 == 9 {
+			node.Level = 1
+			node.Links[1] = nearest(id, upper, m)
+		}
+		legacy.Nodes[id] = node
+	}
+	var file bytes.Buffer
+	if err := gob.NewEncoder(&file).Encode(baselineFile{legacy}); err != nil {
+		t.Fatalf("gob encoding failed: %v", err)
+	}
+
+	loaded := hnsw.NewHNSW(dim, m, 50, core.Distances["euclidean"], "euclidean")
+	if err := loaded.Load(&file); err != nil {
+		t.Fatalf("Load of baseline gob data failed: %v", err)
+	}
+	if count := loaded.Stats().Count; count != len(vectors) {
+		t.Fatalf("expected %d vectors from baseline gob data, got %d", len(vectors), count)
+	}
+	for _, id := range []int{0, 57, 123, 299} {
+		res, err := loaded.Search(vectors[id], 5)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		if len(res) != 5 || res[0].ID != id || res[0].Distance != 0 {
+			t.Errorf("expected id %d first, got %v", id, res)
+		}
+	}
+	// The restored graph can be modified and saved like any other.
+	if err := loaded.Delete(57); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	if err := loaded.Add(1000, vectors[57]); err != nil {
+		t.Fatalf("Add failed: %v", err)
+	}
+	var saved bytes.Buffer
+	if err := loaded.Save(&saved); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	again := hnsw.NewHNSW(dim, m, 50, core.Distances["euclidean"], "euclidean")
+	if err := again.Load(&saved); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	if res, err := again.Search(vectors[57], 1); err != nil || res[0].ID != 1000 {
+		t.Errorf("expected id 1000 at the vector of the deleted id 57, got %v (%v)", res, err)
+	}
+}
+
+func TestHNSWIndex_TombstonesAndRepair(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	dim := 16
+	vectors := uniformVectors(1000, dim)
+	// A sparse graph and a small ef make the search depend on the links the repair keeps.
+	idx := hnsw.NewHNSW(dim, 4, 10, core.Distances["euclidean"], "euclidean")
+	idx.BuildWorkers = 1     // a reproducible graph
+	idx.RepairThreshold = -1 // repair explicitly below
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	// Self-recall before the deletes is the reference for the graph after them.
+	before := 0
+	for id, vec := range vectors {
+		if res, err := idx.Search(vec, 1); err == nil && len(res) == 1 && res[0].ID == id && id%3 != 0 {
+			before++
+		}
+	}
+	// Delete a third of the nodes, which also removes the entry point at some stage.
+	deleted := make(map[int]bool)
+	for id := range vectors {
+		if id%3 == 0 {
+			deleted[id] = true
+		}
+	}
+	for id := range deleted {
+		if err := idx.Delete(id); err != nil {
+			t.Fatalf("Delete failed: %v", err)
+		}
+	}
+	if err := idx.Delete(0); err == nil {
+		t.Error("expected error when deleting a deleted id, got none")
+	}
+
+	check := func(stage string, idx *hnsw.HNSWIndex) {
+		if count := idx.Stats().Count; count != len(vectors)-len(deleted) {
+			t.Fatalf("%s: expected count %d, got %d", stage, len(vectors)-len(deleted), count)
+		}
+		found := 0
+		for id, vec := range vectors {
+			res, err := idx.Search(vec, 10)
+			if err != nil {
+				t.Fatalf("%s: Search failed: %v", stage, err)
+			}
+			if len(res) != 10 {
+				t.Fatalf("%s: expected 10 neighbors, got %v", stage, res)
+			}
+			for _, n := range res {
+				if deleted[n.ID] {
+					t.Fatalf("%s: deleted id %d returned", stage, n.ID)
+				}
+			}
+			if !deleted[id] && res[0].ID == id {
+				found++
+			}
+		}
+		if found < before*90/100 {
+			t.Errorf("%s: %d live nodes found themselves, %d before the deletes", stage, found, before)
+		}
+	}
+	check("tombstones", idx)
+
+	// Tombstones are saved, so a reloaded index skips them too.
+	var buf bytes.Buffer
+	if err := idx.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	loaded := hnsw.NewHNSW(dim, 4, 10, core.Distances["euclidean"], "euclidean")
+	if err := loaded.Load(&buf); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	check("loaded", loaded)
+
+	idx.Repair()
+	check("repaired", idx)
+
+	// A deleted id can be added again, in a slot reclaimed by the repair.
+	if err := idx.Add(0, vectors[0]); err != nil {
+		t.Fatalf("Add of a deleted id failed: %v", err)
+	}
+	delete(deleted, 0)
+	check("re-added", idx)
+}
+
+func TestHNSWIndex_ConcurrentDeletesAndSearches(t *testing.T) {
+	dim := 8
+	vectors := clusteredVectors(1000, dim)
+	idx := hnsw.NewHNSW(dim, 8, 32, core.Distances["euclidean"], "euclidean")
+	idx.RepairThreshold = 0.05 // repair often, so that repairs overlap with the deletes
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	var wg sync.WaitGroup
+	wg.Add(2)
+	go func() {
+		defer wg.Done()
+		for id := 0; id < 600; id++ {
+			if err := idx.Delete(id); err != nil {
+				t.Errorf("Delete failed: %v", err)
+			}
+			// Adds allocate slots that a running repair has not planned for.
+			if id%3 == 0 {
+				if err := idx.Add(1000+id, vectors[id]); err != nil {
+					t.Errorf("Add failed: %v", err)
+				}
+			}
+		}
+	}()
+	go func() {
+		defer wg.Done()
+		for i := 0; i < 300; i++ {
+			if _, err := idx.Search(vectors[999-i], 5); err != nil {
+				t.Errorf("Search failed: %v", err)
+			}
+		}
+	}()
+	wg.Wait()
+	idx.Repair()
+	for i := 600; i < 1000; i += 7 {
+		res, err := idx.Search(vectors[i], 5)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		for _, n := range res {
+			if n.ID < 600 {
+				t.Fatalf("deleted id %d returned", n.ID)
+			}
+		}
+	}
+	if count := idx.Stats().Count; count != 600 {
+		t.Errorf("expected 600 nodes, got %d", count)
+	}
+}
+
+func TestHNSWIndex_SearchesDuringWrites(t *testing.T) {
+	dim := 8
+	vectors := clusteredVectors(2000, dim)
+	initial := make(map[int][]float32)
+	added := make(map[int][]float32)
+	for id, vec := range vectors {
+		if id < 1000 {
+			initial[id] = vec
+		} else {
+			added[id] = vec
+		}
+	}
+	idx := hnsw.NewHNSW(dim, 8, 32, core.Distances["euclidean"], "euclidean")
+	idx.BuildWorkers = 2
+	idx.RepairThreshold = 0.05
+	if err := idx.BulkAdd(initial); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	// A search completes while a writer holds the lock.
+	idx.Mu.Lock()
+	done := make(chan error, 1)
+	go func() {
+		_, err := idx.Search(vectors[3], 5)
+		done <- err
+	}()
+	select {
+	case err := <-done:
+		if err != nil {
+			t.Errorf("Search failed: %v", err)
+		}
+	case <-time.After(10 * time.Second):
+		t.Fatal("search blocked on the write lock")
+	}
+	idx.Mu.Unlock()
+
+	// Searches run throughout bulk adds, updates, deletes and repairs, and a reload.
+	path := filepath.Join(t.TempDir(), "index.hann")
+	var saved bytes.Buffer
+	if err := idx.Save(&saved); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	if err := os.WriteFile(path, saved.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	var stop atomic.Bool
+	var searches atomic.Int64
+	var wg sync.WaitGroup
+	for w := 0; w < 2; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			for i := w; !stop.Load(); i++ {
+				res, err := idx.Search(vectors[i%2000], 5)
+				if err != nil || len(res) == 0 {
+					t.Errorf("Search failed: %v (%d results)", err, len(res))
+					return
+				}
+				searches.Add(1)
+			}
+		}(w)
+	}
+	if err := idx.BulkAdd(added); err != nil {
+		t.Errorf("BulkAdd failed: %v", err)
+	}
+	updates := make(map[int][]float32)
+	for id := 0; id < 1000; id += 3 {
+		updates[id] = vectors[id+1000]
+	}
+	if err := idx.BulkUpdate(updates); err != nil {
+		t.Errorf("BulkUpdate failed: %v", err)
+	}
+	for id := 500; id < 700; id++ {
+		if err := idx.Update(id, vectors[id+1]); err != nil {
+			t.Errorf("Update failed: %v", err)
+		}
+	}
+	var deleted []int
+	for id := 1; id < 2000; id += 4 {
+		deleted = append(deleted, id)
+	}
+	if err := idx.BulkDelete(deleted); err != nil {
+		t.Errorf("BulkDelete failed: %v", err)
+	}
+	idx.Repair()
+	if err := idx.LoadFile(path); err != nil {
+		t.Errorf("LoadFile failed: %v", err)
+	}
+	if err := idx.BulkAdd(added); err != nil {
+		t.Errorf("BulkAdd after LoadFile failed: %v", err)
+	}
+	stop.Store(true)
+	wg.Wait()
+	if searches.Load() == 0 {
+		t.Error("no search ran during the writes")
+	}
+	if count := idx.Stats().Count; count != 2000 {
+		t.Errorf("expected 2000 nodes, got %d", count)
+	}
+	res, err := idx.Search(vectors[1500], 1)
+	if err != nil || res[0].ID != 1500 {
+		t.Errorf("expected id 1500 first, got %v (%v)", res, err)
+	}
+}
+
+// exactNeighbors returns the ids of the k vectors closest to query by Euclidean distance.
+func exactNeighbors(vectors map[int][]float32, query []float32, k int) []int {
+	ids := make([]int, 0, len(vectors))
+	for id := range vectors {
+		ids = append(ids, id)
+	}
+	sort.Slice(ids, func(i, j int) bool {
+		di, dj := core.SquaredEuclidean(query, vectors[ids[i]]), core.SquaredEuclidean(query, vectors[ids[j]])
+		if di == dj {
+			return ids[i] < ids[j]
+		}
+		return di < dj
+	})
+	return ids[:k]
+}
+
+// recallAt10 returns the share of the exact 10 nearest neighbors of the queries that the
+// index finds with the given options.
+func recallAt10(t *testing.T, index *hnsw.HNSWIndex, vectors map[int][]float32, queries [][]float32, opts core.SearchOptions) float64 {
+	t.Helper()
+	found := 0
+	for _, q := range queries {
+		res, err := index.SearchWithOptions(q, 10, opts)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		want := make(map[int]bool)
+		for _, id := range exactNeighbors(vectors, q, 10) {
+			want[id] = true
+		}
+		for _, n := range res {
+			if want[n.ID] {
+				found++
+			}
+		}
+	}
+	return float64(found) / float64(10*len(queries))
+}
+
+func TestHNSWIndex_Quantization(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	dim := 64
+	vectors := uniformVectors(1000, dim)
+	// Midpoints between pairs of vectors are not in the index.
+	queries := make([][]float32, 50)
+	for i := range queries {
+		q := make([]float32, dim)
+		for j := range q {
+			q[j] = (vectors[2*i][j] + vectors[2*i+1][j]) / 2
+		}
+		queries[i] = q
+	}
+	baseline := hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean")
+	if err := baseline.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	exact := recallAt10(t, baseline, vectors, queries, core.SearchOptions{})
+
+	for _, q := range []hnsw.Quantization{hnsw.QuantizeInt8, hnsw.QuantizeFloat16} {
+		index := hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean")
+		if err := index.SetQuantization(q); err != nil {
+			t.Fatalf("SetQuantization(%d) failed: %v", q, err)
+		}
+		if err := index.BulkAdd(vectors); err != nil {
+			t.Fatalf("BulkAdd failed: %v", err)
+		}
+		if got := recallAt10(t, index, vectors, queries, core.SearchOptions{}); got < exact-0.05 {
+			t.Errorf("quantization %d: recall %.3f, want close to the float32 recall %.3f", q, got, exact)
+		}
+		// The float32 vectors were dropped, so there is nothing to re-rank with.
+		if _, err := index.SearchWithOptions(queries[0], 10, core.SearchOptions{RerankFactor: 2}); err == nil {
+			t.Errorf("quantization %d: expected re-ranking without float32 vectors to fail", q)
+		}
+		if err := index.SetQuantization(hnsw.QuantizeNone); err == nil {
+			t.Errorf("quantization %d: expected leaving quantization without float32 vectors to fail", q)
+		}
+	}
+
+	// Quantizing a built index with RetainVectors keeps the float32 vectors for re-ranking,
+	// which returns exact distances.
+	index := hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean")
+	if err := index.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	index.RetainVectors = true
+	if err := index.SetQuantization(hnsw.QuantizeInt8); err != nil {
+		t.Fatalf("SetQuantization failed: %v", err)
+	}
+	index.RerankFactor = 4
+	var stats core.SearchStats
+	res, err := index.SearchWithOptions(queries[0], 10, core.SearchOptions{Stats: &stats})
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if stats.Reranked != 40 {
+		t.Errorf("expected 40 re-ranked candidates, got %+v", stats)
+	}
+	for _, n := range res {
+		if want := core.Euclidean(queries[0], vectors[n.ID]); math.Abs(n.Distance-want) > 1e-5 {
+			t.Fatalf("re-ranked distance of %d is %v, want %v", n.ID, n.Distance, want)
+		}
+	}
+	if got := recallAt10(t, index, vectors, queries, core.SearchOptions{}); got < exact-0.02 {
+		t.Errorf("re-ranked recall %.3f, want close to the float32 recall %.3f", got, exact)
+	}
+
+	// Updates and deletes re-encode and drop nodes as usual.
+	if err := index.Update(3, queries[1]); err != nil {
+		t.Fatalf("Update failed: %v", err)
+	}
+	if err := index.Delete(4); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	res, err = index.Search(queries[1], 1)
+	if err != nil || len(res) != 1 || res[0].ID != 3 || res[0].Distance > 1e-5 {
+		t.Errorf("expected the updated node 3 at distance 0, got %v (%v)", res, err)
+	}
+
+	// Quantization is saved in both formats.
+	var buf bytes.Buffer
+	if err := index.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	path := filepath.Join(t.TempDir(), "index.hann")
+	if err := os.WriteFile(path, buf.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+	var legacy bytes.Buffer
+	if err := gob.NewEncoder(&legacy).Encode(index); err != nil {
+		t.Fatalf("gob encoding failed: %v", err)
+	}
+	loaded := hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean")
+	if err := loaded.Load(&buf); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	mapped := hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean")
+	if err := mapped.LoadFile(path); err != nil {
+		t.Fatalf("LoadFile failed: %v", err)
+	}
+	fromGob := hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean")
+	if err := fromGob.Load(&legacy); err != nil {
+		t.Fatalf("Load of gob data failed: %v", err)
+	}
+	want, _ := index.Search(queries[2], 10)
+	for name, other := range map[string]*hnsw.HNSWIndex{"loaded": loaded, "mapped": mapped, "gob": fromGob} {
+		if other.Quantization() != hnsw.QuantizeInt8 || other.RerankFactor != 4 {
+			t.Errorf("%s index lost its quantization settings", name)
+		}
+		got, err := other.Search(queries[2], 10)
+		if err != nil {
+			t.Fatalf("%s: Search failed: %v", name, err)
+		}
+		for i := range want {
+			if got[i] != want[i] {
+				t.Fatalf("%s: expected %v, got %v", name, want, got)
+			}
+		}
+	}
+}
+
+func TestHNSWIndex_QuantizationWithVectorStore(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	dim := 32
+	vectors := uniformVectors(500, dim)
+	store, err := core.OpenFileVectorStore(filepath.Join(t.TempDir(), "vectors.bin"), dim)
+	if err != nil {
+		t.Fatalf("OpenFileVectorStore failed: %v", err)
+	}
+	defer store.Close()
+
+	// With the cosine distance, re-ranking normalizes the vectors read from the store.
+	index := hnsw.NewHNSW(dim, 8, 64, core.Distances["cosine"], "cosine")
+	if err := index.SetVectorStore(store); err != nil {
+		t.Fatalf("SetVectorStore failed: %v", err)
+	}
+	if err := index.SetQuantization(hnsw.QuantizeFloat16); err != nil {
+		t.Fatalf("SetQuantization failed: %v", err)
+	}
+	if err := index.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := index.Delete(7); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	if store.Len() != 499 {
+		t.Errorf("expected 499 vectors in the store, got %d", store.Len())
+	}
+	res, err := index.SearchWithOptions(vectors[8], 5, core.SearchOptions{RerankFactor: 3})
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if res[0].ID != 8 {
+		t.Errorf("expected the query itself first, got %v", res)
+	}
+	for _, n := range res {
+		if want := core.Cosine(vectors[8], vectors[n.ID]); math.Abs(n.Distance-want) > 1e-5 {
+			t.Fatalf("re-ranked distance of %d is %v, want %v", n.ID, n.Distance, want)
+		}
+	}
+
+	// Metrics that do not expand into dot products cannot be quantized.
+	manhattan := hnsw.NewHNSW(dim, 8, 64, core.Distances["manhattan"], "manhattan")
+	if err := manhattan.SetQuantization(hnsw.QuantizeInt8); err == nil {
+		t.Error("expected quantization of the manhattan distance to fail")
+	}
+}
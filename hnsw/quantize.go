@@ -0,0 +1,276 @@
+package hnsw
+
+import (
+	"errors"
+	"fmt"
+	"math"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// Quantization is the encoding of the vectors that graph searches compare queries with.
+type Quantization int
+
+const (
+	// QuantizeNone compares queries with the float32 vectors. This is the default.
+	QuantizeNone Quantization = iota
+	// QuantizeInt8 stores every component in 8 bits, on a grid spanning the range of the
+	// components of its vector (a quarter of the float32 size).
+	QuantizeInt8
+	// QuantizeFloat16 stores every component as a half-precision float (half the float32
+	// size, with about three significant digits).
+	QuantizeFloat16
+)
+
+// codeParams is the number of float32 parameters stored per slot with its codes: the
+// offset and the scale of the int8 grid, and the squared norm of the encoded vector.
+const codeParams = 3
+
+// codeScoring is the form into which a metric kernel expands on codes.
+type codeScoring int
+
+const (
+	scoreL2     codeScoring = iota // squared Euclidean distance
+	scoreCosine                    // 1 - dot product of unit vectors
+	scoreDot                       // negated dot product
+)
+
+// codeScorings maps the metrics that can be computed on codes to their form.
+var codeScorings = map[string]codeScoring{
+	"euclidean":         scoreL2,
+	"squared_euclidean": scoreL2,
+	"cosine":            scoreCosine,
+	"inner_product":     scoreDot,
+}
+
+// probe is a vector that stored nodes are compared with: a query, or the vector of a node
+// being linked or repaired. Under quantization it carries the sums the code kernels need.
+type probe struct {
+	vec  []float32 // the vector, in the form the metric kernel expects
+	sum  float32   // sum of the components, which the offset of int8 codes is multiplied with
+	norm float32   // squared L2 norm, around which Euclidean distances to codes expand
+	buf  []float32 // storage for a normalized or decoded copy of the vector
+}
+
+// setProbe makes vec, which is in the form the metric kernel expects, the vector of p.
+func (g *graph) setProbe(p *probe, vec []float32) {
+	p.vec = vec
+	if g.quant == QuantizeNone {
+		return
+	}
+	var sum float32
+	for _, x := range vec {
+		sum += x
+	}
+	p.sum, p.norm = sum, core.Dot(vec, vec)
+}
+
+// nodeProbe makes the vector of the node in slot s the vector of p: the float32 vector if
+// it is kept, and the decoded codes otherwise.
+func (g *graph) nodeProbe(p *probe, s uint32) {
+	if g.floats {
+		g.setProbe(p, g.vector(s))
+		return
+	}
+	if cap(p.buf) < g.dim {
+		p.buf = make([]float32, g.dim)
+	}
+	g.setProbe(p, g.decode(s, p.buf[:g.dim]))
+}
+
+// distance returns the metric kernel value between p and the node in slot s. Under
+// quantization it is computed on the codes of s: with x = offset + scale*c the encoded
+// vector, p·x = offset*Σp + scale*(p·c), and |p-x|² = |p|² - 2p·x + |x|².
+func (g *graph) distance(p *probe, s uint32) float64 {
+	if g.quant == QuantizeNone {
+		return g.metric.Kernel(p.vec, g.vector(s))
+	}
+	off := int(s) * g.dim
+	prm := g.params[int(s)*codeParams : int(s)*codeParams+codeParams]
+	var dot float32
+	if g.quant == QuantizeInt8 {
+		dot = prm[0]*p.sum + prm[1]*core.DotUint8(p.vec, g.codes8[off:off+g.dim])
+	} else {
+		dot = core.DotFloat16(p.vec, g.codes16[off:off+g.dim])
+	}
+	switch g.scoring {
+	case scoreCosine:
+		return 1 - float64(dot)
+	case scoreDot:
+		return -float64(dot)
+	}
+	return math.Max(0, float64(p.norm)-2*float64(dot)+float64(prm[2]))
+}
+
+// encode writes the codes and parameters of vector, which is in the form the metric kernel
+// expects, into slot s.
+func (g *graph) encode(s uint32, vector []float32) {
+	off := int(s) * g.dim
+	prm := g.params[int(s)*codeParams : int(s)*codeParams+codeParams]
+	var norm float64
+	switch g.quant {
+	case QuantizeInt8:
+		codes := g.codes8[off : off+g.dim]
+		prm[0], prm[1] = core.EncodeInt8(codes, vector)
+		for _, c := range codes {
+			x := float64(prm[0] + prm[1]*float32(c))
+			norm += x * x
+		}
+	case QuantizeFloat16:
+		codes := g.codes16[off : off+g.dim]
+		core.EncodeFloat16(codes, vector)
+		prm[0], prm[1] = 0, 1
+		for _, c := range codes {
+			x := float64(core.Float32FromFloat16(c))
+			norm += x * x
+		}
+	}
+	prm[2] = float32(norm)
+}
+
+// decode writes the vector encoded in slot s into dst and returns dst.
+func (g *graph) decode(s uint32, dst []float32) []float32 {
+	off := int(s) * g.dim
+	if g.quant == QuantizeInt8 {
+		prm := g.params[int(s)*codeParams:]
+		core.DecodeInt8(dst, g.codes8[off:off+g.dim], prm[0], prm[1])
+	} else {
+		core.DecodeFloat16(dst, g.codes16[off:off+g.dim])
+	}
+	return dst
+}
+
+// validCodes reports whether the code arenas and parameters of a decoded index match the
+// encoding q, for n vector components and m parameters.
+func validCodes(q Quantization, n int, codes8 []uint8, codes16 []uint16, m int, params []float32) bool {
+	switch q {
+	case QuantizeNone:
+		return len(codes8) == 0 && len(codes16) == 0 && len(params) == 0
+	case QuantizeInt8:
+		return len(codes8) == n && len(codes16) == 0 && len(params) == m
+	case QuantizeFloat16:
+		return len(codes8) == 0 && len(codes16) == n && len(params) == m
+	}
+	return false
+}
+
+// SetQuantization changes the encoding of the vectors that searches traverse the graph
+// on. The vectors of the index are encoded at once, and those added later as they are
+// inserted. Under quantization the float32 vectors are dropped, which is what saves the
+// memory, unless RetainVectors is set (it is read here); they are then only used to link
+// nodes and to re-rank results (see RerankFactor). Going back to QuantizeNone, or to
+// another encoding, needs the float32 vectors. Quantization supports the euclidean,
+// squared_euclidean, cosine and inner_product metrics.
+func (h *HNSWIndex) SetQuantization(q Quantization) error {
+	h.Mu.Lock()
+	defer h.Mu.Unlock()
+	if q < QuantizeNone || q > QuantizeFloat16 {
+		return fmt.Errorf("unknown quantization %d", q)
+	}
+	scoring, ok := codeScorings[h.g.metric.Name]
+	if q != QuantizeNone && !ok {
+		return fmt.Errorf("quantization does not support the %q distance", h.g.metric.Name)
+	}
+	if !h.g.floats && h.g.numSlots() > 0 {
+		if q == h.g.quant {
+			return nil
+		}
+		return errors.New("the float32 vectors were dropped by quantization; they are needed to change it")
+	}
+	h.g.scoring = scoring
+	h.g.setQuantization(q, q == QuantizeNone || h.RetainVectors)
+	h.cacheDistances()
+	h.version++
+	h.publish()
+	return nil
+}
+
+// setQuantization re-encodes every slot with q from the float32 arena, which the caller
+// has checked is kept, and keeps that arena only if floats is set. The codes are written to
+// new arenas, so searches of the published view keep reading the previous ones.
+func (g *graph) setQuantization(q Quantization, floats bool) {
+	n := g.numSlots()
+	g.quant = q
+	g.codes8, g.codes16, g.params = nil, nil, nil
+	switch q {
+	case QuantizeInt8:
+		g.codes8 = make([]uint8, n*g.dim)
+	case QuantizeFloat16:
+		g.codes16 = make([]uint16, n*g.dim)
+	}
+	if q != QuantizeNone {
+		g.params = make([]float32, n*codeParams)
+		core.ParallelRange(n, 1024, func(start, end int) {
+			for s := start; s < end; s++ {
+				if g.live(uint32(s)) {
+					g.encode(uint32(s), g.vector(uint32(s)))
+				}
+			}
+		})
+	}
+	if !floats {
+		g.vectors = nil
+	} else if !g.floats {
+		g.vectors = make([]float32, n*g.dim)
+	}
+	g.floats = floats
+}
+
+// Quantization returns the encoding of the vectors that searches traverse the graph on.
+func (h *HNSWIndex) Quantization() Quantization {
+	h.Mu.RLock()
+	defer h.Mu.RUnlock()
+	return h.g.quant
+}
+
+// SetVectorStore attaches an external store (e.g. a core.FileVectorStore) that receives the
+// float32 vector of every node and serves them for re-ranking when quantization has dropped
+// them from memory. Vectors still held in memory are copied into the store; otherwise the
+// store is expected to hold them already (e.g. a core.MappedVectorStore over a store
+// written earlier). Passing nil detaches the current store. The store is not saved with
+// the index.
+func (h *HNSWIndex) SetVectorStore(store core.VectorStore) error {
+	h.Mu.Lock()
+	defer h.Mu.Unlock()
+	if store != nil && h.g.floats {
+		for id, s := range h.g.idToSlot {
+			if err := store.Put(id, h.g.vector(s)); err != nil {
+				return err
+			}
+		}
+	}
+	h.store = store
+	h.publish()
+	return nil
+}
+
+// rerankCandidates replaces the distances of cands, the candidates of a search on codes, with exact
+// distances to query computed on the float32 vectors, and sorts them again. The vectors
+// come from memory (RetainVectors) or from store, the vector store of the searched view.
+func rerankCandidates(ctx *searchContext, store core.VectorStore, query []float32, cands []candidate) error {
+	g := ctx.g
+	if cap(ctx.exact) < g.dim {
+		ctx.exact = make([]float32, g.dim)
+	}
+	for i := range cands {
+		var vec []float32
+		if g.floats {
+			vec = g.vector(cands[i].slot)
+		} else {
+			v, err := store.Get(g.ids[cands[i].slot], ctx.exact[:g.dim])
+			if err != nil {
+				return err
+			}
+			// The store holds the vectors as they were added, and may return its own memory.
+			if g.metric.Normalize {
+				ctx.exact = append(ctx.exact[:0], v...)
+				core.NormalizeInPlace(ctx.exact)
+				v = ctx.exact
+			}
+			vec = v
+		}
+		cands[i].dist = g.metric.Kernel(query, vec)
+	}
+	sortCandidates(cands)
+	return nil
+}
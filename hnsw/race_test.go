@@ -0,0 +1,6 @@
+//go:build race
+
+package hnsw_test
+
+// raceEnabled reports whether the race detector is on, which makes sync.Pool drop items.
+const raceEnabled = true
@@ -0,0 +1,272 @@
+package hnsw
+
+import (
+	"sync"
+	"time"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// defaultRepairThreshold is the share of tombstones that starts a background repair when
+// RepairThreshold is zero.
+const defaultRepairThreshold = 0.1
+
+// indexSlots rebuilds the id table, the free list and the tombstone count from the slot
+// levels and tombstone flags of a decoded graph. Free slots are flagged as deleted, which
+// files written before searches read published views did not do.
+func (h *HNSWIndex) indexSlots() {
+	h.g.tombstones = 0
+	for s, lvl := range h.g.levels {
+		slot := uint32(s)
+		switch {
+		case lvl == freeLevel:
+			h.g.free = append(h.g.free, slot)
+			h.g.setDeleted(slot, true)
+		case h.g.isDeleted(slot):
+			h.g.tombstones++
+		default:
+			h.g.idToSlot[h.g.ids[s]] = slot
+		}
+	}
+}
+
+// maybeRepair starts a background repair if the share of tombstones among the linked
+// nodes has crossed RepairThreshold. The caller holds Mu exclusively.
+func (h *HNSWIndex) maybeRepair() {
+	threshold := h.RepairThreshold
+	if threshold == 0 {
+		threshold = defaultRepairThreshold
+	}
+	if h.repairing || threshold < 0 || h.g.tombstones == 0 ||
+		float64(h.g.tombstones) <= threshold*float64(h.g.tombstones+h.g.size()) {
+		return
+	}
+	h.repairing = true
+	go h.Repair()
+}
+
+// linkPlan is a neighbor list rewritten by a repair.
+type linkPlan struct {
+	slot  uint32      // node whose list is rewritten
+	level int         // level of the list
+	old   []uint32    // the list when the plan was made
+	nbrs  []candidate // the list that replaces it, free of tombstones
+}
+
+// Repair reclaims the slots of deleted nodes. Every neighbor list that links to a
+// tombstone is rewritten: the links to tombstones are replaced by links to neighbors of
+// the tombstones, picked with the neighbor selection of the index, which reconnects the
+// nodes that deletions would otherwise orphan.
+// The new lists are computed under the read lock, and installed under a short write lock.
+// The slots of the tombstones are released once the searches that may still reach them
+// have finished (see retire).
+// Repair runs in the background once RepairThreshold is crossed; calling it directly
+// repairs the graph synchronously.
+func (h *HNSWIndex) Repair() {
+	h.repairMu.Lock()
+	defer h.repairMu.Unlock()
+	start := time.Now()
+
+	h.Mu.RLock()
+	dead := make([]bool, h.g.numSlots())
+	for _, r := range h.retiring {
+		dead[r.slot] = true // already unlinked
+	}
+	var doomed []uint32
+	for s, lvl := range h.g.levels {
+		if lvl != freeLevel && !dead[s] && h.g.isDeleted(uint32(s)) {
+			doomed = append(doomed, uint32(s))
+		}
+	}
+	for _, s := range doomed {
+		dead[s] = true
+	}
+	var plans []linkPlan
+	if len(doomed) > 0 {
+		plans = h.planRepairs(func(s uint32) bool { return dead[s] }, nil)
+	}
+	version := h.version
+	h.Mu.RUnlock()
+
+	h.Mu.Lock()
+	defer h.Mu.Unlock()
+	defer h.publish()
+	h.repairing = false
+	if len(doomed) == 0 || h.version != version {
+		return
+	}
+	// Slots allocated since the plan are live.
+	dead = append(dead, make([]bool, h.g.numSlots()-len(dead))...)
+	// New links only ever point to live nodes, so a list that no longer matches its plan
+	// was rewritten by an insert since; it only needs its links to tombstones dropped.
+	for _, p := range plans {
+		cur := h.g.neighbors(p.slot, p.level)
+		if equalSlots(cur, p.old) {
+			h.setNeighbors(p.slot, p.level, p.nbrs)
+			continue
+		}
+		var kept []candidate
+		dists := h.g.neighborDists(p.slot, p.level)
+		for i, nb := range cur {
+			if !dead[nb] {
+				kept = append(kept, candidate{nb, float64(dists[i])})
+			}
+		}
+		h.setNeighbors(p.slot, p.level, kept)
+	}
+	for _, s := range doomed {
+		h.clearLinks(s)
+		h.retire(s)
+	}
+	h.g.tombstones -= len(doomed)
+	if h.entryPoint != noSlot && dead[h.entryPoint] {
+		h.resetEntryPoint(nil)
+	}
+	h.counters.RecordBuild(h.Sink, "hnsw_repair", time.Since(start))
+}
+
+// repairNeighbors rewrites the neighbor lists of the former neighbors of the tombstones
+// in old, so that they link to live nodes again. This is the local counterpart of Repair:
+// the tombstones keep their slots, which the next Repair reclaims, but the nodes around
+// them no longer route searches through them. The caller holds Mu exclusively.
+func (h *HNSWIndex) repairNeighbors(old []uint32) {
+	seen := make(map[uint32]struct{})
+	var slots []uint32
+	for _, s := range old {
+		for L := h.g.level(s); L >= 0; L-- {
+			for _, nb := range h.g.neighbors(s, L) {
+				if _, ok := seen[nb]; !ok && !h.g.isDeleted(nb) {
+					seen[nb] = struct{}{}
+					slots = append(slots, nb)
+				}
+			}
+		}
+	}
+	for _, p := range h.planRepairs(h.g.isDeleted, slots) {
+		h.setNeighbors(p.slot, p.level, p.nbrs)
+	}
+}
+
+// planRepairs computes the new neighbor lists of the nodes that link to a slot for which
+// dead reports true. The nodes in slots are checked, or every node if slots is nil; they
+// are scanned in chunks on the shared worker pool. The caller holds Mu.
+func (h *HNSWIndex) planRepairs(dead func(uint32) bool, slots []uint32) []linkPlan {
+	n := len(slots)
+	if slots == nil {
+		n = h.g.numSlots()
+	}
+	var mu sync.Mutex
+	var plans []linkPlan
+	core.ParallelRange(n, 1024, func(start, end int) {
+		ctx := getSearchContext(&h.g)
+		defer putSearchContext(ctx)
+		var local []linkPlan
+		for i := start; i < end; i++ {
+			slot := uint32(i)
+			if slots != nil {
+				slot = slots[i]
+			}
+			if !h.g.live(slot) || dead(slot) {
+				continue
+			}
+			for L := h.g.level(slot); L >= 0; L-- {
+				nbrs := h.g.neighbors(slot, L)
+				if !linksTo(nbrs, dead) {
+					continue
+				}
+				// The live neighbors are kept, which preserves the long links that keep the
+				// graph navigable. The candidates to replace the links to tombstones are the
+				// tombstones' own live neighbors: the heuristic selection picks among them and
+				// the kept neighbors alike, while the simple one, which would only pick the
+				// closest, first links each tombstone's closest live neighbor, its stand-in.
+				p := linkPlan{slot: slot, level: L, old: append([]uint32(nil), nbrs...)}
+				dists := h.g.neighborDists(slot, L)
+				for k, nb := range nbrs {
+					if !dead(nb) {
+						p.nbrs = append(p.nbrs, candidate{nb, float64(dists[k])})
+					}
+				}
+				q := &ctx.node
+				h.g.nodeProbe(q, slot)
+				cands := ctx.scratch[:0]
+				for _, nb := range nbrs {
+					if !dead(nb) || h.g.level(nb) < L {
+						continue
+					}
+					if h.NeighborSelection == SelectSimple {
+						if sub := h.standIn(ctx, nb, slot, L, dead, p.nbrs); sub != noSlot {
+							p.nbrs = append(p.nbrs, candidate{sub, h.g.distance(q, sub)})
+						}
+					}
+					for _, nn := range h.g.neighbors(nb, L) {
+						if nn != slot && !dead(nn) && !containsCandidate(p.nbrs, nn) && !containsCandidate(cands, nn) {
+							cands = append(cands, candidate{nn, h.g.distance(q, nn)})
+						}
+					}
+				}
+				ctx.scratch = cands
+				if h.NeighborSelection == SelectSimple {
+					sortCandidates(cands)
+					p.nbrs = append(p.nbrs, cands[:minInt(len(cands), h.g.capacity(L)-len(p.nbrs))]...)
+				} else {
+					ctx.pool = append(append(ctx.pool[:0], p.nbrs...), cands...)
+					p.nbrs = h.selectNeighbors(ctx, ctx.pool, h.g.capacity(L), nil)
+				}
+				local = append(local, p)
+			}
+		}
+		mu.Lock()
+		plans = append(plans, local...)
+		mu.Unlock()
+	})
+	return plans
+}
+
+// standIn returns the live neighbor of the tombstone d at a level that is closest to d,
+// skipping slot itself and the slots in taken, or noSlot if d has none.
+func (h *HNSWIndex) standIn(ctx *searchContext, d, slot uint32, level int, dead func(uint32) bool, taken []candidate) uint32 {
+	best, bestDist := noSlot, 0.0
+	h.g.nodeProbe(&ctx.other, d)
+	for _, nn := range h.g.neighbors(d, level) {
+		if nn == slot || dead(nn) || containsCandidate(taken, nn) {
+			continue
+		}
+		if dist := h.g.distance(&ctx.other, nn); best == noSlot || dist < bestDist {
+			best, bestDist = nn, dist
+		}
+	}
+	return best
+}
+
+// containsCandidate reports whether s is the slot of one of cands.
+func containsCandidate(cands []candidate, s uint32) bool {
+	for _, c := range cands {
+		if c.slot == s {
+			return true
+		}
+	}
+	return false
+}
+
+// linksTo reports whether dead reports true for any slot of nbrs.
+func linksTo(nbrs []uint32, dead func(uint32) bool) bool {
+	for _, nb := range nbrs {
+		if dead(nb) {
+			return true
+		}
+	}
+	return false
+}
+
+// equalSlots reports whether two neighbor lists are identical.
+func equalSlots(a, b []uint32) bool {
+	if len(a) != len(b) {
+		return false
+	}
+	for i := range a {
+		if a[i] != b[i] {
+			return false
+		}
+	}
+	return true
+}
@@ -0,0 +1,162 @@
+package hnsw
+
+import (
+	"sync"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// candidateQueue is a binary heap of candidates.
+// It replaces container/heap so that pushes and pops do not box candidates in interfaces.
+// When max is set the farthest candidate sits on top, otherwise the closest one does.
+type candidateQueue struct {
+	items  []candidate
+	max    bool
+	pushes int // pushes since the context was taken from the pool
+}
+
+// before reports whether a should sit above b in the heap.
+func (q *candidateQueue) before(a, b candidate) bool {
+	if q.max {
+		return b.less(a)
+	}
+	return a.less(b)
+}
+
+// Len returns the number of queued candidates.
+func (q *candidateQueue) Len() int { return len(q.items) }
+
+// Top returns the candidate on top of the heap. The queue must not be empty.
+func (q *candidateQueue) Top() candidate { return q.items[0] }
+
+// Reset empties the queue while keeping its backing array.
+func (q *candidateQueue) Reset() { q.items = q.items[:0] }
+
+// Push adds a candidate to the heap.
+func (q *candidateQueue) Push(c candidate) {
+	q.pushes++
+	q.items = append(q.items, c)
+	i := len(q.items) - 1
+	for i > 0 {
+		parent := (i - 1) / 2
+		if !q.before(q.items[i], q.items[parent]) {
+			break
+		}
+		q.items[i], q.items[parent] = q.items[parent], q.items[i]
+		i = parent
+	}
+}
+
+// Pop removes and returns the candidate on top of the heap.
+func (q *candidateQueue) Pop() candidate {
+	top := q.items[0]
+	last := len(q.items) - 1
+	q.items[0] = q.items[last]
+	q.items = q.items[:last]
+	i := 0
+	for {
+		l := 2*i + 1
+		if l >= last {
+			break
+		}
+		child := l
+		if r := l + 1; r < last && q.before(q.items[r], q.items[l]) {
+			child = r
+		}
+		if !q.before(q.items[child], q.items[i]) {
+			break
+		}
+		q.items[i], q.items[child] = q.items[child], q.items[i]
+		i = child
+	}
+	return top
+}
+
+// searchContext holds the per-goroutine scratch state of a graph search.
+// Contexts are pooled, so steady-state searches do not allocate.
+type searchContext struct {
+	visited  []uint32          // epoch tag per slot; a slot is visited when its tag equals epoch
+	epoch    uint32            // tag of the current search
+	cands    candidateQueue    // min-heap of candidates still to expand
+	results  candidateQueue    // max-heap of the best candidates found so far
+	out      []candidate       // sorted output of the last searchLayer call
+	pool     []candidate       // scratch candidates for the links of a new node
+	selected []candidate       // scratch list of the neighbors selected for a new node
+	scratch  []candidate       // scratch candidates for neighbor list pruning
+	kept     []candidate       // scratch list of the neighbors kept by a pruning
+	pruned   []candidate       // candidates the selection heuristic set aside
+	query    probe             // the query of the current search
+	node     probe             // the vector of the node being linked or repaired
+	other    probe             // the vector of a node compared with other nodes by a selection
+	exact    []float32         // float32 vector read from the vector store for re-ranking
+	nbrs     []uint32          // copy of a neighbor list taken under its lock
+	g        *graph            // graph being searched: the graph of the index, or of a published view
+	shared   bool              // a query search of a view that writers may change concurrently
+	budget   core.SearchBudget // counters and limits of the current query search (unlimited while building)
+	filter   core.Filter       // ids the current query search may return (nil allows all)
+	visits   int               // nodes visited since the context was taken from the pool
+}
+
+// searchContextPool recycles search contexts between searches.
+var searchContextPool = sync.Pool{
+	New: func() interface{} {
+		return &searchContext{results: candidateQueue{max: true}}
+	},
+}
+
+// getSearchContext takes a context from the pool for a search of g.
+func getSearchContext(g *graph) *searchContext {
+	ctx := searchContextPool.Get().(*searchContext)
+	ctx.g = g
+	return ctx
+}
+
+// putSearchContext returns a context to the pool.
+func putSearchContext(ctx *searchContext) {
+	ctx.budget, ctx.filter = core.SearchBudget{}, nil
+	ctx.g, ctx.shared = nil, false
+	ctx.visits, ctx.cands.pushes, ctx.results.pushes = 0, 0, 0
+	searchContextPool.Put(ctx)
+}
+
+// begin starts a new visited epoch covering numSlots slots.
+func (ctx *searchContext) begin(numSlots int) {
+	if len(ctx.visited) < numSlots {
+		ctx.visited = make([]uint32, numSlots+numSlots/4)
+		ctx.epoch = 0
+	}
+	ctx.epoch++
+	if ctx.epoch == 0 {
+		// The tag wrapped around; clear stale tags so they cannot collide.
+		for i := range ctx.visited {
+			ctx.visited[i] = 0
+		}
+		ctx.epoch = 1
+	}
+	ctx.cands.Reset()
+	ctx.results.Reset()
+}
+
+// visit marks slot s as visited and reports whether it was unvisited before.
+func (ctx *searchContext) visit(s uint32) bool {
+	if ctx.visited[s] == ctx.epoch {
+		return false
+	}
+	ctx.visited[s] = ctx.epoch
+	ctx.visits++
+	return true
+}
+
+// drainResults empties the result heap into ctx.out and returns it sorted by distance.
+func (ctx *searchContext) drainResults() []candidate {
+	// Drain the max-heap back to front, which yields the results in ascending order.
+	n := ctx.results.Len()
+	if cap(ctx.out) < n {
+		ctx.out = make([]candidate, n)
+	}
+	results := ctx.out[:n]
+	for i := n - 1; i >= 0; i-- {
+		results[i] = ctx.results.Pop()
+	}
+	return results
+}
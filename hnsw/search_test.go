@@ -0,0 +1,136 @@
+package hnsw
+
+import (
+	"math/rand"
+	"testing"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+func TestSearch_RestartsInDisconnectedGraph(t *testing.T) {
+	t.Setenv("HANN_SEED", "42")
+	h := NewHNSW(2, 4, 4, core.Distances["euclidean"], "euclidean")
+	h.BuildWorkers = 1
+	h.EfConstruction = 32
+	vectors := make(map[int][]float32)
+	for i := 0; i < 5; i++ {
+		vectors[i] = []float32{float32(i), 0} // component A
+	}
+	for i := 5; i < 105; i++ {
+		vectors[i] = []float32{100 + float32(i%10), 100 + float32(i/10)} // component B
+	}
+	if err := h.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	// Cut every link between the components and enter the graph through A.
+	inA := make([]bool, h.g.numSlots())
+	for id := 0; id < 5; id++ {
+		inA[h.g.idToSlot[id]] = true
+	}
+	for s := range h.g.levels {
+		slot := uint32(s)
+		for L := h.g.level(slot); L >= 0; L-- {
+			var kept []candidate
+			dists := h.g.neighborDists(slot, L)
+			for i, nb := range h.g.neighbors(slot, L) {
+				if inA[nb] == inA[slot] {
+					kept = append(kept, candidate{nb, float64(dists[i])})
+				}
+			}
+			h.g.setNeighbors(slot, L, kept)
+		}
+	}
+	h.entryPoint = h.g.idToSlot[0]
+	for id := 1; id < 5; id++ {
+		if s := h.g.idToSlot[id]; h.g.level(s) > h.g.level(h.entryPoint) {
+			h.entryPoint = s
+		}
+	}
+	h.MaxLevel = h.g.level(h.entryPoint)
+	h.collectTopSlots()
+	h.publish()
+
+	var stats core.SearchStats
+	query := vectors[10]
+	res, err := h.SearchWithOptions(query, 10, core.SearchOptions{Stats: &stats})
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if len(res) != 10 || stats.Restarts == 0 || stats.Restarts > maxSearchRestarts {
+		t.Fatalf("expected 10 results after 1..%d restarts, got %d results after %d", maxSearchRestarts, len(res), stats.Restarts)
+	}
+	if res[0].ID != 10 || res[0].Distance != 0 {
+		t.Errorf("expected id 10 at distance 0 first, got %v", res[0])
+	}
+	for _, n := range res {
+		if n.ID < 5 {
+			t.Errorf("component A node %d returned for a query in component B", n.ID)
+		}
+	}
+
+	// A search that finds k nodes right away is not restarted.
+	stats = core.SearchStats{}
+	if _, err := h.SearchWithOptions([]float32{0, 0}, 3, core.SearchOptions{Stats: &stats}); err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if stats.Restarts != 0 {
+		t.Errorf("expected no restarts, got %d", stats.Restarts)
+	}
+}
+
+// BenchmarkSearchLayer measures the base-layer search of queries that entered the graph
+// through the upper layers, on float32 vectors and on int8 codes.
+func BenchmarkSearchLayer(b *testing.B) {
+	b.Setenv("HANN_SEED", "1")
+	rnd := rand.New(rand.NewSource(1))
+	const dim, n = 64, 5000
+	vectors := make(map[int][]float32, n)
+	for i := 0; i < n; i++ {
+		vectors[i] = randomUnitVector(rnd, dim)
+	}
+	queries := make([][]float32, 100)
+	for i := range queries {
+		queries[i] = randomUnitVector(rnd, dim)
+	}
+	for _, tc := range []struct {
+		name  string
+		quant Quantization
+	}{{"float32", QuantizeNone}, {"int8", QuantizeInt8}, {"float16", QuantizeFloat16}} {
+		h := NewHNSW(dim, 16, 100, core.Distances["euclidean"], "euclidean")
+		if err := h.BulkAdd(vectors); err != nil {
+			b.Fatalf("BulkAdd failed: %v", err)
+		}
+		if err := h.SetQuantization(tc.quant); err != nil {
+			b.Fatalf("SetQuantization failed: %v", err)
+		}
+		b.Run(tc.name, func(b *testing.B) {
+			ctx := getSearchContext(&h.g)
+			defer putSearchContext(ctx)
+			entries := make([]uint32, len(queries))
+			for i, query := range queries {
+				q := prepareQuery(ctx, query)
+				entries[i] = h.entryPoint
+				for L := h.MaxLevel; L > 0; L-- {
+					entries[i] = h.greedyClosest(ctx, q, entries[i], L)
+				}
+			}
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				j := i % len(queries)
+				ctx.budget = core.NewSearchBudget(core.SearchOptions{})
+				q := prepareQuery(ctx, queries[j])
+				h.searchLayer(ctx, q, entries[j], 0, h.Ef)
+			}
+		})
+	}
+}
+
+// randomUnitVector returns a random vector of length one.
+func randomUnitVector(rnd *rand.Rand, dim int) []float32 {
+	v := make([]float32, dim)
+	for i := range v {
+		v[i] = float32(rnd.NormFloat64())
+	}
+	core.NormalizeInPlace(v)
+	return v
+}
@@ -0,0 +1,77 @@
+package hnsw
+
+// NeighborSelection is the strategy that picks the links of a node among its candidates.
+type NeighborSelection int
+
+const (
+	// SelectHeuristic keeps a candidate only if it is closer to the node than to every
+	// neighbor kept before it (Algorithm 4 of the HNSW paper). The links spread over all
+	// directions around the node instead of piling up in its densest one, which keeps
+	// clustered data navigable. This is the default.
+	SelectHeuristic NeighborSelection = iota
+	// SelectSimple keeps the closest candidates (Algorithm 3 of the HNSW paper).
+	SelectSimple
+)
+
+// selectNeighbors picks at most m of cands as the neighbors of a node and appends them to
+// out, closest first. cands hold their distances to the node and are reordered. The caller
+// holds the lock of every vector it reads.
+func (h *HNSWIndex) selectNeighbors(ctx *searchContext, cands []candidate, m int, out []candidate) []candidate {
+	sortCandidates(cands)
+	if h.NeighborSelection == SelectSimple {
+		if len(cands) > m {
+			cands = cands[:m]
+		}
+		return append(out, cands...)
+	}
+	first := len(out)
+	pruned := ctx.pruned[:0]
+	for _, c := range cands {
+		if len(out)-first >= m {
+			break
+		}
+		// c is dropped if a neighbor kept so far is closer to it than the node is; the
+		// node then reaches c through that neighbor.
+		ctx.g.nodeProbe(&ctx.other, c.slot)
+		keep := true
+		for _, r := range out[first:] {
+			if ctx.g.distance(&ctx.other, r.slot) < c.dist {
+				keep = false
+				break
+			}
+		}
+		if keep {
+			out = append(out, c)
+		} else if h.KeepPruned {
+			pruned = append(pruned, c)
+		}
+	}
+	// Pruned candidates fill the list up to m, closest first.
+	for _, c := range pruned {
+		if len(out)-first >= m {
+			break
+		}
+		out = append(out, c)
+	}
+	ctx.pruned = pruned
+	return out
+}
+
+// extendCandidates adds the neighbors of the candidates at a level to cands, with their
+// distances to q, skipping slot self, tombstones and slots already present.
+// It implements the extendCandidates option of Algorithm 4 of the HNSW paper and is used
+// when ExtendCandidates is set. The caller has started a visited epoch on ctx.
+func (h *HNSWIndex) extendCandidates(ctx *searchContext, q *probe, self uint32, cands []candidate, level int) []candidate {
+	ctx.visit(self)
+	for _, c := range cands {
+		ctx.visit(c.slot)
+	}
+	for i, n := 0, len(cands); i < n; i++ {
+		for _, nb := range h.neighborsOf(ctx, cands[i].slot, level) {
+			if ctx.visit(nb) && !ctx.g.isDeleted(nb) {
+				cands = append(cands, candidate{nb, ctx.g.distance(q, nb)})
+			}
+		}
+	}
+	return cands
+}
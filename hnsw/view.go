@@ -0,0 +1,118 @@
+package hnsw
+
+import (
+	"runtime"
+	"sync/atomic"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// publishInterval is the number of nodes a bulk insert links between two publications of
+// its progress to searches.
+const publishInterval = 1024
+
+// view is the state of the index that searches read, published by the writers with
+// publish. Searches never take Mu: they read the most recent view, whose graph header
+// aliases the arenas of the index. Writers only append to the arenas, rewrite neighbor
+// lists under their stripe locks and flip tombstone flags atomically; the slots of deleted
+// nodes are reclaimed only once no search of an earlier view can still reach them.
+type view struct {
+	g          graph            // header of the graph arrays at publication
+	dimension  int              // dimension of the vectors
+	entryPoint uint32           // slot of the starting point for searches
+	maxLevel   int              // maximum level in the graph
+	topSlots   []uint32         // live nodes on the top level
+	size       int              // number of live nodes
+	store      core.VectorStore // attached vector store
+	seq        uint64           // publication number
+	readers    atomic.Int64     // searches reading the view
+}
+
+// retiredSlot is the slot of a reclaimed tombstone that searches of the views up to seq
+// may still reach.
+type retiredSlot struct {
+	slot uint32
+	seq  uint64
+}
+
+// publish makes the current state of the index visible to searches, and releases the
+// retired slots that no search can reach any more. The caller holds Mu exclusively (or,
+// during a parallel build, topMu).
+func (h *HNSWIndex) publish() {
+	h.seq++
+	v := &view{
+		g:          h.g,
+		dimension:  h.Dimension,
+		entryPoint: h.entryPoint,
+		maxLevel:   h.MaxLevel,
+		topSlots:   append([]uint32(nil), h.topSlots...),
+		size:       h.g.size(),
+		store:      h.store,
+		seq:        h.seq,
+	}
+	// The id table is shared with the index; searches only read it through lookup.
+	v.g.free, v.g.scratch = nil, nil
+	if old := h.current.Swap(v); old != nil {
+		h.retired = append(h.retired, old)
+	}
+	oldest := h.pruneViews()
+	kept := h.retiring[:0]
+	for _, r := range h.retiring {
+		if r.seq < oldest {
+			h.g.release(r.slot)
+		} else {
+			kept = append(kept, r)
+		}
+	}
+	h.retiring = kept
+}
+
+// pruneViews forgets the superseded views that no search reads any more and returns the
+// publication number of the oldest view still in use. A superseded view never gains
+// readers again (see acquire).
+func (h *HNSWIndex) pruneViews() uint64 {
+	oldest := h.seq
+	kept := h.retired[:0]
+	for _, v := range h.retired {
+		if v.readers.Load() > 0 {
+			kept = append(kept, v)
+			oldest = min(oldest, v.seq)
+		}
+	}
+	clear(h.retired[len(kept):])
+	h.retired = kept
+	return oldest
+}
+
+// retire queues the slot of a tombstone whose links have been removed for release. The
+// slot is released by the first publication after every search that started before the
+// links were removed has finished.
+func (h *HNSWIndex) retire(s uint32) {
+	h.retiring = append(h.retiring, retiredSlot{s, h.seq})
+}
+
+// drainViews waits until no search reads a superseded view, e.g. before the memory mapping
+// such views alias is closed. Searches are not blocked meanwhile.
+func (h *HNSWIndex) drainViews() {
+	for h.pruneViews(); len(h.retired) > 0; h.pruneViews() {
+		runtime.Gosched()
+	}
+}
+
+// acquire returns the current view with its reader count raised, or nil if nothing has
+// been published yet. The caller must call v.readers.Add(-1) when its search is done.
+// The count is raised before the view is checked to still be current, so a writer that
+// sees no readers on a superseded view knows that none will start.
+func (h *HNSWIndex) acquire() *view {
+	for {
+		v := h.current.Load()
+		if v == nil {
+			return nil
+		}
+		v.readers.Add(1)
+		if h.current.Load() == v {
+			return v
+		}
+		v.readers.Add(-1)
+	}
+}
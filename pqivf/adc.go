@@ -0,0 +1,65 @@
+package pqivf
+
+import "github.com/patrikhermansson/hann/core"
+
+// adcTable holds the asymmetric distance computation (ADC) table of a query for one cluster.
+// Entry [i*stride+j] is the squared Euclidean distance between sub-vector i of the query
+// residual and codeword j of subquantizer i. The squared distance between the query and an
+// encoded vector is then the sum of one table entry per subquantizer, so scoring a vector
+// reads numSubquantizers values instead of reconstructing dimension floats.
+type adcTable struct {
+	dists    []float32 // numSubquantizers*stride distances
+	stride   int       // number of codewords per subquantizer
+	residual []float32 // scratch buffer for the query residual
+}
+
+// newADCTable allocates a table sized for the trained codebooks of the index.
+func (pq *PQIVFIndex) newADCTable() *adcTable {
+	return newADCTable(pq.codebooks, pq.dimension)
+}
+
+// newADCTable allocates a table sized for codebooks over vectors of the given dimension.
+func newADCTable(codebooks [][][]float32, dimension int) *adcTable {
+	stride := 0
+	for _, cb := range codebooks {
+		if len(cb) > stride {
+			stride = len(cb)
+		}
+	}
+	return &adcTable{
+		dists:    make([]float32, len(codebooks)*stride),
+		stride:   stride,
+		residual: make([]float32, dimension),
+	}
+}
+
+// fillADCTable computes the table for the residual of query with respect to a coarse centroid.
+func (pq *PQIVFIndex) fillADCTable(t *adcTable, query, centroid []float32) {
+	for i := range query {
+		t.residual[i] = query[i] - centroid[i]
+	}
+	t.fill(pq.codebooks)
+}
+
+// fill computes the distances of the sub-vectors of t.residual to the codewords.
+func (t *adcTable) fill(codebooks [][][]float32) {
+	subDim := len(t.residual) / len(codebooks)
+	for i, cb := range codebooks {
+		sub := t.residual[i*subDim : (i+1)*subDim]
+		row := t.dists[i*t.stride : i*t.stride+len(cb)]
+		for j, codeword := range cb {
+			row[j] = core.SquaredL2(sub, codeword)
+		}
+	}
+}
+
+// scoreCodes returns the approximate squared distance between the query and an encoded vector.
+func scoreCodes[T uint8 | uint16](t *adcTable, codes []T) float64 {
+	var sum float32
+	off := 0
+	for _, code := range codes {
+		sum += t.dists[off+int(code)]
+		off += t.stride
+	}
+	return float64(sum)
+}
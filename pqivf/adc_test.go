@@ -0,0 +1,50 @@
+package pqivf
+
+import (
+	"fmt"
+	"math/rand"
+	"testing"
+)
+
+// BenchmarkADCScan measures the scan of an inverted list by ADC table lookups, including
+// the computation of the table for the query, with 8- and 16-bit codes.
+func BenchmarkADCScan(b *testing.B) {
+	const dim, n = 64, 4000
+	rnd := rand.New(rand.NewSource(1))
+	vectors := make(map[int][]float32, n)
+	for i := 0; i < n; i++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = float32(rnd.NormFloat64())
+		}
+		vectors[i] = vec
+	}
+	for _, pqK := range []int{256, 1024} {
+		pq := NewPQIVFIndex(dim, 1, 8, pqK, 5)
+		if err := pq.BulkAdd(vectors); err != nil {
+			b.Fatalf("BulkAdd failed: %v", err)
+		}
+		if err := pq.Train(); err != nil {
+			b.Fatalf("Train failed: %v", err)
+		}
+		b.Run(fmt.Sprintf("pqK=%d", pqK), func(b *testing.B) {
+			table := pq.newADCTable()
+			l := &pq.invertedLists[0]
+			m := pq.numSubquantizers
+			var sink float64
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				pq.fillADCTable(table, vectors[i%n], pq.coarseCentroids[0])
+				for j := range l.IDs {
+					if pq.wideCodes() {
+						sink += scoreCodes(table, l.Codes16[j*m:(j+1)*m])
+					} else {
+						sink += scoreCodes(table, l.Codes8[j*m:(j+1)*m])
+					}
+				}
+			}
+			b.ReportMetric(float64(b.N*len(l.IDs))/b.Elapsed().Seconds(), "codes/s")
+			_ = sink
+		})
+	}
+}
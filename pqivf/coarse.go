@@ -0,0 +1,187 @@
+package pqivf
+
+import (
+	"math"
+	"sort"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/hnsw"
+)
+
+// A trained index with many coarse clusters looks its centroids up in an HNSW graph built
+// over them instead of scanning all of them, so that assigning a vector and picking the
+// clusters a search probes cost about O(log coarseK) distance computations. The graph is
+// derived from the centroids: it is built by Train and when an index is loaded, and is not
+// saved. Untrained centroids move with every added vector, so they are always scanned.
+
+// Parameters of the coarse graph (see PQIVFIndex.CoarseGraphMin and PQIVFIndex.CoarseEf).
+const (
+	defaultCoarseGraphMin = 4096
+	defaultCoarseEf       = 128
+	coarseGraphM          = 16
+)
+
+// centroidDist is a coarse cluster with the distance of its centroid to a vector.
+type centroidDist struct {
+	cluster int
+	dist    float64
+}
+
+// less orders clusters by distance, breaking ties by cluster.
+func (c centroidDist) less(o centroidDist) bool {
+	if c.dist != o.dist {
+		return c.dist < o.dist
+	}
+	return c.cluster < o.cluster
+}
+
+// newCoarseGraph indexes trained coarse centroids in an HNSW graph, or returns nil if there
+// are fewer than CoarseGraphMin of them (or none are trained).
+func (pq *PQIVFIndex) newCoarseGraph(centroids [][]float32) (*hnsw.HNSWIndex, error) {
+	threshold := pq.CoarseGraphMin
+	if threshold == 0 {
+		threshold = defaultCoarseGraphMin
+	}
+	if threshold < 0 || len(centroids) < max(threshold, 1) {
+		return nil, nil
+	}
+	// The kernel of the index metric is the squared distance, so the graph uses it directly.
+	g := hnsw.NewHNSW(len(centroids[0]), coarseGraphM, defaultCoarseEf,
+		core.Distances["squared_euclidean"], "squared_euclidean")
+	vectors := make(map[int][]float32, len(centroids))
+	for i, c := range centroids {
+		vectors[i] = c
+	}
+	if err := g.BulkAdd(vectors); err != nil {
+		return nil, err
+	}
+	return g, nil
+}
+
+// nearestIn returns the index of the centroid closest to v, looked up in graph if it is not
+// nil.
+func nearestIn(graph *hnsw.HNSWIndex, centroids [][]float32, v []float32) int {
+	if graph != nil {
+		if res, err := graph.Search(v, 1); err == nil && len(res) > 0 {
+			return res[0].ID
+		}
+	}
+	c, _ := nearest(centroids, v)
+	return c
+}
+
+// nearestCentroid finds the closest coarse centroid to the vector and returns its index and distance.
+func (pq *PQIVFIndex) nearestCentroid(vector []float32) (int, float64) {
+	if pq.coarseGraph != nil {
+		if res, err := pq.coarseGraph.Search(vector, 1); err == nil && len(res) > 0 {
+			return res[0].ID, res[0].Distance
+		}
+	}
+	best := -1
+	bestDist := math.MaxFloat64
+	for i, centroid := range pq.coarseCentroids {
+		d := pq.metric.Kernel(vector, centroid)
+		if d < bestDist {
+			bestDist = d
+			best = i
+		}
+	}
+	return best, bestDist
+}
+
+// nearestCentroids returns clusters ranked by distance to the vector, of which the first
+// min(n, len) are the n nearest in ascending order, and the number of distances computed.
+// With a coarse graph only those n are returned; otherwise every centroid is scored and
+// the others follow unsorted (see rankRemaining).
+func (pq *PQIVFIndex) nearestCentroids(vector []float32, n int) ([]centroidDist, int) {
+	n = min(n, len(pq.coarseCentroids))
+	if pq.coarseGraph != nil {
+		ef := pq.CoarseEf
+		if ef <= 0 {
+			ef = defaultCoarseEf
+		}
+		var stats core.SearchStats
+		res, err := pq.coarseGraph.SearchWithOptions(vector, n, core.SearchOptions{Ef: max(ef, n), Stats: &stats})
+		if err == nil {
+			cands := make([]centroidDist, len(res))
+			for i, r := range res {
+				cands[i] = centroidDist{cluster: r.ID, dist: r.Distance}
+			}
+			return cands, stats.DistanceComputations
+		}
+	}
+	cands := make([]centroidDist, len(pq.coarseCentroids))
+	for i, centroid := range pq.coarseCentroids {
+		cands[i] = centroidDist{cluster: i, dist: pq.metric.Kernel(vector, centroid)}
+	}
+	selectNearest(cands, n)
+	return cands, len(cands)
+}
+
+// rankRemaining completes cands, whose first n clusters have been ranked by
+// nearestCentroids, with all other clusters sorted by distance to the vector, and returns
+// the number of distances it computed. Searches only need it when they fall back to
+// clusters beyond the probed ones.
+func (pq *PQIVFIndex) rankRemaining(vector []float32, cands []centroidDist, n int) ([]centroidDist, int) {
+	computed := 0
+	if len(cands) < len(pq.coarseCentroids) {
+		// The graph returned the nearest clusters only; score the others.
+		ranked := make([]bool, len(pq.coarseCentroids))
+		for _, c := range cands[:n] {
+			ranked[c.cluster] = true
+		}
+		all := make([]centroidDist, n, len(pq.coarseCentroids))
+		copy(all, cands[:n])
+		for i, centroid := range pq.coarseCentroids {
+			if !ranked[i] {
+				all = append(all, centroidDist{cluster: i, dist: pq.metric.Kernel(vector, centroid)})
+				computed++
+			}
+		}
+		cands = all
+	}
+	sortCentroids(cands[n:])
+	return cands, computed
+}
+
+// sortCentroids sorts clusters by ascending distance, breaking ties by cluster.
+func sortCentroids(c []centroidDist) {
+	sort.Slice(c, func(i, j int) bool { return c[i].less(c[j]) })
+}
+
+// selectNearest reorders c so that its first n clusters are the nearest in ascending order,
+// leaving the others unsorted. It runs quickselect in expected linear time and sorts only
+// the selected clusters.
+func selectNearest(c []centroidDist, n int) {
+	if n < len(c) {
+		lo, hi := 0, len(c)-1
+		for lo < hi {
+			p := lo + partitionCentroids(c[lo:hi+1])
+			if p == n {
+				break
+			}
+			if p < n {
+				lo = p + 1
+			} else {
+				hi = p - 1
+			}
+		}
+	}
+	sortCentroids(c[:min(n, len(c))])
+}
+
+// partitionCentroids partitions c around its middle element, moving the clusters that
+// order before it to the front, and returns its final position.
+func partitionCentroids(c []centroidDist) int {
+	last := len(c) - 1
+	c[len(c)/2], c[last] = c[last], c[len(c)/2]
+	i := 0
+	for j := 0; j < last; j++ {
+		if c[j].less(c[last]) {
+			c[i], c[j] = c[j], c[i]
+			i++
+		}
+	}
+	c[i], c[last] = c[last], c[i]
+	return i
+}
@@ -0,0 +1,123 @@
+package pqivf
+
+import (
+	"bytes"
+	"math/rand"
+	"sort"
+	"testing"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+func TestSelectNearest(t *testing.T) {
+	rnd := rand.New(rand.NewSource(1))
+	for _, size := range []int{1, 2, 7, 100, 1000} {
+		all := make([]centroidDist, size)
+		for i := range all {
+			// Few distinct distances, so that ties are broken by cluster.
+			all[i] = centroidDist{cluster: i, dist: float64(rnd.Intn(size/3 + 1))}
+		}
+		want := append([]centroidDist(nil), all...)
+		sortCentroids(want)
+		for _, n := range []int{0, 1, size / 2, size - 1, size, size + 3} {
+			got := append([]centroidDist(nil), all...)
+			rnd.Shuffle(len(got), func(i, j int) { got[i], got[j] = got[j], got[i] })
+			selectNearest(got, n)
+			for i := 0; i < min(n, size); i++ {
+				if got[i] != want[i] {
+					t.Fatalf("size %d, n %d: position %d holds %v, want %v", size, n, i, got[i], want[i])
+				}
+			}
+			sort.Slice(got, func(i, j int) bool { return got[i].cluster < got[j].cluster })
+			for i := range got {
+				if got[i].cluster != i {
+					t.Fatalf("size %d, n %d: clusters lost: %v", size, n, got)
+				}
+			}
+		}
+	}
+}
+
+func TestCoarseGraph(t *testing.T) {
+	const dim, n = 8, 3000
+	rnd := rand.New(rand.NewSource(2))
+	vectors := make(map[int][]float32, n)
+	for i := 0; i < n; i++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = rnd.Float32()
+		}
+		vectors[i] = vec
+	}
+	graphed := NewPQIVFIndex(dim, 64, 2, 16, 5)
+	graphed.CoarseGraphMin = 16
+	graphed.NProbe = 4
+	if err := graphed.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if graphed.coarseGraph != nil {
+		t.Fatal("expected no coarse graph before training")
+	}
+	if err := graphed.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+	if graphed.coarseGraph == nil {
+		t.Fatal("expected a coarse graph after training")
+	}
+
+	// The same index without the graph scans all centroids.
+	var buf bytes.Buffer
+	if err := graphed.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	scanned := NewPQIVFIndex(dim, 64, 2, 16, 5)
+	scanned.CoarseGraphMin = -1
+	if err := scanned.Load(bytes.NewReader(buf.Bytes())); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	if scanned.coarseGraph != nil {
+		t.Fatal("expected no coarse graph with CoarseGraphMin < 0")
+	}
+	loaded := NewPQIVFIndex(dim, 64, 2, 16, 5)
+	loaded.CoarseGraphMin = 16
+	if err := loaded.Load(bytes.NewReader(buf.Bytes())); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	if loaded.coarseGraph == nil {
+		t.Fatal("expected the coarse graph to be rebuilt on load")
+	}
+
+	// The graph's candidate list covers all 64 centroids, so its lookups are exact and the
+	// searches match, also when a filter makes them fall back to further clusters.
+	filter := core.NewBitset(5, 500, 1500, 2999)
+	for q := 0; q < 20; q++ {
+		query := vectors[q*97]
+		got, _ := graphed.nearestCentroid(query)
+		if want, _ := scanned.nearestCentroid(query); got != want {
+			t.Fatalf("query %d: nearest centroid %d, want %d", q, got, want)
+		}
+		for _, opts := range []core.SearchOptions{{}, {Filter: filter}} {
+			want, err := scanned.SearchWithOptions(query, 4, opts)
+			if err != nil {
+				t.Fatalf("SearchWithOptions failed: %v", err)
+			}
+			for _, idx := range []*PQIVFIndex{graphed, loaded} {
+				got, err := idx.SearchWithOptions(query, 4, opts)
+				if err != nil {
+					t.Fatalf("SearchWithOptions failed: %v", err)
+				}
+				if len(got) != len(want) {
+					t.Fatalf("query %d: got %v, want %v", q, got, want)
+				}
+				for i := range want {
+					if got[i] != want[i] {
+						t.Fatalf("query %d: got %v, want %v", q, got, want)
+					}
+				}
+			}
+		}
+	}
+	if g, s := graphed.Stats().Memory.Graph, scanned.Stats().Memory.Graph; g <= s {
+		t.Errorf("expected the coarse graph in the memory stats, got %d without it and %d with it", s, g)
+	}
+}
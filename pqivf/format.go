@@ -0,0 +1,251 @@
+package pqivf
+
+import (
+	"errors"
+	"fmt"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/hnsw"
+)
+
+// formatKind identifies PQIVF indexes in binary index files.
+const formatKind = "pqivf"
+
+// Positions of the parameters in the "meta" section.
+const (
+	metaDimension = iota
+	metaCoarseK
+	metaNumSubquantizers
+	metaPqK
+	metaKMeansIters
+	metaRetainVectors
+	metaRerankFactor
+	metaNProbe
+	metaTrainingSampleSize
+	metaMiniBatchSize
+	metaLen
+)
+
+// sections returns the binary file sections of the index. Centroids, codewords and the
+// parallel arrays of all inverted lists are concatenated in cluster order; the list and
+// codebook lengths are stored separately so that the arrays can be sliced up on load.
+func (pq *PQIVFIndex) sections() []core.Section {
+	meta := make([]int64, metaLen)
+	meta[metaDimension] = int64(pq.dimension)
+	meta[metaCoarseK] = int64(pq.coarseK)
+	meta[metaNumSubquantizers] = int64(pq.numSubquantizers)
+	meta[metaPqK] = int64(pq.pqK)
+	meta[metaKMeansIters] = int64(pq.kMeansIters)
+	if pq.RetainVectors {
+		meta[metaRetainVectors] = 1
+	}
+	meta[metaRerankFactor] = int64(pq.RerankFactor)
+	meta[metaNProbe] = int64(pq.NProbe)
+	meta[metaTrainingSampleSize] = int64(pq.TrainingSampleSize)
+	meta[metaMiniBatchSize] = int64(pq.MiniBatchSize)
+
+	codebookSizes := make([]int64, len(pq.codebooks))
+	var codewords [][]float32
+	for i, cb := range pq.codebooks {
+		codebookSizes[i] = int64(len(cb))
+		codewords = append(codewords, cb...)
+	}
+	listLens := make([]int64, len(pq.invertedLists))
+	ids := make([][]int, len(pq.invertedLists))
+	codes8 := make([][]uint8, len(pq.invertedLists))
+	codes16 := make([][]uint16, len(pq.invertedLists))
+	vectors := make([][]float32, len(pq.invertedLists))
+	for i, l := range pq.invertedLists {
+		listLens[i] = int64(len(l.IDs))
+		ids[i], codes8[i], codes16[i], vectors[i] = l.IDs, l.Codes8, l.Codes16, l.Vectors
+	}
+	return []core.Section{
+		core.SliceSection("meta", meta),
+		core.SliceSection("centroids", pq.coarseCentroids...),
+		core.SliceSection("codebook_sizes", codebookSizes),
+		core.SliceSection("codewords", codewords...),
+		core.SliceSection("list_lengths", listLens),
+		core.IntsSection("ids", ids...),
+		core.SliceSection("codes8", codes8...),
+		core.SliceSection("codes16", codes16...),
+		core.SliceSection("vectors", vectors...),
+	}
+}
+
+// loadSections replaces the index with the contents of a binary index file.
+// Centroids, codewords and list arrays alias the file; only the id-to-cluster table is built.
+// The caller holds the write lock.
+func (pq *PQIVFIndex) loadSections(f *core.SectionFile) error {
+	if f.Kind != formatKind {
+		return fmt.Errorf("binary index file holds a %q index, not a PQIVF index", f.Kind)
+	}
+	meta, err := f.Int64s("meta")
+	if err != nil {
+		return err
+	}
+	if len(meta) < metaLen {
+		return errors.New("corrupt PQIVF index file: short meta section")
+	}
+	centroids, err := f.Float32s("centroids")
+	if err != nil {
+		return err
+	}
+	codebookSizes, err := f.Int64s("codebook_sizes")
+	if err != nil {
+		return err
+	}
+	codewords, err := f.Float32s("codewords")
+	if err != nil {
+		return err
+	}
+	listLens, err := f.Int64s("list_lengths")
+	if err != nil {
+		return err
+	}
+	ids, err := f.Ints("ids")
+	if err != nil {
+		return err
+	}
+	codes8, err := f.Uint8s("codes8")
+	if err != nil {
+		return err
+	}
+	codes16, err := f.Uint16s("codes16")
+	if err != nil {
+		return err
+	}
+	vectors, err := f.Float32s("vectors")
+	if err != nil {
+		return err
+	}
+
+	dim, m := int(meta[metaDimension]), int(meta[metaNumSubquantizers])
+	if dim <= 0 || m <= 0 || dim%m != 0 || len(centroids) != len(listLens)*dim {
+		return errors.New("corrupt PQIVF index file: inconsistent dimensions")
+	}
+	coarse := make([][]float32, len(listLens))
+	for i := range coarse {
+		coarse[i] = centroids[i*dim : (i+1)*dim : (i+1)*dim]
+	}
+	var codebooks [][][]float32
+	if len(codebookSizes) > 0 {
+		if len(codebookSizes) != m {
+			return errors.New("corrupt PQIVF index file: wrong number of codebooks")
+		}
+		subDim := dim / m
+		codebooks = make([][][]float32, m)
+		off := 0
+		for i, size := range codebookSizes {
+			if size < 0 || off+int(size)*subDim > len(codewords) {
+				return errors.New("corrupt PQIVF index file: truncated codebooks")
+			}
+			codebooks[i] = make([][]float32, size)
+			for j := range codebooks[i] {
+				codebooks[i][j] = codewords[off : off+subDim : off+subDim]
+				off += subDim
+			}
+		}
+	}
+
+	// Every list holds codes when the index is trained, and either all lists or none hold vectors.
+	total := len(ids)
+	withVectors := len(vectors) == total*dim
+	if !withVectors && len(vectors) != 0 {
+		return errors.New("corrupt PQIVF index file: inconsistent vectors")
+	}
+	codeWidth8, codeWidth16 := 0, 0
+	if codebooks != nil {
+		if meta[metaPqK] > 256 {
+			codeWidth16 = m
+		} else {
+			codeWidth8 = m
+		}
+	}
+	if len(codes8) != total*codeWidth8 || len(codes16) != total*codeWidth16 {
+		return errors.New("corrupt PQIVF index file: inconsistent codes")
+	}
+	lists := make([]invertedList, len(listLens))
+	idToCluster := make(map[int]int, total)
+	start := 0
+	for c, n64 := range listLens {
+		n := int(n64)
+		if n < 0 || start+n > total {
+			return errors.New("corrupt PQIVF index file: truncated inverted lists")
+		}
+		end := start + n
+		l := &lists[c]
+		l.IDs = ids[start:end:end]
+		if codeWidth8 > 0 {
+			l.Codes8 = codes8[start*m : end*m : end*m]
+		}
+		if codeWidth16 > 0 {
+			l.Codes16 = codes16[start*m : end*m : end*m]
+		}
+		if withVectors && n > 0 {
+			l.Vectors = vectors[start*dim : end*dim : end*dim]
+		}
+		for _, id := range l.IDs {
+			idToCluster[id] = c
+		}
+		start = end
+	}
+	if start != total {
+		return errors.New("corrupt PQIVF index file: inconsistent inverted lists")
+	}
+
+	var graph *hnsw.HNSWIndex
+	if codebooks != nil {
+		if graph, err = pq.newCoarseGraph(coarse); err != nil {
+			return err
+		}
+	}
+
+	pq.dimension = dim
+	pq.coarseK = int(meta[metaCoarseK])
+	pq.numSubquantizers = m
+	pq.pqK = int(meta[metaPqK])
+	pq.kMeansIters = int(meta[metaKMeansIters])
+	pq.RetainVectors = meta[metaRetainVectors] != 0
+	pq.RerankFactor = int(meta[metaRerankFactor])
+	pq.NProbe = int(meta[metaNProbe])
+	if pq.NProbe <= 0 {
+		pq.NProbe = defaultNProbe
+	}
+	pq.TrainingSampleSize = int(meta[metaTrainingSampleSize])
+	pq.MiniBatchSize = int(meta[metaMiniBatchSize])
+	pq.coarseCentroids = coarse
+	pq.coarseGraph = graph
+	pq.codebooks = codebooks
+	pq.invertedLists = lists
+	pq.idToCluster = idToCluster
+	pq.store = nil
+	pq.Distance = core.Euclidean
+	pq.metric = core.Metrics["euclidean"]
+	return nil
+}
+
+// setMapping makes f the memory mapping backing the index and releases the previous one.
+// The caller holds the write lock and has already replaced every array that aliased it.
+func (pq *PQIVFIndex) setMapping(f *core.SectionFile) {
+	if pq.mapping != nil && pq.mapping != f {
+		pq.mapping.Close()
+	}
+	pq.mapping = f
+}
+
+// LoadFile loads an index saved with Save from the file at path by mapping it into memory.
+// Inverted lists are read from disk only when searches scan them. The mapping is
+// copy-on-write, so the index can still be modified without changing the file; it is
+// released when another index is loaded into pq. Files in the older gob format are read
+// as with Load. An attached vector store has to be set again.
+func (pq *PQIVFIndex) LoadFile(path string) error {
+	return core.LoadIndexFile(path, func(f *core.SectionFile) error {
+		pq.mu.Lock()
+		defer pq.mu.Unlock()
+		if err := pq.loadSections(f); err != nil {
+			return err
+		}
+		pq.setMapping(f)
+		return nil
+	}, pq.Load)
+}
@@ -1,16 +1,19 @@
 package pqivf
 
 import (
+	"bufio"
 	"bytes"
 	"encoding/gob"
 	"fmt"
 	"io"
-	"math"
+	"math/bits"
 	"math/rand"
 	"sort"
 	"sync"
+	"time"
 
 	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/hnsw"
 	"github.com/schollz/progressbar/v3"
 )
 
@@ -18,47 +21,76 @@ import (
 var seededRand = rand.New(rand.NewSource(core.GetSeed()))
 var seededRandMu sync.Mutex
 
-// pqEntry represents an entry in the index with its vector, PQ codes, and cluster assignment.
-type pqEntry struct {
-	ID      int       // unique identifier for the entry
-	Vector  []float32 // original vector
-	Codes   []int     // PQ codes for subquantizers (if trained)
-	Cluster int       // coarse cluster assignment
-}
-
 // PQIVFIndex is the main structure for the PQIVF index.
+// Each coarse cluster owns an inverted list of ids and packed PQ codes. Before the index is
+// trained, searches are exact over the raw vectors kept in the lists. Train fixes the coarse
+// centroids, learns the codebooks and, unless RetainVectors is set, drops the raw vectors so
+// that each entry costs numSubquantizers code bytes (two bytes per code when pqK > 256).
 type PQIVFIndex struct {
-	mu                   sync.RWMutex      // mutex for concurrent access
-	dimension            int               // dimension of the vectors
-	coarseK              int               // number of coarse clusters
-	coarseCentroids      [][]float32       // centroids for coarse quantization
-	clusterCounts        map[int]int       // count of vectors in each cluster
-	invertedLists        map[int][]pqEntry // inverted index mapping clusters to entries
-	numSubquantizers     int               // number of subquantizers (splits per vector)
-	codebooks            [][][]float32     // codebooks for each subquantizer
-	pqK                  int               // number of centroids per subquantizer (PQ codebook size)
-	kMeansIters          int               // number of iterations for training the subquantizers
-	idToCluster          map[int]int       // mapping from vector id to its cluster assignment
-	Distance             core.DistanceFunc // function to compute distance between vectors
-	numCandidateClusters int               // number of candidate clusters to consider during search
-}
-
-// recalcCentroid recalculates the centroid for a given cluster based on its current entries.
-func (pq *PQIVFIndex) recalcCentroid(cluster int) {
-	entries := pq.invertedLists[cluster]
-	if len(entries) == 0 {
+	mu               sync.RWMutex   // mutex for concurrent access
+	dimension        int            // dimension of the vectors
+	coarseK          int            // number of coarse clusters
+	coarseCentroids  [][]float32    // centroids for coarse quantization
+	invertedLists    []invertedList // inverted lists, indexed by cluster
+	numSubquantizers int            // number of subquantizers (splits per vector)
+	codebooks        [][][]float32  // codebooks for each subquantizer
+	pqK              int            // number of centroids per subquantizer (PQ codebook size)
+	kMeansIters      int            // number of iterations for training the subquantizers
+	idToCluster      map[int]int    // mapping from vector id to its cluster assignment
+	// Deprecated: Distance is always core.Euclidean and is ignored: the coarse quantizer,
+	// the PQ codes and the re-ranking of PQIVF all compare squared Euclidean distances.
+	Distance           core.DistanceFunc
+	RetainVectors      bool               // keep raw vectors in memory after training
+	RerankFactor       int                // default re-ranking factor of searches on a trained index (0 disables)
+	TrainingSampleSize int                // maximum number of vectors k-means trains on (0 uses all)
+	MiniBatchSize      int                // mini-batch size of k-means (0 runs full-batch iterations)
+	trainingTime       time.Duration      // duration of the last call to Train
+	NProbe             int                // default number of coarse clusters scanned by a search
+	CoarseGraphMin     int                // coarse clusters from which a trained index looks centroids up in an HNSW graph (0 uses 4096, negative disables)
+	CoarseEf           int                // candidate list size of searches of the coarse graph (0 uses 128)
+	coarseGraph        *hnsw.HNSWIndex    // graph over the trained coarse centroids, if there are enough of them
+	Sink               core.MetricsSink   // receives the instrumentation of the index, if not nil (set before use)
+	metric             core.Metric        // metric whose kernel (squared Euclidean) is compared internally
+	store              core.VectorStore   // optional external store receiving the raw vectors
+	mapping            *core.SectionFile  // memory-mapped file the index arrays alias (see LoadFile)
+	counters           core.IndexCounters // totals of the searches and builds, reported by Stats
+}
+
+// defaultNProbe is the number of coarse clusters scanned when neither the index nor the
+// search options set one.
+const defaultNProbe = 3
+
+// trained reports whether the codebooks have been trained.
+func (pq *PQIVFIndex) trained() bool {
+	return pq.codebooks != nil
+}
+
+// wideCodes reports whether PQ codes need 16 bits.
+func (pq *PQIVFIndex) wideCodes() bool {
+	return pq.pqK > 256
+}
+
+// keepsVectors reports whether raw vectors are kept in the inverted lists.
+func (pq *PQIVFIndex) keepsVectors() bool {
+	return !pq.trained() || pq.RetainVectors
+}
+
+// moveCentroid keeps the centroid of an untrained cluster at the mean of its vectors after
+// vector was added to it (added is true) or removed from it. n is the number of vectors in
+// the cluster after the change. The update costs O(dimension) instead of a rescan of the list.
+func (pq *PQIVFIndex) moveCentroid(cluster int, vector []float32, n int, added bool) {
+	if n == 0 {
 		return
 	}
-	newCentroid := make([]float32, pq.dimension)
-	for _, entry := range entries {
-		for i, v := range entry.Vector {
-			newCentroid[i] += v
+	c := pq.coarseCentroids[cluster]
+	inv := 1 / float32(n)
+	for j, v := range vector {
+		if added {
+			c[j] += (v - c[j]) * inv
+		} else {
+			c[j] += (c[j] - v) * inv
 		}
 	}
-	for i := range newCentroid {
-		newCentroid[i] /= float32(len(entries))
-	}
-	pq.coarseCentroids[cluster] = newCentroid
 }
 
 // NewPQIVFIndex creates a new PQIVF index. It panics if the dimension is not divisible by numSubquantizers.
@@ -66,103 +98,113 @@ func NewPQIVFIndex(dimension, coarseK, numSubquantizers, pqK, kMeansIters int) *
 	if dimension%numSubquantizers != 0 {
 		panic(fmt.Sprintf("dimension (%d) must be divisible by numSubquantizers (%d)", dimension, numSubquantizers))
 	}
+	if pqK > 1<<16 {
+		panic(fmt.Sprintf("pqK (%d) must not exceed %d", pqK, 1<<16))
+	}
 	return &PQIVFIndex{
-		dimension:            dimension,
-		coarseK:              coarseK,
-		coarseCentroids:      make([][]float32, 0),
-		clusterCounts:        make(map[int]int),
-		invertedLists:        make(map[int][]pqEntry),
-		numSubquantizers:     numSubquantizers,
-		codebooks:            nil,
-		pqK:                  pqK,
-		kMeansIters:          kMeansIters,
-		idToCluster:          make(map[int]int),
-		Distance:             core.Euclidean,
-		numCandidateClusters: 3,
-	}
-}
-
-// nearestCentroid finds the closest coarse centroid to the vector and returns its index and distance.
-func (pq *PQIVFIndex) nearestCentroid(vector []float32) (int, float64) {
-	best := -1
-	bestDist := math.MaxFloat64
-	for i, centroid := range pq.coarseCentroids {
-		d := pq.Distance(vector, centroid)
-		if d < bestDist {
-			bestDist = d
-			best = i
-		}
-	}
-	return best, bestDist
-}
-
-// nearestCentroids returns a sorted slice of clusters with their distances to the vector.
-func (pq *PQIVFIndex) nearestCentroids(vector []float32) []struct {
-	cluster int
-	dist    float64
-} {
-	res := make([]struct {
-		cluster int
-		dist    float64
-	}, 0, len(pq.coarseCentroids))
-	for i, centroid := range pq.coarseCentroids {
-		d := pq.Distance(vector, centroid)
-		res = append(res, struct {
-			cluster int
-			dist    float64
-		}{cluster: i, dist: d})
-	}
-	sort.Slice(res, func(i, j int) bool {
-		return res[i].dist < res[j].dist
-	})
-	return res
+		dimension:        dimension,
+		coarseK:          coarseK,
+		coarseCentroids:  make([][]float32, 0),
+		numSubquantizers: numSubquantizers,
+		codebooks:        nil,
+		pqK:              pqK,
+		kMeansIters:      kMeansIters,
+		idToCluster:      make(map[int]int),
+		Distance:         core.Euclidean,
+		NProbe:           defaultNProbe,
+		metric:           core.Metrics["euclidean"],
+	}
 }
 
-// Add inserts a new vector with an id into the index.
-func (pq *PQIVFIndex) Add(id int, vector []float32) error {
+// SetVectorStore attaches an external store (e.g. a core.FileVectorStore) that receives the
+// raw vector of every entry and serves them for re-ranking and retraining. Vectors still held
+// in memory are copied into the store. Once training has dropped them, the store is expected to
+// hold them already (e.g. a core.MappedVectorStore over a store written earlier).
+// Passing nil detaches the current store. The store is not saved with the index.
+func (pq *PQIVFIndex) SetVectorStore(store core.VectorStore) error {
 	pq.mu.Lock()
 	defer pq.mu.Unlock()
+	if store != nil && pq.keepsVectors() {
+		for _, l := range pq.invertedLists {
+			for i, id := range l.IDs {
+				if err := store.Put(id, l.vector(i, pq.dimension)); err != nil {
+					return err
+				}
+			}
+		}
+	}
+	pq.store = store
+	return nil
+}
 
+// add stores a new entry and returns its cluster. The caller holds the write lock.
+func (pq *PQIVFIndex) add(id int, vector []float32) (int, error) {
 	if len(vector) != pq.dimension {
-		return fmt.Errorf("vector dimension %d does not match index dimension %d", len(vector), pq.dimension)
+		return 0, fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
+			len(vector), pq.dimension, id)
 	}
 	if _, exists := pq.idToCluster[id]; exists {
-		return fmt.Errorf("id %d already exists", id)
+		return 0, fmt.Errorf("id %d already exists", id)
 	}
 
 	var cluster int
-	// If there aren't enough centroids yet, create a new one.
-	if len(pq.coarseCentroids) < pq.coarseK {
+	// If there aren't enough centroids yet (and centroids are not fixed by training), create a new one.
+	if len(pq.coarseCentroids) < pq.coarseK && !pq.trained() {
 		cluster = len(pq.coarseCentroids)
 		centroid := make([]float32, pq.dimension)
 		copy(centroid, vector)
 		pq.coarseCentroids = append(pq.coarseCentroids, centroid)
-		pq.clusterCounts[cluster] = 1
+		pq.invertedLists = append(pq.invertedLists, invertedList{})
 	} else {
 		// Otherwise, assign to the nearest centroid.
 		cluster, _ = pq.nearestCentroid(vector)
-		pq.clusterCounts[cluster]++
 	}
-
-	pq.idToCluster[id] = cluster
-	entry := pqEntry{ID: id, Vector: vector, Cluster: cluster}
-	// If codebooks are available, encode the vector.
-	if pq.codebooks != nil {
-		codes, err := pq.encodeVector(vector, cluster)
+	// Encode before changing any state, so that a failure leaves the index untouched.
+	var codes []int
+	if pq.trained() {
+		var err error
+		codes, err = pq.encodeVector(vector, cluster)
 		if err != nil {
-			return err
+			return 0, err
 		}
-		entry.Codes = codes
 	}
-	pq.invertedLists[cluster] = append(pq.invertedLists[cluster], entry)
-	pq.recalcCentroid(cluster)
-	return nil
+	if pq.store != nil {
+		if err := pq.store.Put(id, vector); err != nil {
+			return 0, err
+		}
+	}
+
+	pq.idToCluster[id] = cluster
+	l := &pq.invertedLists[cluster]
+	l.IDs = append(l.IDs, id)
+	if codes != nil {
+		l.appendCodes(codes, pq.wideCodes())
+	}
+	if pq.keepsVectors() {
+		l.Vectors = append(l.Vectors, vector...)
+	}
+	if !pq.trained() {
+		pq.moveCentroid(cluster, vector, len(l.IDs), true)
+	}
+	return cluster, nil
 }
 
-// BulkAdd inserts multiple vectors into the index.
+// Add inserts a new vector with an id into the index.
+// The vector is copied, so the caller keeps ownership of its slice.
+func (pq *PQIVFIndex) Add(id int, vector []float32) error {
+	pq.mu.Lock()
+	defer pq.mu.Unlock()
+
+	_, err := pq.add(id, vector)
+	return err
+}
+
+// BulkAdd inserts multiple vectors into the index. The vectors are copied, so the caller
+// keeps ownership of the slices.
 func (pq *PQIVFIndex) BulkAdd(vectors map[int][]float32) error {
 	pq.mu.Lock()
 	defer pq.mu.Unlock()
+	start := time.Now()
 
 	var keys []int
 	for id := range vectors {
@@ -175,40 +217,10 @@ func (pq *PQIVFIndex) BulkAdd(vectors map[int][]float32) error {
 		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
 	)
 
-	updatedClusters := make(map[int]bool)
 	for _, id := range keys {
-		vector := vectors[id]
-		if len(vector) != pq.dimension {
-			return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d", len(vector), pq.dimension, id)
-		}
-		if _, exists := pq.idToCluster[id]; exists {
-			return fmt.Errorf("id %d already exists", id)
-		}
-
-		var cluster int
-		// Create new centroid if needed.
-		if len(pq.coarseCentroids) < pq.coarseK {
-			cluster = len(pq.coarseCentroids)
-			centroid := make([]float32, pq.dimension)
-			copy(centroid, vector)
-			pq.coarseCentroids = append(pq.coarseCentroids, centroid)
-			pq.clusterCounts[cluster] = 1
-		} else {
-			cluster, _ = pq.nearestCentroid(vector)
-			pq.clusterCounts[cluster]++
-		}
-		pq.idToCluster[id] = cluster
-		var codes []int
-		if pq.codebooks != nil {
-			var err error
-			codes, err = pq.encodeVector(vector, cluster)
-			if err != nil {
-				return err
-			}
+		if _, err := pq.add(id, vectors[id]); err != nil {
+			return err
 		}
-		entry := pqEntry{ID: id, Vector: vector, Codes: codes, Cluster: cluster}
-		pq.invertedLists[cluster] = append(pq.invertedLists[cluster], entry)
-		updatedClusters[cluster] = true
 
 		// Update the progress bar.
 		err := bar.Add(1)
@@ -216,47 +228,67 @@ func (pq *PQIVFIndex) BulkAdd(vectors map[int][]float32) error {
 			return err
 		}
 	}
-	// Recalculate centroids for clusters that got updated.
-	for cluster := range updatedClusters {
-		pq.recalcCentroid(cluster)
-	}
+	pq.counters.RecordBuild(pq.Sink, "pqivf_bulk_add", time.Since(start))
 	return nil
 }
 
-// Delete removes an entry by its id.
-func (pq *PQIVFIndex) Delete(id int) error {
+// AddStream inserts the batches received from batches until the channel is closed (see
+// core.AddStream). Every batch is added like a BulkAdd, in the order of its rows, under a
+// write lock that is released between batches. The vectors are copied into the inverted
+// lists or encoded, so every batch is released once it is added.
+func (pq *PQIVFIndex) AddStream(batches <-chan core.Batch, opts core.StreamOptions) error {
+	return core.ConsumeBatches(batches, true, pq.addBatch)
+}
+
+// addBatch inserts the vectors of one batch of a stream.
+func (pq *PQIVFIndex) addBatch(b core.Batch) error {
 	pq.mu.Lock()
 	defer pq.mu.Unlock()
+	start := time.Now()
+	if err := b.Validate(pq.dimension); err != nil {
+		return err
+	}
+	for i, id := range b.IDs {
+		if _, err := pq.add(id, b.Row(i, pq.dimension)); err != nil {
+			return err
+		}
+	}
+	pq.counters.RecordBuild(pq.Sink, "pqivf_add_stream", time.Since(start))
+	return nil
+}
 
+// remove deletes an entry. The caller holds the write lock.
+func (pq *PQIVFIndex) remove(id int) error {
 	cluster, exists := pq.idToCluster[id]
 	if !exists {
 		return fmt.Errorf("id %d not found", id)
 	}
-	entries, ok := pq.invertedLists[cluster]
-	if !ok {
-		return fmt.Errorf("inconsistent state: cluster %d not found", cluster)
+	l := &pq.invertedLists[cluster]
+	i := l.find(id)
+	if i < 0 {
+		return fmt.Errorf("id %d not found in cluster %d", id, cluster)
 	}
-	found := false
-	var newEntries []pqEntry
-	for _, entry := range entries {
-		if entry.ID == id {
-			found = true
-			pq.clusterCounts[cluster]--
-		} else {
-			newEntries = append(newEntries, entry)
+	if pq.store != nil {
+		if err := pq.store.Delete(id); err != nil {
+			return err
 		}
 	}
-	if !found {
-		return fmt.Errorf("id %d not found in cluster %d", id, cluster)
+	if !pq.trained() {
+		pq.moveCentroid(cluster, l.vector(i, pq.dimension), len(l.IDs)-1, false)
 	}
-	pq.invertedLists[cluster] = newEntries
+	l.removeAt(i, pq.numSubquantizers, pq.dimension)
 	delete(pq.idToCluster, id)
-	if len(newEntries) > 0 {
-		pq.recalcCentroid(cluster)
-	}
 	return nil
 }
 
+// Delete removes an entry by its id.
+func (pq *PQIVFIndex) Delete(id int) error {
+	pq.mu.Lock()
+	defer pq.mu.Unlock()
+
+	return pq.remove(id)
+}
+
 // BulkDelete removes multiple entries from the index.
 func (pq *PQIVFIndex) BulkDelete(ids []int) error {
 	pq.mu.Lock()
@@ -267,46 +299,17 @@ func (pq *PQIVFIndex) BulkDelete(ids []int) error {
 	bar := progressbar.NewOptions(len(ids),
 		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
 	)
-	updatedClusters := make(map[int]bool)
 	for _, id := range ids {
-		cluster, exists := pq.idToCluster[id]
-		if !exists {
-			err := bar.Add(1)
-			if err != nil {
+		if _, exists := pq.idToCluster[id]; exists {
+			if err := pq.remove(id); err != nil {
 				return err
 			}
-			continue
-		}
-		entries, ok := pq.invertedLists[cluster]
-		if !ok {
-			err := bar.Add(1)
-			if err != nil {
-				return err
-			}
-			continue
-		}
-		var newEntries []pqEntry
-		for _, entry := range entries {
-			if entry.ID == id {
-				pq.clusterCounts[cluster]--
-			} else {
-				newEntries = append(newEntries, entry)
-			}
-		}
-		pq.invertedLists[cluster] = newEntries
-		delete(pq.idToCluster, id)
-		if len(newEntries) > 0 {
-			updatedClusters[cluster] = true
 		}
 		err := bar.Add(1)
 		if err != nil {
 			return err
 		}
 	}
-	// Recalculate centroids for updated clusters.
-	for cluster := range updatedClusters {
-		pq.recalcCentroid(cluster)
-	}
 	return nil
 }
 
@@ -342,60 +345,137 @@ func (pq *PQIVFIndex) BulkUpdate(updates map[int][]float32) error {
 	return nil
 }
 
-// Train runs k-means on residuals to train subquantizers (codebooks).
+// Train trains the coarse quantizer and the subquantizers (codebooks) with k-means.
+// The coarse centroids are trained on the raw vectors (or a random sample of
+// TrainingSampleSize of them); the subquantizers are then trained concurrently on the
+// residuals to those centroids, and every entry is reassigned and encoded. Afterwards the
+// centroids stay fixed, and raw vectors are only kept in memory if RetainVectors is set.
+// Training again needs the raw vectors, so it requires RetainVectors or a vector store.
 func (pq *PQIVFIndex) Train() error {
 	pq.mu.Lock()
 	defer pq.mu.Unlock()
 
-	if len(pq.invertedLists) == 0 {
+	start := time.Now()
+	n := len(pq.idToCluster)
+	if n == 0 {
 		return fmt.Errorf("no data to train on")
 	}
+	ids, flat, err := pq.rawVectors()
+	if err != nil {
+		return err
+	}
+	dim := pq.dimension
+	m := pq.numSubquantizers
 
-	// Prepare data for each subquantizer.
-	dataPerSub := make([][][]float32, pq.numSubquantizers)
-	for i := 0; i < pq.numSubquantizers; i++ {
-		dataPerSub[i] = make([][]float32, 0)
+	// Draw the sample and the seed of every k-means run up front, so that the result does
+	// not depend on how the runs are scheduled.
+	seededRandMu.Lock()
+	var sample []int
+	if pq.TrainingSampleSize > 0 && n > pq.TrainingSampleSize {
+		sample = seededRand.Perm(n)[:pq.TrainingSampleSize]
+	}
+	seeds := make([]int64, m+1)
+	for i := range seeds {
+		seeds[i] = seededRand.Int63()
 	}
+	seededRandMu.Unlock()
 
-	// For each entry, compute residuals and split into sub-vectors.
-	for cluster, entries := range pq.invertedLists {
-		centroid := pq.coarseCentroids[cluster]
-		for _, entry := range entries {
-			residual, err := vectorSub(entry.Vector, centroid)
-			if err != nil {
-				return err
-			}
-			subVecs := splitVector(residual, pq.numSubquantizers)
-			for i, sub := range subVecs {
-				dataPerSub[i] = append(dataPerSub[i], sub)
-			}
+	train := flat
+	if sample != nil {
+		train = make([]float32, len(sample)*dim)
+		for i, row := range sample {
+			copy(train[i*dim:(i+1)*dim], flat[row*dim:(row+1)*dim])
 		}
 	}
+	nTrain := len(train) / dim
 
-	// Train a codebook for each subquantizer.
-	codebooks := make([][][]float32, pq.numSubquantizers)
-	for i := 0; i < pq.numSubquantizers; i++ {
-		cb, err := trainSubquantizer(dataPerSub[i], pq.pqK, pq.kMeansIters)
-		if err != nil {
-			return err
-		}
-		codebooks[i] = cb
+	// Train the coarse quantizer.
+	centroids := kmeans(kmeansData{data: train, n: nTrain, stride: dim, dim: dim}, kmeansConfig{
+		k:          pq.coarseK,
+		iterations: pq.kMeansIters,
+		batchSize:  pq.MiniBatchSize,
+		rnd:        rand.New(rand.NewSource(seeds[0])),
+	})
+	graph, err := pq.newCoarseGraph(centroids)
+	if err != nil {
+		return err
 	}
+
+	// Compute the residuals of the training vectors to their nearest coarse centroid.
+	residuals := make([]float32, len(train))
+	core.ParallelRange(nTrain, 256, func(start, end int) {
+		for i := start; i < end; i++ {
+			row := train[i*dim : (i+1)*dim]
+			c := nearestIn(graph, centroids, row)
+			for j, v := range row {
+				residuals[i*dim+j] = v - centroids[c][j]
+			}
+		}
+	})
+
+	codebooks := trainCodebooks(residuals, nTrain, dim, m, pq.pqK, pq.kMeansIters, pq.MiniBatchSize, seeds[1:])
+	pq.coarseCentroids = centroids
+	pq.coarseGraph = graph
 	pq.codebooks = codebooks
 
-	// Re-encode all entries using the new codebooks.
-	for cluster, entries := range pq.invertedLists {
-		for j, entry := range entries {
-			codes, err := pq.encodeVector(entry.Vector, cluster)
+	// Reassign and encode every vector in parallel.
+	assign := make([]int, n)
+	codes := make([]int, n*m)
+	core.ParallelRange(n, 256, func(start, end int) {
+		residual := make([]float32, dim)
+		for i := start; i < end; i++ {
+			vec := flat[i*dim : (i+1)*dim]
+			c := nearestIn(graph, centroids, vec)
+			assign[i] = c
+			pq.encodeInto(vec, centroids[c], residual, codes[i*m:(i+1)*m])
+		}
+	})
+
+	// Rebuild the inverted lists with packed codes.
+	wide := pq.wideCodes()
+	lists := make([]invertedList, len(centroids))
+	for i, id := range ids {
+		c := assign[i]
+		l := &lists[c]
+		l.IDs = append(l.IDs, id)
+		l.appendCodes(codes[i*m:(i+1)*m], wide)
+		if pq.RetainVectors {
+			l.Vectors = append(l.Vectors, flat[i*dim:(i+1)*dim]...)
+		}
+		pq.idToCluster[id] = c
+	}
+	pq.invertedLists = lists
+	pq.trainingTime = time.Since(start)
+	pq.counters.RecordBuild(pq.Sink, "pqivf_train", pq.trainingTime)
+	return nil
+}
+
+// rawVectors returns the ids of all entries and their raw vectors as one row-major matrix,
+// reading from the inverted lists or, where vectors were dropped, from the vector store.
+func (pq *PQIVFIndex) rawVectors() ([]int, []float32, error) {
+	n := len(pq.idToCluster)
+	ids := make([]int, 0, n)
+	flat := make([]float32, 0, n*pq.dimension)
+	var buf []float32
+	for _, l := range pq.invertedLists {
+		ids = append(ids, l.IDs...)
+		if len(l.Vectors) == len(l.IDs)*pq.dimension {
+			flat = append(flat, l.Vectors...)
+			continue
+		}
+		if pq.store == nil {
+			return nil, nil, fmt.Errorf("raw vectors are not available for training; set RetainVectors or attach a vector store")
+		}
+		for _, id := range l.IDs {
+			v, err := pq.store.Get(id, buf)
 			if err != nil {
-				return err
+				return nil, nil, err
 			}
-			entry.Codes = codes
-			pq.invertedLists[cluster][j] = entry
+			flat = append(flat, v...)
+			buf = v
 		}
 	}
-
-	return nil
+	return ids, flat, nil
 }
 
 // encodeVector computes the PQ codes for a vector given its coarse cluster.
@@ -403,231 +483,249 @@ func (pq *PQIVFIndex) encodeVector(vector []float32, cluster int) ([]int, error)
 	if pq.codebooks == nil {
 		return nil, fmt.Errorf("codebooks not trained")
 	}
-	residual, err := vectorSub(vector, pq.coarseCentroids[cluster])
-	if err != nil {
-		return nil, err
-	}
-	subVecs := splitVector(residual, pq.numSubquantizers)
 	codes := make([]int, pq.numSubquantizers)
-	for i, sub := range subVecs {
-		best := -1
-		bestDist := math.MaxFloat64
-		for j, cent := range pq.codebooks[i] {
-			d := core.Euclidean(sub, cent)
-			if d < bestDist {
-				bestDist = d
-				best = j
-			}
-		}
-		if best < 0 {
-			return nil, fmt.Errorf("failed to encode sub-vector")
-		}
-		codes[i] = best
-	}
+	pq.encodeInto(vector, pq.coarseCentroids[cluster], make([]float32, pq.dimension), codes)
 	return codes, nil
 }
 
-// decodePQCode reconstructs an approximate residual from the PQ codes.
-func (pq *PQIVFIndex) decodePQCode(codes []int) ([]float32, error) {
-	if pq.codebooks == nil {
-		return nil, fmt.Errorf("codebooks not trained")
+// encodeInto writes the PQ codes of the residual of vector to centroid into codes,
+// using residual as scratch space.
+func (pq *PQIVFIndex) encodeInto(vector, centroid, residual []float32, codes []int) {
+	for i, v := range vector {
+		residual[i] = v - centroid[i]
 	}
-	var approx []float32
-	for i, code := range codes {
-		if i >= len(pq.codebooks) || code >= len(pq.codebooks[i]) {
-			return nil, fmt.Errorf("invalid PQ code")
-		}
-		approx = append(approx, pq.codebooks[i][code]...)
+	subDim := pq.dimension / pq.numSubquantizers
+	for i, cb := range pq.codebooks {
+		codes[i], _ = nearest(cb, residual[i*subDim:(i+1)*subDim])
 	}
-	return approx, nil
 }
 
-// vectorSub computes the element-wise subtraction of two vectors.
-func vectorSub(a, b []float32) ([]float32, error) {
-	if len(a) != len(b) {
-		return nil, fmt.Errorf("vector lengths do not match: %d vs %d", len(a), len(b))
-	}
-	res := make([]float32, len(a))
-	for i := range a {
-		res[i] = a[i] - b[i]
-	}
-	return res, nil
+// scoredEntry is a list entry scored during a search.
+type scoredEntry struct {
+	id      int     // entry id
+	cluster int     // cluster of the entry
+	pos     int     // position of the entry in its inverted list
+	dist    float64 // squared distance (approximate after the first stage of a trained index)
 }
 
-// vectorAdd computes the element-wise addition of two vectors.
-func vectorAdd(a, b []float32) ([]float32, error) {
-	if len(a) != len(b) {
-		return nil, fmt.Errorf("vector lengths do not match: %d vs %d", len(a), len(b))
-	}
-	res := make([]float32, len(a))
-	for i := range a {
-		res[i] = a[i] + b[i]
-	}
-	return res, nil
+// Search finds the k nearest neighbors for the given query vector.
+func (pq *PQIVFIndex) Search(query []float32, k int) ([]core.Neighbor, error) {
+	return pq.SearchWithOptions(query, k, core.SearchOptions{})
 }
 
-// splitVector splits a vector into numParts equal parts.
-func splitVector(vec []float32, numParts int) [][]float32 {
-	total := len(vec)
-	subDim := total / numParts
-	parts := make([][]float32, numParts)
-	start := 0
-	for i := 0; i < numParts; i++ {
-		end := start + subDim
-		parts[i] = vec[start:end]
-		start = end
+// SearchWithOptions finds the k nearest neighbors for the given query vector.
+// opts.NProbe overrides the number of coarse clusters scanned. The distance-computation and
+// time budgets of opts are checked between clusters: once they run out, no further
+// clusters are scanned. On a trained index, a positive RerankFactor (from opts, or the
+// index default) re-scores the best k*RerankFactor approximate candidates against their
+// raw vectors, taken from memory (RetainVectors) or from the attached vector store, and
+// returns exact distances. With opts.Filter, entries outside the filter are skipped by the
+// scan, and further clusters are scanned until k allowed entries are found.
+func (pq *PQIVFIndex) SearchWithOptions(query []float32, k int, opts core.SearchOptions) ([]core.Neighbor, error) {
+	var start time.Time
+	if pq.Sink != nil {
+		start = time.Now()
+	}
+	wait := core.RLockTimed(&pq.mu)
+	defer pq.mu.RUnlock()
+
+	if len(query) != pq.dimension {
+		return nil, fmt.Errorf("query dimension %d does not match index dimension %d", len(query), pq.dimension)
+	}
+	if len(pq.idToCluster) == 0 {
+		return nil, core.ErrEmptyIndex
+	}
+	rerankFactor := opts.RerankFactor
+	if rerankFactor == 0 {
+		rerankFactor = pq.RerankFactor
+	}
+	rerank := pq.trained() && rerankFactor > 0
+	if rerank && !pq.RetainVectors && pq.store == nil {
+		return nil, fmt.Errorf("re-ranking needs raw vectors; set RetainVectors or attach a vector store")
 	}
-	return parts
-}
 
-// trainSubquantizer trains a codebook for a subquantizer using k-means.
-func trainSubquantizer(data [][]float32, k int, iterations int) ([][]float32, error) {
-	if len(data) == 0 {
-		return nil, fmt.Errorf("no data for subquantizer training")
+	budget := core.NewSearchBudget(opts)
+
+	numCandidates := pq.NProbe
+	if opts.NProbe > 0 {
+		numCandidates = opts.NProbe
 	}
-	if len(data) < k {
-		k = len(data)
+	if numCandidates <= 0 {
+		numCandidates = defaultNProbe
 	}
-	centroids := make([][]float32, k)
-	seededRandMu.Lock()
-	perm := seededRand.Perm(len(data))
-	seededRandMu.Unlock()
-	for i := 0; i < k; i++ {
-		centroids[i] = make([]float32, len(data[0]))
-		copy(centroids[i], data[perm[i]])
-	}
-	for iter := 0; iter < iterations; iter++ {
-		clusters := make([][][]float32, k)
-		for i := range clusters {
-			clusters[i] = make([][]float32, 0)
-		}
-		for _, point := range data {
-			best := -1
-			bestDist := math.MaxFloat64
-			for i, cent := range centroids {
-				d := core.Euclidean(point, cent)
-				if d < bestDist {
-					bestDist = d
-					best = i
+	numCandidates = min(numCandidates, len(pq.coarseCentroids))
+	// Get nearest coarse centroids as candidate clusters. Only the probed clusters are
+	// ranked up front; the others are ranked if the search falls back to them.
+	centCandidates, computed := pq.nearestCentroids(query, numCandidates)
+	budget.Spend(computed)
+	ranked := min(numCandidates, len(centCandidates))
+	var stats core.SearchStats
+	var table *adcTable
+	if pq.trained() {
+		table = pq.newADCTable()
+	}
+	filter := opts.Filter
+	m := pq.numSubquantizers
+	count := 0
+	for _, c := range centCandidates[:ranked] {
+		count += len(pq.invertedLists[c.cluster].IDs)
+	}
+	scored := make([]scoredEntry, 0, count)
+	// Scan the top candidate clusters, and further ones while fewer than k entries were
+	// scored (entries outside the filter are skipped, so the count is of allowed entries).
+	for rank := 0; rank < len(pq.coarseCentroids); rank++ {
+		// The closest cluster is always scanned, so a search returns some results.
+		if budget.Exhausted() && len(scored) > 0 {
+			break
+		}
+		if rank >= numCandidates {
+			if len(scored) >= k {
+				break
+			}
+			stats.Fallbacks++
+		}
+		if rank == ranked {
+			centCandidates, computed = pq.rankRemaining(query, centCandidates, ranked)
+			budget.Spend(computed)
+			ranked = len(centCandidates)
+		}
+		c := centCandidates[rank]
+		cluster := c.cluster
+		l := &pq.invertedLists[cluster]
+		if len(l.IDs) == 0 {
+			continue
+		}
+		n := len(scored)
+		switch {
+		case table == nil:
+			// Untrained: exact distances on the raw vectors.
+			for i, id := range l.IDs {
+				if filter != nil && !filter.Contains(id) {
+					continue
 				}
+				d := pq.metric.Kernel(query, l.vector(i, pq.dimension))
+				scored = append(scored, scoredEntry{id, cluster, i, d})
 			}
-			clusters[best] = append(clusters[best], point)
-		}
-		for i, clusterData := range clusters {
-			if len(clusterData) == 0 {
-				// If a cluster is empty, reinitialize its centroid randomly.
-				seededRandMu.Lock()
-				index := seededRand.Intn(len(data))
-				seededRandMu.Unlock()
-				newCentroid := make([]float32, len(data[0]))
-				copy(newCentroid, data[index])
-				centroids[i] = newCentroid
-			} else {
-				newCentroid := make([]float32, len(data[0]))
-				for _, point := range clusterData {
-					for j, v := range point {
-						newCentroid[j] += v
-					}
+		case pq.wideCodes():
+			pq.fillADCTable(table, query, pq.coarseCentroids[cluster])
+			for i, id := range l.IDs {
+				if filter != nil && !filter.Contains(id) {
+					continue
 				}
-				for j := range newCentroid {
-					newCentroid[j] /= float32(len(clusterData))
+				d := scoreCodes(table, l.Codes16[i*m:(i+1)*m])
+				scored = append(scored, scoredEntry{id, cluster, i, d})
+			}
+		default:
+			// With trained codebooks, score the cluster by ADC table lookups on its PQ codes.
+			pq.fillADCTable(table, query, pq.coarseCentroids[cluster])
+			for i, id := range l.IDs {
+				if filter != nil && !filter.Contains(id) {
+					continue
 				}
-				centroids[i] = newCentroid
+				d := scoreCodes(table, l.Codes8[i*m:(i+1)*m])
+				scored = append(scored, scoredEntry{id, cluster, i, d})
 			}
 		}
+		budget.Spend(len(scored) - n)
 	}
-	return centroids, nil
-}
-
-// Search finds the k nearest neighbors for the given query vector.
-func (pq *PQIVFIndex) Search(query []float32, k int) ([]core.Neighbor, error) {
-	pq.mu.RLock()
-	defer pq.mu.RUnlock()
+	sortScored(scored)
+	stats.Candidates = len(scored)
 
-	if len(query) != pq.dimension {
-		return nil, fmt.Errorf("query dimension %d does not match index dimension %d", len(query), pq.dimension)
+	if rerank {
+		// Second stage: exact distances for the best approximate candidates.
+		n := k * rerankFactor
+		if n > len(scored) {
+			n = len(scored)
+		}
+		scored = scored[:n]
+		var buf []float32
+		for i := range scored {
+			e := &scored[i]
+			var vec []float32
+			if pq.RetainVectors {
+				vec = pq.invertedLists[e.cluster].vector(e.pos, pq.dimension)
+			} else {
+				var err error
+				if vec, err = pq.store.Get(e.id, buf); err != nil {
+					return nil, err
+				}
+				buf = vec
+			}
+			e.dist = pq.metric.Kernel(query, vec)
+		}
+		sortScored(scored)
+		budget.Spend(n)
+		stats.Reranked = n
 	}
-	// Copy query to avoid modifying original vector.
-	queryCopy := make([]float32, len(query))
-	copy(queryCopy, query)
-	query = queryCopy
-
-	if len(pq.invertedLists) == 0 {
-		return nil, fmt.Errorf("index is empty")
+	budget.Report(&stats)
+	if opts.Stats != nil {
+		*opts.Stats = stats
 	}
+	pq.counters.RecordSearch(pq.Sink, "pqivf", &stats, wait, start)
 
-	// Get nearest coarse centroids as candidate clusters.
-	centCandidates := pq.nearestCentroids(query)
-	numCandidates := pq.numCandidateClusters
-	if numCandidates > len(centCandidates) {
-		numCandidates = len(centCandidates)
-	}
-	var entries []pqEntry
-	// Collect entries from the top candidate clusters.
-	for i := 0; i < numCandidates; i++ {
-		cluster := centCandidates[i].cluster
-		entries = append(entries, pq.invertedLists[cluster]...)
+	if k > len(scored) {
+		k = len(scored)
 	}
-	// If not enough entries, add more from further clusters.
-	if len(entries) < k {
-		for i := numCandidates; i < len(centCandidates) && len(entries) < k; i++ {
-			cluster := centCandidates[i].cluster
-			entries = append(entries, pq.invertedLists[cluster]...)
-		}
-	}
-	// If still not enough, take all available entries.
-	if len(entries) < k {
-		var allEntries []pqEntry
-		for _, list := range pq.invertedLists {
-			allEntries = append(allEntries, list...)
-		}
-		entries = allEntries
+	// Distances were compared as squared values; convert only the returned ones.
+	results := make([]core.Neighbor, k)
+	for i := range results {
+		results[i] = core.Neighbor{ID: scored[i].id, Distance: pq.metric.Finalize(scored[i].dist)}
 	}
+	return results, nil
+}
 
-	var results []core.Neighbor
-	// Compute distances for each candidate entry.
-	for _, entry := range entries {
-		var d float64
-		// If PQ codebooks exist, use PQ reconstruction for approximate distance.
-		if pq.codebooks != nil && len(entry.Codes) == pq.numSubquantizers {
-			approxResidual, err := pq.decodePQCode(entry.Codes)
-			if err != nil {
-				d = pq.Distance(query, entry.Vector)
-			} else {
-				approxVec, err := vectorAdd(pq.coarseCentroids[entry.Cluster], approxResidual)
-				if err != nil {
-					d = pq.Distance(query, entry.Vector)
-				} else {
-					d = pq.Distance(query, approxVec)
-				}
-			}
-		} else {
-			d = pq.Distance(query, entry.Vector)
+// sortScored sorts scored entries by ascending distance, breaking ties by id.
+func sortScored(scored []scoredEntry) {
+	sort.Slice(scored, func(i, j int) bool {
+		if scored[i].dist == scored[j].dist {
+			return scored[i].id < scored[j].id
 		}
-		results = append(results, core.Neighbor{ID: entry.ID, Distance: d})
-	}
-	sort.Slice(results, func(i, j int) bool {
-		return results[i].Distance < results[j].Distance
+		return scored[i].dist < scored[j].dist
 	})
-	if k > len(results) {
-		k = len(results)
-	}
-	return results[:k], nil
+}
+
+// SearchBatch finds the k nearest neighbors for each query vector using the shared worker pool.
+func (pq *PQIVFIndex) SearchBatch(queries [][]float32, k int) ([][]core.Neighbor, error) {
+	return core.SearchBatch(queries, k, pq.Search)
 }
 
 // Stats returns statistics about the index (e.g. total number of entries).
 func (pq *PQIVFIndex) Stats() core.IndexStats {
 	pq.mu.RLock()
 	defer pq.mu.RUnlock()
-	count := 0
-	for _, entries := range pq.invertedLists {
-		count += len(entries)
-	}
-	return core.IndexStats{
-		Count:     count,
-		Dimension: pq.dimension,
-		Distance:  "euclidean",
+	stats := core.IndexStats{
+		Count:        len(pq.idToCluster),
+		Dimension:    pq.dimension,
+		Distance:     "euclidean",
+		TrainingTime: pq.trainingTime,
+		Memory:       pq.memory(),
+	}
+	pq.counters.Fill(&stats)
+	return stats
+}
+
+// memory returns the memory held by the index. The caller holds the lock.
+func (pq *PQIVFIndex) memory() core.MemoryStats {
+	m := core.MemoryStats{IDs: core.MapBytes(len(pq.idToCluster))}
+	for _, c := range pq.coarseCentroids {
+		m.Graph += int64(len(c)) * 4
+	}
+	if pq.coarseGraph != nil {
+		g := pq.coarseGraph.Stats().Memory
+		m.Graph += g.Vectors + g.Graph + g.Codes + g.IDs
+	}
+	for i := range pq.invertedLists {
+		l := &pq.invertedLists[i]
+		m.Vectors += int64(len(l.Vectors)) * 4
+		m.Codes += int64(len(l.Codes8)) + int64(len(l.Codes16))*2
+		m.IDs += int64(len(l.IDs)) * bits.UintSize / 8
+	}
+	for _, cb := range pq.codebooks {
+		for _, c := range cb {
+			m.Codes += int64(len(c)) * 4
+		}
 	}
+	return m
 }
 
 // serializedPQIVF is a serializable representation of the PQIVF index.
@@ -635,12 +733,16 @@ type serializedPQIVF struct {
 	Dimension        int
 	CoarseK          int
 	CoarseCentroids  [][]float32
-	ClusterCounts    map[int]int
-	InvertedLists    map[int][]pqEntry
+	InvertedLists    []invertedList
 	NumSubquantizers int
 	Codebooks        [][][]float32
 	PqK              int
 	KMeansIters      int
+	RetainVectors    bool
+	RerankFactor     int
+	NProbe           int
+	SampleSize       int
+	MiniBatchSize    int
 }
 
 // GobEncode serializes the index into bytes using gob.
@@ -651,12 +753,16 @@ func (pq *PQIVFIndex) GobEncode() ([]byte, error) {
 		Dimension:        pq.dimension,
 		CoarseK:          pq.coarseK,
 		CoarseCentroids:  pq.coarseCentroids,
-		ClusterCounts:    pq.clusterCounts,
 		InvertedLists:    pq.invertedLists,
 		NumSubquantizers: pq.numSubquantizers,
 		Codebooks:        pq.codebooks,
 		PqK:              pq.pqK,
 		KMeansIters:      pq.kMeansIters,
+		RetainVectors:    pq.RetainVectors,
+		RerankFactor:     pq.RerankFactor,
+		NProbe:           pq.NProbe,
+		SampleSize:       pq.TrainingSampleSize,
+		MiniBatchSize:    pq.MiniBatchSize,
 	}
 	var buf bytes.Buffer
 	enc := gob.NewEncoder(&buf)
@@ -666,55 +772,183 @@ func (pq *PQIVFIndex) GobEncode() ([]byte, error) {
 	return buf.Bytes(), nil
 }
 
-// GobDecode deserializes the index from bytes using gob.
+// legacyPQIVF is the gob encoding of the first PQIVF version, whose inverted lists held
+// entries with their vectors and unpacked codes.
+type legacyPQIVF struct {
+	Dimension        int
+	CoarseK          int
+	CoarseCentroids  [][]float32
+	InvertedLists    map[int][]legacyEntry
+	NumSubquantizers int
+	Codebooks        [][][]float32
+	PqK              int
+	KMeansIters      int
+}
+
+// legacyEntry is an entry of an inverted list of a legacyPQIVF.
+type legacyEntry struct {
+	ID      int       // entry id
+	Vector  []float32 // original vector
+	Codes   []int     // PQ codes (if trained)
+	Cluster int       // coarse cluster assignment
+}
+
+// serialized converts the legacy encoding into the current one. The first version moved
+// its centroids after assigning entries to them, so every entry is assigned to its nearest
+// centroid again, as Train does. It kept every vector, so the vectors are kept, with
+// RetainVectors set once trained; the codes are left to encodeLegacyLists, as the saved
+// ones belong to the old assignment.
+func (l *legacyPQIVF) serialized() (serializedPQIVF, error) {
+	ser := serializedPQIVF{
+		Dimension:        l.Dimension,
+		CoarseK:          l.CoarseK,
+		CoarseCentroids:  l.CoarseCentroids,
+		InvertedLists:    make([]invertedList, len(l.CoarseCentroids)),
+		NumSubquantizers: l.NumSubquantizers,
+		Codebooks:        l.Codebooks,
+		PqK:              l.PqK,
+		KMeansIters:      l.KMeansIters,
+		RetainVectors:    l.Codebooks != nil,
+	}
+	for cluster := range l.InvertedLists {
+		if cluster < 0 || cluster >= len(ser.InvertedLists) {
+			return ser, fmt.Errorf("corrupt PQIVF index data: entries in cluster %d of %d", cluster, len(ser.InvertedLists))
+		}
+	}
+	for cluster := range ser.InvertedLists {
+		for _, e := range l.InvertedLists[cluster] {
+			if len(e.Vector) != l.Dimension {
+				return ser, fmt.Errorf("corrupt PQIVF index data: vector of dimension %d for id %d", len(e.Vector), e.ID)
+			}
+			c, _ := nearest(l.CoarseCentroids, e.Vector)
+			list := &ser.InvertedLists[c]
+			list.IDs = append(list.IDs, e.ID)
+			list.Vectors = append(list.Vectors, e.Vector...)
+		}
+	}
+	return ser, nil
+}
+
+// encodeLegacyLists encodes the vectors of the inverted lists of a decoded legacy file with
+// the saved codebooks.
+func (pq *PQIVFIndex) encodeLegacyLists() {
+	m, wide := pq.numSubquantizers, pq.wideCodes()
+	codes := make([]int, m)
+	residual := make([]float32, pq.dimension)
+	for c := range pq.invertedLists {
+		l := &pq.invertedLists[c]
+		for i := range l.IDs {
+			pq.encodeInto(l.vector(i, pq.dimension), pq.coarseCentroids[c], residual, codes)
+			l.appendCodes(codes, wide)
+		}
+	}
+}
+
+// GobDecode deserializes the index from bytes using gob. Files of the first version, whose
+// inverted lists held entries, are converted (see legacyPQIVF).
+// An attached vector store is not part of the saved state and has to be set again.
 func (pq *PQIVFIndex) GobDecode(data []byte) error {
 	var ser serializedPQIVF
-	buf := bytes.NewBuffer(data)
-	dec := gob.NewDecoder(buf)
-	if err := dec.Decode(&ser); err != nil {
-		return err
+	legacy := false
+	if err := gob.NewDecoder(bytes.NewReader(data)).Decode(&ser); err != nil {
+		var old legacyPQIVF
+		if gob.NewDecoder(bytes.NewReader(data)).Decode(&old) != nil {
+			return err
+		}
+		if ser, err = old.serialized(); err != nil {
+			return err
+		}
+		legacy = true
+	}
+	if ser.NumSubquantizers <= 0 || ser.Dimension%ser.NumSubquantizers != 0 ||
+		(ser.Codebooks != nil && len(ser.Codebooks) != ser.NumSubquantizers) {
+		return fmt.Errorf("corrupt PQIVF index data: %d subquantizers for dimension %d",
+			ser.NumSubquantizers, ser.Dimension)
+	}
+	if len(ser.InvertedLists) != len(ser.CoarseCentroids) {
+		return fmt.Errorf("corrupt PQIVF index data: %d inverted lists for %d centroids",
+			len(ser.InvertedLists), len(ser.CoarseCentroids))
+	}
+	var graph *hnsw.HNSWIndex
+	if ser.Codebooks != nil {
+		var err error
+		if graph, err = pq.newCoarseGraph(ser.CoarseCentroids); err != nil {
+			return err
+		}
 	}
 	pq.dimension = ser.Dimension
 	pq.coarseK = ser.CoarseK
 	pq.coarseCentroids = ser.CoarseCentroids
-	pq.clusterCounts = ser.ClusterCounts
+	pq.coarseGraph = graph
 	pq.invertedLists = ser.InvertedLists
 	pq.numSubquantizers = ser.NumSubquantizers
 	pq.codebooks = ser.Codebooks
 	pq.pqK = ser.PqK
 	pq.kMeansIters = ser.KMeansIters
+	pq.RetainVectors = ser.RetainVectors
+	pq.RerankFactor = ser.RerankFactor
+	pq.NProbe = ser.NProbe
+	if pq.NProbe <= 0 {
+		pq.NProbe = defaultNProbe
+	}
+	pq.TrainingSampleSize = ser.SampleSize
+	pq.MiniBatchSize = ser.MiniBatchSize
 	pq.idToCluster = make(map[int]int)
 	// Rebuild idToCluster mapping from the inverted lists.
-	for cluster, entries := range pq.invertedLists {
-		for _, entry := range entries {
-			pq.idToCluster[entry.ID] = cluster
+	for cluster, l := range pq.invertedLists {
+		for _, id := range l.IDs {
+			pq.idToCluster[id] = cluster
 		}
 	}
+	pq.store = nil
 	pq.Distance = core.Euclidean
+	pq.metric = core.Metrics["euclidean"]
+	if legacy && pq.trained() {
+		pq.encodeLegacyLists()
+	}
 	return nil
 }
 
-// Save writes the index to the given writer using gob encoding.
+// Save writes the index to the given writer in the sectioned binary format (see core.WriteSections).
+// The index arrays are streamed to w without an intermediate buffer.
 func (pq *PQIVFIndex) Save(w io.Writer) error {
 	pq.mu.RLock()
 	defer pq.mu.RUnlock()
-	enc := gob.NewEncoder(w)
-	return enc.Encode(pq)
+	return core.WriteSections(w, formatKind, pq.sections())
 }
 
-// Load reads the index from the given reader using gob decoding.
+// Load reads an index written by Save from the given reader.
+// Gob files are still accepted: those of the packed lists and those of the first version,
+// which are converted (see legacyPQIVF). An attached vector store is not part of the saved state and has to be set again.
 func (pq *PQIVFIndex) Load(r io.Reader) error {
 	pq.mu.Lock()
 	defer pq.mu.Unlock()
-	dec := gob.NewDecoder(r)
-	return dec.Decode(pq)
+	br := bufio.NewReader(r)
+	if prefix, _ := br.Peek(core.SectionMagicLen); !core.IsSectionFile(prefix) {
+		dec := gob.NewDecoder(br)
+		if err := dec.Decode(pq); err != nil {
+			return err
+		}
+	} else {
+		f, err := core.ReadSections(br)
+		if err != nil {
+			return err
+		}
+		if err := pq.loadSections(f); err != nil {
+			return err
+		}
+	}
+	pq.setMapping(nil)
+	return nil
 }
 
 // Check interface compliance.
-var _ core.Index = (*PQIVFIndex)(nil)
+var (
+	_ core.Index       = (*PQIVFIndex)(nil)
+	_ core.StreamAdder = (*PQIVFIndex)(nil)
+)
 
 // init registers types for gob encoding.
 func init() {
 	gob.Register(&PQIVFIndex{})
-	gob.Register(pqEntry{})
 }
@@ -2,9 +2,14 @@ package pqivf_test
 
 import (
 	"bytes"
+	"encoding/gob"
+	"math"
+	"os"
+	"path/filepath"
 	"sync"
 	"testing"
 
+	"github.com/patrikhermansson/hann/core"
 	"github.com/patrikhermansson/hann/pqivf"
 )
 
@@ -209,3 +214,563 @@ func TestPQIVF_ConcurrentOperations(t *testing.T) {
 		t.Errorf("expected %d vectors, got %d", numVectors, stats.Count)
 	}
 }
+
+func TestPQIVF_SearchBatch(t *testing.T) {
+	idx := pqivf.NewPQIVFIndex(6, 3, 2, 256, 10)
+
+	vectors := map[int][]float32{
+		1: {1, 2, 3, 4, 5, 6},
+		2: {6, 5, 4, 3, 2, 1},
+		3: {1, 1, 1, 1, 1, 1},
+		4: {2, 2, 2, 2, 2, 2},
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	// Each query is an indexed vector, so it should come back as its own nearest neighbor.
+	ids := []int{1, 2, 3, 4, 2, 1}
+	queries := make([][]float32, len(ids))
+	for i, id := range ids {
+		queries[i] = vectors[id]
+	}
+	results, err := idx.SearchBatch(queries, 1)
+	if err != nil {
+		t.Fatalf("SearchBatch failed: %v", err)
+	}
+	if len(results) != len(queries) {
+		t.Fatalf("expected %d result lists, got %d", len(queries), len(results))
+	}
+	for i, res := range results {
+		if len(res) != 1 || res[0].ID != ids[i] {
+			t.Errorf("query %d: expected neighbor id %d, got %v", i, ids[i], res)
+		}
+	}
+
+	// A query with the wrong dimension fails the whole batch.
+	if _, err := idx.SearchBatch([][]float32{{1, 2, 3}}, 1); err == nil {
+		t.Error("expected error for query dimension mismatch, got none")
+	}
+}
+
+// baselinePQIVF and baselineEntry mirror the gob encoding of the first PQIVF version,
+// whose inverted lists held entries.
+type baselinePQIVF struct {
+	Dimension        int
+	CoarseK          int
+	CoarseCentroids  [][]float32
+	ClusterCounts    map[int]int
+	InvertedLists    map[int][]baselineEntry
+	NumSubquantizers int
+	Codebooks        [][][]float32
+	PqK              int
+	KMeansIters      int
+}
+
+type baselineEntry struct {
+	ID      int
+	Vector  []float32
+	Codes   []int
+	Cluster int
+}
+
+// baselineFile is the index as the first version saved it: a gob-encoded index whose
+// GobEncode encodes a baselinePQIVF.
+type baselineFile struct{ index baselinePQIVF }
+
+func (b baselineFile) GobEncode() ([]byte, error) {
+	var buf bytes.Buffer
+	err := gob.NewEncoder(&buf).Encode(b.index)
+	return buf.Bytes(), err
+}
+
+func TestPQIVF_LoadBaselineGob(t *testing.T) {
+	dim := 8
+	vectors := groupedVectors(200, dim)
+	for _, trained := range []bool{false, true} {
+		// The vectors of group g are near g*10+0.5 in every dimension.
+		legacy := baselinePQIVF{Dimension: dim, CoarseK: 4, NumSubquantizers: 2, PqK: 4, KMeansIters: 5,
+			ClusterCounts: make(map[int]int), InvertedLists: make(map[int][]baselineEntry)}
+		for g := 0; g < 4; g++ {
+			centroid := make([]float32, dim)
+			for j := range centroid {
+				centroid[j] = float32(g*10) + 0.5
+			}
+			legacy.CoarseCentroids = append(legacy.CoarseCentroids, centroid)
+		}
+		if trained {
+			for i := 0; i < 2; i++ {
+				var codebook [][]float32
+				for _, r := range []float32{-0.4, -0.1, 0.1, 0.4} {
+					codebook = append(codebook, []float32{r, r, r, r})
+				}
+				legacy.Codebooks = append(legacy.Codebooks, codebook)
+			}
+		}
+		for id := 0; id < len(vectors); id++ {
+			entry := baselineEntry{ID: id, Vector: vectors[id], Cluster: id % 4}
+			if trained {
+				entry.Codes = []int{0, 0} // stale codes are encoded again
+			}
+			legacy.InvertedLists[id%4] = append(legacy.InvertedLists[id%4], entry)
+			legacy.ClusterCounts[id%4]++
+		}
+		var file bytes.Buffer
+		if err := gob.NewEncoder(&file).Encode(baselineFile{legacy}); err != nil {
+			t.Fatalf("gob encoding failed: %v", err)
+		}
+
+		idx := pqivf.NewPQIVFIndex(dim, 4, 2, 4, 5)
+		if err := idx.Load(&file); err != nil {
+			t.Fatalf("trained=%v: Load of baseline gob data failed: %v", trained, err)
+		}
+		if count := idx.Stats().Count; count != len(vectors) {
+			t.Fatalf("trained=%v: expected %d vectors, got %d", trained, len(vectors), count)
+		}
+		if codes := idx.Stats().Memory.Codes; trained != (codes > 0) {
+			t.Errorf("trained=%v: unexpected code memory %d", trained, codes)
+		}
+		for _, id := range []int{0, 42, 199} {
+			res, err := idx.SearchWithOptions(vectors[id], 5, core.SearchOptions{RerankFactor: 40})
+			if err != nil {
+				t.Fatalf("trained=%v: Search failed: %v", trained, err)
+			}
+			// groupedVectors repeats every 44 ids, so the copies of the query tie with it.
+			found := false
+			for _, n := range res {
+				found = found || (n.ID == id && n.Distance == 0)
+			}
+			if len(res) != 5 || res[0].Distance != 0 || !found {
+				t.Errorf("trained=%v: expected id %d at distance 0, got %v", trained, id, res)
+			}
+		}
+		if err := idx.Update(42, vectors[43]); err != nil {
+			t.Errorf("trained=%v: Update failed: %v", trained, err)
+		}
+	}
+}
+
+func TestPQIVF_TrainedSearch(t *testing.T) {
+	dim := 8
+	idx := pqivf.NewPQIVFIndex(dim, 4, 4, 16, 10)
+
+	vectors := groupedVectors(200, dim)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+
+	// Approximate distances should still rank vectors of the query's group first.
+	query := vectors[42]
+	neighbors, err := idx.Search(query, 10)
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if len(neighbors) != 10 {
+		t.Fatalf("expected 10 neighbors, got %d", len(neighbors))
+	}
+	for i, n := range neighbors {
+		if n.ID%4 != 42%4 {
+			t.Errorf("neighbor %d: id %d is not in the query's group", i, n.ID)
+		}
+		if i > 0 && n.Distance < neighbors[i-1].Distance {
+			t.Errorf("neighbors are not sorted by distance: %v", neighbors)
+		}
+	}
+}
+
+func TestPQIVF_MiniBatchTraining(t *testing.T) {
+	dim := 8
+	idx := pqivf.NewPQIVFIndex(dim, 4, 4, 16, 20)
+	idx.TrainingSampleSize = 300
+	idx.MiniBatchSize = 64
+
+	vectors := groupedVectors(1000, dim)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+	stats := idx.Stats()
+	if stats.Count != 1000 {
+		t.Errorf("expected count 1000, got %d", stats.Count)
+	}
+	if stats.TrainingTime <= 0 {
+		t.Errorf("expected a positive training time, got %v", stats.TrainingTime)
+	}
+
+	// Every entry is encoded, including those outside the training sample.
+	query := vectors[501]
+	neighbors, err := idx.Search(query, 10)
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if len(neighbors) != 10 {
+		t.Fatalf("expected 10 neighbors, got %d", len(neighbors))
+	}
+	for i, n := range neighbors {
+		if n.ID%4 != 501%4 {
+			t.Errorf("neighbor %d: id %d is not in the query's group", i, n.ID)
+		}
+	}
+}
+
+// groupedVectors returns n vectors in four well separated groups (by id modulo 4).
+func groupedVectors(n, dim int) map[int][]float32 {
+	vectors := make(map[int][]float32, n)
+	for id := 0; id < n; id++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = float32((id%4)*10) + float32((id*7+j*3)%11)/10
+		}
+		vectors[id] = vec
+	}
+	return vectors
+}
+
+func TestPQIVF_CompressedStorage(t *testing.T) {
+	dim := 8
+	vectors := groupedVectors(200, dim)
+
+	// pqK above 256 stores 16-bit codes.
+	for _, pqK := range []int{16, 300} {
+		idx := pqivf.NewPQIVFIndex(dim, 4, 4, pqK, 5)
+		if err := idx.BulkAdd(vectors); err != nil {
+			t.Fatalf("BulkAdd failed: %v", err)
+		}
+		if err := idx.Train(); err != nil {
+			t.Fatalf("Train failed: %v", err)
+		}
+		// Raw vectors are dropped after training, so the codebooks cannot be retrained.
+		if err := idx.Train(); err == nil {
+			t.Errorf("pqK=%d: expected error when retraining without raw vectors, got none", pqK)
+		}
+
+		// Entries added, updated and deleted after training are encoded directly.
+		if err := idx.Add(1000, vectors[5]); err != nil {
+			t.Fatalf("Add failed: %v", err)
+		}
+		if err := idx.Update(7, vectors[3]); err != nil {
+			t.Fatalf("Update failed: %v", err)
+		}
+		if err := idx.Delete(11); err != nil {
+			t.Fatalf("Delete failed: %v", err)
+		}
+		if stats := idx.Stats(); stats.Count != 200 {
+			t.Errorf("pqK=%d: expected count 200, got %d", pqK, stats.Count)
+		}
+
+		var buf bytes.Buffer
+		if err := idx.Save(&buf); err != nil {
+			t.Fatalf("Save failed: %v", err)
+		}
+		loaded := pqivf.NewPQIVFIndex(dim, 4, 4, pqK, 5)
+		if err := loaded.Load(&buf); err != nil {
+			t.Fatalf("Load failed: %v", err)
+		}
+		neighbors, err := loaded.Search(vectors[5], 5)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		for _, n := range neighbors {
+			if n.ID == 11 {
+				t.Errorf("pqK=%d: deleted id 11 returned in search results", pqK)
+			}
+			if n.ID%4 != 1 && n.ID != 1000 {
+				t.Errorf("pqK=%d: id %d is not in the query's group", pqK, n.ID)
+			}
+		}
+	}
+}
+
+func TestPQIVF_VectorStore(t *testing.T) {
+	dim := 8
+	vectors := groupedVectors(100, dim)
+	store, err := core.OpenFileVectorStore(filepath.Join(t.TempDir(), "vectors.bin"), dim)
+	if err != nil {
+		t.Fatalf("OpenFileVectorStore failed: %v", err)
+	}
+	defer store.Close()
+
+	idx := pqivf.NewPQIVFIndex(dim, 4, 4, 16, 5)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.SetVectorStore(store); err != nil {
+		t.Fatalf("SetVectorStore failed: %v", err)
+	}
+	if store.Len() != len(vectors) {
+		t.Errorf("expected %d vectors in the store, got %d", len(vectors), store.Len())
+	}
+	if err := idx.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+	// The raw vectors live in the store, so retraining remains possible.
+	if err := idx.Train(); err != nil {
+		t.Errorf("expected retraining from the vector store to succeed, got %v", err)
+	}
+	if err := idx.Delete(3); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	if _, err := store.Get(3, nil); err == nil {
+		t.Error("expected deleted id to be removed from the vector store")
+	}
+}
+
+func TestPQIVF_Rerank(t *testing.T) {
+	dim, k := 8, 5
+	vectors := groupedVectors(200, dim)
+	query := vectors[42]
+
+	// A tiny codebook makes the ADC distances coarse; re-ranking must return exact ones.
+	idx := pqivf.NewPQIVFIndex(dim, 4, 2, 4, 5)
+	idx.RetainVectors = true
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+
+	var stats core.SearchStats
+	neighbors, err := idx.SearchWithOptions(query, k, core.SearchOptions{RerankFactor: 4, Stats: &stats})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if stats.Reranked != k*4 || stats.Candidates < stats.Reranked {
+		t.Errorf("expected %d re-ranked candidates out of at least as many, got %+v", k*4, stats)
+	}
+	if len(neighbors) != k || neighbors[0].ID != 42 || neighbors[0].Distance != 0 {
+		t.Fatalf("expected the query itself at distance 0 first, got %v", neighbors)
+	}
+	for _, n := range neighbors {
+		if want := core.Euclidean(query, vectors[n.ID]); math.Abs(n.Distance-want) > 1e-4 {
+			t.Errorf("id %d: expected exact distance %f, got %f", n.ID, want, n.Distance)
+		}
+	}
+
+	// Without raw vectors in memory, re-ranking reads them from a memory-mapped store.
+	path := filepath.Join(t.TempDir(), "vectors.bin")
+	store, err := core.OpenFileVectorStore(path, dim)
+	if err != nil {
+		t.Fatalf("OpenFileVectorStore failed: %v", err)
+	}
+	for id, vec := range vectors {
+		if err := store.Put(id, vec); err != nil {
+			t.Fatalf("Put failed: %v", err)
+		}
+	}
+	store.Close()
+	mapped, err := core.OpenMappedVectorStore(path, dim)
+	if err != nil {
+		t.Fatalf("OpenMappedVectorStore failed: %v", err)
+	}
+	defer mapped.Close()
+
+	compact := pqivf.NewPQIVFIndex(dim, 4, 2, 4, 5)
+	compact.RerankFactor = 4
+	if err := compact.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := compact.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+	if _, err := compact.Search(query, k); err == nil {
+		t.Error("expected error when re-ranking without raw vectors, got none")
+	}
+	if err := compact.SetVectorStore(mapped); err != nil {
+		t.Fatalf("SetVectorStore failed: %v", err)
+	}
+	neighbors, err = compact.SearchWithOptions(query, k, core.SearchOptions{Stats: &stats})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if stats.Reranked != k*4 {
+		t.Errorf("expected %d re-ranked candidates with the index default factor, got %d", k*4, stats.Reranked)
+	}
+	for _, n := range neighbors {
+		if want := core.Euclidean(query, vectors[n.ID]); math.Abs(n.Distance-want) > 1e-4 {
+			t.Errorf("id %d: expected exact distance %f, got %f", n.ID, want, n.Distance)
+		}
+	}
+}
+
+func TestPQIVF_SearchWithOptions(t *testing.T) {
+	dim := 8
+	idx := pqivf.NewPQIVFIndex(dim, 8, 4, 16, 10)
+	if err := idx.BulkAdd(groupedVectors(400, dim)); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+	query := make([]float32, dim)
+
+	var one, all core.SearchStats
+	if _, err := idx.SearchWithOptions(query, 5, core.SearchOptions{NProbe: 1, Stats: &one}); err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if _, err := idx.SearchWithOptions(query, 5, core.SearchOptions{NProbe: 8, Stats: &all}); err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if all.Candidates != 400 || one.Candidates >= all.Candidates {
+		t.Errorf("expected nprobe=8 to scan every entry and nprobe=1 fewer, got %+v and %+v", all, one)
+	}
+
+	// A budget smaller than one list stops after the closest cluster.
+	var limited core.SearchStats
+	neighbors, err := idx.SearchWithOptions(query, 5, core.SearchOptions{
+		NProbe:                  8,
+		MaxDistanceComputations: 1,
+		Stats:                   &limited,
+	})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if !limited.Truncated || limited.Candidates > one.Candidates || len(neighbors) == 0 {
+		t.Errorf("expected a truncated search of the closest cluster, got %+v", limited)
+	}
+}
+
+func TestPQIVF_Instrumentation(t *testing.T) {
+	dim := 8
+	idx := pqivf.NewPQIVFIndex(dim, 8, 4, 16, 10)
+	var sink core.MapSink
+	idx.Sink = &sink
+	if err := idx.BulkAdd(groupedVectors(400, dim)); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+	query := make([]float32, dim)
+
+	// More neighbors than one cluster holds widen the scan to further clusters.
+	var stats core.SearchStats
+	if _, err := idx.SearchWithOptions(query, 300, core.SearchOptions{NProbe: 1, Stats: &stats}); err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if stats.Fallbacks == 0 {
+		t.Errorf("expected the scan to be widened, got %+v", stats)
+	}
+	if _, err := idx.Search(query, 5); err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+
+	total := idx.Stats()
+	if total.Searches != 2 || total.Fallbacks != int64(stats.Fallbacks) || total.Builds != 2 ||
+		total.DistanceComputations < int64(stats.DistanceComputations) {
+		t.Errorf("unexpected totals %+v", total)
+	}
+	// Trained without RetainVectors, the entries are held as codes only.
+	if total.Memory.Vectors != 0 || total.Memory.Codes < 400*4 || total.Memory.IDs == 0 || total.Memory.Graph == 0 {
+		t.Errorf("unexpected memory %+v", total.Memory)
+	}
+	if n := sink.Counter("pqivf_searches"); n != 2 {
+		t.Errorf("expected 2 searches in the sink, got %d", n)
+	}
+	if n := sink.Counter("pqivf_search_fallbacks"); n != int64(stats.Fallbacks) {
+		t.Errorf("expected %d fallbacks in the sink, got %d", stats.Fallbacks, n)
+	}
+	if h := sink.Histogram("pqivf_train_seconds"); h.Count != 1 {
+		t.Errorf("expected one training in the sink, got %+v", h)
+	}
+}
+
+func TestPQIVF_FilteredSearch(t *testing.T) {
+	dim := 8
+	idx := pqivf.NewPQIVFIndex(dim, 8, 4, 16, 10)
+	vectors := groupedVectors(400, dim)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	// A few ids of the group of the query, and ids spread over the other groups.
+	filter := core.NewBitset(10, 50, 90)
+	for id := 1; id < 400; id += 40 {
+		filter.Add(id)
+	}
+	for _, train := range []bool{false, true} {
+		if train {
+			if err := idx.Train(); err != nil {
+				t.Fatalf("Train failed: %v", err)
+			}
+		}
+		var stats core.SearchStats
+		neighbors, err := idx.SearchWithOptions(vectors[10], 8, core.SearchOptions{NProbe: 1, Filter: filter, Stats: &stats})
+		if err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+		// The probed cluster holds only some of the allowed ids; further clusters fill the rest.
+		if len(neighbors) != 8 || stats.Fallbacks == 0 || stats.Candidates > filter.Len() {
+			t.Fatalf("expected 8 neighbors from widened scans of allowed entries, got %v and %+v", neighbors, stats)
+		}
+		for _, n := range neighbors {
+			if !filter.Contains(n.ID) {
+				t.Errorf("neighbor %d is not in the filter", n.ID)
+			}
+		}
+		if neighbors[0].ID != 10 {
+			t.Errorf("expected the query itself first, got %v", neighbors)
+		}
+	}
+}
+
+func TestPQIVF_LoadFile(t *testing.T) {
+	dim := 8
+	vectors := groupedVectors(300, dim)
+	idx := pqivf.NewPQIVFIndex(dim, 4, 4, 300, 10)
+	idx.RetainVectors = true
+	idx.NProbe = 2
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := idx.Train(); err != nil {
+		t.Fatalf("Train failed: %v", err)
+	}
+	path := filepath.Join(t.TempDir(), "index.hann")
+	var saved bytes.Buffer
+	if err := idx.Save(&saved); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	if err := os.WriteFile(path, saved.Bytes(), 0o644); err != nil {
+		t.Fatal(err)
+	}
+
+	loaded := pqivf.NewPQIVFIndex(dim, 4, 4, 300, 10)
+	if err := loaded.LoadFile(path); err != nil {
+		t.Fatalf("LoadFile failed: %v", err)
+	}
+	if !loaded.RetainVectors || loaded.NProbe != 2 || loaded.Stats().Count != 300 {
+		t.Errorf("parameters not restored: RetainVectors=%v NProbe=%d count=%d",
+			loaded.RetainVectors, loaded.NProbe, loaded.Stats().Count)
+	}
+	opts := core.SearchOptions{RerankFactor: 4}
+	want, err := idx.SearchWithOptions(vectors[42], 5, opts)
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	got, err := loaded.SearchWithOptions(vectors[42], 5, opts)
+	if err != nil {
+		t.Fatalf("Search on mapped index failed: %v", err)
+	}
+	for i := range want {
+		if got[i] != want[i] {
+			t.Fatalf("expected %v from mapped index, got %v", want, got)
+		}
+	}
+
+	// Compressed entries can be added and removed on the copy-on-write mapping.
+	if err := loaded.Delete(42); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	if err := loaded.Add(1000, vectors[42]); err != nil {
+		t.Fatalf("Add failed: %v", err)
+	}
+	data, err := os.ReadFile(path)
+	if err != nil || !bytes.Equal(data, saved.Bytes()) {
+		t.Error("modifying the mapped index changed its file")
+	}
+}
@@ -0,0 +1,239 @@
+package pqivf
+
+import (
+	"math"
+	"math/rand"
+	"sync/atomic"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// kmeansPlusPlusMaxK is the largest k initialized with k-means++.
+// Larger k (e.g. big coarse quantizers) start from distinct random rows instead,
+// because k-means++ needs k passes over its sample.
+const kmeansPlusPlusMaxK = 256
+
+// kmeansInitSample is the number of rows per centroid that k-means++ initialization looks at.
+const kmeansInitSample = 16
+
+// kmeansData is a row-major view of training vectors without copying them.
+// Row i is data[i*stride+offset : i*stride+offset+dim], so the sub-vectors of one
+// subquantizer can be read straight from a matrix of full residuals.
+type kmeansData struct {
+	data   []float32
+	n      int // number of rows
+	stride int // distance between the starts of consecutive rows
+	offset int // offset of the first element of a row
+	dim    int // number of elements per row
+}
+
+// row returns row i of the view.
+func (m kmeansData) row(i int) []float32 {
+	start := i*m.stride + m.offset
+	return m.data[start : start+m.dim : start+m.dim]
+}
+
+// kmeansConfig controls a k-means run.
+type kmeansConfig struct {
+	k          int        // number of centroids
+	iterations int        // maximum number of iterations (or mini-batches)
+	batchSize  int        // mini-batch size; 0 runs full-batch Lloyd iterations
+	rnd        *rand.Rand // random source owned by this run
+}
+
+// nearest returns the index of the centroid closest to v and its squared distance.
+func nearest(centroids [][]float32, v []float32) (int, float32) {
+	best := 0
+	bestDist := float32(math.MaxFloat32)
+	for i, c := range centroids {
+		if d := core.SquaredL2(v, c); d < bestDist {
+			best, bestDist = i, d
+		}
+	}
+	return best, bestDist
+}
+
+// newCentroids allocates k centroids of dimension dim in one contiguous block.
+func newCentroids(k, dim int) [][]float32 {
+	block := make([]float32, k*dim)
+	centroids := make([][]float32, k)
+	for i := range centroids {
+		centroids[i] = block[i*dim : (i+1)*dim : (i+1)*dim]
+	}
+	return centroids
+}
+
+// kmeans clusters the rows of m into at most cfg.k centroids.
+// Assignment runs in parallel on the shared worker pool, and centroids are accumulated in
+// place (each worker owns a block of centroids), so no per-cluster buckets are built.
+func kmeans(m kmeansData, cfg kmeansConfig) [][]float32 {
+	k := cfg.k
+	if k > m.n {
+		k = m.n
+	}
+	if k <= 0 {
+		return nil
+	}
+	centroids := initCentroids(m, k, cfg.rnd)
+	if cfg.batchSize > 0 && cfg.batchSize < m.n {
+		miniBatchKMeans(m, centroids, cfg)
+		return centroids
+	}
+
+	assign := make([]int32, m.n)
+	for i := range assign {
+		assign[i] = -1
+	}
+	counts := make([]int, k)
+	for iter := 0; iter < cfg.iterations; iter++ {
+		// Assign every row to its nearest centroid.
+		var changed atomic.Bool
+		core.ParallelRange(m.n, 256, func(start, end int) {
+			moved := false
+			for i := start; i < end; i++ {
+				c, _ := nearest(centroids, m.row(i))
+				if assign[i] != int32(c) {
+					assign[i] = int32(c)
+					moved = true
+				}
+			}
+			if moved {
+				changed.Store(true)
+			}
+		})
+		if !changed.Load() {
+			break
+		}
+		accumulate(m, assign, centroids, counts)
+		// Reseed empty clusters from random rows.
+		for c, n := range counts {
+			if n == 0 {
+				copy(centroids[c], m.row(cfg.rnd.Intn(m.n)))
+			}
+		}
+	}
+	return centroids
+}
+
+// accumulate recomputes every centroid as the mean of its assigned rows.
+// Centroids are split into blocks that are updated in parallel.
+func accumulate(m kmeansData, assign []int32, centroids [][]float32, counts []int) {
+	k := len(centroids)
+	blocks := core.Workers()
+	if blocks > k {
+		blocks = k
+	}
+	per := (k + blocks - 1) / blocks
+	core.ParallelFor(blocks, func(b int) {
+		lo, hi := int32(b*per), int32((b+1)*per)
+		if int(hi) > k {
+			hi = int32(k)
+		}
+		sums := make([]float64, int(hi-lo)*m.dim)
+		for c := lo; c < hi; c++ {
+			counts[c] = 0
+		}
+		for i, c := range assign {
+			if c < lo || c >= hi {
+				continue
+			}
+			counts[c]++
+			sum := sums[int(c-lo)*m.dim:]
+			for j, v := range m.row(i) {
+				sum[j] += float64(v)
+			}
+		}
+		for c := lo; c < hi; c++ {
+			if counts[c] == 0 {
+				continue
+			}
+			sum := sums[int(c-lo)*m.dim:]
+			inv := 1 / float64(counts[c])
+			for j := range centroids[c] {
+				centroids[c][j] = float32(sum[j] * inv)
+			}
+		}
+	})
+}
+
+// miniBatchKMeans refines centroids with mini-batch k-means: each iteration assigns a random
+// batch of rows in parallel and moves every centroid towards its rows with a per-centroid
+// learning rate of 1/count.
+func miniBatchKMeans(m kmeansData, centroids [][]float32, cfg kmeansConfig) {
+	counts := make([]int, len(centroids))
+	batch := make([]int, cfg.batchSize)
+	assign := make([]int32, cfg.batchSize)
+	for iter := 0; iter < cfg.iterations; iter++ {
+		for i := range batch {
+			batch[i] = cfg.rnd.Intn(m.n)
+		}
+		core.ParallelRange(len(batch), 256, func(start, end int) {
+			for i := start; i < end; i++ {
+				c, _ := nearest(centroids, m.row(batch[i]))
+				assign[i] = int32(c)
+			}
+		})
+		for i, row := range batch {
+			c := assign[i]
+			counts[c]++
+			eta := 1 / float32(counts[c])
+			for j, v := range m.row(row) {
+				centroids[c][j] += eta * (v - centroids[c][j])
+			}
+		}
+	}
+}
+
+// initCentroids picks k starting centroids. Small k use k-means++ on a random sample of the
+// rows; large k use distinct random rows.
+func initCentroids(m kmeansData, k int, rnd *rand.Rand) [][]float32 {
+	centroids := newCentroids(k, m.dim)
+	if k > kmeansPlusPlusMaxK {
+		for i, row := range rnd.Perm(m.n)[:k] {
+			copy(centroids[i], m.row(row))
+		}
+		return centroids
+	}
+
+	// k-means++ over a sample: each next centroid is drawn with probability proportional
+	// to the squared distance to the closest centroid chosen so far.
+	sample := rnd.Perm(m.n)
+	if n := kmeansInitSample * k; n < len(sample) {
+		sample = sample[:n]
+	}
+	minDist := make([]float32, len(sample))
+	copy(centroids[0], m.row(sample[0]))
+	for i := range minDist {
+		minDist[i] = float32(math.MaxFloat32)
+	}
+	for c := 1; c < k; c++ {
+		last := centroids[c-1]
+		core.ParallelRange(len(sample), 256, func(start, end int) {
+			for i := start; i < end; i++ {
+				if d := core.SquaredL2(m.row(sample[i]), last); d < minDist[i] {
+					minDist[i] = d
+				}
+			}
+		})
+		var total float64
+		for _, d := range minDist {
+			total += float64(d)
+		}
+		pick := len(sample) - 1
+		if total > 0 {
+			target := rnd.Float64() * total
+			for i, d := range minDist {
+				target -= float64(d)
+				if target <= 0 {
+					pick = i
+					break
+				}
+			}
+		} else {
+			// All sampled rows coincide with chosen centroids; fall back to any row.
+			pick = rnd.Intn(len(sample))
+		}
+		copy(centroids[c], m.row(sample[pick]))
+	}
+	return centroids
+}
@@ -0,0 +1,58 @@
+package pqivf
+
+// invertedList holds the entries of one coarse cluster as parallel arrays.
+// PQ codes are packed numSubquantizers per entry, in Codes8 when pqK <= 256 and in
+// Codes16 otherwise. Vectors holds dimension floats per entry for as long as raw vectors
+// are kept in memory (always before training, afterwards only with RetainVectors).
+type invertedList struct {
+	IDs     []int     // entry ids
+	Codes8  []uint8   // packed PQ codes (pqK <= 256)
+	Codes16 []uint16  // packed PQ codes (pqK > 256)
+	Vectors []float32 // raw vectors, if kept in memory
+}
+
+// find returns the position of id in the list, or -1 if it is not there.
+func (l *invertedList) find(id int) int {
+	for i, x := range l.IDs {
+		if x == id {
+			return i
+		}
+	}
+	return -1
+}
+
+// vector returns the raw vector of entry i.
+func (l *invertedList) vector(i, dim int) []float32 {
+	return l.Vectors[i*dim : (i+1)*dim : (i+1)*dim]
+}
+
+// appendCodes appends the codes of one entry in the list's code width.
+func (l *invertedList) appendCodes(codes []int, wide bool) {
+	for _, c := range codes {
+		if wide {
+			l.Codes16 = append(l.Codes16, uint16(c))
+		} else {
+			l.Codes8 = append(l.Codes8, uint8(c))
+		}
+	}
+}
+
+// removeAt removes entry i by moving the last entry into its place.
+// m is the number of codes per entry and dim the vector dimension.
+func (l *invertedList) removeAt(i, m, dim int) {
+	last := len(l.IDs) - 1
+	l.IDs[i] = l.IDs[last]
+	l.IDs = l.IDs[:last]
+	if len(l.Codes8) > 0 {
+		copy(l.Codes8[i*m:(i+1)*m], l.Codes8[last*m:])
+		l.Codes8 = l.Codes8[:last*m]
+	}
+	if len(l.Codes16) > 0 {
+		copy(l.Codes16[i*m:(i+1)*m], l.Codes16[last*m:])
+		l.Codes16 = l.Codes16[:last*m]
+	}
+	if len(l.Vectors) > 0 {
+		copy(l.Vectors[i*dim:(i+1)*dim], l.Vectors[last*dim:])
+		l.Vectors = l.Vectors[:last*dim]
+	}
+}
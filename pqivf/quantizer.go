@@ -0,0 +1,92 @@
+package pqivf
+
+import (
+	"fmt"
+	"math/rand"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// trainCodebooks trains m subquantizers of k codewords on the rows of the row-major matrix
+// data, which holds n vectors of dimension dim, with one seed per subquantizer. The
+// subquantizers are independent, so they are trained concurrently, each reading its
+// sub-vectors straight out of the matrix.
+func trainCodebooks(data []float32, n, dim, m, k, iterations, batchSize int, seeds []int64) [][][]float32 {
+	subDim := dim / m
+	codebooks := make([][][]float32, m)
+	core.ParallelFor(m, func(i int) {
+		codebooks[i] = kmeans(kmeansData{data: data, n: n, stride: dim, offset: i * subDim, dim: subDim},
+			kmeansConfig{
+				k:          k,
+				iterations: iterations,
+				batchSize:  batchSize,
+				rnd:        rand.New(rand.NewSource(seeds[i])),
+			})
+	})
+	return codebooks
+}
+
+// Quantizer is a product quantizer of raw vectors, trained like the subquantizers of a
+// PQIVFIndex, for indexes that keep PQ codes without coarse clusters (e.g. diskann). Its
+// codebooks hold at most 256 codewords, so every code takes one byte.
+type Quantizer struct {
+	Dimension int           // dimension of the vectors
+	Codebooks [][][]float32 // codewords of every subquantizer
+}
+
+// TrainQuantizer trains numSubquantizers codebooks of at most k codewords (k <= 256) on
+// the rows of the row-major matrix vectors, with iterations k-means iterations (or
+// mini-batches of batchSize rows, if batchSize > 0) seeded from rnd.
+func TrainQuantizer(vectors []float32, dimension, numSubquantizers, k, iterations, batchSize int,
+	rnd *rand.Rand) (*Quantizer, error) {
+	switch {
+	case dimension <= 0 || numSubquantizers <= 0 || dimension%numSubquantizers != 0:
+		return nil, fmt.Errorf("dimension (%d) must be divisible by numSubquantizers (%d)", dimension, numSubquantizers)
+	case k < 1 || k > 256:
+		return nil, fmt.Errorf("codebook size %d is not between 1 and 256", k)
+	case len(vectors) == 0 || len(vectors)%dimension != 0:
+		return nil, fmt.Errorf("training matrix of %d values does not hold vectors of dimension %d", len(vectors), dimension)
+	}
+	seeds := make([]int64, numSubquantizers)
+	for i := range seeds {
+		seeds[i] = rnd.Int63()
+	}
+	n := len(vectors) / dimension
+	return &Quantizer{
+		Dimension: dimension,
+		Codebooks: trainCodebooks(vectors, n, dimension, numSubquantizers, k, iterations, batchSize, seeds),
+	}, nil
+}
+
+// Encode writes the code of every sub-vector of v into codes, which holds one byte per
+// subquantizer.
+func (q *Quantizer) Encode(v []float32, codes []uint8) {
+	subDim := q.Dimension / len(q.Codebooks)
+	for i, cb := range q.Codebooks {
+		c, _ := nearest(cb, v[i*subDim:(i+1)*subDim])
+		codes[i] = uint8(c)
+	}
+}
+
+// Table is the ADC table of a query for a Quantizer, which scores codes without decoding
+// them. A table is used by one search at a time.
+type Table struct {
+	adc *adcTable
+}
+
+// NewTable allocates a table for the codebooks of the quantizer.
+func (q *Quantizer) NewTable() *Table {
+	return &Table{adc: newADCTable(q.Codebooks, q.Dimension)}
+}
+
+// Fill computes the table of query.
+func (q *Quantizer) Fill(t *Table, query []float32) {
+	copy(t.adc.residual, query)
+	t.adc.fill(q.Codebooks)
+}
+
+// Distance returns the approximate squared Euclidean distance between the query of the
+// table and the vector encoded by codes.
+func (t *Table) Distance(codes []uint8) float64 {
+	return scoreCodes(t.adc, codes)
+}
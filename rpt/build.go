@@ -0,0 +1,257 @@
+package rpt
+
+import (
+	"math"
+	"math/rand"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// project returns the dot product of a vector with a projection. Building, inserting and
+// searching all route points with it, accumulating in float64 in a fixed order, so a point
+// always follows the path it was placed along (also on another machine, after a load).
+func project(vector, projection []float32) float64 {
+	var dot float64
+	for i, p := range projection {
+		dot += float64(vector[i]) * float64(p)
+	}
+	return dot
+}
+
+// treeBuilder builds random projection trees over a contiguous matrix of vectors.
+// Every node owns a contiguous range of rows, which is partitioned in place between its
+// children, so the scratch arrays are shared by subtrees that are built concurrently.
+type treeBuilder struct {
+	data                 []float32 // row-major matrix of the vectors, dim values per row
+	dim                  int       // dimension of the vectors
+	ids                  []int     // id of the point of each row
+	leafCapacity         int       // maximum number of points in a leaf
+	candidateProjections int       // number of random projections tried per node
+	parallelThreshold    int       // nodes with more rows build their subtrees in parallel
+	kernel               core.DistanceFunc
+}
+
+// treeScratch holds the per-tree arrays of a build, indexed like rows.
+type treeScratch struct {
+	rows    []int32   // matrix rows in tree order; each node owns a contiguous range
+	dots    []float64 // projections of the rows of a node on the candidate being tried
+	best    []float64 // projections of the rows of a node on the best candidate so far
+	ordered []float64 // copy of dots reordered by quickselect to find the median
+}
+
+// newTreeBuilder gathers the vectors of ids into a matrix for building trees.
+func newTreeBuilder(ids []int, points map[int][]float32, dimension int,
+	leafCapacity int, candidateProjections int, parallelThreshold int) *treeBuilder {
+	data := make([]float32, len(ids)*dimension)
+	for i, id := range ids {
+		copy(data[i*dimension:(i+1)*dimension], points[id])
+	}
+	return &treeBuilder{
+		data:                 data,
+		dim:                  dimension,
+		ids:                  ids,
+		leafCapacity:         leafCapacity,
+		candidateProjections: candidateProjections,
+		parallelThreshold:    parallelThreshold,
+		kernel:               core.Metrics["euclidean"].Kernel,
+	}
+}
+
+// row returns the vector of matrix row i.
+func (b *treeBuilder) row(i int32) []float32 {
+	return b.data[int(i)*b.dim : (int(i)+1)*b.dim]
+}
+
+// tree builds a tree over all rows, drawing its random choices from rnd.
+func (b *treeBuilder) tree(rnd *rand.Rand) *treeNode {
+	n := len(b.ids)
+	s := &treeScratch{
+		rows:    make([]int32, n),
+		dots:    make([]float64, n),
+		best:    make([]float64, n),
+		ordered: make([]float64, n),
+	}
+	for i := range s.rows {
+		s.rows[i] = int32(i)
+	}
+	return b.build(s, 0, n, rnd)
+}
+
+// build returns the subtree over the rows in s.rows[lo:hi].
+func (b *treeBuilder) build(s *treeScratch, lo, hi int, rnd *rand.Rand) *treeNode {
+	n := hi - lo
+	if n <= b.leafCapacity {
+		return b.leaf(s.rows[lo:hi])
+	}
+	rows := s.rows[lo:hi]
+	dots, best, ordered := s.dots[lo:hi], s.best[lo:hi], s.ordered[lo:hi]
+
+	// The jitter of the thresholds scales with the diameter of the node, which is estimated
+	// once from the largest distance of a random row to the others.
+	x := b.row(rows[rnd.Intn(n)])
+	var maxDist float64
+	for _, i := range rows {
+		maxDist = math.Max(maxDist, b.kernel(x, b.row(i)))
+	}
+	jitterScale := 6 * math.Sqrt(maxDist) / math.Sqrt(float64(b.dim))
+
+	// Try multiple random projections and keep the most balanced split.
+	var bestProj []float32
+	var bestThreshold float64
+	bestImbalance := -1
+	for c := 0; c < b.candidateProjections; c++ {
+		proj := randomDirection(rnd, b.dim)
+		for j, i := range rows {
+			dots[j] = project(b.row(i), proj)
+		}
+		copy(ordered, dots)
+		median := quickselect(ordered, n/2)
+		threshold := median + (rnd.Float64()*2-1)*jitterScale
+		left := countBelow(dots, threshold)
+		// Fallback: if one side is empty, split at the median.
+		if left == 0 || left == n {
+			threshold = median
+			if left = countBelow(dots, threshold); left == 0 {
+				continue // all rows project to the same value
+			}
+		}
+		imbalance := left - (n - left)
+		if imbalance < 0 {
+			imbalance = -imbalance
+		}
+		if bestImbalance < 0 || imbalance < bestImbalance {
+			bestProj, bestThreshold, bestImbalance = proj, threshold, imbalance
+			dots, best = best, dots
+		}
+	}
+	// No projection separates the rows (they are all equal), so keep them in one leaf.
+	if bestProj == nil {
+		return b.leaf(rows)
+	}
+	mid := lo + partition(rows, best, bestThreshold)
+
+	node := &treeNode{projection: bestProj, threshold: bestThreshold}
+	if n > b.parallelThreshold {
+		// Each subtree gets its own random source with a distinct seed. The subtrees run on
+		// the shared worker pool when a worker is idle, so the parallelism stays bounded.
+		seeds := [2]int64{rnd.Int63(), rnd.Int63()}
+		core.ParallelFor(2, func(c int) {
+			childRnd := rand.New(rand.NewSource(seeds[c]))
+			if c == 0 {
+				node.left = b.build(s, lo, mid, childRnd)
+			} else {
+				node.right = b.build(s, mid, hi, childRnd)
+			}
+		})
+	} else {
+		node.left = b.build(s, lo, mid, rnd)
+		node.right = b.build(s, mid, hi, rnd)
+	}
+	return node
+}
+
+// leaf returns a leaf holding the ids of rows.
+func (b *treeBuilder) leaf(rows []int32) *treeNode {
+	points := make([]int, len(rows))
+	for j, i := range rows {
+		points[j] = b.ids[i]
+	}
+	return &treeNode{isLeaf: true, points: points}
+}
+
+// randomDirection returns a random unit vector.
+func randomDirection(rnd *rand.Rand, dimension int) []float32 {
+	proj := make([]float32, dimension)
+	var norm float64
+	for i := range proj {
+		v := rnd.Float32()*2 - 1
+		proj[i] = v
+		norm += float64(v * v)
+	}
+	norm = math.Sqrt(norm)
+	if norm < 1e-8 {
+		norm = 1
+	}
+	for i := range proj {
+		proj[i] /= float32(norm)
+	}
+	return proj
+}
+
+// quickselect reorders a so that a[k] holds the value it would have if a were sorted, and
+// returns that value. It runs in expected linear time.
+func quickselect(a []float64, k int) float64 {
+	lo, hi := 0, len(a)-1
+	for lo < hi {
+		pivot := a[lo+(hi-lo)/2]
+		i, j := lo, hi
+		for i <= j {
+			for a[i] < pivot {
+				i++
+			}
+			for a[j] > pivot {
+				j--
+			}
+			if i <= j {
+				a[i], a[j] = a[j], a[i]
+				i++
+				j--
+			}
+		}
+		// a[lo:j+1] <= pivot, a[i:hi+1] >= pivot, and everything in between equals pivot.
+		switch {
+		case k <= j:
+			hi = j
+		case k >= i:
+			lo = i
+		default:
+			return a[k]
+		}
+	}
+	return a[k]
+}
+
+// countBelow returns the number of values below threshold.
+func countBelow(values []float64, threshold float64) int {
+	n := 0
+	for _, v := range values {
+		if v < threshold {
+			n++
+		}
+	}
+	return n
+}
+
+// partition reorders rows (and their projections in dots) in place so that the rows that
+// project below threshold come first, and returns their number.
+func partition(rows []int32, dots []float64, threshold float64) int {
+	i, j := 0, len(rows)-1
+	for {
+		for i <= j && dots[i] < threshold {
+			i++
+		}
+		for i <= j && dots[j] >= threshold {
+			j--
+		}
+		if i >= j {
+			return i
+		}
+		rows[i], rows[j] = rows[j], rows[i]
+		dots[i], dots[j] = dots[j], dots[i]
+		i++
+		j--
+	}
+}
+
+// buildForest builds one tree over ids per seed. The vectors are gathered into a matrix
+// once and the trees are built in parallel on the shared worker pool, each drawing its
+// projections from its own seed, so the trees partition the points independently.
+func buildForest(ids []int, points map[int][]float32, dimension int, seeds []int64,
+	leafCapacity int, candidateProjections int, parallelThreshold int) []*treeNode {
+	b := newTreeBuilder(ids, points, dimension, leafCapacity, candidateProjections, parallelThreshold)
+	trees := make([]*treeNode, len(seeds))
+	core.ParallelFor(len(seeds), func(t int) {
+		trees[t] = b.tree(rand.New(rand.NewSource(seeds[t])))
+	})
+	return trees
+}
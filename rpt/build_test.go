@@ -0,0 +1,110 @@
+package rpt
+
+import (
+	"math/rand"
+	"sort"
+	"testing"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+func TestQuickselect(t *testing.T) {
+	rnd := rand.New(rand.NewSource(1))
+	for _, n := range []int{1, 2, 3, 10, 101, 1000} {
+		values := make([]float64, n)
+		for i := range values {
+			values[i] = float64(rnd.Intn(n/2 + 1)) // with duplicates
+		}
+		sorted := append([]float64(nil), values...)
+		sort.Float64s(sorted)
+		for _, k := range []int{0, n / 2, n - 1} {
+			a := append([]float64(nil), values...)
+			if got := quickselect(a, k); got != sorted[k] {
+				t.Errorf("n=%d k=%d: expected %v, got %v", n, k, sorted[k], got)
+			}
+		}
+	}
+}
+
+func TestPartition(t *testing.T) {
+	dots := []float64{5, 1, 4, 2, 3, 3, 0}
+	rows := []int32{0, 1, 2, 3, 4, 5, 6}
+	left := partition(rows, dots, 3)
+	if left != 3 {
+		t.Fatalf("expected 3 rows below the threshold, got %d", left)
+	}
+	for j, i := range rows {
+		if want := []float64{5, 1, 4, 2, 3, 3, 0}[i]; dots[j] != want {
+			t.Fatalf("rows and projections were reordered differently: %v %v", rows, dots)
+		}
+		if (j < left) != (dots[j] < 3) {
+			t.Fatalf("row %d is on the wrong side: %v %v", i, rows, dots)
+		}
+	}
+}
+
+func TestBuildForestRoutesEveryPoint(t *testing.T) {
+	dim := 5
+	rnd := rand.New(rand.NewSource(3))
+	points := make(map[int][]float32)
+	ids := make([]int, 3000)
+	for i := range ids {
+		ids[i] = i * 7
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = float32(rnd.NormFloat64())
+		}
+		points[ids[i]] = vec
+	}
+	// A low parallel threshold builds most subtrees with their own seeds.
+	trees := buildForest(ids, points, dim, []int64{1, 2}, 8, 3, 50)
+	for _, tree := range trees {
+		count := 0
+		var walk func(node *treeNode)
+		walk = func(node *treeNode) {
+			if node.isLeaf {
+				if len(node.points) > 8 {
+					t.Errorf("leaf holds %d points", len(node.points))
+				}
+				count += len(node.points)
+				for _, id := range node.points {
+					if leaf, _ := leafFor(tree, points[id]); leaf != node {
+						t.Fatalf("id %d is not in the leaf it routes to", id)
+					}
+				}
+				return
+			}
+			walk(node.left)
+			walk(node.right)
+		}
+		walk(tree)
+		if count != len(ids) {
+			t.Errorf("expected %d points in the leaves, got %d", len(ids), count)
+		}
+	}
+	if trees[0].threshold == trees[1].threshold {
+		t.Error("trees built from different seeds have the same root split")
+	}
+}
+
+// BenchmarkComputeDistances measures the scoring of a candidate list as long as the
+// candidates gathered by a multi-probe search.
+func BenchmarkComputeDistances(b *testing.B) {
+	const dim = 128
+	rnd := rand.New(rand.NewSource(1))
+	r := NewRPTIndex(dim, 10, 10, 100, 0)
+	ids := make([]int, 2000)
+	for i := range ids {
+		ids[i] = i
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = float32(rnd.NormFloat64())
+		}
+		r.points[i] = vec
+	}
+	query := r.points[0]
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		r.computeDistances(query, ids, core.SquaredEuclidean)
+	}
+}
@@ -0,0 +1,263 @@
+package rpt
+
+import (
+	"errors"
+	"fmt"
+	"sort"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// formatKind identifies RPT indexes in binary index files.
+const formatKind = "rpt"
+
+// Positions of the parameters in the "meta" section.
+const (
+	metaDimension = iota
+	metaLeafCapacity
+	metaCandidateProjections
+	metaParallelThreshold
+	metaTrees // absent in files written before forests were supported
+	metaLen
+)
+
+// Fields of a node in the "nodes" section. Nodes are numbered in depth-first order, tree
+// after tree; the "roots" section holds the index of the root of each tree. Internal nodes store their children and the row of their projection in
+// "projections" (and of their threshold in "thresholds"); leaves have no children and store
+// their range of ids in "tree_ids", which lists the ids of all leaves back to back.
+const (
+	nodeLeft  = iota // index of the left child, or -1 for a leaf
+	nodeRight        // index of the right child, or -1 for a leaf
+	nodeFirst        // projection row of an internal node, or first position in tree_ids of a leaf
+	nodeCount        // number of ids in a leaf
+	nodeLen
+)
+
+// flatTree is a tree flattened into the arrays of the binary format.
+type flatTree struct {
+	nodes       []int64   // nodeLen fields per node
+	projections []float32 // one projection of dimension floats per internal node
+	thresholds  []float64 // one threshold per internal node
+	ids         []int     // ids of all leaves, in leaf order
+}
+
+// flatten appends the subtree rooted at node to t and returns the index of its root.
+func (t *flatTree) flatten(node *treeNode) int64 {
+	i := int64(len(t.nodes) / nodeLen)
+	t.nodes = append(t.nodes, make([]int64, nodeLen)...)
+	fields := func() []int64 { return t.nodes[i*nodeLen : (i+1)*nodeLen] }
+	if node.isLeaf {
+		f := fields()
+		f[nodeLeft], f[nodeRight] = -1, -1
+		f[nodeFirst], f[nodeCount] = int64(len(t.ids)), int64(len(node.points))
+		t.ids = append(t.ids, node.points...)
+		return i
+	}
+	row := int64(len(t.thresholds))
+	t.projections = append(t.projections, node.projection...)
+	t.thresholds = append(t.thresholds, node.threshold)
+	left := t.flatten(node.left)
+	right := t.flatten(node.right)
+	f := fields()
+	f[nodeLeft], f[nodeRight], f[nodeFirst] = left, right, row
+	return i
+}
+
+// unflatten rebuilds the subtree rooted at node i of a flattened tree. Projections and leaf
+// id lists alias the flat arrays; the capacity of every leaf list ends at the leaf, so
+// appending to one never overwrites the next. depth guards against cyclic (corrupt) data.
+func (t *flatTree) unflatten(i int64, dim, depth int) (*treeNode, error) {
+	if i < 0 || (i+1)*nodeLen > int64(len(t.nodes)) || depth > maxTreeDepth {
+		return nil, errors.New("corrupt RPT index file: invalid tree node")
+	}
+	f := t.nodes[i*nodeLen : (i+1)*nodeLen]
+	if f[nodeLeft] < 0 {
+		first, count := f[nodeFirst], f[nodeCount]
+		if first < 0 || count < 0 || first+count > int64(len(t.ids)) {
+			return nil, errors.New("corrupt RPT index file: invalid leaf range")
+		}
+		end := first + count
+		return &treeNode{isLeaf: true, points: t.ids[first:end:end]}, nil
+	}
+	row := f[nodeFirst]
+	if row < 0 || row >= int64(len(t.thresholds)) || (row+1)*int64(dim) > int64(len(t.projections)) {
+		return nil, errors.New("corrupt RPT index file: invalid projection row")
+	}
+	left, err := t.unflatten(f[nodeLeft], dim, depth+1)
+	if err != nil {
+		return nil, err
+	}
+	right, err := t.unflatten(f[nodeRight], dim, depth+1)
+	if err != nil {
+		return nil, err
+	}
+	start := row * int64(dim)
+	return &treeNode{
+		projection: t.projections[start : start+int64(dim) : start+int64(dim)],
+		threshold:  t.thresholds[row],
+		left:       left,
+		right:      right,
+	}, nil
+}
+
+// maxTreeDepth bounds the depth of a loaded tree.
+const maxTreeDepth = 1 << 12
+
+// sections returns the binary file sections of the index. Points are written in id order
+// as an id array and a matrix of vectors. An up-to-date tree is written as well, so that a
+// loaded index does not rebuild it; a pending rebuild leaves the tree sections empty.
+func (r *RPTIndex) sections() []core.Section {
+	meta := make([]int64, metaLen)
+	meta[metaDimension] = int64(r.dimension)
+	meta[metaLeafCapacity] = int64(r.LeafCapacity)
+	meta[metaCandidateProjections] = int64(r.CandidateProjections)
+	meta[metaParallelThreshold] = int64(r.ParallelThreshold)
+	meta[metaTrees] = int64(r.Trees)
+	ids := make([]int, 0, len(r.points))
+	for id := range r.points {
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	vectors := make([][]float32, len(ids))
+	for i, id := range ids {
+		vectors[i] = r.points[id]
+	}
+	var tree flatTree
+	var roots []int64
+	if !r.dirty {
+		for _, root := range r.trees {
+			roots = append(roots, tree.flatten(root))
+		}
+	}
+	return []core.Section{
+		core.SliceSection("meta", meta),
+		core.SliceSection("probe_margin", []float64{r.ProbeMargin}),
+		core.BytesSection("distance", []byte(r.DistanceName)),
+		core.IntsSection("ids", ids),
+		core.SliceSection("vectors", vectors...),
+		core.SliceSection("roots", roots),
+		core.SliceSection("nodes", tree.nodes),
+		core.SliceSection("projections", tree.projections),
+		core.SliceSection("thresholds", tree.thresholds),
+		core.IntsSection("tree_ids", tree.ids),
+	}
+}
+
+// loadSections replaces the index with the contents of a binary index file.
+// The stored vectors and the tree arrays alias the file, and a saved tree is used as it is,
+// so the loaded index serves searches without rebuilding. The caller holds the write lock.
+func (r *RPTIndex) loadSections(f *core.SectionFile) error {
+	if f.Kind != formatKind {
+		return fmt.Errorf("binary index file holds a %q index, not an RPT index", f.Kind)
+	}
+	meta, err := f.Int64s("meta")
+	if err != nil {
+		return err
+	}
+	if len(meta) < metaTrees {
+		return errors.New("corrupt RPT index file: short meta section")
+	}
+	margin, err := f.Float64s("probe_margin")
+	if err != nil {
+		return err
+	}
+	ids, err := f.Ints("ids")
+	if err != nil {
+		return err
+	}
+	vectors, err := f.Float32s("vectors")
+	if err != nil {
+		return err
+	}
+	dim := int(meta[metaDimension])
+	if dim <= 0 || len(margin) != 1 || len(vectors) != len(ids)*dim {
+		return errors.New("corrupt RPT index file: inconsistent section sizes")
+	}
+	points := make(map[int][]float32, len(ids))
+	for i, id := range ids {
+		points[id] = vectors[i*dim : (i+1)*dim : (i+1)*dim]
+	}
+	trees := int64(1)
+	if len(meta) > metaTrees {
+		trees = meta[metaTrees]
+	}
+	var tree flatTree
+	if tree.nodes, err = f.Int64s("nodes"); err != nil {
+		return err
+	}
+	if tree.projections, err = f.Float32s("projections"); err != nil {
+		return err
+	}
+	if tree.thresholds, err = f.Float64s("thresholds"); err != nil {
+		return err
+	}
+	if tree.ids, err = f.Ints("tree_ids"); err != nil {
+		return err
+	}
+	var roots []*treeNode
+	if len(tree.nodes) > 0 {
+		// Files written before forests were supported hold a single tree without "roots".
+		rootIndices := []int64{0}
+		if f.Has("roots") {
+			if rootIndices, err = f.Int64s("roots"); err != nil {
+				return err
+			}
+		}
+		if len(tree.ids) < len(ids)*len(rootIndices) {
+			return errors.New("corrupt RPT index file: tree does not cover the points")
+		}
+		for _, i := range rootIndices {
+			root, err := tree.unflatten(i, dim, 0)
+			if err != nil {
+				return err
+			}
+			roots = append(roots, root)
+		}
+	}
+	r.dimension = dim
+	r.LeafCapacity = int(meta[metaLeafCapacity])
+	r.CandidateProjections = int(meta[metaCandidateProjections])
+	r.ParallelThreshold = int(meta[metaParallelThreshold])
+	r.Trees = int(trees)
+	r.ProbeMargin = margin[0]
+	r.points = points
+	r.trees = roots
+	r.treeSize, r.maxDepth = len(tree.ids), forestDepth(roots)
+	r.generation++
+	r.dirty = roots == nil // without a saved tree, the first search builds one
+	// Files written before the metric was saved hold Euclidean indexes.
+	distance := []byte("euclidean")
+	if f.Has("distance") {
+		if distance, err = f.Bytes("distance"); err != nil {
+			return err
+		}
+	}
+	r.setDistance(string(distance))
+	return nil
+}
+
+// setMapping makes f the memory mapping backing the index and releases the previous one.
+// The caller holds the write lock and has already replaced every array that aliased it.
+func (r *RPTIndex) setMapping(f *core.SectionFile) {
+	if r.mapping != nil && r.mapping != f {
+		r.mapping.Close()
+	}
+	r.mapping = f
+}
+
+// LoadFile loads an index saved with Save from the file at path by mapping it into memory.
+// The mapping is copy-on-write and is released when another index is loaded into r.
+// Files in the older gob format are read as with Load.
+func (r *RPTIndex) LoadFile(path string) error {
+	return core.LoadIndexFile(path, func(f *core.SectionFile) error {
+		r.writeMu.Lock()
+		defer r.writeMu.Unlock()
+		r.mu.Lock()
+		defer r.mu.Unlock()
+		if err := r.loadSections(f); err != nil {
+			return err
+		}
+		r.setMapping(f)
+		return nil
+	}, r.Load)
+}
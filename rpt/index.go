@@ -1,21 +1,25 @@
 package rpt
 
 import (
+	"bufio"
 	"bytes"
 	"encoding/gob"
-	"errors"
 	"fmt"
 	"io"
 	"math"
 	"math/rand"
-	"runtime"
 	"sort"
 	"sync"
+	"sync/atomic"
+	"time"
 
 	"github.com/patrikhermansson/hann/core"
 	"github.com/schollz/progressbar/v3"
 )
 
+// writeBatchSize is the number of points a bulk write changes per hold of the write lock.
+const writeBatchSize = 1024
+
 // NewRPTIndex creates a new RPT (Random Projection Tree) index.
 // It initializes parameters like dimension, leaf capacity, candidate projections, parallel threshold, and probe margin.
 func NewRPTIndex(
@@ -53,334 +57,265 @@ type treeNode struct {
 // RPTIndex is the main structure for the random projection tree index.
 // It holds all points, the tree root, and configuration parameters.
 type RPTIndex struct {
-	mu                   sync.RWMutex      // protects concurrent access
-	dimension            int               // dimension of each vector
-	points               map[int][]float32 // mapping of point id to vector
-	tree                 *treeNode         // root of the random projection tree
-	dirty                bool              // indicates if the tree needs to be rebuilt
-	Distance             core.DistanceFunc // function to compute distance between vectors
-	DistanceName         string            // name of the distance metric
-	LeafCapacity         int               // maximum number of points in a leaf
-	CandidateProjections int               // number of random projections to try when splitting
-	ParallelThreshold    int               // threshold to trigger parallel tree building
-	ProbeMargin          float64           // margin for multi-probe search
+	mu                   sync.RWMutex       // protects concurrent access
+	writeMu              sync.Mutex         // serializes writers, so bulk writes stay valid across their batches
+	dimension            int                // dimension of each vector
+	points               map[int][]float32  // mapping of point id to vector
+	trees                []*treeNode        // roots of the random projection trees of the forest
+	dirty                bool               // indicates if the tree needs to be rebuilt
+	Distance             core.DistanceFunc  // function to compute distance between vectors (used if DistanceName is not in core.Metrics)
+	DistanceName         string             // name of the distance metric (see searchMetric)
+	LeafCapacity         int                // maximum number of points in a leaf
+	CandidateProjections int                // number of random projections to try when splitting
+	ParallelThreshold    int                // threshold to trigger parallel tree building
+	ProbeMargin          float64            // margin for multi-probe search
+	Trees                int                // number of independently built trees searched together (0 means 1)
+	RebuildStaleRatio    float64            // share of stale tree entries that triggers a background rebuild (0 uses 0.25, negative disables)
+	RebuildDepthFactor   float64            // tree depth, relative to a balanced tree, that triggers a background rebuild (0 uses 3, negative disables)
+	mapping              *core.SectionFile  // memory-mapped file the stored vectors alias (see LoadFile)
+	treeSize             int                // number of entries in the leaves, including stale ones
+	maxDepth             int                // depth of the deepest leaf
+	generation           uint64             // incremented whenever the tree is replaced as a whole
+	rnd                  *rand.Rand         // random source of local leaf splits
+	rebuilding           bool               // a rebuild is running and mutations are logged in pending
+	pending              []int              // ids mutated while a rebuild is running
+	rebuildMu            sync.Mutex         // serializes rebuilds
+	building             atomic.Bool        // a search has started a background build of the dirty tree
+	Sink                 core.MetricsSink   // receives the instrumentation of the index, if not nil (set before use)
+	counters             core.IndexCounters // totals of the searches and builds, reported by Stats
 }
 
-// buildTreeRecursive builds the tree recursively using random projections.
-// It splits the given set of point ids based on a randomly chosen projection.
-func buildTreeRecursive(ids []int, points map[int][]float32, dimension int,
-	distance core.DistanceFunc, rnd *rand.Rand,
-	leafCapacity int, candidateProjections int, parallelThreshold int) *treeNode {
-
-	// If the number of points is small enough, create a leaf node.
-	if len(ids) <= leafCapacity {
-		return &treeNode{
-			isLeaf: true,
-			points: ids,
-		}
+// numTrees returns the number of trees in the forest.
+func (r *RPTIndex) numTrees() int {
+	if r.Trees < 1 {
+		return 1
 	}
+	return r.Trees
+}
 
-	// Define a candidate structure to store the projection and split details.
-	type candidate struct {
-		proj      []float32 // random projection vector
-		threshold float64   // median threshold along projection
-		leftIDs   []int     // point ids going to left child
-		rightIDs  []int     // point ids going to right child
-		imbalance int       // difference in count between left and right sets
-	}
-	var bestCandidate *candidate
-
-	// Try multiple random projections to find a good split.
-	for c := 0; c < candidateProjections; c++ {
-		proj := make([]float32, dimension)
-		var norm float64
-		// Generate a random vector.
-		for i := 0; i < dimension; i++ {
-			v := rnd.Float32()*2 - 1
-			proj[i] = v
-			norm += float64(v * v)
-		}
-		norm = math.Sqrt(norm)
-		if norm < 1e-8 {
-			norm = 1
-		}
-		// Normalize the projection.
-		for i := 0; i < dimension; i++ {
-			proj[i] /= float32(norm)
-		}
-
-		// Compute dot products of all points with the projection.
-		type pair struct {
-			id  int
-			dot float64
-		}
-		pairs := make([]pair, len(ids))
-		for i, id := range ids {
-			vec := points[id]
-			var dot float64
-			for j := 0; j < dimension; j++ {
-				dot += float64(vec[j]) * float64(proj[j])
-			}
-			pairs[i] = pair{id, dot}
-		}
-		// Sort points by their projection value.
-		sort.Slice(pairs, func(i, j int) bool {
-			return pairs[i].dot < pairs[j].dot
-		})
-		// Choose the median as threshold.
-		mid := len(pairs) / 2
-
-		// Choose a random point x and compute the maximum distance to any other point.
-		x := points[ids[rnd.Intn(len(ids))]]
-		var maxDist float64
-		for _, id := range ids {
-			y := points[id]
-			var dist float64
-			for i := 0; i < dimension; i++ {
-				d := float64(x[i] - y[i])
-				dist += d * d
-			}
-			if dist > maxDist {
-				maxDist = dist
-			}
-		}
-		maxDist = math.Sqrt(maxDist)
-
-		// Compute jitter
-		jitter := (rnd.Float64()*2 - 1) * 6 * maxDist / math.Sqrt(float64(dimension))
+// forestDepth returns the depth of the deepest leaf of the trees.
+func forestDepth(trees []*treeNode) int {
+	depth := 0
+	for _, tree := range trees {
+		depth = max(depth, treeDepth(tree))
+	}
+	return depth
+}
 
-		// Median threshold with jitter
-		threshold := pairs[mid].dot + jitter
+// treeSeeds draws one seed per tree of the forest from rnd.
+func (r *RPTIndex) treeSeeds(rnd *rand.Rand) []int64 {
+	seeds := make([]int64, r.numTrees())
+	for i := range seeds {
+		seeds[i] = rnd.Int63()
+	}
+	return seeds
+}
 
-		// Split ids into left and right groups.
-		var leftIDs, rightIDs []int
-		for _, p := range pairs {
-			if p.dot < threshold {
-				leftIDs = append(leftIDs, p.id)
-			} else {
-				rightIDs = append(rightIDs, p.id)
-			}
+// collectCandidates adds the ids of the leaves of node that the query reaches to the
+// candidates of ctx, skipping ids that were collected before (from this or another tree).
+// It follows both branches if the projection value is close to the threshold (within
+// margin). Ids outside the filter of ctx are masked out, and with skipStale set, ids of
+// deleted points are skipped as well.
+func (r *RPTIndex) collectCandidates(node *treeNode, query []float32, margin float64,
+	ctx *searchContext, skipStale bool) {
+	for !node.isLeaf {
+		dot := project(query, node.projection)
+		// If close to threshold, probe both children.
+		if math.Abs(dot-node.threshold) < margin {
+			r.collectCandidates(node.left, query, margin, ctx, skipStale)
+			node = node.right
+		} else if dot < node.threshold {
+			node = node.left
+		} else {
+			node = node.right
 		}
-		// Fallback: if one side is empty, split evenly.
-		if len(leftIDs) == 0 || len(rightIDs) == 0 {
-			mid = len(ids) / 2
-			leftIDs = make([]int, mid)
-			rightIDs = make([]int, len(ids)-mid)
-			copy(leftIDs, ids[:mid])
-			copy(rightIDs, ids[mid:])
+	}
+	for _, id := range node.points {
+		if ctx.filter != nil && !ctx.filter.Contains(id) {
+			continue
 		}
-		imbalance := int(math.Abs(float64(len(leftIDs) - len(rightIDs))))
-		cand := candidate{
-			proj:      proj,
-			threshold: threshold,
-			leftIDs:   leftIDs,
-			rightIDs:  rightIDs,
-			imbalance: imbalance,
+		if skipStale {
+			if _, ok := r.points[id]; !ok {
+				continue
+			}
 		}
-		// Choose the candidate with the smallest imbalance.
-		if bestCandidate == nil || cand.imbalance < bestCandidate.imbalance {
-			bestCandidate = &cand
+		if ctx.visited.add(id) {
+			ctx.candidates = append(ctx.candidates, id)
 		}
 	}
-
-	var leftChild, rightChild *treeNode
-	// If many points, build subtrees in parallel.
-	if len(ids) > parallelThreshold {
-		var wg sync.WaitGroup
-		wg.Add(2)
-		leftRnd := rand.New(rand.NewSource(core.GetSeed() + 1))
-		rightRnd := rand.New(rand.NewSource(core.GetSeed() + 2))
-		go func() {
-			defer wg.Done()
-			leftChild = buildTreeRecursive(bestCandidate.leftIDs, points, dimension, distance,
-				leftRnd, leafCapacity, candidateProjections, parallelThreshold)
-		}()
-		go func() {
-			defer wg.Done()
-			rightChild = buildTreeRecursive(bestCandidate.rightIDs, points, dimension, distance,
-				rightRnd, leafCapacity, candidateProjections, parallelThreshold)
-		}()
-		wg.Wait()
-	} else {
-		// Otherwise, build recursively in a single thread.
-		leftChild = buildTreeRecursive(bestCandidate.leftIDs, points, dimension, distance, rnd,
-			leafCapacity, candidateProjections, parallelThreshold)
-		rightChild = buildTreeRecursive(bestCandidate.rightIDs, points, dimension, distance, rnd,
-			leafCapacity, candidateProjections, parallelThreshold)
-	}
-
-	// Return an internal node with the best projection and split.
-	return &treeNode{
-		isLeaf:     false,
-		projection: bestCandidate.proj,
-		threshold:  bestCandidate.threshold,
-		left:       leftChild,
-		right:      rightChild,
-	}
 }
 
-// buildTree constructs the random projection tree from all stored points.
-func (r *RPTIndex) buildTree() {
-	// Collect all point ids.
-	ids := make([]int, 0, len(r.points))
-	for id := range r.points {
-		ids = append(ids, id)
-	}
-	// Shuffle the ids to avoid bias.
-	rand.Shuffle(len(ids), func(i, j int) {
-		ids[i], ids[j] = ids[j], ids[i]
-	})
-	// Use a new random source for building the tree.
-	localRand := rand.New(rand.NewSource(core.GetSeed()))
-	r.tree = buildTreeRecursive(ids, r.points, r.dimension, r.Distance, localRand, r.LeafCapacity,
-		r.CandidateProjections, r.ParallelThreshold)
-	r.dirty = false // tree is now up to date
-}
-
-// searchTreeMultiProbeWithMargin searches the tree for candidate point ids using multi-probing.
-// It follows both branches if the projection value is close to the threshold (within margin).
-func searchTreeMultiProbeWithMargin(node *treeNode, query []float32, dimension int,
-	distance core.DistanceFunc, margin float64) []int {
-	if node == nil {
-		return nil
-	}
-	// If it's a leaf, return all point ids.
-	if node.isLeaf {
-		return node.points
-	}
-	// Compute the dot product with the node's projection.
-	var dot float64
-	for i := 0; i < dimension; i++ {
-		dot += float64(query[i]) * float64(node.projection[i])
-	}
-	// If close to threshold, probe both children.
-	if math.Abs(dot-node.threshold) < margin {
-		leftIDs := searchTreeMultiProbeWithMargin(node.left, query, dimension, distance, margin)
-		rightIDs := searchTreeMultiProbeWithMargin(node.right, query, dimension, distance, margin)
-		return append(leftIDs, rightIDs...)
-	} else if dot < node.threshold {
-		return searchTreeMultiProbeWithMargin(node.left, query, dimension, distance, margin)
-	}
-	return searchTreeMultiProbeWithMargin(node.right, query, dimension, distance, margin)
+// searchMetric resolves the metric searches compare from DistanceName and Distance (see
+// core.ResolveMetric), so changes to the fields apply to the next search. The points are
+// stored as given, so a metric whose kernel expects normalized vectors (cosine) compares
+// its distance instead.
+func (r *RPTIndex) searchMetric() core.Metric {
+	m := core.ResolveMetric(r.DistanceName, r.Distance)
+	if m.Normalize {
+		exact := core.ResolveMetric("", m.Distance)
+		exact.Name = m.Name
+		return exact
+	}
+	return m
 }
 
-// unionInts returns the union of two integer slices (removing duplicates).
-func unionInts(a, b []int) []int {
-	m := make(map[int]struct{})
-	for _, x := range a {
-		m[x] = struct{}{}
-	}
-	for _, x := range b {
-		m[x] = struct{}{}
-	}
-	result := make([]int, 0, len(m))
-	for x := range m {
-		result = append(result, x)
-	}
-	return result
-}
-
-// computeDistances calculates the distance from the query to each point id in the list.
-// It does this in parallel across available CPUs.
-func (r *RPTIndex) computeDistances(query []float32, ids []int) []core.Neighbor {
+// computeDistances calculates the kernel distance from the query to each point id in the
+// list. Long lists are split into chunks that run on the shared worker pool.
+func (r *RPTIndex) computeDistances(query []float32, ids []int, kernel core.DistanceFunc) []core.Neighbor {
 	neighbors := make([]core.Neighbor, len(ids))
-	numWorkers := runtime.NumCPU()
-	chunkSize := (len(ids) + numWorkers - 1) / numWorkers
-
-	var wg sync.WaitGroup
-	for i := 0; i < numWorkers; i++ {
-		start := i * chunkSize
-		end := start + chunkSize
-		if end > len(ids) {
-			end = len(ids)
-		}
-		if start >= end {
-			break
+	core.ParallelRange(len(ids), 256, func(start, end int) {
+		for j := start; j < end; j++ {
+			id := ids[j]
+			vec := r.points[id]
+			d := kernel(query, vec)
+			neighbors[j] = core.Neighbor{ID: id, Distance: d}
 		}
-		wg.Add(1)
-		go func(start, end int) {
-			defer wg.Done()
-			for j := start; j < end; j++ {
-				id := ids[j]
-				vec := r.points[id]
-				d := r.Distance(query, vec)
-				neighbors[j] = core.Neighbor{ID: id, Distance: d}
-			}
-		}(start, end)
-	}
-	wg.Wait()
+	})
 	return neighbors
 }
 
 // Search returns the k nearest neighbors to the query vector.
-// It rebuilds the tree if needed and uses multi-probe search to get candidate ids.
+// It uses multi-probe search of the tree to get candidate ids.
 func (r *RPTIndex) Search(query []float32, k int) ([]core.Neighbor, error) {
-	r.mu.RLock()
+	return r.SearchWithOptions(query, k, core.SearchOptions{})
+}
+
+// SearchWithOptions returns the k nearest neighbors to the query vector.
+// opts.ProbeMargin overrides the index's ProbeMargin (a negative value follows a single
+// path down the tree). A distance-computation budget caps the number of candidates that
+// are scored; once the budget or the timeout of opts runs out, the scan for additional
+// points is skipped. RPT scores every candidate from the tree with its
+// full-precision vector, so the candidates are already exact and RerankFactor has no
+// effect; opts.Stats reports the number of candidates scored. With opts.Filter, the ids of the
+// leaves reached are masked by the filter, and the scan for additional points only
+// considers the ids of the filter. Searches never build the tree themselves: while it is
+// missing or out of date (after a load without a tree or a large BulkAdd), a background
+// build is started and the points are scanned exactly instead, which opts.Stats reports as
+// BruteForce.
+func (r *RPTIndex) SearchWithOptions(query []float32, k int, opts core.SearchOptions) ([]core.Neighbor, error) {
+	var start time.Time
+	if r.Sink != nil {
+		start = time.Now()
+	}
+	wait := core.RLockTimed(&r.mu)
+	defer r.mu.RUnlock()
 	if len(query) != r.dimension {
-		r.mu.RUnlock()
 		return nil, fmt.Errorf("query dimension %d does not match index dimension %d",
 			len(query), r.dimension)
 	}
 	if len(r.points) == 0 {
-		r.mu.RUnlock()
-		return nil, errors.New("index is empty")
+		return nil, core.ErrEmptyIndex
 	}
 	// Copy the query to avoid modifying the original.
 	queryCopy := make([]float32, len(query))
 	copy(queryCopy, query)
 	query = queryCopy
 
-	// If the tree is dirty, rebuild it.
+	margin := r.ProbeMargin
+	if opts.ProbeMargin > 0 {
+		margin = opts.ProbeMargin
+	} else if opts.ProbeMargin < 0 {
+		margin = 0
+	}
+	budget := core.NewSearchBudget(opts)
+	metric := r.searchMetric()
+
+	ctx := getSearchContext()
+	defer putSearchContext(ctx)
+	ctx.filter = opts.Filter
+	var stats core.SearchStats
+	var neighbors []core.Neighbor
 	if r.dirty {
-		r.mu.RUnlock()
-		r.mu.Lock()
-		if r.dirty {
-			r.buildTree()
-		}
-		r.mu.Unlock()
-		r.mu.RLock()
-	}
-	// Get candidate ids using multi-probe search.
-	candidateIDs := searchTreeMultiProbeWithMargin(r.tree, query, r.dimension, r.Distance, r.ProbeMargin)
-	// If not enough candidates, try with a larger margin.
-	if len(candidateIDs) < k*2 {
-		candidateIDsAlt := searchTreeMultiProbeWithMargin(r.tree, query, r.dimension, r.Distance, r.ProbeMargin*2)
-		candidateIDs = unionInts(candidateIDs, candidateIDsAlt)
-	}
-	r.mu.RUnlock()
-
-	// Compute distances for candidate points.
-	neighbors := r.computeDistances(query, candidateIDs)
-	// If still not enough, add extra points.
-	if len(neighbors) < k {
-		r.mu.RLock()
-		candidateSet := make(map[int]struct{}, len(candidateIDs))
-		for _, id := range candidateIDs {
-			candidateSet[id] = struct{}{}
+		// The tree is built in the background; until it is swapped in, the points are
+		// scanned exactly.
+		r.startBuild()
+		stats.BruteForce = true
+		neighbors = r.scanPoints(query, ctx, &budget, metric.Kernel)
+	} else {
+		// Get candidate ids from every tree using multi-probe search.
+		skipStale := r.treeSize > len(r.points)*len(r.trees)
+		for _, tree := range r.trees {
+			r.collectCandidates(tree, query, margin, ctx, skipStale)
 		}
-		var missingIDs []int
-		for id := range r.points {
-			if _, exists := candidateSet[id]; !exists {
-				missingIDs = append(missingIDs, id)
+		// If not enough candidates, try with a larger margin.
+		if len(ctx.candidates) < k*2 && margin > 0 {
+			stats.Fallbacks++
+			for _, tree := range r.trees {
+				r.collectCandidates(tree, query, margin*2, ctx, skipStale)
 			}
 		}
-		r.mu.RUnlock()
-		extraNeighbors := r.computeDistances(query, missingIDs)
-		neighbors = append(neighbors, extraNeighbors...)
+		candidateIDs := ctx.candidates
+		if rem := budget.Remaining(); rem >= 0 && len(candidateIDs) > rem {
+			candidateIDs = candidateIDs[:rem]
+		}
+
+		// Compute distances for candidate points.
+		neighbors = r.computeDistances(query, candidateIDs, metric.Kernel)
+		// If still not enough (and the budget allows it), add extra points.
+		if budget.Spend(len(candidateIDs)) && len(neighbors) < k {
+			neighbors = append(neighbors, r.scanPoints(query, ctx, &budget, metric.Kernel)...)
+			stats.Fallbacks++
+		}
+	}
+	stats.Candidates = len(neighbors)
+	budget.Report(&stats)
+	if opts.Stats != nil {
+		*opts.Stats = stats
 	}
-	// Sort by distance.
+	r.counters.RecordSearch(r.Sink, "rpt", &stats, wait, start)
+	// Sort by distance, breaking ties by id so that results do not depend on the candidate order.
 	sort.Slice(neighbors, func(i, j int) bool {
-		return neighbors[i].Distance < neighbors[j].Distance
+		if neighbors[i].Distance != neighbors[j].Distance {
+			return neighbors[i].Distance < neighbors[j].Distance
+		}
+		return neighbors[i].ID < neighbors[j].ID
 	})
 	if k > len(neighbors) {
 		k = len(neighbors)
 	}
-	return neighbors[:k], nil
+	neighbors = neighbors[:k]
+	// Distances were compared as kernel values (e.g. squared); convert only the returned ones.
+	for i := range neighbors {
+		neighbors[i].Distance = metric.Finalize(neighbors[i].Distance)
+	}
+	return neighbors, nil
+}
+
+// scanPoints scores the points that ctx has not collected from the tree (within its filter
+// and the remaining budget) and spends the budget on them. The caller holds the read lock.
+func (r *RPTIndex) scanPoints(query []float32, ctx *searchContext, budget *core.SearchBudget, kernel core.DistanceFunc) []core.Neighbor {
+	var missingIDs []int
+	if f := ctx.filter; f != nil && f.Len() < len(r.points) {
+		f.ForEach(func(id int) bool {
+			if _, ok := r.points[id]; ok && !ctx.visited.contains(id) {
+				missingIDs = append(missingIDs, id)
+			}
+			return true
+		})
+	} else {
+		for id := range r.points {
+			if !ctx.visited.contains(id) && (f == nil || f.Contains(id)) {
+				missingIDs = append(missingIDs, id)
+			}
+		}
+	}
+	if rem := budget.Remaining(); rem >= 0 && len(missingIDs) > rem {
+		missingIDs = missingIDs[:rem]
+	}
+	budget.Spend(len(missingIDs))
+	return r.computeDistances(query, missingIDs, kernel)
+}
+
+// SearchBatch returns the k nearest neighbors for each query vector using the shared worker pool.
+func (r *RPTIndex) SearchBatch(queries [][]float32, k int) ([][]core.Neighbor, error) {
+	return core.SearchBatch(queries, k, r.Search)
 }
 
 // Add inserts a new point with the given id and vector into the index.
-// It marks the tree as dirty so it will be rebuilt.
+// Once the tree is built, the point is routed down to its leaf.
 func (r *RPTIndex) Add(id int, vector []float32) error {
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
 	r.mu.Lock()
 	defer r.mu.Unlock()
 	if len(vector) != r.dimension {
@@ -391,19 +326,22 @@ func (r *RPTIndex) Add(id int, vector []float32) error {
 		return fmt.Errorf("id %d already exists", id)
 	}
 	r.points[id] = vector
-	r.dirty = true
+	r.record(id, vector)
 	return nil
 }
 
-// BulkAdd inserts multiple points into the index and marks the tree as dirty.
+// BulkAdd inserts multiple points into the index. Points are routed into a built tree one by
+// one unless they outnumber the indexed points, in which case the tree is rebuilt instead.
+// The points are validated first, then added in batches of writeBatchSize, and the write
+// lock is released between batches, so searches are not blocked for the whole operation.
+// The points keep the vector slices, so the caller must not modify them afterwards.
 func (r *RPTIndex) BulkAdd(vectors map[int][]float32) error {
-	r.mu.Lock()
-	defer r.mu.Unlock()
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
 
-	// Create a progress bar with a newline on completion.
-	bar := progressbar.NewOptions(len(vectors),
-		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
-	)
+	// Writers are serialized by writeMu, so the points can be read without the lock and
+	// stay valid until the last batch is added.
+	ids := make([]int, 0, len(vectors))
 	for id, vector := range vectors {
 		if len(vector) != r.dimension {
 			return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
@@ -412,50 +350,114 @@ func (r *RPTIndex) BulkAdd(vectors map[int][]float32) error {
 		if _, exists := r.points[id]; exists {
 			return fmt.Errorf("id %d already exists", id)
 		}
-		r.points[id] = vector
-		err := bar.Add(1)
-		if err != nil {
+		ids = append(ids, id)
+	}
+	rebuild := len(vectors) > len(r.points)
+	return r.writeBatches(ids, func(first bool, id int) {
+		if first && rebuild {
+			r.dirty = true
+		}
+		r.points[id] = vectors[id]
+		r.record(id, vectors[id])
+	})
+}
+
+// writeBatches calls write for each of ids, holding the write lock for batches of
+// writeBatchSize ids at a time; first is set for the first call. The caller holds writeMu.
+func (r *RPTIndex) writeBatches(ids []int, write func(first bool, id int)) error {
+	// Create a progress bar with a newline on completion.
+	bar := progressbar.NewOptions(len(ids),
+		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
+	)
+	for start := 0; start < len(ids); start += writeBatchSize {
+		batch := ids[start:min(start+writeBatchSize, len(ids))]
+		r.mu.Lock()
+		for i, id := range batch {
+			write(start+i == 0, id)
+		}
+		r.mu.Unlock()
+		if err := bar.Add(len(batch)); err != nil {
 			return err
 		}
 	}
-	r.dirty = true
 	return nil
 }
 
-// Delete removes a point by its id and marks the tree as dirty.
+// AddStream inserts the batches received from batches until the channel is closed (see
+// core.AddStream). Every batch is added like a BulkAdd under a write lock that is released
+// between batches. With opts.Copy the vectors are copied and every batch is released once
+// it is added; otherwise the points alias the matrices of the batches, which are never
+// released.
+func (r *RPTIndex) AddStream(batches <-chan core.Batch, opts core.StreamOptions) error {
+	return core.ConsumeBatches(batches, opts.Copy, func(b core.Batch) error {
+		return r.addBatch(b, opts.Copy)
+	})
+}
+
+// addBatch inserts the vectors of one batch of a stream, copying the matrix first if
+// copyVectors is set.
+func (r *RPTIndex) addBatch(b core.Batch, copyVectors bool) error {
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	if err := b.Validate(r.dimension); err != nil {
+		return err
+	}
+	for _, id := range b.IDs {
+		if _, exists := r.points[id]; exists {
+			return fmt.Errorf("id %d already exists", id)
+		}
+	}
+	matrix := b.Vectors
+	if copyVectors {
+		matrix = append([]float32(nil), matrix...)
+	}
+	if len(b.IDs) > len(r.points) {
+		r.dirty = true
+	}
+	dim := r.dimension
+	for i, id := range b.IDs {
+		vector := matrix[i*dim : (i+1)*dim : (i+1)*dim]
+		r.points[id] = vector
+		r.record(id, vector)
+	}
+	return nil
+}
+
+// Delete removes a point by its id. Its entry in the tree is left as a stale entry until
+// the next rebuild.
 func (r *RPTIndex) Delete(id int) error {
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
 	r.mu.Lock()
 	defer r.mu.Unlock()
 	if _, exists := r.points[id]; !exists {
 		return fmt.Errorf("id %d not found", id)
 	}
 	delete(r.points, id)
-	r.dirty = true
+	r.record(id, nil)
 	return nil
 }
 
-// BulkDelete removes multiple points from the index and marks the tree as dirty.
+// BulkDelete removes multiple points from the index, as Delete does. Ids that are not in
+// the index are skipped. The ids are removed in batches of writeBatchSize, and the write
+// lock is released between batches.
 func (r *RPTIndex) BulkDelete(ids []int) error {
-	r.mu.Lock()
-	defer r.mu.Unlock()
-
-	// Create a progress bar with a newline on completion.
-	bar := progressbar.NewOptions(len(ids),
-		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
-	)
-	for _, id := range ids {
-		delete(r.points, id)
-		err := bar.Add(1)
-		if err != nil {
-			return err
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
+	return r.writeBatches(ids, func(_ bool, id int) {
+		if _, exists := r.points[id]; exists {
+			delete(r.points, id)
+			r.record(id, nil)
 		}
-	}
-	r.dirty = true
-	return nil
+	})
 }
 
-// Update changes the vector of an existing point and marks the tree as dirty.
+// Update changes the vector of an existing point and routes it to the leaf of its new vector.
 func (r *RPTIndex) Update(id int, vector []float32) error {
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
 	r.mu.Lock()
 	defer r.mu.Unlock()
 	if len(vector) != r.dimension {
@@ -466,19 +468,19 @@ func (r *RPTIndex) Update(id int, vector []float32) error {
 		return fmt.Errorf("id %d not found", id)
 	}
 	r.points[id] = vector
-	r.dirty = true
+	r.record(id, vector)
 	return nil
 }
 
-// BulkUpdate updates multiple points in the index.
+// BulkUpdate updates multiple points in the index, as Update does. The updates are validated
+// first, then applied in batches of writeBatchSize, and the write lock is released between
+// batches.
 func (r *RPTIndex) BulkUpdate(updates map[int][]float32) error {
-	r.mu.Lock()
-	defer r.mu.Unlock()
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
 
-	// Create a progress bar with a newline on completion.
-	bar := progressbar.NewOptions(len(updates),
-		progressbar.OptionOnCompletion(func() { fmt.Print("\n") }),
-	)
+	// As in BulkAdd, writeMu keeps the points from changing until the last batch.
+	ids := make([]int, 0, len(updates))
 	for id, vector := range updates {
 		if len(vector) != r.dimension {
 			return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
@@ -487,25 +489,41 @@ func (r *RPTIndex) BulkUpdate(updates map[int][]float32) error {
 		if _, exists := r.points[id]; !exists {
 			return fmt.Errorf("id %d not found", id)
 		}
-		r.points[id] = vector
-		err := bar.Add(1)
-		if err != nil {
-			return err
-		}
+		ids = append(ids, id)
 	}
-	r.dirty = true
-	return nil
+	return r.writeBatches(ids, func(_ bool, id int) {
+		r.points[id] = updates[id]
+		r.record(id, updates[id])
+	})
 }
 
-// Stats returns some basic statistics about the index.
+// Stats returns statistics about the index: its size, the totals of its searches and
+// builds, and its memory by kind.
 func (r *RPTIndex) Stats() core.IndexStats {
 	r.mu.RLock()
 	defer r.mu.RUnlock()
 	count := len(r.points)
-	return core.IndexStats{
+	stats := core.IndexStats{
 		Count:     count,
 		Dimension: r.dimension,
-		Distance:  "euclidean",
+		Distance:  r.DistanceName,
+		Memory: core.MemoryStats{
+			Vectors: int64(count) * int64(r.dimension) * 4,
+			IDs:     core.MapBytes(count),
+		},
+	}
+	for _, tree := range r.trees {
+		stats.Memory.Graph += treeBytes(tree)
+	}
+	r.counters.Fill(&stats)
+	return stats
+}
+
+// setDistance adopts the metric name saved with an index if it is registered in
+// core.Distances; otherwise the configured distance is kept.
+func (r *RPTIndex) setDistance(name string) {
+	if fn, ok := core.Distances[name]; ok {
+		r.Distance, r.DistanceName = fn, name
 	}
 }
 
@@ -523,7 +541,7 @@ func (r *RPTIndex) GobEncode() ([]byte, error) {
 	ser := rptSerialized{
 		Dimension:    r.dimension,
 		Points:       r.points,
-		DistanceName: "euclidean",
+		DistanceName: r.DistanceName,
 	}
 	var buf bytes.Buffer
 	enc := gob.NewEncoder(&buf)
@@ -543,29 +561,51 @@ func (r *RPTIndex) GobDecode(data []byte) error {
 	}
 	r.dimension = ser.Dimension
 	r.points = ser.Points
-	r.DistanceName = "euclidean"
+	r.setDistance(ser.DistanceName)
+	r.trees = nil
+	r.generation++
 	r.dirty = true // mark tree as dirty so it will be rebuilt
 	return nil
 }
 
-// Save writes the index to the given writer using gob encoding.
+// Save writes the index to the given writer in the sectioned binary format (see core.WriteSections).
 func (r *RPTIndex) Save(w io.Writer) error {
 	r.mu.RLock()
 	defer r.mu.RUnlock()
-	enc := gob.NewEncoder(w)
-	return enc.Encode(r)
+	return core.WriteSections(w, formatKind, r.sections())
 }
 
-// Load reads the index from the given reader using gob encoding.
+// Load reads an index written by Save from the given reader.
+// Gob files of every earlier version are still accepted; their tree is built again.
 func (r *RPTIndex) Load(rdr io.Reader) error {
+	r.writeMu.Lock()
+	defer r.writeMu.Unlock()
 	r.mu.Lock()
 	defer r.mu.Unlock()
-	dec := gob.NewDecoder(rdr)
-	return dec.Decode(r)
+	br := bufio.NewReader(rdr)
+	if prefix, _ := br.Peek(core.SectionMagicLen); !core.IsSectionFile(prefix) {
+		dec := gob.NewDecoder(br)
+		if err := dec.Decode(r); err != nil {
+			return err
+		}
+	} else {
+		f, err := core.ReadSections(br)
+		if err != nil {
+			return err
+		}
+		if err := r.loadSections(f); err != nil {
+			return err
+		}
+	}
+	r.setMapping(nil)
+	return nil
 }
 
 // Check that RPTIndex implements the core.Index interface.
-var _ core.Index = (*RPTIndex)(nil)
+var (
+	_ core.Index       = (*RPTIndex)(nil)
+	_ core.StreamAdder = (*RPTIndex)(nil)
+)
 
 // Register RPTIndex for gob encoding.
 func init() {
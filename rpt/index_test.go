@@ -2,9 +2,16 @@ package rpt_test
 
 import (
 	"bytes"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"sort"
 	"sync"
+	"sync/atomic"
 	"testing"
+	"time"
 
+	"github.com/patrikhermansson/hann/core"
 	"github.com/patrikhermansson/hann/rpt"
 )
 
@@ -196,6 +203,67 @@ func TestRPTIndex_SaveLoad(t *testing.T) {
 	}
 }
 
+func TestRPTIndex_Distance(t *testing.T) {
+	dim := 4
+	idx := rpt.NewRPTIndex(dim, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	vectors := map[int][]float32{1: {1, 0, 0, 0}, 2: {0, 3, 0, 0}, 3: {2, 2, 0, 0}}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	query := []float32{0, 0, 0, 0}
+	check := func(name string, idx *rpt.RPTIndex, distance core.DistanceFunc) {
+		t.Helper()
+		neighbors, err := idx.Search(query, 3)
+		if err != nil {
+			t.Fatalf("%s: Search failed: %v", name, err)
+		}
+		for i, n := range neighbors {
+			if want := distance(query, vectors[n.ID]); n.Distance != want ||
+				(i > 0 && n.Distance < neighbors[i-1].Distance) {
+				t.Fatalf("%s: got %v, want distances of %s", name, neighbors, name)
+			}
+		}
+	}
+	check("euclidean", idx, core.Euclidean)
+
+	// The metric is resolved by name, or from Distance for names not in core.Metrics.
+	idx.DistanceName = "manhattan"
+	check("manhattan", idx, core.Manhattan)
+	chebyshev := func(a, b []float32) float64 {
+		d := 0.0
+		for i := range a {
+			d = max(d, float64(abs(a[i]-b[i])))
+		}
+		return d
+	}
+	idx.Distance, idx.DistanceName = chebyshev, "chebyshev"
+	check("chebyshev", idx, chebyshev)
+
+	// A saved index keeps its registered metric.
+	idx.Distance, idx.DistanceName = core.Manhattan, "manhattan"
+	var buf bytes.Buffer
+	if err := idx.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	loaded := rpt.NewRPTIndex(dim, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	if err := loaded.Load(bytes.NewReader(buf.Bytes())); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	if loaded.Stats().Distance != "manhattan" {
+		t.Errorf("expected the loaded index to use manhattan, got %q", loaded.Stats().Distance)
+	}
+	check("loaded manhattan", loaded, core.Manhattan)
+}
+
+func abs(x float32) float32 {
+	if x < 0 {
+		return -x
+	}
+	return x
+}
+
 func TestRPTIndex_ConcurrentOperations(t *testing.T) {
 	dim := 6
 	idx := rpt.NewRPTIndex(dim, defaultLeafCapacity, defaultCandidateProjections,
@@ -248,3 +316,607 @@ func TestRPTIndex_ErrorOnWrongVectorDimension(t *testing.T) {
 		t.Errorf("expected error for wrong vector dimension in BulkAdd, but got none")
 	}
 }
+
+func TestRPTIndex_SearchBatch(t *testing.T) {
+	idx := rpt.NewRPTIndex(6, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+
+	vectors := map[int][]float32{
+		1: {1, 2, 3, 4, 5, 6},
+		2: {6, 5, 4, 3, 2, 1},
+		3: {1, 1, 1, 1, 1, 1},
+		4: {2, 2, 2, 2, 2, 2},
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	// Each query is an indexed vector, so it should come back as its own nearest neighbor.
+	ids := []int{1, 2, 3, 4, 2, 1}
+	queries := make([][]float32, len(ids))
+	for i, id := range ids {
+		queries[i] = vectors[id]
+	}
+	results, err := idx.SearchBatch(queries, 1)
+	if err != nil {
+		t.Fatalf("SearchBatch failed: %v", err)
+	}
+	if len(results) != len(queries) {
+		t.Fatalf("expected %d result lists, got %d", len(queries), len(results))
+	}
+	for i, res := range results {
+		if len(res) != 1 || res[0].ID != ids[i] {
+			t.Errorf("query %d: expected neighbor id %d, got %v", i, ids[i], res)
+		}
+	}
+
+	// A query with the wrong dimension fails the whole batch.
+	if _, err := idx.SearchBatch([][]float32{{1, 2, 3}}, 1); err == nil {
+		t.Error("expected error for query dimension mismatch, got none")
+	}
+}
+
+func TestRPTIndex_SearchStats(t *testing.T) {
+	idx := rpt.NewRPTIndex(2, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	vectors := make(map[int][]float32)
+	for i := 0; i < 100; i++ {
+		vectors[i] = []float32{float32(i), float32(i % 7)}
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	var stats core.SearchStats
+	neighbors, err := idx.SearchWithOptions([]float32{50, 1}, 5, core.SearchOptions{Stats: &stats})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if len(neighbors) != 5 {
+		t.Errorf("expected 5 neighbors, got %v", neighbors)
+	}
+	// RPT candidates are scored exactly, so nothing needs re-ranking.
+	if stats.Candidates < 5 || stats.Reranked != 0 {
+		t.Errorf("expected at least 5 exact candidates and none re-ranked, got %+v", stats)
+	}
+}
+
+func TestRPTIndex_Instrumentation(t *testing.T) {
+	idx := rpt.NewRPTIndex(2, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	var sink core.MapSink
+	idx.Sink = &sink
+	vectors := make(map[int][]float32)
+	for i := 0; i < 100; i++ {
+		vectors[i] = []float32{float32(i), float32(i % 7)}
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	// Build the tree up front; searches of a dirty tree scan all points instead.
+	idx.Rebuild()
+
+	// Asking for most of the points leaves too few candidates in the probed leaves.
+	var stats core.SearchStats
+	if _, err := idx.SearchWithOptions([]float32{50, 1}, 60, core.SearchOptions{Stats: &stats}); err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if stats.Fallbacks == 0 {
+		t.Errorf("expected the search to widen, got %+v", stats)
+	}
+
+	total := idx.Stats()
+	if total.Searches != 1 || total.Fallbacks != int64(stats.Fallbacks) || total.Builds == 0 ||
+		total.DistanceComputations != int64(stats.DistanceComputations) {
+		t.Errorf("unexpected totals %+v", total)
+	}
+	if total.Memory.Vectors != 100*2*4 || total.Memory.Graph == 0 || total.Memory.IDs == 0 {
+		t.Errorf("unexpected memory %+v", total.Memory)
+	}
+	if n := sink.Counter("rpt_searches"); n != 1 {
+		t.Errorf("expected 1 search in the sink, got %d", n)
+	}
+	if h := sink.Histogram("rpt_search_distance_computations"); h.Count != 1 || h.Sum != float64(stats.DistanceComputations) {
+		t.Errorf("unexpected distance histogram %+v", h)
+	}
+}
+
+func TestRPTIndex_SearchDuringBuild(t *testing.T) {
+	idx := rpt.NewRPTIndex(2, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	vectors := make(map[int][]float32)
+	for i := 0; i < 1000; i++ {
+		vectors[i] = []float32{float32(i), float32(i % 7)}
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	// The first search starts a background build and answers with an exact scan.
+	var stats core.SearchStats
+	neighbors, err := idx.SearchWithOptions([]float32{500, 3}, 3, core.SearchOptions{Stats: &stats})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if !stats.BruteForce || stats.Candidates != 1000 {
+		t.Errorf("expected an exact scan of all points, got %+v", stats)
+	}
+	if len(neighbors) != 3 || neighbors[0].ID != 500 || neighbors[0].Distance != 0 {
+		t.Errorf("expected 500 first, got %v", neighbors)
+	}
+
+	deadline := time.Now().Add(10 * time.Second)
+	for idx.Stats().Builds == 0 {
+		if time.Now().After(deadline) {
+			t.Fatal("the background build did not finish")
+		}
+		time.Sleep(time.Millisecond)
+	}
+	if _, err := idx.SearchWithOptions([]float32{500, 3}, 3, core.SearchOptions{Stats: &stats}); err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if stats.BruteForce || stats.Candidates >= 1000 {
+		t.Errorf("expected the search to use the built tree, got %+v", stats)
+	}
+}
+
+func TestRPTIndex_AddStream(t *testing.T) {
+	for _, copyVectors := range []bool{false, true} {
+		idx := rpt.NewRPTIndex(2, defaultLeafCapacity, defaultCandidateProjections,
+			defaultParallelThreshold, defaultProbeMargin)
+		matrix := make([]float32, 0, 200)
+		for i := 0; i < 100; i++ {
+			matrix = append(matrix, float32(i), float32(i%7))
+		}
+		released := 0
+		batches := make(chan core.Batch, 2)
+		batches <- core.Batch{IDs: seq(0, 50), Vectors: matrix[:100], Release: func() { released++ }}
+		batches <- core.Batch{IDs: seq(50, 100), Vectors: matrix[100:], Release: func() { released++ }}
+		close(batches)
+		if err := idx.AddStream(batches, core.StreamOptions{Copy: copyVectors}); err != nil {
+			t.Fatalf("AddStream failed: %v", err)
+		}
+		// Overwriting the matrix only changes the points that alias it.
+		for i := range matrix {
+			matrix[i] = 1000
+		}
+		neighbors, err := idx.Search([]float32{20, 6}, 1)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		if copyVectors {
+			if released != 2 || neighbors[0].ID != 20 || neighbors[0].Distance != 0 {
+				t.Errorf("expected copied points and released batches, got %v and %d releases", neighbors, released)
+			}
+		} else if released != 0 || neighbors[0].Distance == 0 {
+			t.Errorf("expected aliased points and no releases, got %v and %d releases", neighbors, released)
+		}
+	}
+}
+
+// seq returns the ids in [start, end).
+func seq(start, end int) []int {
+	ids := make([]int, 0, end-start)
+	for id := start; id < end; id++ {
+		ids = append(ids, id)
+	}
+	return ids
+}
+
+func TestRPTIndex_FilteredSearch(t *testing.T) {
+	idx := rpt.NewRPTIndex(2, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	vectors := make(map[int][]float32)
+	for i := 0; i < 500; i++ {
+		vectors[i] = []float32{float32(i), float32(i % 7)}
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	even := core.NewBitset()
+	for id := 0; id < 500; id += 2 {
+		even.Add(id)
+	}
+	// Ids far from the query are only found by the scan for additional points.
+	far := core.NewIDSet(0, 1, 499, 10000)
+	for _, tc := range []struct {
+		filter core.Filter
+		want   int
+	}{{even, 5}, {far, 3}} {
+		neighbors, err := idx.SearchWithOptions([]float32{250, 1}, 5, core.SearchOptions{Filter: tc.filter})
+		if err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+		if len(neighbors) != tc.want {
+			t.Fatalf("expected %d neighbors, got %v", tc.want, neighbors)
+		}
+		for _, n := range neighbors {
+			if !tc.filter.Contains(n.ID) {
+				t.Errorf("neighbor %d is not in the filter", n.ID)
+			}
+		}
+	}
+}
+
+func TestRPTIndex_SearchBudget(t *testing.T) {
+	idx := rpt.NewRPTIndex(2, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	vectors := make(map[int][]float32)
+	for i := 0; i < 500; i++ {
+		vectors[i] = []float32{float32(i), float32(i % 7)}
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	var stats core.SearchStats
+	neighbors, err := idx.SearchWithOptions([]float32{50, 1}, 5, core.SearchOptions{
+		ProbeMargin:             -1,
+		MaxDistanceComputations: 3,
+		Stats:                   &stats,
+	})
+	if err != nil {
+		t.Fatalf("SearchWithOptions failed: %v", err)
+	}
+	if len(neighbors) != 3 || stats.DistanceComputations != 3 || !stats.Truncated {
+		t.Errorf("expected 3 neighbors from a truncated search, got %v and %+v", neighbors, stats)
+	}
+}
+
+func TestRPTIndex_LoadFile(t *testing.T) {
+	idx := rpt.NewRPTIndex(2, 7, defaultCandidateProjections, defaultParallelThreshold, 0.25)
+	vectors := make(map[int][]float32)
+	for i := 0; i < 100; i++ {
+		vectors[i] = []float32{float32(i), float32(i % 7)}
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	// Build the tree so that it is saved with the points.
+	idx.Rebuild()
+	path := filepath.Join(t.TempDir(), "index.hann")
+	file, err := os.Create(path)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := idx.Save(file); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	file.Close()
+
+	loaded := rpt.NewRPTIndex(2, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	if err := loaded.LoadFile(path); err != nil {
+		t.Fatalf("LoadFile failed: %v", err)
+	}
+	if loaded.LeafCapacity != 7 || loaded.ProbeMargin != 0.25 || loaded.Stats().Count != 100 {
+		t.Errorf("parameters not restored: %+v", loaded.Stats())
+	}
+	// The loaded index uses the saved tree, so it answers exactly like the original.
+	for _, query := range [][]float32{{50, 1}, {3, 6}, {97.5, 0}} {
+		want, err := idx.Search(query, 5)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		got, err := loaded.Search(query, 5)
+		if err != nil {
+			t.Fatalf("Search on loaded index failed: %v", err)
+		}
+		if len(got) != len(want) {
+			t.Fatalf("query %v: expected %v, got %v", query, want, got)
+		}
+		for i := range want {
+			if got[i] != want[i] {
+				t.Fatalf("query %v: expected %v, got %v", query, want, got)
+			}
+		}
+	}
+}
+
+func TestRPTIndex_IncrementalUpdates(t *testing.T) {
+	dim := 4
+	idx := rpt.NewRPTIndex(dim, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, -1)
+	rnd := rand.New(rand.NewSource(1))
+	randomVector := func() []float32 {
+		vec := make([]float32, dim)
+		for i := range vec {
+			vec[i] = rnd.Float32() * 100
+		}
+		return vec
+	}
+	vectors := make(map[int][]float32)
+	for i := 0; i < 500; i++ {
+		vectors[i] = randomVector()
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	// Once the tree is built, later mutations update it in place.
+	idx.Rebuild()
+	for i := 500; i < 700; i++ {
+		vectors[i] = randomVector()
+		if err := idx.Add(i, vectors[i]); err != nil {
+			t.Fatalf("Add failed: %v", err)
+		}
+	}
+	for i := 0; i < 100; i++ {
+		vectors[i] = randomVector()
+		if err := idx.Update(i, vectors[i]); err != nil {
+			t.Fatalf("Update failed: %v", err)
+		}
+	}
+	if err := idx.BulkDelete([]int{100, 101, 102, 600}); err != nil {
+		t.Fatalf("BulkDelete failed: %v", err)
+	}
+	for _, id := range []int{100, 101, 102, 600} {
+		delete(vectors, id)
+	}
+
+	check := func(stage string) {
+		// Without a probe margin a search follows the path a point was routed along, so
+		// every point is found as its own nearest neighbor and deleted points never appear.
+		for id, vec := range vectors {
+			res, err := idx.Search(vec, 1)
+			if err != nil {
+				t.Fatalf("%s: Search failed: %v", stage, err)
+			}
+			if len(res) != 1 || res[0].ID != id || res[0].Distance != 0 {
+				t.Fatalf("%s: expected id %d at distance 0, got %v", stage, id, res)
+			}
+		}
+		if count := idx.Stats().Count; count != len(vectors) {
+			t.Errorf("%s: expected count %d, got %d", stage, len(vectors), count)
+		}
+	}
+	check("incremental")
+	idx.Rebuild()
+	check("rebuilt")
+}
+
+func TestRPTIndex_ConcurrentUpdatesAndSearches(t *testing.T) {
+	dim := 4
+	idx := rpt.NewRPTIndex(dim, 5, defaultCandidateProjections, defaultParallelThreshold, defaultProbeMargin)
+	idx.RebuildStaleRatio = 0.05 // rebuild often, so that rebuilds overlap with the mutations
+	vectorOf := func(id, version int) []float32 {
+		return []float32{float32(id), float32(id%13 + version), float32(id%7 - version), float32(version)}
+	}
+	for i := 0; i < 300; i++ {
+		if err := idx.Add(i, vectorOf(i, 0)); err != nil {
+			t.Fatalf("Add failed: %v", err)
+		}
+	}
+	if _, err := idx.Search(vectorOf(0, 0), 1); err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+
+	var wg sync.WaitGroup
+	for w := 0; w < 4; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			for n := 0; n < 200; n++ {
+				id := w*1000 + 300 + n
+				if w == 0 {
+					// One writer deletes and updates existing points; the others add new ones.
+					if err := idx.Delete(n); err != nil {
+						t.Errorf("Delete failed: %v", err)
+					}
+					if err := idx.Update(n+100, vectorOf(n+100, 1)); err != nil {
+						t.Errorf("Update failed: %v", err)
+					}
+				} else if err := idx.Add(id, vectorOf(id, 0)); err != nil {
+					t.Errorf("Add failed: %v", err)
+				}
+				if _, err := idx.Search(vectorOf(n, 0), 3); err != nil {
+					t.Errorf("Search failed: %v", err)
+				}
+			}
+		}(w)
+	}
+	wg.Wait()
+	idx.Rebuild()
+
+	if count := idx.Stats().Count; count != 300-200+3*200 {
+		t.Errorf("expected %d points, got %d", 300-200+3*200, count)
+	}
+	for _, id := range []int{250, 1300, 3499} {
+		version := 0
+		if id == 250 {
+			version = 1
+		}
+		res, err := idx.SearchWithOptions(vectorOf(id, version), 1, core.SearchOptions{ProbeMargin: -1})
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		if len(res) != 1 || res[0].ID != id {
+			t.Errorf("expected id %d, got %v", id, res)
+		}
+	}
+	if res, err := idx.Search(vectorOf(10, 0), 5); err != nil {
+		t.Fatalf("Search failed: %v", err)
+	} else {
+		for _, n := range res {
+			if n.ID < 200 {
+				t.Errorf("deleted id %d returned", n.ID)
+			}
+		}
+	}
+}
+
+// TestRPTIndex_ConcurrentBulkWrites runs bulk writes of several lock batches alongside
+// searches and conflicting writes: every bulk write is applied entirely or, if it fails
+// validation, not at all.
+func TestRPTIndex_ConcurrentBulkWrites(t *testing.T) {
+	dim := 4
+	idx := rpt.NewRPTIndex(dim, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	vectorOf := func(id, version int) []float32 {
+		return []float32{float32(id), float32(id%13 + version), float32(id%7 - version), float32(version)}
+	}
+	bulk := func(from, to, version int) map[int][]float32 {
+		vectors := make(map[int][]float32, to-from)
+		for id := from; id < to; id++ {
+			vectors[id] = vectorOf(id, version)
+		}
+		return vectors
+	}
+	if err := idx.BulkAdd(bulk(0, 3000, 0)); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+
+	var wg sync.WaitGroup
+	var conflicts atomic.Int32
+	wg.Add(4)
+	go func() {
+		defer wg.Done()
+		if err := idx.BulkAdd(bulk(3000, 6000, 0)); err != nil {
+			conflicts.Add(1)
+		}
+	}()
+	go func() {
+		defer wg.Done()
+		// Id 5999 is added by the BulkAdd above, or the BulkAdd fails on it.
+		if err := idx.Add(5999, vectorOf(5999, 0)); err != nil {
+			conflicts.Add(1)
+		}
+	}()
+	go func() {
+		defer wg.Done()
+		if err := idx.BulkUpdate(bulk(1000, 2500, 1)); err != nil {
+			t.Errorf("BulkUpdate failed: %v", err)
+		}
+		if err := idx.BulkDelete([]int{0, 1, 2, 8000}); err != nil {
+			t.Errorf("BulkDelete failed: %v", err)
+		}
+	}()
+	go func() {
+		defer wg.Done()
+		for n := 0; n < 200; n++ {
+			if _, err := idx.Search(vectorOf(n*10, 0), 3); err != nil {
+				t.Errorf("Search failed: %v", err)
+			}
+		}
+	}()
+	wg.Wait()
+	if n := conflicts.Load(); n != 1 {
+		t.Fatalf("expected exactly one of the conflicting writes to fail, got %d failures", n)
+	}
+	count := idx.Stats().Count
+	if count != 3000-3+1 && count != 6000-3 {
+		t.Errorf("expected the BulkAdd to be applied entirely or not at all, got %d points", count)
+	}
+	// An update of a missing id fails before any point is changed.
+	updates := bulk(2000, 3500, 2)
+	updates[9000] = vectorOf(9000, 2)
+	if err := idx.BulkUpdate(updates); err == nil {
+		t.Error("expected an error for a missing id")
+	}
+	res, err := idx.SearchWithOptions(vectorOf(2000, 1), 1, core.SearchOptions{ProbeMargin: -1})
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if len(res) != 1 || res[0].ID != 2000 || res[0].Distance != 0 {
+		t.Errorf("expected id 2000 at its first update, got %v", res)
+	}
+}
+
+func TestRPTIndex_Forest(t *testing.T) {
+	dim, n, k := 8, 2000, 10
+	rnd := rand.New(rand.NewSource(2))
+	vectors := make(map[int][]float32, n)
+	for i := 0; i < n; i++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = rnd.Float32()
+		}
+		vectors[i] = vec
+	}
+	queries := make([][]float32, 50)
+	for q := range queries {
+		queries[q] = make([]float32, dim)
+		for j := range queries[q] {
+			queries[q][j] = rnd.Float32()
+		}
+	}
+	// exact returns the ids of the k nearest vectors to query by brute force.
+	exact := func(query []float32) map[int]bool {
+		ids := make([]int, 0, n)
+		dist := make(map[int]float64, n)
+		for id, vec := range vectors {
+			var d float64
+			for j := range vec {
+				diff := float64(vec[j] - query[j])
+				d += diff * diff
+			}
+			ids = append(ids, id)
+			dist[id] = d
+		}
+		sort.Slice(ids, func(i, j int) bool { return dist[ids[i]] < dist[ids[j]] })
+		want := make(map[int]bool, k)
+		for _, id := range ids[:k] {
+			want[id] = true
+		}
+		return want
+	}
+	recall := func(idx *rpt.RPTIndex) float64 {
+		hits := 0
+		for _, query := range queries {
+			want := exact(query)
+			res, err := idx.Search(query, k)
+			if err != nil {
+				t.Fatalf("Search failed: %v", err)
+			}
+			seen := make(map[int]bool, len(res))
+			for _, nb := range res {
+				if seen[nb.ID] {
+					t.Fatalf("id %d returned twice: %v", nb.ID, res)
+				}
+				seen[nb.ID] = true
+				if want[nb.ID] {
+					hits++
+				}
+			}
+		}
+		return float64(hits) / float64(len(queries)*k)
+	}
+
+	single := rpt.NewRPTIndex(dim, 20, defaultCandidateProjections, defaultParallelThreshold, 0.05)
+	forest := rpt.NewRPTIndex(dim, 20, defaultCandidateProjections, defaultParallelThreshold, 0.05)
+	forest.Trees = 8
+	for _, idx := range []*rpt.RPTIndex{single, forest} {
+		if err := idx.BulkAdd(vectors); err != nil {
+			t.Fatalf("BulkAdd failed: %v", err)
+		}
+	}
+	singleRecall, forestRecall := recall(single), recall(forest)
+	if forestRecall <= singleRecall || forestRecall < 0.8 {
+		t.Errorf("expected the forest to improve recall: single tree %.2f, forest %.2f", singleRecall, forestRecall)
+	}
+
+	// All trees are saved, so a loaded forest answers exactly like the original.
+	var buf bytes.Buffer
+	if err := forest.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	loaded := rpt.NewRPTIndex(dim, defaultLeafCapacity, defaultCandidateProjections,
+		defaultParallelThreshold, defaultProbeMargin)
+	if err := loaded.Load(&buf); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	if loaded.Trees != 8 {
+		t.Errorf("expected 8 trees after loading, got %d", loaded.Trees)
+	}
+	for _, query := range queries[:5] {
+		want, _ := forest.Search(query, k)
+		got, err := loaded.Search(query, k)
+		if err != nil {
+			t.Fatalf("Search on loaded index failed: %v", err)
+		}
+		for i := range want {
+			if i >= len(got) || got[i] != want[i] {
+				t.Fatalf("expected %v, got %v", want, got)
+			}
+		}
+	}
+}
@@ -0,0 +1,126 @@
+package rpt
+
+import (
+	"sync"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// visitedSet is a set of point ids that is emptied in constant time. It is an open
+// addressing hash table whose slots are tagged with the epoch that filled them, so
+// starting a new epoch forgets every id without clearing the table.
+type visitedSet struct {
+	keys  []int    // id held by each slot
+	tags  []uint32 // epoch tag per slot; a slot is in use when its tag equals epoch
+	epoch uint32   // tag of the current search
+	count int      // ids added in the current epoch
+	shift uint     // 64 minus the log2 of the table size
+}
+
+// hashMultiplier spreads consecutive ids over the table (Fibonacci hashing).
+const hashMultiplier = 0x9E3779B97F4A7C15
+
+// minVisitedSlots is the initial size of a visited set.
+const minVisitedSlots = 64
+
+// reset empties the set.
+func (s *visitedSet) reset() {
+	if len(s.tags) == 0 {
+		s.resize(minVisitedSlots)
+		return
+	}
+	s.epoch++
+	s.count = 0
+	if s.epoch == 0 {
+		// The tag wrapped around; clear stale tags so they cannot collide.
+		for i := range s.tags {
+			s.tags[i] = 0
+		}
+		s.epoch = 1
+	}
+}
+
+// resize replaces the table with an empty one of size slots (a power of two).
+func (s *visitedSet) resize(size int) {
+	s.keys = make([]int, size)
+	s.tags = make([]uint32, size)
+	s.epoch = 1
+	s.count = 0
+	s.shift = 64
+	for size > 1 {
+		size >>= 1
+		s.shift--
+	}
+}
+
+// slot returns the slot that holds id, or the empty slot where it would go.
+func (s *visitedSet) slot(id int) int {
+	mask := len(s.tags) - 1
+	i := int((uint64(id) * hashMultiplier) >> s.shift)
+	for s.tags[i] == s.epoch && s.keys[i] != id {
+		i = (i + 1) & mask
+	}
+	return i
+}
+
+// add inserts id and reports whether it was absent before.
+func (s *visitedSet) add(id int) bool {
+	i := s.slot(id)
+	if s.tags[i] == s.epoch {
+		return false
+	}
+	if 2*(s.count+1) > len(s.tags) {
+		s.grow()
+		i = s.slot(id)
+	}
+	s.keys[i], s.tags[i] = id, s.epoch
+	s.count++
+	return true
+}
+
+// contains reports whether id is in the set.
+func (s *visitedSet) contains(id int) bool {
+	return s.tags[s.slot(id)] == s.epoch
+}
+
+// grow doubles the table, keeping the ids of the current epoch.
+func (s *visitedSet) grow() {
+	keys, tags, epoch := s.keys, s.tags, s.epoch
+	s.resize(2 * len(tags))
+	for i, tag := range tags {
+		if tag == epoch {
+			j := s.slot(keys[i])
+			s.keys[j], s.tags[j] = keys[i], s.epoch
+			s.count++
+		}
+	}
+}
+
+// searchContext holds the per-goroutine scratch state of a search.
+// Contexts are pooled, so a search merges the candidates of all trees without allocating.
+type searchContext struct {
+	visited    visitedSet  // ids collected so far
+	candidates []int       // collected candidate ids, in collection order
+	filter     core.Filter // ids the search may return (nil allows all)
+}
+
+// searchContextPool recycles search contexts between searches.
+var searchContextPool = sync.Pool{
+	New: func() interface{} {
+		return new(searchContext)
+	},
+}
+
+// getSearchContext takes a context from the pool and empties it.
+func getSearchContext() *searchContext {
+	ctx := searchContextPool.Get().(*searchContext)
+	ctx.visited.reset()
+	ctx.candidates = ctx.candidates[:0]
+	return ctx
+}
+
+// putSearchContext returns a context to the pool.
+func putSearchContext(ctx *searchContext) {
+	ctx.filter = nil
+	searchContextPool.Put(ctx)
+}
@@ -0,0 +1,249 @@
+package rpt
+
+import (
+	"math"
+	"math/bits"
+	"math/rand"
+	"sort"
+	"time"
+	"unsafe"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// Default thresholds of the background rebuild (see RPTIndex.RebuildStaleRatio and
+// RPTIndex.RebuildDepthFactor).
+const (
+	defaultRebuildStaleRatio  = 0.25
+	defaultRebuildDepthFactor = 3
+)
+
+// Once the trees are built, mutations update them in place instead of discarding them: a
+// new or updated point is routed down to its leaf in every tree (a leaf that grows past
+// LeafCapacity is split locally), and a deleted point stays in its leaves as stale entries
+// that searches skip. An updated point leaves stale entries behind in its old leaves as
+// well, so the forest holds treeSize entries of which treeSize-len(points)*len(trees) are
+// stale.
+//
+// When stale entries or local splits degrade the tree past the rebuild thresholds, a new
+// tree is built in the background from a snapshot of the points while searches keep using
+// the current one. Mutations made in the meantime are logged in pending and replayed on
+// the new tree before it is swapped in under a short write lock.
+
+// active reports whether mutations maintain the tree incrementally. Without a tree (or with
+// a full rebuild pending) they only change the points. The caller holds the lock.
+func (r *RPTIndex) active() bool {
+	return len(r.trees) > 0 && !r.dirty
+}
+
+// random returns the random source used for local splits. The caller holds the write lock.
+func (r *RPTIndex) random() *rand.Rand {
+	if r.rnd == nil {
+		r.rnd = rand.New(rand.NewSource(core.GetSeed()))
+	}
+	return r.rnd
+}
+
+// leafFor returns the leaf that vector routes to and its depth, following the same
+// decisions as a search with no probe margin.
+func leafFor(node *treeNode, vector []float32) (*treeNode, int) {
+	depth := 0
+	for !node.isLeaf {
+		if project(vector, node.projection) < node.threshold {
+			node = node.left
+		} else {
+			node = node.right
+		}
+		depth++
+	}
+	return node, depth
+}
+
+// treeDepth returns the length of the longest path from node to a leaf.
+func treeDepth(node *treeNode) int {
+	if node == nil || node.isLeaf {
+		return 0
+	}
+	return 1 + max(treeDepth(node.left), treeDepth(node.right))
+}
+
+// treeBytes returns the memory held by the nodes of a tree: their structs, projections and
+// leaf id lists.
+func treeBytes(node *treeNode) int64 {
+	if node == nil {
+		return 0
+	}
+	size := int64(unsafe.Sizeof(*node)) + int64(len(node.points))*bits.UintSize/8 + int64(len(node.projection))*4
+	return size + treeBytes(node.left) + treeBytes(node.right)
+}
+
+// insert routes a point that is already stored in points down to its leaf in every tree,
+// and splits leaves that overflow. The caller holds the write lock and the tree is active.
+func (r *RPTIndex) insert(id int, vector []float32) {
+	for _, tree := range r.trees {
+		leaf, depth := leafFor(tree, vector)
+		leaf.points = append(leaf.points, id)
+		r.treeSize++
+		if len(leaf.points) > r.LeafCapacity {
+			r.splitLeaf(leaf, depth)
+		}
+	}
+}
+
+// splitLeaf replaces an overflowing leaf with a subtree built from its live entries.
+// Stale entries found in the leaf are dropped on the way.
+func (r *RPTIndex) splitLeaf(leaf *treeNode, depth int) {
+	seen := make(map[int]struct{}, len(leaf.points))
+	ids := make([]int, 0, len(leaf.points))
+	for _, id := range leaf.points {
+		if _, ok := r.points[id]; !ok {
+			continue
+		}
+		if _, dup := seen[id]; dup {
+			continue
+		}
+		seen[id] = struct{}{}
+		ids = append(ids, id)
+	}
+	r.treeSize -= len(leaf.points) - len(ids)
+	if len(ids) <= r.LeafCapacity {
+		leaf.points = ids
+		return
+	}
+	*leaf = *newTreeBuilder(ids, r.points, r.dimension, r.LeafCapacity,
+		r.CandidateProjections, r.ParallelThreshold).tree(r.random())
+	r.maxDepth = max(r.maxDepth, depth+treeDepth(leaf))
+}
+
+// record notes a mutation of id after its point has been changed: the id is logged for a
+// running background rebuild, an active tree takes the new vector (vector is nil for a
+// delete), and a background rebuild is started if the tree has degraded too much.
+// The caller holds the write lock.
+func (r *RPTIndex) record(id int, vector []float32) {
+	if r.rebuilding {
+		r.pending = append(r.pending, id)
+	}
+	if !r.active() {
+		return
+	}
+	if vector != nil {
+		r.insert(id, vector)
+	}
+	if !r.rebuilding && r.needsRebuild() {
+		r.rebuilding = true
+		go r.rebuild()
+	}
+}
+
+// needsRebuild reports whether the share of stale entries or the depth of the tree has
+// crossed its rebuild threshold. The caller holds the lock.
+func (r *RPTIndex) needsRebuild() bool {
+	n := len(r.points)
+	if n == 0 {
+		return false
+	}
+	if ratio := orDefault(r.RebuildStaleRatio, defaultRebuildStaleRatio); ratio > 0 &&
+		float64(r.treeSize-n*len(r.trees)) > ratio*float64(r.treeSize) {
+		return true
+	}
+	// A balanced tree splits until its leaves hold at most LeafCapacity points.
+	balanced := math.Max(1, math.Ceil(math.Log2(float64(n)/float64(max(r.LeafCapacity, 1)))))
+	factor := orDefault(r.RebuildDepthFactor, defaultRebuildDepthFactor)
+	return factor > 0 && float64(r.maxDepth) > factor*balanced
+}
+
+// orDefault returns v, or def if v is zero. Negative values disable a threshold.
+func orDefault(v, def float64) float64 {
+	if v == 0 {
+		return def
+	}
+	return v
+}
+
+// Rebuild builds a new tree from all current points and swaps it in. The index stays
+// fully usable during the build: searches use the previous tree and mutations are
+// replayed on the new tree before the swap. Rebuilds also start automatically in the
+// background once the tree has degraded (see RebuildStaleRatio and RebuildDepthFactor).
+func (r *RPTIndex) Rebuild() {
+	r.mu.Lock()
+	r.rebuilding = true
+	r.mu.Unlock()
+	r.rebuild()
+}
+
+// startBuild builds a dirty tree in the background unless such a build is already running.
+// Searches call it under the read lock and scan the points exactly until the tree is
+// swapped in, so they never wait for a build.
+func (r *RPTIndex) startBuild() {
+	if r.building.CompareAndSwap(false, true) {
+		go func() {
+			defer r.building.Store(false)
+			r.rebuild()
+		}()
+	}
+}
+
+// rebuild builds a tree from a snapshot of the points without holding the lock, then
+// replays the mutations logged since the snapshot and swaps the tree in. The result is
+// dropped if the tree was replaced in the meantime (by a load or a full rebuild).
+func (r *RPTIndex) rebuild() {
+	r.rebuildMu.Lock()
+	defer r.rebuildMu.Unlock()
+	begin := time.Now()
+	defer func() { r.counters.RecordBuild(r.Sink, "rpt_rebuild", time.Since(begin)) }()
+
+	r.mu.Lock()
+	r.rebuilding = true
+	r.pending = r.pending[:0]
+	seeds := r.treeSeeds(r.random())
+	r.mu.Unlock()
+
+	// Writers are excluded while the snapshot is taken, so every mutation logged after
+	// position start is missing from it.
+	r.mu.RLock()
+	ids := make([]int, 0, len(r.points))
+	points := make(map[int][]float32, len(r.points))
+	for id, vector := range r.points {
+		ids = append(ids, id)
+		points[id] = vector
+	}
+	start := len(r.pending)
+	generation := r.generation
+	dimension := r.dimension
+	leafCapacity, candidateProjections, parallelThreshold := r.LeafCapacity, r.CandidateProjections, r.ParallelThreshold
+	r.mu.RUnlock()
+
+	sort.Ints(ids)
+	var trees []*treeNode
+	if len(ids) > 0 {
+		trees = buildForest(ids, points, dimension, seeds,
+			leafCapacity, candidateProjections, parallelThreshold)
+	}
+
+	r.mu.Lock()
+	defer r.mu.Unlock()
+	pending := r.pending[start:]
+	r.rebuilding = false
+	r.pending = nil
+	if r.generation != generation {
+		return
+	}
+	r.trees, r.treeSize, r.maxDepth = trees, len(ids)*len(seeds), forestDepth(trees)
+	r.dirty = trees == nil
+	r.generation++
+	if trees == nil {
+		return
+	}
+	// Every replayed id that was in the snapshot leaves a stale entry behind; ids that are
+	// still live are routed to their current leaf.
+	replayed := make(map[int]struct{}, len(pending))
+	for _, id := range pending {
+		if _, done := replayed[id]; done {
+			continue
+		}
+		replayed[id] = struct{}{}
+		if vector, ok := r.points[id]; ok {
+			r.insert(id, vector)
+		}
+	}
+}
@@ -0,0 +1,113 @@
+package shard
+
+import (
+	"bufio"
+	"bytes"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"path/filepath"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/rs/zerolog/log"
+)
+
+// formatKind identifies sharded indexes in binary index files.
+const formatKind = "sharded"
+
+// shardSection returns the name of the section holding shard i.
+func shardSection(i int) string { return fmt.Sprintf("shard%d", i) }
+
+// Save writes all shards to w as one binary index file (see core.WriteSections), with the
+// saved state of every shard in a section of its own. Each shard is saved into memory
+// first, as section sizes are written up front; use SaveFiles to stream shards to files
+// of their own instead. Writes that run during Save may be saved for some shards only.
+func (s *ShardedIndex) Save(w io.Writer) error {
+	bufs := make([]bytes.Buffer, len(s.shards))
+	if err := s.forShards(func(i int, shard core.Index) error {
+		return shard.Save(&bufs[i])
+	}); err != nil {
+		return err
+	}
+	sections := []core.Section{core.SliceSection("meta", []int64{int64(len(s.shards))})}
+	for i := range bufs {
+		sections = append(sections, core.BytesSection(shardSection(i), bufs[i].Bytes()))
+	}
+	if err := core.WriteSections(w, formatKind, sections); err != nil {
+		return err
+	}
+	log.Info().Msg("Index saved")
+	return nil
+}
+
+// Load reads an index written by Save. The index must have been created with as many
+// shards, of the same types, and with the same partitioner as the saved one; shards are
+// loaded in parallel.
+func (s *ShardedIndex) Load(r io.Reader) error {
+	f, err := core.ReadSections(r)
+	if err != nil {
+		return err
+	}
+	if f.Kind != formatKind {
+		return fmt.Errorf("binary index file holds a %q index, not a sharded index", f.Kind)
+	}
+	meta, err := f.Int64s("meta")
+	if err != nil {
+		return err
+	}
+	if len(meta) < 1 {
+		return errors.New("corrupt sharded index file: short meta section")
+	}
+	if meta[0] != int64(len(s.shards)) {
+		return fmt.Errorf("binary index file holds %d shards, but the index has %d", meta[0], len(s.shards))
+	}
+	if err := s.forShards(func(i int, shard core.Index) error {
+		data, err := f.Bytes(shardSection(i))
+		if err != nil {
+			return err
+		}
+		return shard.Load(bytes.NewReader(data))
+	}); err != nil {
+		return err
+	}
+	log.Info().Msg("Index loaded")
+	return nil
+}
+
+// ShardFile returns the path of the file SaveFiles writes shard i to within dir.
+func ShardFile(dir string, i int) string {
+	return filepath.Join(dir, fmt.Sprintf("shard-%04d.hann", i))
+}
+
+// SaveFiles saves every shard to a file of its own in dir (see ShardFile), in parallel and
+// without buffering a shard in memory. Each file is written under a temporary name, synced
+// and renamed once complete (see core.WriteFile), so an interrupted save or a crash leaves
+// the previous files intact. A single shard can be saved the same way with s.Shard(i).Save.
+func (s *ShardedIndex) SaveFiles(dir string) error {
+	return s.forShards(func(i int, shard core.Index) error {
+		return core.WriteFile(ShardFile(dir, i), shard.Save)
+	})
+}
+
+// LoadFiles loads every shard from its file in dir, as written by SaveFiles, in parallel.
+// Shards that have a LoadFile method (as the HNSW, PQIVF and RPT indexes do) memory-map
+// their file; the others read it with Load.
+func (s *ShardedIndex) LoadFiles(dir string) error {
+	return s.forShards(func(i int, shard core.Index) error {
+		return loadShardFile(shard, ShardFile(dir, i))
+	})
+}
+
+// loadShardFile loads shard from the file at path.
+func loadShardFile(shard core.Index, path string) error {
+	if m, ok := shard.(interface{ LoadFile(string) error }); ok {
+		return m.LoadFile(path)
+	}
+	file, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+	return shard.Load(bufio.NewReader(file))
+}
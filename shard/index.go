@@ -0,0 +1,354 @@
+package shard
+
+import (
+	"errors"
+	"fmt"
+	"sync"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/rs/zerolog/log"
+)
+
+// ShardedIndex partitions ids over several inner indexes of any type and implements
+// core.Index on top of them. Every id lives in the shard its partitioner assigns it to.
+// The wrapper holds no lock of its own: writes to different shards run in parallel, each
+// under the lock of its shard, and searches fan out to all shards concurrently, after
+// which the partial results are merged.
+type ShardedIndex struct {
+	shards    []core.Index // inner indexes
+	partition Partitioner  // assigns ids to shards
+}
+
+// NewShardedIndex creates an index of n shards (at least one), each created by newShard
+// with its shard number. The shards must use the same dimension and distance. A nil
+// partition uses HashPartition.
+func NewShardedIndex(n int, newShard func(shard int) core.Index, partition Partitioner) *ShardedIndex {
+	n = max(n, 1)
+	log.Info().Msgf("Creating new sharded index with %d shards", n)
+	if partition == nil {
+		partition = HashPartition
+	}
+	shards := make([]core.Index, n)
+	for i := range shards {
+		shards[i] = newShard(i)
+	}
+	return &ShardedIndex{shards: shards, partition: partition}
+}
+
+// NumShards returns the number of shards.
+func (s *ShardedIndex) NumShards() int { return len(s.shards) }
+
+// Shard returns shard i, e.g. to save or load it on its own or to tune its parameters.
+func (s *ShardedIndex) Shard(i int) core.Index { return s.shards[i] }
+
+// ShardOf returns the shard that holds id.
+func (s *ShardedIndex) ShardOf(id int) int { return s.partition(id, len(s.shards)) }
+
+// forShards calls fn for every shard in parallel and returns the first error, prefixed
+// with the number of its shard.
+func (s *ShardedIndex) forShards(fn func(i int, shard core.Index) error) error {
+	errs := make([]error, len(s.shards))
+	core.ParallelFor(len(s.shards), func(i int) {
+		errs[i] = fn(i, s.shards[i])
+	})
+	for i, err := range errs {
+		if err != nil {
+			return fmt.Errorf("shard %d: %w", i, err)
+		}
+	}
+	return nil
+}
+
+// split groups the entries of m by shard.
+func split[T any](s *ShardedIndex, m map[int]T) []map[int]T {
+	parts := make([]map[int]T, len(s.shards))
+	for id, v := range m {
+		i := s.ShardOf(id)
+		if parts[i] == nil {
+			parts[i] = make(map[int]T)
+		}
+		parts[i][id] = v
+	}
+	return parts
+}
+
+// Add inserts a vector with the given id into its shard.
+func (s *ShardedIndex) Add(id int, vector []float32) error {
+	return s.shards[s.ShardOf(id)].Add(id, vector)
+}
+
+// BulkAdd inserts the vectors into their shards, running the shards in parallel.
+func (s *ShardedIndex) BulkAdd(vectors map[int][]float32) error {
+	parts := split(s, vectors)
+	return s.forShards(func(i int, shard core.Index) error {
+		if len(parts[i]) == 0 {
+			return nil
+		}
+		return shard.BulkAdd(parts[i])
+	})
+}
+
+// AddStream splits every batch received from batches by shard and streams the parts to all
+// shards concurrently (see core.AddStream), so the shards build in parallel while the next
+// batches are read and split; a shard that falls behind holds up the splitting once it has
+// a part pending. The parts are new matrices owned by the shards, so every batch is
+// released once it is split.
+func (s *ShardedIndex) AddStream(batches <-chan core.Batch, opts core.StreamOptions) error {
+	dimension := s.shards[0].Stats().Dimension
+	parts := make([]chan core.Batch, len(s.shards))
+	errs := make([]error, len(s.shards))
+	var wg sync.WaitGroup
+	for i := range s.shards {
+		parts[i] = make(chan core.Batch, 1)
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			errs[i] = core.AddStream(s.shards[i], parts[i], core.StreamOptions{})
+		}(i)
+	}
+	err := core.ConsumeBatches(batches, true, func(b core.Batch) error {
+		if err := b.Validate(dimension); err != nil {
+			return err
+		}
+		for i, part := range splitBatch(s, b, dimension) {
+			if len(part.IDs) > 0 {
+				parts[i] <- part
+			}
+		}
+		return nil
+	})
+	for _, p := range parts {
+		close(p)
+	}
+	wg.Wait()
+	if err != nil {
+		return err
+	}
+	for i, err := range errs {
+		if err != nil {
+			return fmt.Errorf("shard %d: %w", i, err)
+		}
+	}
+	return nil
+}
+
+// splitBatch copies the rows of b into one batch per shard.
+func splitBatch(s *ShardedIndex, b core.Batch, dimension int) []core.Batch {
+	shardOf := make([]int, len(b.IDs))
+	counts := make([]int, len(s.shards))
+	for i, id := range b.IDs {
+		shardOf[i] = s.ShardOf(id)
+		counts[shardOf[i]]++
+	}
+	parts := make([]core.Batch, len(s.shards))
+	for i, n := range counts {
+		parts[i] = core.Batch{IDs: make([]int, 0, n), Vectors: make([]float32, 0, n*dimension)}
+	}
+	for i, id := range b.IDs {
+		p := &parts[shardOf[i]]
+		p.IDs = append(p.IDs, id)
+		p.Vectors = append(p.Vectors, b.Row(i, dimension)...)
+	}
+	return parts
+}
+
+// Delete removes the vector with the given id from its shard.
+func (s *ShardedIndex) Delete(id int) error {
+	return s.shards[s.ShardOf(id)].Delete(id)
+}
+
+// BulkDelete removes the vectors with the given ids from their shards in parallel.
+func (s *ShardedIndex) BulkDelete(ids []int) error {
+	parts := make([][]int, len(s.shards))
+	for _, id := range ids {
+		i := s.ShardOf(id)
+		parts[i] = append(parts[i], id)
+	}
+	return s.forShards(func(i int, shard core.Index) error {
+		if len(parts[i]) == 0 {
+			return nil
+		}
+		return shard.BulkDelete(parts[i])
+	})
+}
+
+// Update changes the vector of the given id in its shard.
+func (s *ShardedIndex) Update(id int, vector []float32) error {
+	return s.shards[s.ShardOf(id)].Update(id, vector)
+}
+
+// BulkUpdate changes the vectors of the given ids in their shards in parallel.
+func (s *ShardedIndex) BulkUpdate(updates map[int][]float32) error {
+	parts := split(s, updates)
+	return s.forShards(func(i int, shard core.Index) error {
+		if len(parts[i]) == 0 {
+			return nil
+		}
+		return shard.BulkUpdate(parts[i])
+	})
+}
+
+// Search returns the k nearest neighbors of the query over all shards.
+func (s *ShardedIndex) Search(query []float32, k int) ([]core.Neighbor, error) {
+	return s.SearchWithOptions(query, k, core.SearchOptions{})
+}
+
+// SearchWithOptions searches every shard for the k nearest neighbors of the query
+// concurrently and merges their results. The options are passed on to every shard, except
+// that MaxDistanceComputations is divided between the shards so that it still bounds the
+// whole search; opts.Stats receives the sums over the shards (Truncated and BruteForce are
+// set if they are for any shard). Empty shards are skipped.
+func (s *ShardedIndex) SearchWithOptions(query []float32, k int, opts core.SearchOptions) ([]core.Neighbor, error) {
+	n := len(s.shards)
+	shardOpts := opts
+	if opts.MaxDistanceComputations > 0 {
+		shardOpts.MaxDistanceComputations = max(opts.MaxDistanceComputations/n, 1)
+	}
+	parts := make([][]core.Neighbor, n)
+	errs := make([]error, n)
+	var stats []core.SearchStats
+	if opts.Stats != nil {
+		stats = make([]core.SearchStats, n)
+	}
+	core.ParallelFor(n, func(i int) {
+		o := shardOpts
+		if stats != nil {
+			o.Stats = &stats[i]
+		}
+		parts[i], errs[i] = s.shards[i].SearchWithOptions(query, k, o)
+	})
+	empty := 0
+	for i, err := range errs {
+		if errors.Is(err, core.ErrEmptyIndex) {
+			empty++
+		} else if err != nil {
+			return nil, fmt.Errorf("shard %d: %w", i, err)
+		}
+	}
+	if empty == n {
+		return nil, core.ErrEmptyIndex
+	}
+	if opts.Stats != nil {
+		*opts.Stats = sumStats(stats)
+	}
+	return mergeNeighbors(parts, k), nil
+}
+
+// sumStats adds up the statistics of the searches of several shards.
+func sumStats(stats []core.SearchStats) core.SearchStats {
+	var sum core.SearchStats
+	for _, st := range stats {
+		sum.Candidates += st.Candidates
+		sum.Reranked += st.Reranked
+		sum.DistanceComputations += st.DistanceComputations
+		sum.Truncated = sum.Truncated || st.Truncated
+		sum.Restarts += st.Restarts
+		sum.Fallbacks += st.Fallbacks
+		sum.NodesVisited += st.NodesVisited
+		sum.BlocksRead += st.BlocksRead
+		sum.HeapPushes += st.HeapPushes
+		sum.BruteForce = sum.BruteForce || st.BruteForce
+	}
+	return sum
+}
+
+// head is the next neighbor of one sorted partial result in a k-way merge.
+type head struct {
+	part int // index of the partial result
+	pos  int // position of the neighbor in it
+}
+
+// mergeNeighbors merges partial results, each sorted by distance, into the k nearest
+// neighbors overall. A min-heap holds the next neighbor of every partial result, so the
+// merge costs O(k log n) for n results and never looks past the first k of any of them.
+// Ties are broken by id, so the merged order does not depend on the shard order.
+func mergeNeighbors(parts [][]core.Neighbor, k int) []core.Neighbor {
+	less := func(a, b head) bool {
+		x, y := parts[a.part][a.pos], parts[b.part][b.pos]
+		if x.Distance != y.Distance {
+			return x.Distance < y.Distance
+		}
+		return x.ID < y.ID
+	}
+	heap := make([]head, 0, len(parts))
+	total := 0
+	for i, p := range parts {
+		if len(p) > 0 {
+			heap = append(heap, head{i, 0})
+			total += len(p)
+		}
+	}
+	down := func(i int) {
+		for {
+			l := 2*i + 1
+			if l >= len(heap) {
+				return
+			}
+			child := l
+			if r := l + 1; r < len(heap) && less(heap[r], heap[l]) {
+				child = r
+			}
+			if !less(heap[child], heap[i]) {
+				return
+			}
+			heap[i], heap[child] = heap[child], heap[i]
+			i = child
+		}
+	}
+	for i := len(heap)/2 - 1; i >= 0; i-- {
+		down(i)
+	}
+	results := make([]core.Neighbor, 0, min(k, total))
+	for len(results) < k && len(heap) > 0 {
+		top := &heap[0]
+		results = append(results, parts[top.part][top.pos])
+		if top.pos++; top.pos == len(parts[top.part]) {
+			heap[0] = heap[len(heap)-1]
+			heap = heap[:len(heap)-1]
+		}
+		down(0)
+	}
+	return results
+}
+
+// SearchBatch returns the k nearest neighbors of several queries, spread over the shared
+// worker pool.
+func (s *ShardedIndex) SearchBatch(queries [][]float32, k int) ([][]core.Neighbor, error) {
+	return core.SearchBatch(queries, k, s.Search)
+}
+
+// Stats returns the statistics of the shards added up, so a search of the sharded index
+// counts once per shard. Dimension and Distance come from the first shard; TrainingTime is
+// the longest of the shards.
+func (s *ShardedIndex) Stats() core.IndexStats {
+	all := make([]core.IndexStats, len(s.shards))
+	core.ParallelFor(len(s.shards), func(i int) {
+		all[i] = s.shards[i].Stats()
+	})
+	stats := core.IndexStats{Dimension: all[0].Dimension, Distance: all[0].Distance}
+	for _, st := range all {
+		stats.Count += st.Count
+		stats.TrainingTime = max(stats.TrainingTime, st.TrainingTime)
+		stats.Searches += st.Searches
+		stats.DistanceComputations += st.DistanceComputations
+		stats.NodesVisited += st.NodesVisited
+		stats.HeapPushes += st.HeapPushes
+		stats.Fallbacks += st.Fallbacks
+		stats.Reranked += st.Reranked
+		stats.Truncated += st.Truncated
+		stats.LockWait += st.LockWait
+		stats.Builds += st.Builds
+		stats.BuildTime += st.BuildTime
+		stats.Memory.Vectors += st.Memory.Vectors
+		stats.Memory.Graph += st.Memory.Graph
+		stats.Memory.Codes += st.Memory.Codes
+		stats.Memory.IDs += st.Memory.IDs
+	}
+	return stats
+}
+
+// Check interface compliance at compile time.
+var (
+	_ core.Index       = (*ShardedIndex)(nil)
+	_ core.StreamAdder = (*ShardedIndex)(nil)
+)
@@ -0,0 +1,291 @@
+package shard_test
+
+import (
+	"bytes"
+	"errors"
+	"fmt"
+	"math/rand"
+	"path/filepath"
+	"sort"
+	"testing"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/diskann"
+	"github.com/patrikhermansson/hann/hnsw"
+	"github.com/patrikhermansson/hann/pqivf"
+	"github.com/patrikhermansson/hann/shard"
+)
+
+func randomVectors(n, dim int, seed int64) map[int][]float32 {
+	rng := rand.New(rand.NewSource(seed))
+	vectors := make(map[int][]float32, n)
+	for id := 0; id < n; id++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = rng.Float32()
+		}
+		vectors[id] = vec
+	}
+	return vectors
+}
+
+// exactShards creates untrained PQIVF shards that scan all their clusters, so searches of
+// the sharded index are exact.
+func exactShards(dim int) func(int) core.Index {
+	return func(int) core.Index {
+		idx := pqivf.NewPQIVFIndex(dim, 4, 2, 16, 5)
+		idx.NProbe = 4
+		return idx
+	}
+}
+
+func TestPartition(t *testing.T) {
+	counts := make([]int, 4)
+	for id := 0; id < 4000; id++ {
+		counts[shard.HashPartition(id, 4)]++
+	}
+	for i, c := range counts {
+		if c < 800 || c > 1200 {
+			t.Errorf("hash partition put %d of 4000 ids in shard %d", c, i)
+		}
+	}
+	p := shard.RangePartition(100, 200, 300)
+	for _, tc := range []struct{ id, n, want int }{
+		{-5, 4, 0}, {99, 4, 0}, {100, 4, 1}, {250, 4, 2}, {300, 4, 3}, {1 << 30, 4, 3}, {250, 2, 1},
+	} {
+		if got := p(tc.id, tc.n); got != tc.want {
+			t.Errorf("RangePartition(%d, %d) = %d, want %d", tc.id, tc.n, got, tc.want)
+		}
+	}
+}
+
+func TestShardedIndex_Search(t *testing.T) {
+	dim := 8
+	vectors := randomVectors(1000, dim, 1)
+	idx := shard.NewShardedIndex(4, exactShards(dim), nil)
+	if _, err := idx.Search(vectors[0], 5); !errors.Is(err, core.ErrEmptyIndex) {
+		t.Fatalf("expected ErrEmptyIndex from an empty index, got %v", err)
+	}
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if got := idx.Stats().Count; got != 1000 {
+		t.Fatalf("expected 1000 vectors, got %d", got)
+	}
+	for i := 0; i < idx.NumShards(); i++ {
+		if n := idx.Shard(i).Stats().Count; n < 150 {
+			t.Errorf("shard %d holds only %d vectors", i, n)
+		}
+	}
+
+	for q := 0; q < 10; q++ {
+		query := vectors[q*31]
+		var stats core.SearchStats
+		neighbors, err := idx.SearchWithOptions(query, 10, core.SearchOptions{Stats: &stats})
+		if err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+		ids := make([]int, 0, len(vectors))
+		for id := range vectors {
+			ids = append(ids, id)
+		}
+		sort.Slice(ids, func(i, j int) bool {
+			return core.SquaredL2(query, vectors[ids[i]]) < core.SquaredL2(query, vectors[ids[j]])
+		})
+		if len(neighbors) != 10 {
+			t.Fatalf("expected 10 neighbors, got %d", len(neighbors))
+		}
+		for i, n := range neighbors {
+			if n.ID != ids[i] {
+				t.Fatalf("neighbor %d is %d, want %d", i, n.ID, ids[i])
+			}
+		}
+		if stats.Candidates != 1000 {
+			t.Errorf("expected every shard to scan its vectors, got %+v", stats)
+		}
+	}
+
+	// Writes are routed to the shard of the id.
+	if err := idx.Update(7, vectors[8]); err != nil {
+		t.Fatalf("Update failed: %v", err)
+	}
+	if err := idx.BulkDelete([]int{8, 9, 10}); err != nil {
+		t.Fatalf("BulkDelete failed: %v", err)
+	}
+	neighbors, err := idx.Search(vectors[8], 1)
+	if err != nil || neighbors[0].ID != 7 || neighbors[0].Distance != 0 {
+		t.Errorf("expected the updated vector 7 first, got %v (%v)", neighbors, err)
+	}
+	if err := idx.Delete(8); err == nil {
+		t.Error("expected an error deleting a missing id")
+	}
+}
+
+// TestShardedIndex_SearchStats checks that the statistics of a search are the sums of
+// those of its shards, using DiskANN shards, which count nodes and blocks read.
+func TestShardedIndex_SearchStats(t *testing.T) {
+	dim := 8
+	vectors := randomVectors(600, dim, 4)
+	dir := t.TempDir()
+	idx := shard.NewShardedIndex(3, func(i int) core.Index {
+		d := diskann.NewDiskIndex(filepath.Join(dir, fmt.Sprintf("shard-%d.diskann", i)), dim, 16, 64,
+			core.Distances["euclidean"], "euclidean")
+		d.CacheNodes = -1
+		t.Cleanup(func() { d.Close() })
+		return d
+	}, nil)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	for q := 0; q < 5; q++ {
+		query := vectors[q*53]
+		var stats core.SearchStats
+		if _, err := idx.SearchWithOptions(query, 10, core.SearchOptions{Stats: &stats}); err != nil {
+			t.Fatalf("SearchWithOptions failed: %v", err)
+		}
+		var want core.SearchStats
+		for i := 0; i < idx.NumShards(); i++ {
+			var st core.SearchStats
+			if _, err := idx.Shard(i).SearchWithOptions(query, 10, core.SearchOptions{Stats: &st}); err != nil {
+				t.Fatalf("SearchWithOptions failed: %v", err)
+			}
+			want.Candidates += st.Candidates
+			want.DistanceComputations += st.DistanceComputations
+			want.NodesVisited += st.NodesVisited
+			want.BlocksRead += st.BlocksRead
+		}
+		if want.BlocksRead == 0 {
+			t.Fatalf("query %d: expected the shards to read node blocks, got %+v", q, want)
+		}
+		if stats.Candidates != want.Candidates || stats.DistanceComputations != want.DistanceComputations ||
+			stats.NodesVisited != want.NodesVisited || stats.BlocksRead != want.BlocksRead {
+			t.Errorf("query %d: got %+v, want the sums %+v", q, stats, want)
+		}
+	}
+}
+
+func TestShardedIndex_AddStream(t *testing.T) {
+	dim := 8
+	vectors := randomVectors(1000, dim, 3)
+	streamed := shard.NewShardedIndex(4, exactShards(dim), nil)
+	batches := make(chan core.Batch)
+	released := make(chan struct{}, 10)
+	go func() {
+		defer close(batches)
+		for start := 0; start < 1000; start += 100 {
+			b := core.Batch{Release: func() { released <- struct{}{} }}
+			for id := start; id < start+100; id++ {
+				b.IDs = append(b.IDs, id)
+				b.Vectors = append(b.Vectors, vectors[id]...)
+			}
+			batches <- b
+		}
+	}()
+	if err := core.AddStream(streamed, batches, core.StreamOptions{}); err != nil {
+		t.Fatalf("AddStream failed: %v", err)
+	}
+	if len(released) != 10 {
+		t.Errorf("expected the splitter to release all 10 batches, got %d", len(released))
+	}
+	bulk := shard.NewShardedIndex(4, exactShards(dim), nil)
+	if err := bulk.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	for i := 0; i < 4; i++ {
+		if a, b := streamed.Shard(i).Stats().Count, bulk.Shard(i).Stats().Count; a != b {
+			t.Errorf("shard %d holds %d streamed vectors, want %d", i, a, b)
+		}
+	}
+	for q := 0; q < 5; q++ {
+		want, _ := bulk.Search(vectors[q*101], 5)
+		got, err := streamed.Search(vectors[q*101], 5)
+		if err != nil {
+			t.Fatalf("Search failed: %v", err)
+		}
+		for i := range want {
+			if got[i] != want[i] {
+				t.Fatalf("query %d: got %v, want %v", q, got, want)
+			}
+		}
+	}
+
+	// A duplicate id fails its shard's stream, and the error names the shard.
+	batches = make(chan core.Batch, 1)
+	batches <- core.Batch{IDs: []int{7}, Vectors: vectors[7]}
+	close(batches)
+	if err := streamed.AddStream(batches, core.StreamOptions{}); err == nil {
+		t.Error("expected an error for an existing id")
+	}
+}
+
+func TestShardedIndex_EmptyShards(t *testing.T) {
+	dim := 4
+	idx := shard.NewShardedIndex(3, exactShards(dim), shard.RangePartition(10, 20))
+	if err := idx.Add(15, []float32{1, 2, 3, 4}); err != nil {
+		t.Fatalf("Add failed: %v", err)
+	}
+	if idx.ShardOf(15) != 1 || idx.Shard(1).Stats().Count != 1 {
+		t.Fatalf("id 15 is not in shard 1")
+	}
+	neighbors, err := idx.Search([]float32{0, 0, 0, 0}, 3)
+	if err != nil || len(neighbors) != 1 || neighbors[0].ID != 15 {
+		t.Errorf("expected the only vector from the only non-empty shard, got %v (%v)", neighbors, err)
+	}
+}
+
+func TestShardedIndex_SaveLoad(t *testing.T) {
+	dim := 8
+	vectors := randomVectors(600, dim, 2)
+	newShard := func(int) core.Index {
+		return hnsw.NewHNSW(dim, 8, 50, core.Distances["euclidean"], "euclidean")
+	}
+	idx := shard.NewShardedIndex(3, newShard, nil)
+	if err := idx.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	queries := [][]float32{vectors[1], vectors[200], vectors[599]}
+	want, err := idx.SearchBatch(queries, 5)
+	if err != nil {
+		t.Fatalf("SearchBatch failed: %v", err)
+	}
+	check := func(name string, loaded *shard.ShardedIndex) {
+		t.Helper()
+		got, err := loaded.SearchBatch(queries, 5)
+		if err != nil {
+			t.Fatalf("%s: SearchBatch failed: %v", name, err)
+		}
+		for q := range want {
+			for i := range want[q] {
+				if got[q][i] != want[q][i] {
+					t.Fatalf("%s: query %d: got %v, want %v", name, q, got[q], want[q])
+				}
+			}
+		}
+		if n := loaded.Stats().Count; n != 600 {
+			t.Errorf("%s: expected 600 vectors, got %d", name, n)
+		}
+	}
+
+	var buf bytes.Buffer
+	if err := idx.Save(&buf); err != nil {
+		t.Fatalf("Save failed: %v", err)
+	}
+	loaded := shard.NewShardedIndex(3, newShard, nil)
+	if err := loaded.Load(bytes.NewReader(buf.Bytes())); err != nil {
+		t.Fatalf("Load failed: %v", err)
+	}
+	check("Load", loaded)
+	if err := shard.NewShardedIndex(2, newShard, nil).Load(bytes.NewReader(buf.Bytes())); err == nil {
+		t.Error("expected an error loading into a different number of shards")
+	}
+
+	dir := t.TempDir()
+	if err := idx.SaveFiles(dir); err != nil {
+		t.Fatalf("SaveFiles failed: %v", err)
+	}
+	mapped := shard.NewShardedIndex(3, newShard, nil)
+	if err := mapped.LoadFiles(dir); err != nil {
+		t.Fatalf("LoadFiles failed: %v", err)
+	}
+	check("LoadFiles", mapped)
+}
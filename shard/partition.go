@@ -0,0 +1,26 @@
+package shard
+
+import "sort"
+
+// Partitioner assigns id to one of n shards, returning a shard number in [0, n).
+// It must always return the same shard for the same id and n.
+type Partitioner func(id, n int) int
+
+// HashPartition spreads ids evenly over the shards by a multiplicative hash of the id,
+// so consecutive ids land on different shards. It is the default partitioner.
+func HashPartition(id, n int) int {
+	h := uint64(id) * 0x9e3779b97f4a7c15
+	return int((h >> 32) * uint64(n) >> 32)
+}
+
+// RangePartition returns a partitioner that assigns contiguous ranges of ids to the shards:
+// ids below bounds[0] go to shard 0, ids in [bounds[i-1], bounds[i]) to shard i, and larger
+// ids to the last shard. bounds must be sorted; with fewer shards than len(bounds)+1, the
+// ranges beyond the last shard are merged into it.
+func RangePartition(bounds ...int) Partitioner {
+	bounds = append([]int(nil), bounds...)
+	return func(id, n int) int {
+		i := sort.Search(len(bounds), func(i int) bool { return bounds[i] > id })
+		return min(i, n-1)
+	}
+}
@@ -0,0 +1,235 @@
+package wal
+
+import (
+	"bufio"
+	"fmt"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// deltaKind identifies delta checkpoints in binary index files.
+const deltaKind = "delta"
+
+// Positions of the parameters in the "meta" section of a delta.
+const (
+	deltaBase = iota
+	deltaDimension
+	deltaLen
+)
+
+// File names of the snapshots, deltas and log segments within the directory of a log.
+// A checkpoint numbered seq holds the state of the index before log segment seq.
+const (
+	snapshotPrefix = "snapshot-"
+	deltaPrefix    = "delta-"
+	segmentPrefix  = "wal-"
+	snapshotSuffix = ".hann"
+	segmentSuffix  = ".log"
+	tmpSuffix      = core.TmpSuffix
+)
+
+// snapshotPath returns the path of snapshot seq in dir.
+func snapshotPath(dir string, seq int) string {
+	return filepath.Join(dir, fmt.Sprintf("%s%08d%s", snapshotPrefix, seq, snapshotSuffix))
+}
+
+// deltaPath returns the path of delta seq in dir.
+func deltaPath(dir string, seq int) string {
+	return filepath.Join(dir, fmt.Sprintf("%s%08d%s", deltaPrefix, seq, snapshotSuffix))
+}
+
+// segmentPath returns the path of log segment seq in dir.
+func segmentPath(dir string, seq int) string {
+	return filepath.Join(dir, fmt.Sprintf("%s%08d%s", segmentPrefix, seq, segmentSuffix))
+}
+
+// dirFiles holds the sequence numbers of the files in the directory of a log, ascending.
+type dirFiles struct {
+	snapshots []int
+	deltas    []int
+	segments  []int
+}
+
+// last returns the highest sequence number of all files, 0 if there are none.
+func (d dirFiles) last() int {
+	seq := 0
+	for _, list := range [][]int{d.snapshots, d.deltas, d.segments} {
+		if len(list) > 0 {
+			seq = max(seq, list[len(list)-1])
+		}
+	}
+	return seq
+}
+
+// listFiles lists the checkpoints and log segments in dir and removes the temporary files
+// left by interrupted checkpoints.
+func listFiles(dir string) (dirFiles, error) {
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		return dirFiles{}, err
+	}
+	var files dirFiles
+	for _, e := range entries {
+		name := e.Name()
+		if strings.HasSuffix(name, tmpSuffix) {
+			if err := os.Remove(filepath.Join(dir, name)); err != nil {
+				return dirFiles{}, err
+			}
+			continue
+		}
+		for _, kind := range []struct {
+			prefix, suffix string
+			list           *[]int
+		}{
+			{snapshotPrefix, snapshotSuffix, &files.snapshots},
+			{deltaPrefix, snapshotSuffix, &files.deltas},
+			{segmentPrefix, segmentSuffix, &files.segments},
+		} {
+			num, ok := strings.CutPrefix(name, kind.prefix)
+			if !ok || !strings.HasSuffix(num, kind.suffix) {
+				continue
+			}
+			if seq, err := strconv.Atoi(strings.TrimSuffix(num, kind.suffix)); err == nil && seq > 0 {
+				*kind.list = append(*kind.list, seq)
+			}
+		}
+	}
+	sort.Ints(files.snapshots)
+	sort.Ints(files.deltas)
+	sort.Ints(files.segments)
+	return files, nil
+}
+
+// loadSnapshot loads the snapshot at path into index. Indexes with a LoadFile method (as
+// the HNSW, PQIVF, RPT and DiskANN indexes have) memory-map binary index files; others
+// stream the file to Load.
+func loadSnapshot(index core.Index, path string) error {
+	if m, ok := index.(interface{ LoadFile(string) error }); ok {
+		return m.LoadFile(path)
+	}
+	file, err := os.Open(path)
+	if err != nil {
+		return err
+	}
+	defer file.Close()
+	return index.Load(bufio.NewReaderSize(file, 1<<20))
+}
+
+// delta is the content of a delta checkpoint: the net changes since a snapshot.
+type delta struct {
+	base      int         // sequence number of the snapshot, 0 for the empty index
+	ids       []int       // ids whose last write stored a vector
+	vectors   [][]float32 // their vectors
+	deleted   []int       // ids whose last write deleted them
+	updateIDs []int       // ids last written by a BulkUpdate that skips missing ids
+	updates   [][]float32 // their vectors
+}
+
+// sections returns the sections of the delta file.
+func (d *delta) sections(dimension int) []core.Section {
+	meta := make([]int64, deltaLen)
+	meta[deltaBase] = int64(d.base)
+	meta[deltaDimension] = int64(dimension)
+	return []core.Section{
+		core.SliceSection("meta", meta),
+		core.IntsSection("ids", d.ids),
+		core.SliceSection("vectors", d.vectors...),
+		core.IntsSection("deleted", d.deleted),
+		core.IntsSection("updateIDs", d.updateIDs),
+		core.SliceSection("updates", d.updates...),
+	}
+}
+
+// readDelta reads the delta file at path, whose vectors have the given dimension.
+func readDelta(path string, dimension int) (*delta, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer file.Close()
+	f, err := core.ReadSections(bufio.NewReaderSize(file, 1<<20))
+	if err != nil {
+		return nil, err
+	}
+	if f.Kind != deltaKind {
+		return nil, fmt.Errorf("binary index file holds a %q index, not a delta", f.Kind)
+	}
+	meta, err := f.Int64s("meta")
+	if err != nil {
+		return nil, err
+	}
+	if len(meta) < deltaLen {
+		return nil, fmt.Errorf("corrupt delta file: meta section has %d values", len(meta))
+	}
+	if int(meta[deltaDimension]) != dimension {
+		return nil, fmt.Errorf("delta dimension %d does not match index dimension %d", meta[deltaDimension], dimension)
+	}
+	d := &delta{base: int(meta[deltaBase])}
+	if d.ids, err = f.Ints("ids"); err != nil {
+		return nil, err
+	}
+	if d.deleted, err = f.Ints("deleted"); err != nil {
+		return nil, err
+	}
+	if d.updateIDs, err = f.Ints("updateIDs"); err != nil {
+		return nil, err
+	}
+	if d.vectors, err = rows(f, "vectors", len(d.ids), dimension); err != nil {
+		return nil, err
+	}
+	if d.updates, err = rows(f, "updates", len(d.updateIDs), dimension); err != nil {
+		return nil, err
+	}
+	return d, nil
+}
+
+// rows returns the n vectors of the given dimension held by section name, aliasing it.
+func rows(f *core.SectionFile, name string, n, dimension int) ([][]float32, error) {
+	values, err := f.Float32s(name)
+	if err != nil {
+		return nil, err
+	}
+	if len(values) != n*dimension {
+		return nil, fmt.Errorf("corrupt delta file: section %q holds %d values, want %d", name, len(values), n*dimension)
+	}
+	vectors := make([][]float32, n)
+	for i := range vectors {
+		vectors[i] = values[i*dimension : (i+1)*dimension : (i+1)*dimension]
+	}
+	return vectors, nil
+}
+
+// apply applies the delta to index, which holds its snapshot: the deleted ids and those
+// that were written are removed, the latter are added again with their vectors, and the
+// updates of ids that may not be in the snapshot are applied with BulkUpdate, as they were
+// written.
+func (d *delta) apply(index core.Index) error {
+	if remove := append(append([]int(nil), d.deleted...), d.ids...); len(remove) > 0 {
+		if err := index.BulkDelete(remove); err != nil {
+			return err
+		}
+	}
+	if len(d.ids) > 0 {
+		if err := index.BulkAdd(entries(d.ids, d.vectors)); err != nil {
+			return err
+		}
+	}
+	if len(d.updateIDs) > 0 {
+		return index.BulkUpdate(entries(d.updateIDs, d.updates))
+	}
+	return nil
+}
+
+// entries returns the map of ids to vectors that bulk writes take.
+func entries(ids []int, vectors [][]float32) map[int][]float32 {
+	m := make(map[int][]float32, len(ids))
+	for i, id := range ids {
+		m[id] = vectors[i]
+	}
+	return m
+}
@@ -0,0 +1,580 @@
+package wal
+
+import (
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"sort"
+	"sync"
+	"time"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/rs/zerolog/log"
+)
+
+// defaultCheckpointBytes is the size of the log that starts a background checkpoint when
+// CheckpointBytes is zero.
+const defaultCheckpointBytes = 64 << 20
+
+// defaultFullRatio is the share of changed ids beyond which a checkpoint writes a full
+// snapshot when FullRatio is zero.
+const defaultFullRatio = 0.25
+
+// errClosed is returned by the writes and checkpoints of a closed LoggedIndex.
+var errClosed = errors.New("log is closed")
+
+// change is the net effect of the writes to an id since the snapshot.
+type change struct {
+	vector    []float32 // the vector written last, nil if the id was deleted
+	ifPresent bool      // the vector was written by a BulkUpdate to an id the snapshot may not hold
+}
+
+// LoggedIndex makes the writes to an index of any type durable with a write-ahead log
+// kept in a directory, and implements core.Index on top of it. Every write is applied to
+// the index and then appended to the log as a binary record, before the call returns, so
+// persisting it costs O(size of the write) rather than O(size of the index).
+// Checkpoints keep the log short: a delta checkpoint writes the net changes since the last
+// full snapshot and starts a new log segment; once the changes are a large share of the
+// index, a full snapshot (the binary format of the index, see Save) replaces the deltas.
+// Open recovers the index from the directory: it loads the last snapshot, memory-mapped for
+// indexes with a LoadFile method, applies the last delta and replays the log after it.
+// The changes since the snapshot are also kept in memory, for the next delta.
+// Searches go straight to the index; writes are serialized by the wrapper. Streams given to
+// core.AddStream are logged batch by batch, as BulkAdd calls.
+type LoggedIndex struct {
+	// SyncInterval controls when the log is synced to disk: 0 syncs every write before it
+	// returns; a positive interval syncs a write only if the last sync is that old, so a
+	// crash loses at most the writes of the interval; a negative interval leaves syncing to
+	// the operating system until the next checkpoint or Close.
+	SyncInterval time.Duration
+
+	// CheckpointBytes is the size of the log since the last checkpoint that starts a
+	// checkpoint in the background. 0 uses the default (64 MiB), negative disables.
+	CheckpointBytes int64
+
+	// FullRatio is the share of changed ids, relative to the size of the index, beyond which
+	// a checkpoint writes a full snapshot instead of a delta. 0 uses the default (0.25),
+	// negative always writes deltas.
+	FullRatio float64
+
+	index     core.Index
+	dir       string
+	dimension int
+
+	mu      sync.Mutex     // serializes writes, their records and the rotation of segments
+	log     *segment       // segment writes are appended to (nil once closed)
+	logged  int64          // bytes logged since the last checkpoint
+	base    int            // sequence number of the snapshot, 0 for none (the empty index)
+	changes map[int]change // net changes since the snapshot
+	stale   bool           // the index holds writes the log misses, so only a snapshot checkpoints it
+	buf     []byte         // encoding buffer of records
+
+	checkpointMu  sync.Mutex     // serializes checkpoints
+	checkpointing bool           // a background checkpoint is running (guarded by mu)
+	background    sync.WaitGroup // background checkpoints
+}
+
+// Open opens the log in dir, creating the directory if needed, and recovers index from it.
+// index must be new and empty, and of the type, dimension and parameters of the index the
+// log was written for. A record torn by a crash at the end of the log is dropped; every
+// write that returned before the crash is recovered (see SyncInterval).
+func Open(dir string, index core.Index) (*LoggedIndex, error) {
+	start := time.Now()
+	if err := os.MkdirAll(dir, 0o755); err != nil {
+		return nil, err
+	}
+	files, err := listFiles(dir)
+	if err != nil {
+		return nil, err
+	}
+	w := &LoggedIndex{
+		index:     index,
+		dir:       dir,
+		dimension: index.Stats().Dimension,
+		changes:   make(map[int]change),
+	}
+	if n := len(files.snapshots); n > 0 {
+		w.base = files.snapshots[n-1]
+		if err := loadSnapshot(index, snapshotPath(dir, w.base)); err != nil {
+			return nil, fmt.Errorf("loading snapshot %d: %w", w.base, err)
+		}
+	}
+	// The last delta holds the changes since the snapshot up to its log segment; older
+	// deltas and those of an older snapshot are left over from checkpoints that were
+	// replaced before their files were removed.
+	from := w.base
+	if n := len(files.deltas); n > 0 && files.deltas[n-1] > w.base {
+		from = files.deltas[n-1]
+		if err := w.applyDelta(from); err != nil {
+			return nil, fmt.Errorf("applying delta %d: %w", from, err)
+		}
+	}
+	records := 0
+	for i, seq := range files.segments {
+		if seq < from {
+			continue
+		}
+		path := segmentPath(dir, seq)
+		valid, torn, err := readSegment(path, w.dimension, func(rec record) error {
+			records++
+			return w.apply(rec)
+		})
+		if err != nil {
+			return nil, err
+		}
+		if torn {
+			if i < len(files.segments)-1 {
+				return nil, fmt.Errorf("log segment %s is corrupt at offset %d", path, valid)
+			}
+			log.Warn().Msgf("Dropping the torn record at offset %d of %s", valid, path)
+			if err := os.Truncate(path, valid); err != nil {
+				return nil, err
+			}
+		}
+	}
+	if w.log, err = createSegment(dir, files.last()+1, w.dimension); err != nil {
+		return nil, err
+	}
+	w.removeBefore(w.base, from)
+	log.Info().Msgf("Recovered index from %s with %d log records in %v", dir, records, time.Since(start))
+	return w, nil
+}
+
+// applyDelta applies delta seq to the index and records its changes.
+func (w *LoggedIndex) applyDelta(seq int) error {
+	d, err := readDelta(deltaPath(w.dir, seq), w.dimension)
+	if err != nil {
+		return err
+	}
+	if d.base != w.base {
+		return fmt.Errorf("delta is based on snapshot %d, not %d", d.base, w.base)
+	}
+	if err := d.apply(w.index); err != nil {
+		return err
+	}
+	for _, id := range d.deleted {
+		w.changes[id] = change{}
+	}
+	for i, id := range d.ids {
+		w.changes[id] = change{vector: d.vectors[i]}
+	}
+	for i, id := range d.updateIDs {
+		w.changes[id] = change{vector: d.updates[i], ifPresent: true}
+	}
+	return nil
+}
+
+// apply replays a record on the index and records its changes.
+func (w *LoggedIndex) apply(rec record) error {
+	var err error
+	switch rec.op {
+	case opAdd:
+		err = w.index.Add(rec.ids[0], rec.vectors[0])
+	case opDelete:
+		err = w.index.Delete(rec.ids[0])
+	case opUpdate:
+		err = w.index.Update(rec.ids[0], rec.vectors[0])
+	case opBulkAdd:
+		err = w.index.BulkAdd(entries(rec.ids, rec.vectors))
+	case opBulkDelete:
+		err = w.index.BulkDelete(rec.ids)
+	case opBulkUpdate:
+		err = w.index.BulkUpdate(entries(rec.ids, rec.vectors))
+	}
+	if err != nil {
+		return err
+	}
+	w.track(rec.op, rec.ids, rec.vectors)
+	return nil
+}
+
+// track records the changes of a write applied to the index.
+func (w *LoggedIndex) track(o op, ids []int, vectors [][]float32) {
+	for i, id := range ids {
+		switch o {
+		case opDelete, opBulkDelete:
+			w.changes[id] = change{}
+		case opBulkUpdate:
+			// BulkUpdate skips ids that are not in the index (HNSW and DiskANN do), so an
+			// update of a deleted id leaves it deleted, and one of an id without changes
+			// applies only if the snapshot holds the id.
+			prev, changed := w.changes[id]
+			if changed && prev.vector == nil {
+				continue
+			}
+			w.changes[id] = change{vector: clone(vectors[i]), ifPresent: !changed || prev.ifPresent}
+		default:
+			w.changes[id] = change{vector: clone(vectors[i])}
+		}
+	}
+}
+
+// clone returns a copy of v.
+func clone(v []float32) []float32 {
+	return append([]float32(nil), v...)
+}
+
+// Inner returns the logged index, e.g. to tune its search parameters. Writes must go
+// through the LoggedIndex, or they are not logged.
+func (w *LoggedIndex) Inner() core.Index { return w.index }
+
+// write applies a write to the index with do and logs it. A failed single write leaves
+// the index unchanged; a failed bulk write may have applied part of its changes, which the
+// log cannot replay, so a snapshot then replaces the log.
+func (w *LoggedIndex) write(o op, ids []int, vectors [][]float32, do func() error) error {
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	if w.log == nil {
+		return errClosed
+	}
+	if w.stale {
+		if err := w.snapshot(); err != nil {
+			return fmt.Errorf("index holds writes missing from the log: %w", err)
+		}
+	}
+	if err := do(); err != nil {
+		if o == opBulkAdd || o == opBulkDelete || o == opBulkUpdate {
+			return w.resync(err)
+		}
+		return err
+	}
+	if err := w.append(o, ids, vectors); err != nil {
+		return w.resync(fmt.Errorf("writing the log: %w", err))
+	}
+	w.track(o, ids, vectors)
+	w.maybeCheckpoint()
+	return nil
+}
+
+// append logs a write, splitting bulk writes over records of at most maxRecordBytes.
+func (w *LoggedIndex) append(o op, ids []int, vectors [][]float32) error {
+	perRecord := max((recordLimit(w.dimension)-5)/entrySize(o, w.dimension), 1)
+	w.buf = w.buf[:0]
+	for start := 0; start < len(ids); start += perRecord {
+		end := min(start+perRecord, len(ids))
+		var chunk [][]float32
+		if vectors != nil {
+			chunk = vectors[start:end]
+		}
+		w.buf = appendRecord(w.buf, o, ids[start:end], chunk)
+	}
+	if err := w.log.write(w.buf, w.SyncInterval); err != nil {
+		return err
+	}
+	w.logged += int64(len(w.buf))
+	return nil
+}
+
+// resync snapshots the index after a write failed with err, which it returns. If the
+// snapshot fails too, the next write or checkpoint retries it. The caller holds mu.
+func (w *LoggedIndex) resync(err error) error {
+	w.stale = true
+	if serr := w.snapshot(); serr != nil {
+		log.Error().Err(serr).Msg("Snapshot after a failed write failed")
+	}
+	return err
+}
+
+// maybeCheckpoint starts a background checkpoint if the log has grown past
+// CheckpointBytes since the last one. The caller holds mu.
+func (w *LoggedIndex) maybeCheckpoint() {
+	threshold := w.CheckpointBytes
+	if threshold == 0 {
+		threshold = defaultCheckpointBytes
+	}
+	if w.checkpointing || threshold < 0 || w.logged < threshold {
+		return
+	}
+	w.checkpointing = true
+	w.background.Add(1)
+	go func() {
+		defer w.background.Done()
+		if err := w.Checkpoint(); err != nil && !errors.Is(err, errClosed) {
+			log.Error().Err(err).Msg("Background checkpoint failed")
+		}
+		w.mu.Lock()
+		w.checkpointing = false
+		w.mu.Unlock()
+	}()
+}
+
+// Checkpoint persists the changes since the last checkpoint, so that the log written
+// before it is no longer needed for recovery, and removes the files it replaces. It writes
+// a delta of the changes since the last snapshot, without blocking writes, unless the
+// changed ids exceed FullRatio of the index, in which case it snapshots the whole index
+// while writes wait (see Snapshot).
+func (w *LoggedIndex) Checkpoint() error {
+	w.checkpointMu.Lock()
+	defer w.checkpointMu.Unlock()
+	w.mu.Lock()
+	if w.log == nil {
+		w.mu.Unlock()
+		return errClosed
+	}
+	ratio := w.FullRatio
+	if ratio == 0 {
+		ratio = defaultFullRatio
+	}
+	if w.stale || (ratio > 0 && float64(len(w.changes)) > ratio*float64(max(w.index.Stats().Count, 1))) {
+		defer w.mu.Unlock()
+		return w.snapshot()
+	}
+	seq, err := w.rotate()
+	if err != nil {
+		w.mu.Unlock()
+		return err
+	}
+	d := w.delta()
+	w.mu.Unlock()
+
+	start := time.Now()
+	if err := core.WriteFile(deltaPath(w.dir, seq), func(out io.Writer) error {
+		return core.WriteSections(out, deltaKind, d.sections(w.dimension))
+	}); err != nil {
+		return fmt.Errorf("writing delta %d: %w", seq, err)
+	}
+	w.removeBefore(d.base, seq)
+	log.Info().Msgf("Checkpointed %d changes in %v", len(d.ids)+len(d.deleted)+len(d.updateIDs), time.Since(start))
+	return nil
+}
+
+// Snapshot writes a full snapshot of the index and removes the deltas and the log before
+// it. Writes wait until it is written; searches do not, unless Save of the index blocks
+// them.
+func (w *LoggedIndex) Snapshot() error {
+	w.checkpointMu.Lock()
+	defer w.checkpointMu.Unlock()
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	if w.log == nil {
+		return errClosed
+	}
+	return w.snapshot()
+}
+
+// snapshot implements Snapshot. The caller holds mu.
+func (w *LoggedIndex) snapshot() error {
+	start := time.Now()
+	seq, err := w.rotate()
+	if err != nil {
+		return err
+	}
+	if err := core.WriteFile(snapshotPath(w.dir, seq), w.index.Save); err != nil {
+		return fmt.Errorf("writing snapshot %d: %w", seq, err)
+	}
+	w.base = seq
+	w.changes = make(map[int]change)
+	w.stale = false
+	w.removeBefore(seq, seq)
+	log.Info().Msgf("Snapshot of the index written in %v", time.Since(start))
+	return nil
+}
+
+// rotate closes the current log segment and starts the next, whose sequence number it
+// returns. The current segment is synced before the next one exists, so that a segment
+// followed by another never ends in a torn record, which recovery only accepts in the last
+// one. The caller holds mu.
+func (w *LoggedIndex) rotate() (int, error) {
+	if err := w.log.sync(); err != nil {
+		return 0, err
+	}
+	seq := w.log.seq + 1
+	next, err := createSegment(w.dir, seq, w.dimension)
+	if err != nil {
+		return 0, err
+	}
+	if err := w.log.close(); err != nil {
+		log.Warn().Err(err).Msgf("Closing log segment %d failed", w.log.seq)
+	}
+	w.log = next
+	w.logged = 0
+	return seq, nil
+}
+
+// delta collects the changes since the snapshot. The vectors of the changes are never
+// modified, only replaced, so the delta can be written while writes continue. The caller
+// holds mu.
+func (w *LoggedIndex) delta() *delta {
+	d := &delta{base: w.base}
+	ids := make([]int, 0, len(w.changes))
+	for id := range w.changes {
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	for _, id := range ids {
+		c := w.changes[id]
+		switch {
+		case c.vector == nil:
+			d.deleted = append(d.deleted, id)
+		case c.ifPresent:
+			d.updateIDs = append(d.updateIDs, id)
+			d.updates = append(d.updates, c.vector)
+		default:
+			d.ids = append(d.ids, id)
+			d.vectors = append(d.vectors, c.vector)
+		}
+	}
+	return d
+}
+
+// removeBefore removes the snapshots before snapshot base and the deltas and log segments
+// before seq, which recovery no longer reads. Failures are only logged, as the files are
+// skipped by recovery anyway.
+func (w *LoggedIndex) removeBefore(base, seq int) {
+	files, err := listFiles(w.dir)
+	if err != nil {
+		log.Warn().Err(err).Msg("Listing obsolete log files failed")
+		return
+	}
+	var paths []string
+	for _, s := range files.snapshots {
+		if s < base {
+			paths = append(paths, snapshotPath(w.dir, s))
+		}
+	}
+	for _, s := range files.deltas {
+		if s < seq {
+			paths = append(paths, deltaPath(w.dir, s))
+		}
+	}
+	for _, s := range files.segments {
+		if s < seq {
+			paths = append(paths, segmentPath(w.dir, s))
+		}
+	}
+	for _, path := range paths {
+		if err := os.Remove(path); err != nil {
+			log.Warn().Err(err).Msgf("Removing %s failed", path)
+		}
+	}
+}
+
+// Close waits for a background checkpoint, then syncs and closes the log. The index stays
+// usable for searches; later writes fail. Close does not checkpoint, as Open replays the log.
+func (w *LoggedIndex) Close() error {
+	w.mu.Lock()
+	seg := w.log
+	w.log = nil
+	w.mu.Unlock()
+	w.background.Wait()
+	if seg == nil {
+		return nil
+	}
+	return seg.close()
+}
+
+// checkDimension returns the error of the indexes for a vector of another dimension.
+func (w *LoggedIndex) checkDimension(id int, vector []float32) error {
+	if len(vector) != w.dimension {
+		return fmt.Errorf("vector dimension %d does not match index dimension %d for id %d",
+			len(vector), w.dimension, id)
+	}
+	return nil
+}
+
+// split returns the ids and vectors of a bulk write, checking the dimensions first, so
+// that invalid writes fail before they reach the index.
+func (w *LoggedIndex) split(vectors map[int][]float32) ([]int, [][]float32, error) {
+	ids := make([]int, 0, len(vectors))
+	for id, vec := range vectors {
+		if err := w.checkDimension(id, vec); err != nil {
+			return nil, nil, err
+		}
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	vecs := make([][]float32, len(ids))
+	for i, id := range ids {
+		vecs[i] = vectors[id]
+	}
+	return ids, vecs, nil
+}
+
+// Add inserts a vector into the index and logs it.
+func (w *LoggedIndex) Add(id int, vector []float32) error {
+	if err := w.checkDimension(id, vector); err != nil {
+		return err
+	}
+	return w.write(opAdd, []int{id}, [][]float32{vector}, func() error { return w.index.Add(id, vector) })
+}
+
+// BulkAdd inserts the vectors into the index and logs them.
+func (w *LoggedIndex) BulkAdd(vectors map[int][]float32) error {
+	ids, vecs, err := w.split(vectors)
+	if err != nil {
+		return err
+	}
+	return w.write(opBulkAdd, ids, vecs, func() error { return w.index.BulkAdd(vectors) })
+}
+
+// Delete removes a vector from the index and logs it.
+func (w *LoggedIndex) Delete(id int) error {
+	return w.write(opDelete, []int{id}, nil, func() error { return w.index.Delete(id) })
+}
+
+// BulkDelete removes the vectors from the index and logs it. The index gets a copy of ids,
+// as some indexes sort them.
+func (w *LoggedIndex) BulkDelete(ids []int) error {
+	return w.write(opBulkDelete, ids, nil, func() error { return w.index.BulkDelete(append([]int(nil), ids...)) })
+}
+
+// Update changes a vector of the index and logs it.
+func (w *LoggedIndex) Update(id int, vector []float32) error {
+	if err := w.checkDimension(id, vector); err != nil {
+		return err
+	}
+	return w.write(opUpdate, []int{id}, [][]float32{vector}, func() error { return w.index.Update(id, vector) })
+}
+
+// BulkUpdate changes the vectors of the index and logs them.
+func (w *LoggedIndex) BulkUpdate(updates map[int][]float32) error {
+	ids, vecs, err := w.split(updates)
+	if err != nil {
+		return err
+	}
+	return w.write(opBulkUpdate, ids, vecs, func() error { return w.index.BulkUpdate(updates) })
+}
+
+// Search searches the index.
+func (w *LoggedIndex) Search(query []float32, k int) ([]core.Neighbor, error) {
+	return w.index.Search(query, k)
+}
+
+// SearchWithOptions searches the index with per-query options.
+func (w *LoggedIndex) SearchWithOptions(query []float32, k int, opts core.SearchOptions) ([]core.Neighbor, error) {
+	return w.index.SearchWithOptions(query, k, opts)
+}
+
+// SearchBatch searches the index for several queries.
+func (w *LoggedIndex) SearchBatch(queries [][]float32, k int) ([][]core.Neighbor, error) {
+	return w.index.SearchBatch(queries, k)
+}
+
+// Stats returns the statistics of the index.
+func (w *LoggedIndex) Stats() core.IndexStats {
+	return w.index.Stats()
+}
+
+// Save writes the index to w in its own format, e.g. to copy it elsewhere; the log does
+// not need it.
+func (w *LoggedIndex) Save(out io.Writer) error {
+	return w.index.Save(out)
+}
+
+// Load replaces the index with one read from r and snapshots it, which replaces the log.
+func (w *LoggedIndex) Load(r io.Reader) error {
+	w.checkpointMu.Lock()
+	defer w.checkpointMu.Unlock()
+	w.mu.Lock()
+	defer w.mu.Unlock()
+	if w.log == nil {
+		return errClosed
+	}
+	if err := w.index.Load(r); err != nil {
+		return w.resync(err)
+	}
+	return w.snapshot()
+}
+
+var _ core.Index = (*LoggedIndex)(nil)
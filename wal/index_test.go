@@ -0,0 +1,275 @@
+package wal_test
+
+import (
+	"math/rand"
+	"os"
+	"path/filepath"
+	"testing"
+
+	"github.com/patrikhermansson/hann/core"
+	"github.com/patrikhermansson/hann/hnsw"
+	"github.com/patrikhermansson/hann/pqivf"
+	"github.com/patrikhermansson/hann/wal"
+)
+
+func randomVectors(n, dim int, seed int64) map[int][]float32 {
+	rng := rand.New(rand.NewSource(seed))
+	vectors := make(map[int][]float32, n)
+	for id := 0; id < n; id++ {
+		vec := make([]float32, dim)
+		for j := range vec {
+			vec[j] = rng.Float32()
+		}
+		vectors[id] = vec
+	}
+	return vectors
+}
+
+// exactIndex creates an untrained PQIVF index that scans all its clusters, so its searches
+// are exact and do not depend on the order of the writes.
+func exactIndex(dim int) core.Index {
+	idx := pqivf.NewPQIVFIndex(dim, 4, 2, 16, 5)
+	idx.NProbe = 4
+	return idx
+}
+
+func open(t *testing.T, dir string, idx core.Index) *wal.LoggedIndex {
+	t.Helper()
+	w, err := wal.Open(dir, idx)
+	if err != nil {
+		t.Fatalf("Open failed: %v", err)
+	}
+	return w
+}
+
+// compare checks that two indexes return the same neighbors for the given queries.
+func compare(t *testing.T, name string, got, want core.Index, queries [][]float32) {
+	t.Helper()
+	if g, w := got.Stats().Count, want.Stats().Count; g != w {
+		t.Fatalf("%s: expected %d vectors, got %d", name, w, g)
+	}
+	for q, query := range queries {
+		a, err := got.Search(query, 10)
+		if err != nil {
+			t.Fatalf("%s: Search failed: %v", name, err)
+		}
+		b, err := want.Search(query, 10)
+		if err != nil {
+			t.Fatalf("%s: Search failed: %v", name, err)
+		}
+		if len(a) != len(b) {
+			t.Fatalf("%s: query %d: got %v, want %v", name, q, a, b)
+		}
+		for i := range a {
+			if a[i] != b[i] {
+				t.Fatalf("%s: query %d: got %v, want %v", name, q, a, b)
+			}
+		}
+	}
+}
+
+// files returns the names of the files in dir.
+func files(t *testing.T, dir string) map[string]bool {
+	t.Helper()
+	entries, err := os.ReadDir(dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	names := make(map[string]bool)
+	for _, e := range entries {
+		names[e.Name()] = true
+	}
+	return names
+}
+
+// writeAll applies the same writes to both indexes.
+func writeAll(t *testing.T, indexes []core.Index, write func(idx core.Index) error) {
+	t.Helper()
+	for _, idx := range indexes {
+		if err := write(idx); err != nil {
+			t.Fatalf("write failed: %v", err)
+		}
+	}
+}
+
+func TestLoggedIndex_Recover(t *testing.T) {
+	dim := 8
+	dir := t.TempDir()
+	vectors := randomVectors(300, dim, 1)
+	extra := randomVectors(10, dim, 2)
+	w := open(t, dir, exactIndex(dim))
+	ref := exactIndex(dim)
+	both := []core.Index{w, ref}
+	writeAll(t, both, func(idx core.Index) error { return idx.BulkAdd(vectors) })
+	writeAll(t, both, func(idx core.Index) error { return idx.Add(1000, extra[0]) })
+	writeAll(t, both, func(idx core.Index) error { return idx.Delete(5) })
+	writeAll(t, both, func(idx core.Index) error { return idx.Update(6, extra[1]) })
+	writeAll(t, both, func(idx core.Index) error { return idx.BulkDelete([]int{7, 8, 9}) })
+	writeAll(t, both, func(idx core.Index) error {
+		return idx.BulkUpdate(map[int][]float32{10: extra[2], 11: extra[3]})
+	})
+	if err := w.Add(1000, extra[4]); err == nil {
+		t.Error("expected an error for an existing id")
+	}
+	if err := w.Add(2000, extra[4][:3]); err == nil {
+		t.Error("expected an error for a vector of another dimension")
+	}
+	if err := w.Close(); err != nil {
+		t.Fatalf("Close failed: %v", err)
+	}
+	if err := w.Add(2000, extra[4]); err == nil {
+		t.Error("expected an error writing to a closed log")
+	}
+
+	queries := [][]float32{extra[0], extra[1], extra[2], vectors[5], vectors[100]}
+	recovered := open(t, dir, exactIndex(dim))
+	compare(t, "recovered", recovered, ref, queries)
+
+	// A record torn by a crash is dropped; the writes before it are recovered.
+	writeAll(t, []core.Index{recovered, ref}, func(idx core.Index) error { return idx.Add(3000, extra[5]) })
+	if err := recovered.Add(3001, extra[6]); err != nil {
+		t.Fatalf("Add failed: %v", err)
+	}
+	recovered.Close()
+	segments, err := filepath.Glob(filepath.Join(dir, "wal-*.log"))
+	if err != nil || len(segments) == 0 {
+		t.Fatalf("expected log segments, got %v (%v)", segments, err)
+	}
+	last := segments[len(segments)-1]
+	info, err := os.Stat(last)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if err := os.Truncate(last, info.Size()-3); err != nil {
+		t.Fatal(err)
+	}
+	torn := open(t, dir, exactIndex(dim))
+	defer torn.Close()
+	compare(t, "torn", torn, ref, queries)
+	writeAll(t, []core.Index{torn, ref}, func(idx core.Index) error { return idx.Add(3001, extra[6]) })
+	torn.Close()
+	again := open(t, dir, exactIndex(dim))
+	compare(t, "reopened", again, ref, queries)
+	again.Close()
+
+	// A crash may also leave a zero-filled tail, whose empty records have valid checksums.
+	segments, err = filepath.Glob(filepath.Join(dir, "wal-*.log"))
+	if err != nil || len(segments) == 0 {
+		t.Fatalf("expected log segments, got %v (%v)", segments, err)
+	}
+	zeros, err := os.OpenFile(segments[len(segments)-1], os.O_WRONLY|os.O_APPEND, 0)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if _, err := zeros.Write(make([]byte, 4096)); err != nil {
+		t.Fatal(err)
+	}
+	zeros.Close()
+	zeroed := open(t, dir, exactIndex(dim))
+	compare(t, "zero-filled", zeroed, ref, queries)
+	writeAll(t, []core.Index{zeroed, ref}, func(idx core.Index) error { return idx.Delete(3001) })
+	zeroed.Close()
+	final := open(t, dir, exactIndex(dim))
+	defer final.Close()
+	compare(t, "after zero-filled", final, ref, queries)
+}
+
+func TestLoggedIndex_Checkpoint(t *testing.T) {
+	dim := 8
+	dir := t.TempDir()
+	vectors := randomVectors(400, dim, 3)
+	extra := randomVectors(10, dim, 4)
+	w := open(t, dir, exactIndex(dim))
+	w.CheckpointBytes = -1
+	ref := exactIndex(dim)
+	both := []core.Index{w, ref}
+	writeAll(t, both, func(idx core.Index) error { return idx.BulkAdd(vectors) })
+
+	// The first checkpoint covers the whole index, so it is a snapshot.
+	if err := w.Checkpoint(); err != nil {
+		t.Fatalf("Checkpoint failed: %v", err)
+	}
+	names := files(t, dir)
+	if !names["snapshot-00000002.hann"] || names["wal-00000001.log"] {
+		t.Fatalf("expected a snapshot replacing the first segment, got %v", names)
+	}
+
+	// Later checkpoints of a few changes write deltas, replayed on top of the snapshot.
+	writeAll(t, both, func(idx core.Index) error { return idx.Add(1000, extra[0]) })
+	writeAll(t, both, func(idx core.Index) error { return idx.Delete(1) })
+	writeAll(t, both, func(idx core.Index) error { return idx.Update(2, extra[1]) })
+	if err := w.Checkpoint(); err != nil {
+		t.Fatalf("Checkpoint failed: %v", err)
+	}
+	writeAll(t, both, func(idx core.Index) error { return idx.Delete(1000) })
+	writeAll(t, both, func(idx core.Index) error { return idx.BulkUpdate(map[int][]float32{3: extra[2]}) })
+	if err := w.Checkpoint(); err != nil {
+		t.Fatalf("Checkpoint failed: %v", err)
+	}
+	names = files(t, dir)
+	if !names["snapshot-00000002.hann"] || !names["delta-00000004.hann"] || names["delta-00000003.hann"] ||
+		names["wal-00000003.log"] || !names["wal-00000004.log"] {
+		t.Fatalf("expected the snapshot, the last delta and its segment, got %v", names)
+	}
+	writeAll(t, both, func(idx core.Index) error { return idx.Add(1001, extra[3]) })
+	w.Close()
+
+	queries := [][]float32{extra[0], extra[1], extra[2], extra[3], vectors[1]}
+	recovered := open(t, dir, exactIndex(dim))
+	compare(t, "delta", recovered, ref, queries)
+
+	// Once most ids have changed, a checkpoint snapshots the index again.
+	recovered.FullRatio = 0.01
+	writeAll(t, []core.Index{recovered, ref}, func(idx core.Index) error { return idx.BulkDelete([]int{10, 11, 12, 13, 14}) })
+	if err := recovered.Checkpoint(); err != nil {
+		t.Fatalf("Checkpoint failed: %v", err)
+	}
+	recovered.Close()
+	names = files(t, dir)
+	if len(names) != 2 || !names["snapshot-00000006.hann"] || !names["wal-00000006.log"] {
+		t.Fatalf("expected only a new snapshot and its segment, got %v", names)
+	}
+	snapshot := open(t, dir, exactIndex(dim))
+	defer snapshot.Close()
+	compare(t, "snapshot", snapshot, ref, queries)
+}
+
+// TestLoggedIndex_HNSW recovers an HNSW index, which maps its snapshot and skips missing
+// ids in BulkUpdate, through background checkpoints.
+func TestLoggedIndex_HNSW(t *testing.T) {
+	dim := 8
+	dir := t.TempDir()
+	vectors := randomVectors(200, dim, 5)
+	newIndex := func() core.Index { return hnsw.NewHNSW(dim, 8, 64, core.Distances["euclidean"], "euclidean") }
+	w := open(t, dir, newIndex())
+	w.CheckpointBytes = 1
+	if err := w.BulkAdd(vectors); err != nil {
+		t.Fatalf("BulkAdd failed: %v", err)
+	}
+	if err := w.Delete(0); err != nil {
+		t.Fatalf("Delete failed: %v", err)
+	}
+	// Id 0 was deleted and id 500 never existed, so the update only changes id 1.
+	moved := []float32{0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5, 0.5}
+	if err := w.BulkUpdate(map[int][]float32{0: moved, 1: moved, 500: moved}); err != nil {
+		t.Fatalf("BulkUpdate failed: %v", err)
+	}
+	if err := w.Close(); err != nil {
+		t.Fatalf("Close failed: %v", err)
+	}
+	recovered := open(t, dir, newIndex())
+	defer recovered.Close()
+	if n := recovered.Stats().Count; n != 199 {
+		t.Errorf("expected 199 vectors, got %d", n)
+	}
+	neighbors, err := recovered.Search(moved, 2)
+	if err != nil {
+		t.Fatalf("Search failed: %v", err)
+	}
+	if neighbors[0].ID != 1 || neighbors[0].Distance != 0 || neighbors[1].Distance == 0 {
+		t.Errorf("expected only id 1 at the updated vector, got %v", neighbors)
+	}
+	if got, err := recovered.Search(vectors[2], 1); err != nil || got[0].ID != 2 {
+		t.Errorf("expected id 2 to be recovered, got %v (%v)", got, err)
+	}
+}
@@ -0,0 +1,286 @@
+package wal
+
+import (
+	"bufio"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"hash/crc32"
+	"io"
+	"math"
+	"os"
+	"time"
+
+	"github.com/patrikhermansson/hann/core"
+)
+
+// segmentMagic starts every log segment, followed by the dimension of the vectors and four
+// reserved bytes.
+const segmentMagic = "HANNWAL1"
+
+// segmentHeaderSize is the size of the header of a log segment.
+const segmentHeaderSize = 16
+
+// recordHeaderSize is the size of the header of a record: the length of its payload and the
+// CRC-32C checksum of the payload.
+const recordHeaderSize = 8
+
+// maxRecordBytes bounds the payload of a record; larger bulk writes are split over several
+// records.
+const maxRecordBytes = 16 << 20
+
+// castagnoli is the CRC-32C table of the record checksums.
+var castagnoli = crc32.MakeTable(crc32.Castagnoli)
+
+// op is the write a record logs.
+type op uint8
+
+const (
+	opAdd op = iota + 1
+	opDelete
+	opUpdate
+	opBulkAdd
+	opBulkDelete
+	opBulkUpdate
+)
+
+// deletes reports whether the records of o hold ids only, without vectors.
+func (o op) deletes() bool {
+	return o == opDelete || o == opBulkDelete
+}
+
+// record is a decoded record.
+type record struct {
+	op      op
+	ids     []int
+	vectors [][]float32 // vectors of the ids, nil for deletions
+}
+
+// entrySize returns the size of an entry of a record of o.
+func entrySize(o op, dimension int) int {
+	if o.deletes() {
+		return 8
+	}
+	return 8 + 4*dimension
+}
+
+// recordLimit returns the largest payload a record of vectors of the given dimension holds.
+func recordLimit(dimension int) int {
+	return max(maxRecordBytes, 5+entrySize(opAdd, dimension))
+}
+
+// appendRecord appends the record of a write to buf: its header, then the payload, which is
+// the operation, the number of entries and the entries, each an id and, unless the
+// operation deletes, a vector; numbers are little-endian.
+func appendRecord(buf []byte, o op, ids []int, vectors [][]float32) []byte {
+	start := len(buf)
+	buf = append(buf, make([]byte, recordHeaderSize)...)
+	buf = append(buf, byte(o))
+	buf = binary.LittleEndian.AppendUint32(buf, uint32(len(ids)))
+	for i, id := range ids {
+		buf = binary.LittleEndian.AppendUint64(buf, uint64(id))
+		if !o.deletes() {
+			for _, v := range vectors[i] {
+				buf = binary.LittleEndian.AppendUint32(buf, math.Float32bits(v))
+			}
+		}
+	}
+	payload := buf[start+recordHeaderSize:]
+	binary.LittleEndian.PutUint32(buf[start:], uint32(len(payload)))
+	binary.LittleEndian.PutUint32(buf[start+4:], crc32.Checksum(payload, castagnoli))
+	return buf
+}
+
+// decodeRecord decodes the payload of a record of vectors of the given dimension.
+func decodeRecord(payload []byte, dimension int) (record, error) {
+	if len(payload) < 5 {
+		return record{}, errors.New("short record")
+	}
+	rec := record{op: op(payload[0])}
+	if rec.op < opAdd || rec.op > opBulkUpdate {
+		return record{}, fmt.Errorf("unknown operation %d", rec.op)
+	}
+	n := int(binary.LittleEndian.Uint32(payload[1:]))
+	size := entrySize(rec.op, dimension)
+	if (len(payload)-5)/size != n || (len(payload)-5)%size != 0 {
+		return record{}, fmt.Errorf("record of %d bytes does not hold %d entries", len(payload), n)
+	}
+	rec.ids = make([]int, n)
+	var values []float32
+	if !rec.op.deletes() {
+		rec.vectors = make([][]float32, n)
+		values = make([]float32, n*dimension)
+	}
+	for i := range rec.ids {
+		entry := payload[5+i*size:]
+		rec.ids[i] = int(int64(binary.LittleEndian.Uint64(entry)))
+		if rec.vectors != nil {
+			vec := values[i*dimension : (i+1)*dimension : (i+1)*dimension]
+			for j := range vec {
+				vec[j] = math.Float32frombits(binary.LittleEndian.Uint32(entry[8+4*j:]))
+			}
+			rec.vectors[i] = vec
+		}
+	}
+	return rec, nil
+}
+
+// segment is the log segment writes are appended to.
+type segment struct {
+	seq    int       // sequence number of the segment
+	file   *os.File  // the segment file
+	size   int64     // bytes written, including the header
+	synced time.Time // time of the last sync
+	dirty  bool      // bytes were written since the last sync
+}
+
+// createSegment creates the log segment seq in dir, for vectors of the given dimension,
+// and syncs its header.
+func createSegment(dir string, seq, dimension int) (*segment, error) {
+	file, err := os.OpenFile(segmentPath(dir, seq), os.O_RDWR|os.O_CREATE|os.O_EXCL, 0o644)
+	if err != nil {
+		return nil, err
+	}
+	header := make([]byte, segmentHeaderSize)
+	copy(header, segmentMagic)
+	binary.LittleEndian.PutUint32(header[len(segmentMagic):], uint32(dimension))
+	s := &segment{seq: seq, file: file}
+	if _, err = file.Write(header); err == nil {
+		s.size = segmentHeaderSize
+		err = s.sync()
+	}
+	if err == nil {
+		err = core.SyncDir(dir)
+	}
+	if err != nil {
+		file.Close()
+		os.Remove(file.Name())
+		return nil, err
+	}
+	return s, nil
+}
+
+// write appends encoded records to the segment. With interval 0 they are synced before
+// write returns; with a positive interval, only once that long has passed since the last
+// sync; with a negative interval, only when the segment is closed. A failed write is cut
+// off the segment, so that no torn record is left before the records that follow.
+func (s *segment) write(records []byte, interval time.Duration) error {
+	if _, err := s.file.WriteAt(records, s.size); err != nil {
+		if terr := s.file.Truncate(s.size); terr != nil {
+			return errors.Join(err, terr)
+		}
+		return err
+	}
+	s.size += int64(len(records))
+	s.dirty = true
+	if interval == 0 || (interval > 0 && time.Since(s.synced) >= interval) {
+		return s.sync()
+	}
+	return nil
+}
+
+// sync syncs the segment to disk.
+func (s *segment) sync() error {
+	if err := s.file.Sync(); err != nil {
+		return err
+	}
+	s.synced = time.Now()
+	s.dirty = false
+	return nil
+}
+
+// close syncs the segment if needed and closes it.
+func (s *segment) close() error {
+	var err error
+	if s.dirty {
+		err = s.sync()
+	}
+	if cerr := s.file.Close(); err == nil {
+		err = cerr
+	}
+	return err
+}
+
+// readSegment reads the records of the log segment at path and calls fn for each. It
+// returns the offset after the last complete record and whether the segment ends in a torn
+// record, i.e. one that is cut short, whose checksum does not match or that does not
+// decode, which a crash during a write leaves behind.
+func readSegment(path string, dimension int, fn func(record) error) (int64, bool, error) {
+	file, err := os.Open(path)
+	if err != nil {
+		return 0, false, err
+	}
+	defer file.Close()
+	r := bufio.NewReaderSize(file, 1<<20)
+	header := make([]byte, segmentHeaderSize)
+	if _, err := io.ReadFull(r, header); err != nil {
+		if errors.Is(err, io.EOF) || errors.Is(err, io.ErrUnexpectedEOF) {
+			return 0, true, nil
+		}
+		return 0, false, err
+	}
+	if string(header[:len(segmentMagic)]) != segmentMagic {
+		if allZero(header) {
+			return 0, true, nil
+		}
+		return 0, false, fmt.Errorf("%s is not a log segment", path)
+	}
+	if d := int(binary.LittleEndian.Uint32(header[len(segmentMagic):])); d != dimension {
+		return 0, false, fmt.Errorf("log segment dimension %d does not match index dimension %d", d, dimension)
+	}
+	offset := int64(segmentHeaderSize)
+	limit := recordLimit(dimension)
+	head := make([]byte, recordHeaderSize)
+	var payload []byte
+	for {
+		if _, err := io.ReadFull(r, head); err != nil {
+			if errors.Is(err, io.EOF) {
+				return offset, false, nil
+			}
+			return offset, errors.Is(err, io.ErrUnexpectedEOF), ignoreEOF(err)
+		}
+		n := int(binary.LittleEndian.Uint32(head))
+		// A zero-filled tail left by a crash has an empty payload, whose checksum is 0.
+		if n < 5 || n > limit {
+			return offset, true, nil
+		}
+		if cap(payload) < n {
+			payload = make([]byte, n)
+		}
+		payload = payload[:n]
+		if _, err := io.ReadFull(r, payload); err != nil {
+			return offset, errors.Is(err, io.EOF) || errors.Is(err, io.ErrUnexpectedEOF), ignoreEOF(err)
+		}
+		if crc32.Checksum(payload, castagnoli) != binary.LittleEndian.Uint32(head[4:]) {
+			return offset, true, nil
+		}
+		rec, err := decodeRecord(payload, dimension)
+		if err != nil {
+			return offset, true, nil
+		}
+		if err := fn(rec); err != nil {
+			return offset, false, fmt.Errorf("replaying %s at offset %d: %w", path, offset, err)
+		}
+		offset += int64(recordHeaderSize + n)
+	}
+}
+
+// allZero reports whether b holds only zero bytes, as the unwritten blocks of a file
+// extended before a crash do.
+func allZero(b []byte) bool {
+	for _, c := range b {
+		if c != 0 {
+			return false
+		}
+	}
+	return true
+}
+
+// ignoreEOF returns nil for the errors of reads cut short by the end of a file, and err
+// otherwise.
+func ignoreEOF(err error) error {
+	if errors.Is(err, io.EOF) || errors.Is(err, io.ErrUnexpectedEOF) {
+		return nil
+	}
+	return err
+}